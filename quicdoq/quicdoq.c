@@ -51,6 +51,7 @@ quicdoq_stream_ctx_t* quicdoq_find_or_create_stream(uint64_t stream_id, quicdoq_
             DBG_PRINTF("Could not allocate data for stream %llu\n", (unsigned long long)stream_id);
         } else {
             memset(stream_ctx, 0, sizeof(quicdoq_stream_ctx_t));
+            stream_ctx->previous_stream = cnx_ctx->last_stream;
             if (cnx_ctx->last_stream == NULL) {
                 cnx_ctx->first_stream = stream_ctx;
             }
@@ -60,18 +61,44 @@ quicdoq_stream_ctx_t* quicdoq_find_or_create_stream(uint64_t stream_id, quicdoq_
             cnx_ctx->last_stream = stream_ctx;
             stream_ctx->stream_id = stream_id;
             stream_ctx->cnx_ctx = cnx_ctx;
+            cnx_ctx->stats.open_streams++;
+            if (cnx_ctx->stats.open_streams > cnx_ctx->stats.peak_streams) {
+                cnx_ctx->stats.peak_streams = cnx_ctx->stats.open_streams;
+            }
         }
     }
 
     return stream_ctx;
 }
 
+/* Delete the query context of a server stream, and remove it from the load */
+static void quicdoq_release_query_ctx(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx)
+{
+    quicdoq_load_stats_t* load = &cnx_ctx->quicdoq_ctx->load_stats;
+    uint64_t buffer_bytes = (uint64_t)stream_ctx->query_ctx->query_max_size + stream_ctx->query_ctx->response_max_size;
+
+    load->buffer_bytes = (load->buffer_bytes > buffer_bytes) ? load->buffer_bytes - buffer_bytes : 0;
+    if (load->nb_inflight_queries > 0) {
+        load->nb_inflight_queries--;
+    }
+    quicdoq_delete_query_ctx(stream_ctx->query_ctx);
+    stream_ctx->query_ctx = NULL;
+}
+
 void quicdoq_delete_stream_ctx(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx)
 {
     if (cnx_ctx != NULL && stream_ctx != NULL) {
+        quicdoq_deadline_stop(cnx_ctx->quicdoq_ctx, &stream_ctx->deadline);
         /* If this is a server stream, delete the query */
         if (cnx_ctx->is_server && stream_ctx->query_ctx != NULL) {
-            quicdoq_delete_query_ctx(stream_ctx->query_ctx);
+            quicdoq_release_query_ctx(cnx_ctx, stream_ctx);
+        }
+        else if (!cnx_ctx->is_server && cnx_ctx->nb_open_streams > 0) {
+            /* Return the stream credit to the connection pool */
+            cnx_ctx->nb_open_streams--;
+        }
+        if (cnx_ctx->stats.open_streams > 0) {
+            cnx_ctx->stats.open_streams--;
         }
         /* Remove the links */
         if (stream_ctx->previous_stream == NULL) {
@@ -90,6 +117,452 @@ void quicdoq_delete_stream_ctx(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t*
     }
 }
 
+/* Replay cache for queries accepted in 0-RTT.
+ * Returns 0 if the query was not seen before and is now remembered,
+ * 1 if it is a replay, or a false positive of the filter.
+ */
+static uint64_t quicdoq_replay_hash(picoquic_connection_id_t const* initial_cid, uint64_t stream_id)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (uint8_t i = 0; i < initial_cid->id_len; i++) {
+        h ^= initial_cid->id[i];
+        h *= 0x100000001b3ull;
+    }
+    for (int i = 0; i < 8; i++) {
+        h ^= (uint8_t)(stream_id >> (8 * i));
+        h *= 0x100000001b3ull;
+    }
+    /* Final mix, so that both halves of the hash can index the filter */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static void quicdoq_replay_clear_generation(quicdoq_replay_cache_t* cache, int generation)
+{
+    memset(cache->filter[generation], 0, sizeof(cache->filter[generation]));
+    cache->nb_entries[generation] = 0;
+}
+
+static void quicdoq_replay_rotate(quicdoq_replay_cache_t* cache, uint64_t current_time, uint64_t replay_window)
+{
+    uint64_t slice = replay_window / (QUICDOQ_REPLAY_GENERATIONS - 1);
+
+    if (slice == 0) {
+        slice = 1;
+    }
+
+    if (!cache->is_started) {
+        cache->generation_start = current_time;
+        cache->is_started = 1;
+    }
+    else if (current_time >= cache->generation_start + slice) {
+        uint64_t nb_slices = (current_time - cache->generation_start) / slice;
+
+        if (nb_slices >= QUICDOQ_REPLAY_GENERATIONS) {
+            quicdoq_replay_cache_clear(cache);
+            cache->generation_start = current_time;
+            cache->is_started = 1;
+        }
+        else {
+            for (uint64_t i = 0; i < nb_slices; i++) {
+                cache->newest = (cache->newest + 1) % QUICDOQ_REPLAY_GENERATIONS;
+                quicdoq_replay_clear_generation(cache, cache->newest);
+            }
+            cache->generation_start += nb_slices * slice;
+        }
+    }
+}
+
+int quicdoq_replay_check(quicdoq_replay_cache_t* cache, picoquic_connection_id_t const* initial_cid,
+    uint64_t stream_id, uint64_t current_time, uint64_t replay_window)
+{
+    int ret = 0;
+    uint64_t h = quicdoq_replay_hash(initial_cid, stream_id);
+    uint64_t h1 = h & 0xffffffffull;
+    uint64_t h2 = (h >> 32) | 1;
+    size_t bit[QUICDOQ_REPLAY_FILTER_HASHES];
+
+    quicdoq_replay_rotate(cache, current_time, replay_window);
+
+    for (int k = 0; k < QUICDOQ_REPLAY_FILTER_HASHES; k++) {
+        bit[k] = (size_t)((h1 + k * h2) % QUICDOQ_REPLAY_FILTER_BITS);
+    }
+
+    for (int g = 0; ret == 0 && g < QUICDOQ_REPLAY_GENERATIONS; g++) {
+        int is_found = 1;
+
+        for (int k = 0; is_found && k < QUICDOQ_REPLAY_FILTER_HASHES; k++) {
+            is_found = (cache->filter[g][bit[k] / 64] >> (bit[k] % 64)) & 1;
+        }
+        ret = is_found;
+    }
+
+    if (ret == 0) {
+        for (int k = 0; k < QUICDOQ_REPLAY_FILTER_HASHES; k++) {
+            cache->filter[cache->newest][bit[k] / 64] |= 1ull << (bit[k] % 64);
+        }
+        if (cache->nb_entries[cache->newest] >= QUICDOQ_REPLAY_GENERATION_MAX) {
+            cache->nb_saturated++;
+        }
+        cache->nb_entries[cache->newest]++;
+    }
+
+    return ret;
+}
+
+void quicdoq_replay_cache_clear(quicdoq_replay_cache_t* cache)
+{
+    for (int g = 0; g < QUICDOQ_REPLAY_GENERATIONS; g++) {
+        quicdoq_replay_clear_generation(cache, g);
+    }
+    cache->newest = 0;
+    cache->is_started = 0;
+}
+
+/* Note the time at which a server query reaches a stage */
+static void quicdoq_mark_stage(quicdoq_stream_ctx_t* stream_ctx, quicdoq_stage_enum stage, uint64_t current_time)
+{
+    stream_ctx->stage_time[stage] = current_time;
+    stream_ctx->stage_mask |= (1u << stage);
+}
+
+/* Heap of running deadlines, see quicdoq_check_deadlines() */
+static void quicdoq_deadline_place(quicdoq_ctx_t* quicdoq_ctx, size_t index, quicdoq_deadline_t* entry)
+{
+    quicdoq_ctx->deadline_heap[index] = entry;
+    entry->heap_index = index + 1;
+}
+
+static size_t quicdoq_deadline_sift_up(quicdoq_ctx_t* quicdoq_ctx, size_t index)
+{
+    quicdoq_deadline_t* entry = quicdoq_ctx->deadline_heap[index];
+
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (quicdoq_ctx->deadline_heap[parent]->deadline <= entry->deadline) {
+            break;
+        }
+        quicdoq_deadline_place(quicdoq_ctx, index, quicdoq_ctx->deadline_heap[parent]);
+        index = parent;
+    }
+    quicdoq_deadline_place(quicdoq_ctx, index, entry);
+
+    return index;
+}
+
+static void quicdoq_deadline_sift_down(quicdoq_ctx_t* quicdoq_ctx, size_t index)
+{
+    quicdoq_deadline_t* entry = quicdoq_ctx->deadline_heap[index];
+
+    while (2 * index + 1 < quicdoq_ctx->nb_deadlines) {
+        size_t child = 2 * index + 1;
+        if (child + 1 < quicdoq_ctx->nb_deadlines &&
+            quicdoq_ctx->deadline_heap[child + 1]->deadline < quicdoq_ctx->deadline_heap[child]->deadline) {
+            child++;
+        }
+        if (entry->deadline <= quicdoq_ctx->deadline_heap[child]->deadline) {
+            break;
+        }
+        quicdoq_deadline_place(quicdoq_ctx, index, quicdoq_ctx->deadline_heap[child]);
+        index = child;
+    }
+    quicdoq_deadline_place(quicdoq_ctx, index, entry);
+}
+
+void quicdoq_deadline_stop(quicdoq_ctx_t* quicdoq_ctx, quicdoq_deadline_t* entry)
+{
+    if (entry->heap_index != 0) {
+        size_t index = entry->heap_index - 1;
+
+        quicdoq_ctx->nb_deadlines--;
+        if (index < quicdoq_ctx->nb_deadlines) {
+            quicdoq_deadline_place(quicdoq_ctx, index, quicdoq_ctx->deadline_heap[quicdoq_ctx->nb_deadlines]);
+            if (quicdoq_deadline_sift_up(quicdoq_ctx, index) == index) {
+                quicdoq_deadline_sift_down(quicdoq_ctx, index);
+            }
+        }
+        entry->heap_index = 0;
+    }
+}
+
+int quicdoq_deadline_start(quicdoq_ctx_t* quicdoq_ctx, quicdoq_deadline_t* entry)
+{
+    int ret = 0;
+
+    quicdoq_deadline_stop(quicdoq_ctx, entry);
+    if (quicdoq_ctx->nb_deadlines >= quicdoq_ctx->deadline_heap_max) {
+        size_t new_max = (quicdoq_ctx->deadline_heap_max == 0) ? 64 : 2 * quicdoq_ctx->deadline_heap_max;
+        quicdoq_deadline_t** new_heap = (quicdoq_deadline_t**)realloc(quicdoq_ctx->deadline_heap,
+            new_max * sizeof(quicdoq_deadline_t*));
+
+        if (new_heap == NULL) {
+            ret = -1;
+        }
+        else {
+            quicdoq_ctx->deadline_heap = new_heap;
+            quicdoq_ctx->deadline_heap_max = new_max;
+        }
+    }
+
+    if (ret == 0) {
+        quicdoq_deadline_place(quicdoq_ctx, quicdoq_ctx->nb_deadlines, entry);
+        quicdoq_ctx->nb_deadlines++;
+        (void)quicdoq_deadline_sift_up(quicdoq_ctx, quicdoq_ctx->nb_deadlines - 1);
+    }
+
+    return ret;
+}
+
+/* Callbacks of client queries go through the hedging logic if servers are
+ * declared for hedging, see quicdoq_add_hedge_server() */
+static int quicdoq_client_callback(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_return_enum callback_code,
+    quicdoq_query_ctx_t* query_ctx, uint64_t current_time)
+{
+    int ret;
+
+    if (quicdoq_ctx->first_hedge_server != NULL) {
+        ret = quicdoq_hedge_callback(quicdoq_ctx, callback_code, query_ctx, current_time);
+    }
+    else {
+        ret = quicdoq_ctx->app_cb_fn(callback_code, quicdoq_ctx->app_cb_ctx, query_ctx, current_time);
+    }
+
+    return ret;
+}
+
+/* Response priority.
+ * Classes are spaced by 2, and the priorities are odd, which picoquic
+ * serves in stream order within a class, so that each small response
+ * completes before the next one starts.
+ */
+uint8_t quicdoq_response_priority(size_t remaining_bytes, uint64_t age)
+{
+    uint64_t size_class = 0;
+    uint64_t age_class = age / QUICDOQ_PRIORITY_AGE_STEP;
+
+    while (size_class < QUICDOQ_PRIORITY_NB_CLASSES - 1 &&
+        remaining_bytes > ((size_t)QUICDOQ_PRIORITY_MIN_SIZE << size_class)) {
+        size_class++;
+    }
+    size_class = (age_class < size_class) ? size_class - age_class : 0;
+
+    return (uint8_t)(3 + 2 * size_class);
+}
+
+static int quicdoq_update_response_priority(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx, uint64_t current_time)
+{
+    int ret = 0;
+
+    if (cnx_ctx->quicdoq_ctx->is_response_priority) {
+        size_t response_bytes = stream_ctx->query_ctx->response_length + 2;
+        size_t remaining = (stream_ctx->bytes_sent < response_bytes) ? response_bytes - stream_ctx->bytes_sent : 0;
+        uint64_t age = (current_time > stream_ctx->stage_time[quicdoq_stage_first_byte]) ?
+            current_time - stream_ctx->stage_time[quicdoq_stage_first_byte] : 0;
+        uint8_t priority = quicdoq_response_priority(remaining, age);
+
+        if (priority != stream_ctx->priority) {
+            stream_ctx->priority = priority;
+            ret = picoquic_set_stream_priority(cnx_ctx->cnx, stream_ctx->stream_id, priority);
+        }
+    }
+
+    return ret;
+}
+
+/* Add the time spent reaching each stage to the latency histograms */
+static void quicdoq_record_latency(quicdoq_ctx_t* quicdoq_ctx, quicdoq_stream_ctx_t* stream_ctx)
+{
+    int previous = quicdoq_stage_first_byte;
+
+    for (int stage = quicdoq_stage_first_byte + 1; stage < quicdoq_stage_max; stage++) {
+        if ((stream_ctx->stage_mask & (1u << stage)) != 0) {
+            uint64_t delay = (stream_ctx->stage_time[stage] > stream_ctx->stage_time[previous]) ?
+                stream_ctx->stage_time[stage] - stream_ctx->stage_time[previous] : 0;
+            quicdoq_histogram_record(&quicdoq_ctx->latency_stats.stage[stage], delay);
+            previous = stage;
+        }
+    }
+    quicdoq_histogram_record(&quicdoq_ctx->latency_stats.end_to_end,
+        stream_ctx->stage_time[previous] - stream_ctx->stage_time[quicdoq_stage_first_byte]);
+}
+
+/* Pass an incoming query to the application, unless it arrived in 0-RTT and
+ * the policy requires waiting for the end of the handshake. The query is
+ * decoded first, so the application can use the view instead of parsing
+ * the message again.
+ */
+static int quicdoq_server_incoming_query(picoquic_cnx_t* cnx, quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx)
+{
+    int ret = 0;
+    quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+    quicdoq_query_ctx_t* query_ctx = stream_ctx->query_ctx;
+    uint64_t current_time = picoquic_get_quic_time(quicdoq_ctx->quic);
+
+    quicdoq_mark_stage(stream_ctx, quicdoq_stage_query_complete, current_time);
+    if (quicdoq_ctx->deadline_budget > 0 && query_ctx->deadline == 0) {
+        query_ctx->deadline = stream_ctx->stage_time[quicdoq_stage_first_byte] + quicdoq_ctx->deadline_budget;
+        stream_ctx->deadline.deadline = query_ctx->deadline;
+        stream_ctx->deadline.kind = quicdoq_deadline_stream;
+        stream_ctx->deadline.owner = stream_ctx;
+        if (quicdoq_deadline_start(quicdoq_ctx, &stream_ctx->deadline) != 0) {
+            DBG_PRINTF("Cannot start the deadline of stream %" PRIu64, stream_ctx->stream_id);
+        }
+    }
+    quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_received);
+    cnx_ctx->stats.nb_queries++;
+    quicdoq_tp_message_received(cnx_ctx, query_ctx->query_length);
+    query_ctx->is_query_view_valid = (quicdoq_dns_view_parse(&query_ctx->query_view, query_ctx->query, query_ctx->query_length) == 0);
+    if (!query_ctx->is_query_view_valid) {
+        quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_malformed);
+        quicdoq_log_event(quicdoq_ctx, cnx, quicdoq_log_event_malformed, query_ctx->query_id, stream_ctx->stream_id, 0);
+    }
+
+    if (picoquic_get_cnx_state(cnx) < picoquic_state_ready) {
+        int is_eligible = 0;
+
+        switch (quicdoq_ctx->early_policy) {
+        case quicdoq_0rtt_accept_all:
+            is_eligible = 1;
+            break;
+        case quicdoq_0rtt_accept_idempotent:
+            is_eligible = query_ctx->is_query_view_valid && quicdoq_dns_view_is_idempotent(&query_ctx->query_view);
+            break;
+        default:
+            break;
+        }
+
+        if (is_eligible && quicdoq_ctx->replay_cache != NULL) {
+            picoquic_connection_id_t initial_cid = picoquic_get_initial_cnxid(cnx);
+            int replay_ret = quicdoq_replay_check(quicdoq_ctx->replay_cache, &initial_cid, stream_ctx->stream_id,
+                current_time, quicdoq_ctx->replay_window);
+
+            if (replay_ret != 0) {
+                is_eligible = 0;
+                quicdoq_ctx->early_stats.nb_replays++;
+                quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_replayed);
+                quicdoq_log_event(quicdoq_ctx, cnx, quicdoq_log_event_replay, query_ctx->query_id, stream_ctx->stream_id, 0);
+            }
+        }
+        else {
+            is_eligible = 0;
+        }
+
+        if (!is_eligible) {
+            stream_ctx->is_deferred = 1;
+            quicdoq_ctx->early_stats.nb_deferred++;
+            quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_deferred);
+            return 0;
+        }
+        quicdoq_ctx->early_stats.nb_accepted++;
+    }
+
+    quicdoq_mark_stage(stream_ctx, quicdoq_stage_app_callback, current_time);
+    ret = quicdoq_ctx->app_cb_fn(quicdoq_incoming_query, quicdoq_ctx->app_cb_ctx, query_ctx, current_time);
+
+    return ret;
+}
+
+/* Once the handshake completes, pass the deferred early queries to the application */
+static int quicdoq_server_release_deferred(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    int ret = 0;
+    quicdoq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
+
+    while (ret == 0 && stream_ctx != NULL) {
+        quicdoq_stream_ctx_t* next_stream = stream_ctx->next_stream;
+
+        if (stream_ctx->is_deferred) {
+            uint64_t current_time = picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic);
+
+            stream_ctx->is_deferred = 0;
+            if (stream_ctx->deadline.deadline != 0 && stream_ctx->deadline.heap_index == 0) {
+                /* The deadline expired while the query was deferred, restart it so it is checked again */
+                (void)quicdoq_deadline_start(cnx_ctx->quicdoq_ctx, &stream_ctx->deadline);
+            }
+            quicdoq_mark_stage(stream_ctx, quicdoq_stage_app_callback, current_time);
+            ret = cnx_ctx->quicdoq_ctx->app_cb_fn(quicdoq_incoming_query,
+                cnx_ctx->quicdoq_ctx->app_cb_ctx, stream_ctx->query_ctx, current_time);
+        }
+        stream_ctx = next_stream;
+    }
+
+    return ret;
+}
+
+/* Load shedding. The budget is checked when a new stream opens, assuming that
+ * the query will need full size buffers. */
+static int quicdoq_server_is_overloaded(quicdoq_ctx_t* quicdoq_ctx)
+{
+    quicdoq_load_budget_t const* budget = &quicdoq_ctx->load_budget;
+    quicdoq_load_stats_t const* load = &quicdoq_ctx->load_stats;
+
+    return (budget->max_inflight_queries > 0 && load->nb_inflight_queries >= budget->max_inflight_queries) ||
+        (budget->max_relay_queue > 0 && load->relay_queue_depth >= budget->max_relay_queue) ||
+        (budget->max_buffer_bytes > 0 &&
+            load->buffer_bytes + 2 * (uint64_t)QUICDOQ_MAX_STREAM_DATA > budget->max_buffer_bytes);
+}
+
+/* Reset a stream with QUICDOQ_ERROR_EXCESSIVE_LOAD. If the query is not fully
+ * received, ask the client to stop sending, and keep the stream context so the
+ * remaining data is ignored until the client finishes or resets the stream. */
+static int quicdoq_server_shed_stream(picoquic_cnx_t* cnx, quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx, int is_fin)
+{
+    int ret = picoquic_reset_stream(cnx, stream_ctx->stream_id, QUICDOQ_ERROR_EXCESSIVE_LOAD);
+
+    if (!stream_ctx->is_rate_limited) {
+        cnx_ctx->quicdoq_ctx->load_stats.nb_shed_reset++;
+    }
+    if (is_fin) {
+        quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+    }
+    else {
+        if (stream_ctx->query_ctx != NULL) {
+            /* Release the buffers now rather than when the stream closes */
+            quicdoq_release_query_ctx(cnx_ctx, stream_ctx);
+        }
+        stream_ctx->is_reset = 1;
+        if (ret == 0) {
+            ret = picoquic_stop_sending(cnx, stream_ctx->stream_id, QUICDOQ_ERROR_EXCESSIVE_LOAD);
+        }
+    }
+
+    return ret;
+}
+
+/* Allocate the query context of a server stream, and count it in the load */
+static int quicdoq_server_create_query_ctx(picoquic_cnx_t* cnx, quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx,
+    uint16_t query_max_size, uint16_t response_max_size)
+{
+    int ret = 0;
+
+    stream_ctx->query_ctx = quicdoq_create_query_ctx(query_max_size, response_max_size);
+    if (stream_ctx->query_ctx == NULL) {
+        DBG_PRINTF("Cannot create query context for server stream  #%llu", (unsigned long long)stream_ctx->stream_id);
+        picoquic_log_app_message(cnx, "Quicdoq: Cannot create query context for server stream  #%llu\n", (unsigned long long)stream_ctx->stream_id);
+        ret = -1;
+    }
+    else {
+        /* On the server side, there is no call back per se, but we
+         * ned to associate responses with the stream context 
+         * TODO: check what happens if the server connection disappears. */
+        stream_ctx->query_ctx->client_cb_ctx = stream_ctx;
+        stream_ctx->query_ctx->quic = picoquic_get_quic_ctx(cnx);
+        stream_ctx->query_ctx->cid = picoquic_get_logging_cnxid(cnx);
+        stream_ctx->query_ctx->query_id = cnx_ctx->quicdoq_ctx->next_query_id++;
+        stream_ctx->query_ctx->stream_id = stream_ctx->stream_id;
+        cnx_ctx->quicdoq_ctx->load_stats.nb_inflight_queries++;
+        cnx_ctx->quicdoq_ctx->load_stats.buffer_bytes += (uint64_t)query_max_size + response_max_size;
+    }
+
+    return ret;
+}
+
 /* On the data callback, fill the bytes in the relevant query field, and if needed signal the app. */
 int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx, uint64_t stream_id,
     uint8_t* bytes, size_t length, picoquic_call_back_event_t fin_or_event, quicdoq_cnx_ctx_t* cnx_ctx)
@@ -97,6 +570,7 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
     int ret = 0;
     size_t consumed = 0;
 
+    cnx_ctx->stats.bytes_received += length;
     if (cnx_ctx->is_server) {
         if (stream_ctx == NULL) {
             /* Incoming data, server size, requires a context creation */
@@ -106,28 +580,52 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
                 picoquic_log_app_message(cnx, "Quicdoq: Cannot create server context for server stream  #%llu.\n", (unsigned long long)stream_id);
                 ret = -1;
             }
-            else {
-                /* If this is a server stream, allocate a query structure */
-                stream_ctx->query_ctx = quicdoq_create_query_ctx(QUICDOQ_MAX_STREAM_DATA, QUICDOQ_MAX_STREAM_DATA);
-                if (stream_ctx->query_ctx == NULL) {
-                    DBG_PRINTF("Cannot create query context for server stream  #%llu", (unsigned long long)stream_id);
-                    picoquic_log_app_message(cnx, "Quicdoq: Cannot create query context for server stream  #%llu\n", (unsigned long long)stream_id);
+            else if (stream_ctx->query_ctx == NULL && !stream_ctx->is_shed) {
+                /* New stream. Check the load budget and the client rate before allocating the query buffers */
+                quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+                uint64_t current_time = picoquic_get_quic_time(quicdoq_ctx->quic);
+                int is_refused = 0;
+
+                quicdoq_mark_stage(stream_ctx, quicdoq_stage_first_byte, current_time);
+                if (quicdoq_server_is_overloaded(quicdoq_ctx)) {
+                    stream_ctx->is_shed = 1;
+                    stream_ctx->shed_ede = quicdoq_ctx->load_budget.overload_ede;
+                    is_refused = quicdoq_ctx->load_budget.refuse_on_overload;
+                    quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_shed);
+                }
+                else if (quicdoq_ctx->rate_limiter != NULL) {
+                    struct sockaddr* peer_addr = NULL;
+
+                    picoquic_get_peer_addr(cnx, &peer_addr);
+                    if (quicdoq_rate_limiter_check(quicdoq_ctx->rate_limiter, peer_addr, current_time) != 0) {
+                        stream_ctx->is_shed = 1;
+                        stream_ctx->is_rate_limited = 1;
+                        stream_ctx->shed_ede = quicdoq_ctx->rate_limiter->config.over_limit_ede;
+                        is_refused = quicdoq_ctx->rate_limiter->config.refuse_over_limit;
+                        quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_rate_limited);
+                    }
+                }
+
+                if (stream_ctx->is_shed) {
+                    if (!is_refused) {
+                        return quicdoq_server_shed_stream(cnx, cnx_ctx, stream_ctx, fin_or_event == picoquic_callback_stream_fin);
+                    }
+                }
+                else if (quicdoq_server_create_query_ctx(cnx, cnx_ctx, stream_ctx, QUICDOQ_MAX_STREAM_DATA, QUICDOQ_MAX_STREAM_DATA) != 0) {
                     quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
                     ret = -1;
                 }
-                else {
-                    /* On the server side, there is no call back per se, but we
-                     * ned to associate responses with the stream context 
-                     * TODO: check what happens if the server connection disappears. */
-                    stream_ctx->query_ctx->client_cb_ctx = stream_ctx;
-                    stream_ctx->query_ctx->quic = picoquic_get_quic_ctx(cnx);
-                    stream_ctx->query_ctx->cid = picoquic_get_logging_cnxid(cnx);
-                    stream_ctx->query_ctx->query_id = cnx_ctx->quicdoq_ctx->next_query_id++;
-                    stream_ctx->query_ctx->stream_id = stream_ctx->stream_id;
-                }
             }
         }
 
+        if (ret == 0 && stream_ctx->is_reset) {
+            /* Remaining data of a stream already reset. Forget the stream once the client is done with it. */
+            if (fin_or_event == picoquic_callback_stream_fin) {
+                quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+            }
+            return 0;
+        }
+
         if (ret == 0) {
             /* First two bytes of stream are query length. 
              * - must be stored when receiving.
@@ -138,6 +636,16 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
                 stream_ctx->length_received += bytes[consumed++];
                 stream_ctx->bytes_received++;
             }
+            if (stream_ctx->query_ctx == NULL && stream_ctx->bytes_received >= 2) {
+                /* The query is refused because of the load. Allocate just enough to
+                 * receive it and to format the refusal, or reset the stream if
+                 * the query cannot be refused. */
+                if (stream_ctx->length_received <= 12 || stream_ctx->length_received > QUICDOQ_MAX_STREAM_DATA - 15 ||
+                    quicdoq_server_create_query_ctx(cnx, cnx_ctx, stream_ctx, stream_ctx->length_received,
+                        (uint16_t)(stream_ctx->length_received + 15)) != 0) {
+                    return quicdoq_server_shed_stream(cnx, cnx_ctx, stream_ctx, fin_or_event == picoquic_callback_stream_fin);
+                }
+            }
             if (length > consumed) {
                 /* TODO: maybe allocate data for stated length instead of relying on max_query_size */
                 if (stream_ctx->length_received > stream_ctx->query_ctx->query_max_size) {
@@ -163,12 +671,22 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
                             picoquic_log_app_message(cnx, "Quicdoq: Stream FIN before query was received fully on stream  #%llu.\n", (unsigned long long)stream_id);
                             ret = -1;
                         } else  if (stream_ctx->query_ctx->query_length < 2 || stream_ctx->query_ctx->query[0] != 0 || stream_ctx->query_ctx->query[1] != 0) {
+                            quicdoq_count_metric(cnx_ctx->quicdoq_ctx, quicdoq_metric_protocol_errors);
                             ret = picoquic_close(cnx, QUICDOQ_ERROR_PROTOCOL);
                         }
+                        else if (stream_ctx->is_shed) {
+                            quicdoq_mark_stage(stream_ctx, quicdoq_stage_query_complete, picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic));
+                            if (quicdoq_refuse_response(cnx_ctx->quicdoq_ctx, stream_ctx->query_ctx, stream_ctx->shed_ede) == 0) {
+                                if (!stream_ctx->is_rate_limited) {
+                                    cnx_ctx->quicdoq_ctx->load_stats.nb_shed_refused++;
+                                }
+                            }
+                            else {
+                                ret = quicdoq_server_shed_stream(cnx, cnx_ctx, stream_ctx, 1);
+                            }
+                        }
                         else {
-                            ret = cnx_ctx->quicdoq_ctx->app_cb_fn(quicdoq_incoming_query,
-                                cnx_ctx->quicdoq_ctx->app_cb_ctx, stream_ctx->query_ctx,
-                                picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic));
+                            ret = quicdoq_server_incoming_query(cnx, cnx_ctx, stream_ctx);
                         }
                     }
                 }
@@ -176,7 +694,10 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
         }
     }
     else {
-        if (stream_ctx == NULL) {
+        if (stream_ctx == NULL && (stream_id & 3) == 0 && stream_id < cnx_ctx->next_available_stream_id) {
+            /* Data of a query cancelled by the client, ignore it */
+        }
+        else if (stream_ctx == NULL) {
             DBG_PRINTF("Data arrived on client stream  #%llu before context creation", (unsigned long long)stream_id);
             picoquic_log_app_message(cnx, "Quicdoq: Data arrived on client stream  #%llu before context creation.\n", (unsigned long long)stream_id);
             ret = -1;
@@ -202,8 +723,8 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
                         bytes + consumed, to_be_consumed);
                     consumed += to_be_consumed;
                     /* then signal a partial response */
-                    ret = cnx_ctx->quicdoq_ctx->app_cb_fn(quicdoq_response_partial,
-                        cnx_ctx->quicdoq_ctx->app_cb_ctx, stream_ctx->query_ctx,
+                    ret = quicdoq_client_callback(cnx_ctx->quicdoq_ctx, quicdoq_response_partial,
+                        stream_ctx->query_ctx,
                         picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic));
                     /* then reset the receive state */
                     stream_ctx->query_ctx->response_length = 0;
@@ -225,17 +746,26 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
                     ret = -1;
                 } else {
                     /* Query has arrived, apply the call back */
-                    ret = cnx_ctx->quicdoq_ctx->app_cb_fn(quicdoq_response_complete,
-                        cnx_ctx->quicdoq_ctx->app_cb_ctx, stream_ctx->query_ctx,
+                    quicdoq_count_metric(cnx_ctx->quicdoq_ctx, quicdoq_metric_responses_received);
+                    cnx_ctx->stats.nb_responses++;
+                    quicdoq_tp_message_received(cnx_ctx, stream_ctx->query_ctx->response_length);
+                    ret = quicdoq_client_callback(cnx_ctx->quicdoq_ctx, quicdoq_response_complete,
+                        stream_ctx->query_ctx,
                         picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic));
                     /* Close the stream on the client side, give control of the query context to the client */
                     stream_ctx->query_ctx = NULL;
                     quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+                    /* The stream credit can be used by a waiting query */
+                    quicdoq_pool_drain(cnx_ctx);
                 }
             }
         }
     }
 
+    if (ret != 0) {
+        quicdoq_count_metric(cnx_ctx->quicdoq_ctx, quicdoq_metric_protocol_errors);
+    }
+
     return ret;
 }
 
@@ -247,10 +777,11 @@ int quicdoq_callback_prepare_to_send(picoquic_cnx_t* cnx, uint64_t stream_id, qu
     uint8_t* data;
     size_t data_length;
     size_t already_sent = 0;
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(stream_id);
-    UNREFERENCED_PARAMETER(cnx);
-#endif
+
+    if (stream_ctx == NULL) {
+        /* The stream context was unlinked when the query was cancelled */
+        return picoquic_mark_active_stream(cnx, stream_id, 0, NULL);
+    }
     /* TODO: this code assumes a single response per query. In order
      * to support XFR and AXFR, need a way to push several responses */
     if (cnx_ctx->is_server) {
@@ -278,6 +809,7 @@ int quicdoq_callback_prepare_to_send(picoquic_cnx_t* cnx, uint64_t stream_id, qu
                 stream_ctx->bytes_sent++;
                 already_sent++;
             }
+            cnx_ctx->stats.bytes_sent += available;
             if (already_sent < space) {
                 memcpy(buffer + already_sent, data + stream_ctx->bytes_sent - 2, available - already_sent);
                 stream_ctx->bytes_sent += available - already_sent;
@@ -285,9 +817,29 @@ int quicdoq_callback_prepare_to_send(picoquic_cnx_t* cnx, uint64_t stream_id, qu
             }
 
             if (is_fin && cnx_ctx->is_server) {
+                uint64_t current_time = picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic);
+
+                quicdoq_mark_stage(stream_ctx, quicdoq_stage_last_byte_sent, current_time);
+                quicdoq_record_latency(cnx_ctx->quicdoq_ctx, stream_ctx);
+                if (cnx_ctx->quicdoq_ctx->cdns_log != NULL) {
+                    struct sockaddr* peer_addr = NULL;
+                    quicdoq_query_ctx_t* query_ctx = stream_ctx->query_ctx;
+
+                    picoquic_get_peer_addr(cnx, &peer_addr);
+                    (void)quicdoq_cdns_log(cnx_ctx->quicdoq_ctx->cdns_log,
+                        (query_ctx->is_query_view_valid) ? &query_ctx->query_view : NULL, query_ctx->query, query_ctx->query_length,
+                        query_ctx->response, query_ctx->response_length, peer_addr,
+                        stream_ctx->stage_time[quicdoq_stage_query_complete], current_time);
+                }
                 /* delete the stream context for the server */
                 quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
             }
+            else if (cnx_ctx->is_server) {
+                /* The priority is only a scheduling hint, a failure must not abort the connection */
+                if (quicdoq_update_response_priority(cnx_ctx, stream_ctx, picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic)) != 0) {
+                    DBG_PRINTF("Cannot set the priority of stream %" PRIu64, stream_ctx->stream_id);
+                }
+            }
         }
         else {
             ret = -1;
@@ -330,6 +882,8 @@ quicdoq_cnx_ctx_t* quicdoq_callback_create_context(quicdoq_ctx_t* quicdoq_ctx, i
         quicdoq_ctx->last_cnx = cnx_ctx;
 
         cnx_ctx->is_server = is_server;
+        quicdoq_ctx->nb_cnx++;
+        quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_connections_opened);
     }
     return cnx_ctx;
 }
@@ -352,53 +906,304 @@ void quicdoq_callback_delete_context(quicdoq_cnx_ctx_t* cnx_ctx)
         if (cnx_ctx->previous_cnx == NULL) {
             cnx_ctx->quicdoq_ctx->first_cnx = cnx_ctx->next_cnx;
         }
-        else {
-            cnx_ctx->previous_cnx->next_cnx = cnx_ctx->next_cnx;
+        else {
+            cnx_ctx->previous_cnx->next_cnx = cnx_ctx->next_cnx;
+        }
+
+        if (cnx_ctx->next_cnx == NULL) {
+            cnx_ctx->quicdoq_ctx->last_cnx = cnx_ctx->previous_cnx;
+        }
+        else {
+            cnx_ctx->next_cnx->previous_cnx = cnx_ctx->previous_cnx;
+        }
+
+        if (cnx_ctx->quicdoq_ctx->nb_cnx > 0) {
+            cnx_ctx->quicdoq_ctx->nb_cnx--;
+        }
+        quicdoq_count_metric(cnx_ctx->quicdoq_ctx, quicdoq_metric_connections_closed);
+        free(cnx_ctx);
+    }
+}
+
+/* Client connection pool.
+ * A client connection matches a query if it was opened to the same address
+ * with the same SNI and the same affinity. It can carry a new query if it
+ * is not closing and has not exhausted its stream credit.
+ */
+static int quicdoq_cnx_matches(quicdoq_cnx_ctx_t* cnx_ctx, char const* sni, struct sockaddr* addr, uint64_t affinity)
+{
+    int is_match = 0;
+
+    if (!cnx_ctx->is_server && cnx_ctx->affinity == affinity &&
+        picoquic_compare_addr(addr, (struct sockaddr*) & cnx_ctx->addr) == 0) {
+        if (sni == NULL) {
+            is_match = (cnx_ctx->sni == NULL);
+        }
+        else {
+            is_match = (cnx_ctx->sni != NULL && strcmp(sni, cnx_ctx->sni) == 0);
+        }
+    }
+
+    return is_match;
+}
+
+static int quicdoq_cnx_is_closing(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    return (cnx_ctx->cnx == NULL || picoquic_get_cnx_state(cnx_ctx->cnx) >= picoquic_state_disconnecting);
+}
+
+/* Queries that cannot be replayed are not sent in 0-RTT. They wait until the
+ * client has the 1-RTT keys, which is signalled by the almost ready callback. */
+static int quicdoq_cnx_is_ready(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    return (picoquic_get_cnx_state(cnx_ctx->cnx) >= picoquic_state_client_ready_start);
+}
+
+static int quicdoq_query_can_start(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_query_ctx_t* query_ctx)
+{
+    return (quicdoq_cnx_is_ready(cnx_ctx) || quicdoq_is_idempotent_query(query_ctx->query, query_ctx->query_length));
+}
+
+static int quicdoq_cnx_is_usable(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    return (!quicdoq_cnx_is_closing(cnx_ctx) && cnx_ctx->nb_open_streams < cnx_ctx->max_open_streams);
+}
+
+/* Find the least loaded connection that can carry a new query */
+quicdoq_cnx_ctx_t* quicdoq_find_cnx_ctx(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, uint64_t affinity)
+{
+    quicdoq_cnx_ctx_t* cnx_ctx = quicdoq_ctx->first_cnx;
+    quicdoq_cnx_ctx_t* best_ctx = NULL;
+
+    while (cnx_ctx != NULL) {
+        if (quicdoq_cnx_matches(cnx_ctx, sni, addr, affinity) && quicdoq_cnx_is_usable(cnx_ctx) &&
+            (best_ctx == NULL || cnx_ctx->nb_open_streams < best_ctx->nb_open_streams)) {
+            best_ctx = cnx_ctx;
+        }
+        cnx_ctx = cnx_ctx->next_cnx;
+    }
+
+    return best_ctx;
+}
+
+static int quicdoq_count_cnx(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, uint64_t affinity)
+{
+    quicdoq_cnx_ctx_t* cnx_ctx = quicdoq_ctx->first_cnx;
+    int nb_cnx = 0;
+
+    while (cnx_ctx != NULL) {
+        if (quicdoq_cnx_matches(cnx_ctx, sni, addr, affinity) && !quicdoq_cnx_is_closing(cnx_ctx)) {
+            nb_cnx++;
+        }
+        cnx_ctx = cnx_ctx->next_cnx;
+    }
+
+    return nb_cnx;
+}
+
+static int quicdoq_count_pending(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, uint64_t affinity)
+{
+    quicdoq_pending_query_t* pending = quicdoq_ctx->first_pending;
+    int nb_pending = 0;
+
+    while (pending != NULL) {
+        if (pending->query_ctx->cnx_affinity == affinity &&
+            picoquic_compare_addr(addr, pending->query_ctx->server_addr) == 0 &&
+            ((sni == NULL) ? (pending->query_ctx->server_name == NULL) :
+            (pending->query_ctx->server_name != NULL && strcmp(sni, pending->query_ctx->server_name) == 0))) {
+            nb_pending++;
+        }
+        pending = pending->next;
+    }
+
+    return nb_pending;
+}
+
+static int quicdoq_pool_enqueue(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx)
+{
+    int ret = 0;
+    quicdoq_pending_query_t* pending = (quicdoq_pending_query_t*)malloc(sizeof(quicdoq_pending_query_t));
+
+    if (pending == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_pending_query_t* next = NULL;
+
+        memset(pending, 0, sizeof(quicdoq_pending_query_t));
+        pending->query_ctx = query_ctx;
+        if (query_ctx->deadline != 0) {
+            pending->deadline.deadline = query_ctx->deadline;
+            pending->deadline.kind = quicdoq_deadline_pending;
+            pending->deadline.owner = pending;
+            if (quicdoq_deadline_start(quicdoq_ctx, &pending->deadline) != 0) {
+                free(pending);
+                return -1;
+            }
+        }
+        quicdoq_ctx->pool_stats.nb_queries_queued++;
+        pending->queued_time = picoquic_get_quic_time(quicdoq_ctx->quic);
+        /* Queries with a deadline wait ahead of queries with a later deadline, or none */
+        if (query_ctx->deadline != 0) {
+            next = quicdoq_ctx->first_pending;
+            while (next != NULL && next->query_ctx->deadline != 0 && next->query_ctx->deadline <= query_ctx->deadline) {
+                next = next->next;
+            }
+        }
+        pending->next = next;
+        pending->previous = (next == NULL) ? quicdoq_ctx->last_pending : next->previous;
+        if (pending->previous == NULL) {
+            quicdoq_ctx->first_pending = pending;
+        }
+        else {
+            pending->previous->next = pending;
+        }
+        if (next == NULL) {
+            quicdoq_ctx->last_pending = pending;
+        }
+        else {
+            next->previous = pending;
+        }
+    }
+
+    return ret;
+}
+
+static void quicdoq_pool_dequeue(quicdoq_ctx_t* quicdoq_ctx, quicdoq_pending_query_t* pending)
+{
+    quicdoq_deadline_stop(quicdoq_ctx, &pending->deadline);
+    if (pending->previous == NULL) {
+        quicdoq_ctx->first_pending = pending->next;
+    }
+    else {
+        pending->previous->next = pending->next;
+    }
+    if (pending->next == NULL) {
+        quicdoq_ctx->last_pending = pending->previous;
+    }
+    else {
+        pending->next->previous = pending->previous;
+    }
+    free(pending);
+}
+
+/* Open a stream for the query on the selected connection */
+static int quicdoq_start_query_on_cnx(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_query_ctx_t* query_ctx)
+{
+    int ret = 0;
+    /* Pick a stream ID for the query context */
+    quicdoq_stream_ctx_t* stream_ctx = quicdoq_find_or_create_stream(
+        cnx_ctx->next_available_stream_id, cnx_ctx, 1);
+    if (stream_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        /* Mark the stream as used, update the context, post the data */
+        cnx_ctx->next_available_stream_id += 4;
+        cnx_ctx->nb_open_streams++;
+        cnx_ctx->stats.nb_queries++;
+        if (cnx_ctx->is_0rtt_attempted && !quicdoq_cnx_is_ready(cnx_ctx)) {
+            /* If early data is rejected, the transport repeats the stream data in 1-RTT */
+            cnx_ctx->nb_early_queries++;
+        }
+        stream_ctx->query_ctx = query_ctx;
+        query_ctx->stream_id = stream_ctx->stream_id;
+        query_ctx->cid = picoquic_get_logging_cnxid(cnx_ctx->cnx);
+        query_ctx->quic = cnx_ctx->quicdoq_ctx->quic;
+        quicdoq_tp_open_stream_credit(cnx_ctx, stream_ctx->stream_id);
+        if (query_ctx->deadline != 0) {
+            stream_ctx->deadline.deadline = query_ctx->deadline;
+            stream_ctx->deadline.kind = quicdoq_deadline_stream;
+            stream_ctx->deadline.owner = stream_ctx;
+            ret = quicdoq_deadline_start(cnx_ctx->quicdoq_ctx, &stream_ctx->deadline);
+        }
+
+        if (ret == 0) {
+            ret = picoquic_mark_active_stream(cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
+        }
+    }
+
+    return ret;
+}
+
+/* Move waiting queries to the connection, as long as it has stream credit */
+void quicdoq_pool_drain(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+    quicdoq_pending_query_t* pending = quicdoq_ctx->first_pending;
+
+    while (pending != NULL && quicdoq_cnx_is_usable(cnx_ctx)) {
+        quicdoq_pending_query_t* next = pending->next;
+        quicdoq_query_ctx_t* query_ctx = pending->query_ctx;
+
+        if (quicdoq_cnx_matches(cnx_ctx, query_ctx->server_name, query_ctx->server_addr, query_ctx->cnx_affinity) &&
+            quicdoq_query_can_start(cnx_ctx, query_ctx)) {
+            quicdoq_pool_dequeue(quicdoq_ctx, pending);
+            if (quicdoq_start_query_on_cnx(cnx_ctx, query_ctx) != 0) {
+                picoquic_log_app_message(cnx_ctx->cnx, "Quicdoq: Cannot start queued query #%" PRIu64 ".\n", query_ctx->query_id);
+                query_ctx->return_code = quicdoq_query_failed;
+                quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_failed);
+                (void)quicdoq_client_callback(quicdoq_ctx, quicdoq_query_failed, query_ctx,
+                    picoquic_get_quic_time(quicdoq_ctx->quic));
+                /* The application may have cancelled other queries, restart from the top */
+                next = quicdoq_ctx->first_pending;
+            }
         }
+        pending = next;
+    }
+}
 
-        if (cnx_ctx->next_cnx == NULL) {
-            cnx_ctx->quicdoq_ctx->last_cnx = cnx_ctx->previous_cnx;
+/* When a connection closes, the queries in flight on that connection fail. */
+static void quicdoq_fail_client_queries(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+    quicdoq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
+
+    while (stream_ctx != NULL) {
+        quicdoq_query_ctx_t* query_ctx = stream_ctx->query_ctx;
+
+        if (query_ctx != NULL) {
+            /* Give control of the query context back to the client */
+            stream_ctx->query_ctx = NULL;
+            query_ctx->return_code = quicdoq_query_failed;
+            quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_failed);
+            (void)quicdoq_client_callback(quicdoq_ctx, quicdoq_query_failed, query_ctx,
+                picoquic_get_quic_time(quicdoq_ctx->quic));
+            /* The application may have cancelled other queries, restart from the top */
+            stream_ctx = cnx_ctx->first_stream;
         }
         else {
-            cnx_ctx->next_cnx->previous_cnx = cnx_ctx->previous_cnx;
+            stream_ctx = stream_ctx->next_stream;
         }
-
-        free(cnx_ctx);
     }
 }
 
-quicdoq_cnx_ctx_t* quicdoq_find_cnx_ctx(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr)
+/* Queries waiting for a server that has no connection left get a new connection */
+static void quicdoq_pool_restart(quicdoq_ctx_t* quicdoq_ctx)
 {
-    quicdoq_cnx_ctx_t* cnx_ctx = quicdoq_ctx->first_cnx;
-
-    if (sni != NULL) {
-        size_t l_sni = strlen(sni);
-
-        while (cnx_ctx != NULL) {
-            if (!cnx_ctx->is_server &&
-                picoquic_compare_addr(addr, (struct sockaddr*) & cnx_ctx->addr) == 0 &&
-                cnx_ctx->sni != NULL && strlen(cnx_ctx->sni) == l_sni &&
-                memcmp(sni, cnx_ctx->sni, l_sni) == 0) {
-                /* TODO: manage connection life time */
-                break;
+    quicdoq_pending_query_t* pending = quicdoq_ctx->first_pending;
+
+    while (pending != NULL) {
+        quicdoq_query_ctx_t* query_ctx = pending->query_ctx;
+
+        if (quicdoq_count_cnx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr, query_ctx->cnx_affinity) == 0) {
+            if (quicdoq_create_client_cnx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr, query_ctx->cnx_affinity) == NULL) {
+                quicdoq_pool_dequeue(quicdoq_ctx, pending);
+                query_ctx->return_code = quicdoq_query_failed;
+                quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_failed);
+                (void)quicdoq_client_callback(quicdoq_ctx, quicdoq_query_failed, query_ctx,
+                    picoquic_get_quic_time(quicdoq_ctx->quic));
             }
+            /* The queue was modified, restart from the top. */
+            pending = quicdoq_ctx->first_pending;
         }
-    }
-    else {
-        while (cnx_ctx != NULL) {
-            if (!cnx_ctx->is_server &&
-                picoquic_compare_addr(addr, (struct sockaddr*) & cnx_ctx->addr) == 0 &&
-                cnx_ctx->sni == NULL) {
-                /* TODO: manage connection life time */
-                break;
-            }
+        else {
+            pending = pending->next;
         }
     }
-
-    return cnx_ctx;
 }
 
-quicdoq_cnx_ctx_t* quicdoq_create_client_cnx(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr)
+quicdoq_cnx_ctx_t* quicdoq_create_client_cnx(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, uint64_t affinity)
 {
     quicdoq_cnx_ctx_t* cnx_ctx = NULL;
     picoquic_cnx_t* cnx = picoquic_create_cnx(quicdoq_ctx->quic, picoquic_null_connection_id, picoquic_null_connection_id,
@@ -412,15 +1217,31 @@ quicdoq_cnx_ctx_t* quicdoq_create_client_cnx(quicdoq_ctx_t* quicdoq_ctx, char co
         else {
             picoquic_store_addr(&cnx_ctx->addr, addr);
             cnx_ctx->sni = picoquic_string_duplicate(sni);
+            cnx_ctx->affinity = affinity;
+            cnx_ctx->max_open_streams = quicdoq_ctx->pool_max_streams;
             picoquic_set_callback(cnx, quicdoq_callback, cnx_ctx);
 
-            quicdoq_set_tp(cnx);
+            quicdoq_set_tp(quicdoq_ctx, cnx);
+
+            if (quicdoq_ctx->pool_keep_alive_interval > 0) {
+                picoquic_enable_keep_alive(cnx, quicdoq_ctx->pool_keep_alive_interval);
+            }
 
             if (picoquic_start_client_cnx(cnx) != 0) {
                 DBG_PRINTF("Could not start the connection to %s", sni);
                 picoquic_log_app_message(cnx, "Quicdoq: Could not start the connection to %s.\n", (sni == NULL)?"<NULL>":sni);
                 /* TODO: proper error handling */
             }
+            else {
+                /* If a session ticket was found, idempotent queries go out in 0-RTT */
+                cnx_ctx->is_0rtt_attempted = picoquic_is_0rtt_available(cnx);
+                quicdoq_ctx->pool_stats.nb_cnx_started++;
+                if (cnx_ctx->is_0rtt_attempted) {
+                    quicdoq_ctx->pool_stats.nb_cnx_0rtt++;
+                }
+                /* Queries waiting for this server can use the new connection */
+                quicdoq_pool_drain(cnx_ctx);
+            }
         }
     }
 
@@ -466,16 +1287,58 @@ int quicdoq_callback(picoquic_cnx_t* cnx,
             break;
         case picoquic_callback_stream_reset: /* Client reset stream #x */
         case picoquic_callback_stop_sending: /* Client asks server to reset stream #x */
-            picoquic_reset_stream(cnx, stream_id, 0);
-            ret = cnx_ctx->quicdoq_ctx->app_cb_fn(quicdoq_response_cancelled,
-                cnx_ctx->quicdoq_ctx->app_cb_ctx, stream_ctx->query_ctx,
-                picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic));
+            quicdoq_count_metric(cnx_ctx->quicdoq_ctx, quicdoq_metric_streams_reset);
+            cnx_ctx->stats.nb_resets++;
+            if (stream_ctx == NULL && cnx_ctx->is_server) {
+                stream_ctx = quicdoq_find_or_create_stream(stream_id, cnx_ctx, 0);
+            }
+            if (stream_ctx == NULL && !cnx_ctx->is_server) {
+                /* Stream of a query cancelled by the client, already reset */
+            }
+            else if (stream_ctx != NULL && stream_ctx->is_reset) {
+                /* The client gave up on a stream shed by the server */
+                quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+            }
+            else {
+                picoquic_reset_stream(cnx, stream_id, 0);
+                if (stream_ctx != NULL && stream_ctx->query_ctx != NULL && cnx_ctx->is_server) {
+                    /* The client abandoned the query. If the application holds it and
+                     * has not responded yet, let it drop the query, then release the stream. */
+                    if ((stream_ctx->stage_mask & (1u << quicdoq_stage_app_callback)) != 0 &&
+                        (stream_ctx->stage_mask & (1u << quicdoq_stage_response_posted)) == 0) {
+                        ret = cnx_ctx->quicdoq_ctx->app_cb_fn(quicdoq_query_cancelled,
+                            cnx_ctx->quicdoq_ctx->app_cb_ctx, stream_ctx->query_ctx,
+                            picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic));
+                    }
+                    picoquic_unlink_app_stream_ctx(cnx, stream_id);
+                    quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+                }
+                else if (stream_ctx != NULL && stream_ctx->query_ctx != NULL) {
+                    quicdoq_query_ctx_t* query_ctx = stream_ctx->query_ctx;
+                    /* Give control of the query context back to the client, and release the stream */
+                    picoquic_unlink_app_stream_ctx(cnx, stream_id);
+                    stream_ctx->query_ctx = NULL;
+                    quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+                    ret = quicdoq_client_callback(cnx_ctx->quicdoq_ctx, quicdoq_response_cancelled, query_ctx,
+                        picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic));
+                    quicdoq_pool_drain(cnx_ctx);
+                }
+            }
             break;
         case picoquic_callback_stateless_reset:
         case picoquic_callback_close: /* Received connection close */
         case picoquic_callback_application_close: /* Received application close */
-            quicdoq_callback_delete_context(cnx_ctx);
-            picoquic_set_callback(cnx, NULL, NULL);
+            if (!cnx_ctx->is_server && !cnx_ctx->quicdoq_ctx->is_deleting) {
+                quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+                quicdoq_fail_client_queries(cnx_ctx);
+                quicdoq_callback_delete_context(cnx_ctx);
+                picoquic_set_callback(cnx, NULL, NULL);
+                quicdoq_pool_restart(quicdoq_ctx);
+            }
+            else {
+                quicdoq_callback_delete_context(cnx_ctx);
+                picoquic_set_callback(cnx, NULL, NULL);
+            }
             break;
         case picoquic_callback_stream_gap:
             /* Gap indication, when unreliable streams are supported */
@@ -488,8 +1351,24 @@ int quicdoq_callback(picoquic_cnx_t* cnx,
         case picoquic_callback_ready:
             /* Check that the transport parameters are what DoQ expects */
             if (quicdoq_check_tp(cnx_ctx, cnx) != 0) {
+                quicdoq_count_metric(cnx_ctx->quicdoq_ctx, quicdoq_metric_protocol_errors);
                 (void)picoquic_close(cnx, QUICDOQ_ERROR_PROTOCOL);
             }
+            else if (!cnx_ctx->is_server) {
+                if (cnx_ctx->is_0rtt_attempted && fin_or_event == picoquic_callback_almost_ready) {
+                    picoquic_log_app_message(cnx, "Quicdoq: %d queries sent in 0-RTT.\n", cnx_ctx->nb_early_queries);
+                }
+                /* Do not open more streams than the server allows */
+                picoquic_tp_t const* tp = picoquic_get_transport_parameters(cnx, 0);
+                uint64_t nb_streams = quicdoq_tp_stream_count_from_limit(tp->initial_max_stream_id_bidir);
+                if (nb_streams > 0 && nb_streams < cnx_ctx->max_open_streams) {
+                    cnx_ctx->max_open_streams = (uint16_t)nb_streams;
+                }
+                quicdoq_pool_drain(cnx_ctx);
+            }
+            else if (fin_or_event == picoquic_callback_ready) {
+                ret = quicdoq_server_release_deferred(cnx_ctx);
+            }
             break;
         case picoquic_callback_datagram:/* No datagram support in DoQ */
             break;
@@ -553,14 +1432,14 @@ int quicdoq_set_default_tp(quicdoq_ctx_t* quicdoq_ctx)
         * initiated by the client, and should be authorized to send
         * a 64K-1 packet */
     tp.initial_max_stream_data_bidi_local = 0;
-    tp.initial_max_stream_data_bidi_remote = QUICDOQ_MAX_STREAM_DATA;
-    tp.initial_max_stream_id_bidir = 256;
+    tp.initial_max_stream_data_bidi_remote = quicdoq_ctx->tp_profile.initial_max_stream_data;
+    tp.initial_max_stream_id_bidir = quicdoq_tp_stream_limit_from_count(quicdoq_ctx->tp_profile.max_bidir_streams);
     tp.initial_max_stream_data_uni = 0;
-    tp.initial_max_data = 0x10000;
+    tp.initial_max_data = quicdoq_ctx->tp_credit.max_data;
     tp.initial_max_stream_id_unidir = 0;
-    tp.max_idle_timeout = 20000;
+    tp.max_idle_timeout = quicdoq_ctx->tp_profile.max_idle_timeout;
     tp.max_packet_size = 1232;
-    tp.max_ack_delay = 10000;
+    tp.max_ack_delay = quicdoq_ctx->tp_profile.max_ack_delay;
     tp.active_connection_id_limit = 3;
     tp.ack_delay_exponent = 3;
     tp.migration_disabled = 0;
@@ -572,22 +1451,22 @@ int quicdoq_set_default_tp(quicdoq_ctx_t* quicdoq_ctx)
 
 /* Set transport parameters to adequate value for quicdoq client.
  */
-void quicdoq_set_tp(picoquic_cnx_t * cnx)
+void quicdoq_set_tp(quicdoq_ctx_t* quicdoq_ctx, picoquic_cnx_t * cnx)
 {
     picoquic_tp_t tp;
     memset(&tp, 0, sizeof(picoquic_tp_t));
     /* This is a client context. The "local" bidi streams are those
         * initiated by the client, and the server should be authorized to send
         * a 64K-1 packet */
-    tp.initial_max_stream_data_bidi_local = QUICDOQ_MAX_STREAM_DATA;
+    tp.initial_max_stream_data_bidi_local = quicdoq_ctx->tp_profile.initial_max_stream_data;
     tp.initial_max_stream_data_bidi_remote = 0;
     tp.initial_max_stream_id_bidir = 0;
     tp.initial_max_stream_data_uni = 0;
-    tp.initial_max_data = 0x10000;
+    tp.initial_max_data = quicdoq_ctx->tp_credit.max_data;
     tp.initial_max_stream_id_unidir = 0;
-    tp.max_idle_timeout = 20000;
+    tp.max_idle_timeout = quicdoq_ctx->tp_profile.max_idle_timeout;
     tp.max_packet_size = 1232;
-    tp.max_ack_delay = 10000;
+    tp.max_ack_delay = quicdoq_ctx->tp_profile.max_ack_delay;
     tp.active_connection_id_limit = 3;
     tp.ack_delay_exponent = 3;
     tp.migration_disabled = 0;
@@ -624,6 +1503,17 @@ quicdoq_ctx_t * quicdoq_create(char const * alpn,
     char const * cert_file_name, char const * key_file_name, char const * cert_root_file_name,
     char const * ticket_store_file_name, char const * token_store_file_name,
     quicdoq_app_cb_fn app_cb_fn, void* app_cb_ctx, uint64_t * simulated_time)
+{
+    return quicdoq_create_ex(alpn, cert_file_name, key_file_name, cert_root_file_name,
+        ticket_store_file_name, token_store_file_name, app_cb_fn, app_cb_ctx, simulated_time,
+        QUICDOQ_DEFAULT_MAX_CONNECTIONS);
+}
+
+quicdoq_ctx_t* quicdoq_create_ex(char const* alpn,
+    char const* cert_file_name, char const* key_file_name, char const* cert_root_file_name,
+    char const* ticket_store_file_name, char const* token_store_file_name,
+    quicdoq_app_cb_fn app_cb_fn, void* app_cb_ctx, uint64_t* simulated_time,
+    uint32_t max_nb_connections)
 {
     quicdoq_ctx_t* quicdoq_ctx = (quicdoq_ctx_t*)malloc(sizeof(quicdoq_ctx_t));
     if (quicdoq_ctx != NULL) {
@@ -640,13 +1530,32 @@ quicdoq_ctx_t * quicdoq_create(char const * alpn,
         quicdoq_ctx->default_callback_ctx.quicdoq_ctx = quicdoq_ctx;
         quicdoq_ctx->app_cb_fn = app_cb_fn;
         quicdoq_ctx->app_cb_ctx = app_cb_ctx;
+        quicdoq_ctx->pool_max_streams = QUICDOQ_POOL_DEFAULT_MAX_STREAMS;
+        quicdoq_ctx->pool_max_cnx = QUICDOQ_POOL_DEFAULT_MAX_CNX;
+        quicdoq_ctx->pool_queue_threshold = QUICDOQ_POOL_DEFAULT_QUEUE_THRESHOLD;
+        quicdoq_ctx->early_policy = quicdoq_0rtt_accept_idempotent;
+        quicdoq_ctx->replay_window = QUICDOQ_REPLAY_WINDOW_DEFAULT;
+        quicdoq_ctx->is_response_priority = 1;
+        quicdoq_get_default_hedge_policy(&quicdoq_ctx->hedge_policy);
+        quicdoq_get_default_tp_profile(&quicdoq_ctx->tp_profile);
+        quicdoq_ctx->tp_credit.max_data = quicdoq_ctx->tp_profile.initial_max_data;
+        quicdoq_ctx->tp_credit.stream_data = quicdoq_ctx->tp_profile.initial_max_stream_data;
+        quicdoq_ctx->replay_cache = (quicdoq_replay_cache_t*)malloc(sizeof(quicdoq_replay_cache_t));
+        if (quicdoq_ctx->replay_cache != NULL) {
+            memset(quicdoq_ctx->replay_cache, 0, sizeof(quicdoq_replay_cache_t));
+        }
         if (alpn == NULL) {
             alpn = QUICDOQ_ALPN;
         }
 
-        quicdoq_ctx->quic = picoquic_create(64, cert_file_name, key_file_name, cert_root_file_name,
-            alpn, quicdoq_callback, &quicdoq_ctx->default_callback_ctx, NULL, NULL, NULL, current_time, simulated_time,
-            ticket_store_file_name, NULL, 0);
+        if (quicdoq_ctx->replay_cache == NULL) {
+            DBG_PRINTF("%s", "Cannot allocate the replay cache.");
+        }
+        else {
+            quicdoq_ctx->quic = picoquic_create(max_nb_connections, cert_file_name, key_file_name, cert_root_file_name,
+                alpn, quicdoq_callback, &quicdoq_ctx->default_callback_ctx, NULL, NULL, NULL, current_time, simulated_time,
+                ticket_store_file_name, NULL, 0);
+        }
 
         if (quicdoq_ctx->quic == NULL) {
             quicdoq_delete(quicdoq_ctx);
@@ -677,6 +1586,8 @@ quicdoq_ctx_t * quicdoq_create(char const * alpn,
  */
 void quicdoq_delete(quicdoq_ctx_t* ctx)
 {
+    ctx->is_deleting = 1;
+
     if (ctx->quic != NULL) {
         picoquic_free(ctx->quic);
         ctx->quic = NULL;
@@ -686,6 +1597,29 @@ void quicdoq_delete(quicdoq_ctx_t* ctx)
         quicdoq_callback_delete_context(ctx->first_cnx);
     }
 
+    /* Queries still waiting are owned by the application */
+    while (ctx->first_pending != NULL) {
+        quicdoq_pool_dequeue(ctx, ctx->first_pending);
+    }
+
+    /* Copies of queries sent as hedges are owned by quicdoq */
+    quicdoq_hedge_clear(ctx);
+
+    if (ctx->deadline_heap != NULL) {
+        free(ctx->deadline_heap);
+        ctx->deadline_heap = NULL;
+    }
+
+    if (ctx->replay_cache != NULL) {
+        free(ctx->replay_cache);
+        ctx->replay_cache = NULL;
+    }
+
+    if (ctx->rate_limiter != NULL) {
+        quicdoq_rate_limiter_delete(ctx->rate_limiter);
+        ctx->rate_limiter = NULL;
+    }
+
     free(ctx);
 }
 
@@ -703,62 +1637,171 @@ picoquic_quic_t* quicdoq_get_quic_ctx(quicdoq_ctx_t* ctx)
 int quicdoq_post_query(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx)
 {
     int ret = 0;
-    /* Find whether there already is a connection to the specified address and SNI */
-    quicdoq_cnx_ctx_t* cnx_ctx = quicdoq_find_cnx_ctx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr);
+    quicdoq_cnx_ctx_t* cnx_ctx;
+
+    if (quicdoq_ctx->first_hedge_server != NULL) {
+        /* The hedge record must exist before any callback of the query */
+        quicdoq_hedge_prepare_post(quicdoq_ctx, query_ctx, picoquic_get_quic_time(quicdoq_ctx->quic));
+    }
+
+    /* Find the least loaded connection to the specified address and SNI */
+    cnx_ctx = quicdoq_find_cnx_ctx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr,
+        query_ctx->cnx_affinity);
 
     if (cnx_ctx == NULL) {
-        cnx_ctx = quicdoq_create_client_cnx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr);
+        int nb_cnx = quicdoq_count_cnx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr, query_ctx->cnx_affinity);
 
-        if (cnx_ctx == NULL) {
-            ret = -1;
+        if (nb_cnx == 0) {
+            cnx_ctx = quicdoq_create_client_cnx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr,
+                query_ctx->cnx_affinity);
+
+            if (cnx_ctx == NULL) {
+                ret = -1;
+            }
+        }
+        else {
+            /* All connections are busy. Queue the query, and open an extra
+             * connection if too many queries are waiting. Queries with an
+             * affinity stay on their single connection. */
+            ret = quicdoq_pool_enqueue(quicdoq_ctx, query_ctx);
+            if (ret == 0 && query_ctx->cnx_affinity == 0 && nb_cnx < quicdoq_ctx->pool_max_cnx &&
+                quicdoq_count_pending(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr, 0) >= quicdoq_ctx->pool_queue_threshold) {
+                (void)quicdoq_create_client_cnx(quicdoq_ctx, query_ctx->server_name, query_ctx->server_addr, 0);
+            }
         }
     }
 
-    if (ret == 0) {
-        /* Pick a stream ID for the query context */
-        quicdoq_stream_ctx_t* stream_ctx = quicdoq_find_or_create_stream(
-            cnx_ctx->next_available_stream_id, cnx_ctx, 1);
-        if (stream_ctx == NULL) {
-            ret = -1;
+    if (ret == 0 && cnx_ctx != NULL) {
+        if (quicdoq_query_can_start(cnx_ctx, query_ctx)) {
+            ret = quicdoq_start_query_on_cnx(cnx_ctx, query_ctx);
         }
         else {
-            /* Mark the stream as used, update the context, post the data */
-            cnx_ctx->next_available_stream_id += 4;
-            stream_ctx->query_ctx = query_ctx;
-            query_ctx->stream_id = stream_ctx->stream_id;
-            query_ctx->cid = picoquic_get_logging_cnxid(cnx_ctx->cnx);
-            query_ctx->quic = quicdoq_ctx->quic;
+            /* Hold the query until the handshake completes */
+            ret = quicdoq_pool_enqueue(quicdoq_ctx, query_ctx);
+        }
+    }
+
+    if (ret == 0) {
+        quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_sent);
+    }
+    else if (quicdoq_ctx->first_hedge != NULL) {
+        quicdoq_hedge_post_failed(quicdoq_ctx, query_ctx);
+    }
 
+    return ret;
+}
 
-            ret = picoquic_mark_active_stream(cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
+/* Abandon the stream of a client query, and release the stream context.
+ * The query context is returned to the application.
+ */
+static void quicdoq_client_abandon_stream(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx)
+{
+    /* The stream may already be closed in either direction, errors are expected */
+    (void)picoquic_reset_stream(cnx_ctx->cnx, stream_ctx->stream_id, QUICDOQ_ERROR_REQUEST_CANCELLED);
+    (void)picoquic_stop_sending(cnx_ctx->cnx, stream_ctx->stream_id, QUICDOQ_ERROR_REQUEST_CANCELLED);
+    picoquic_unlink_app_stream_ctx(cnx_ctx->cnx, stream_ctx->stream_id);
+    stream_ctx->query_ctx = NULL;
+    quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+}
+
+/* Withdraw a client query.
+ * A query waiting in the pool is removed from the queue. A query in flight
+ * is abandoned: the stream is reset and the server is asked to stop sending,
+ * then the stream context is unlinked from picoquic and deleted, so that the
+ * data or reset that the server may still send are ignored.
+ */
+int quicdoq_client_withdraw_query(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx)
+{
+    int ret = -1;
+    quicdoq_cnx_ctx_t* cnx_ctx = NULL;
+    quicdoq_stream_ctx_t* stream_ctx = NULL;
+    quicdoq_pending_query_t* pending;
+
+    pending = quicdoq_ctx->first_pending;
+    while (pending != NULL && pending->query_ctx != query_ctx) {
+        pending = pending->next;
+    }
+
+    if (pending != NULL) {
+        quicdoq_pool_dequeue(quicdoq_ctx, pending);
+        ret = 0;
+    }
+    else {
+        cnx_ctx = quicdoq_ctx->first_cnx;
+        while (cnx_ctx != NULL && stream_ctx == NULL) {
+            if (!cnx_ctx->is_server) {
+                stream_ctx = cnx_ctx->first_stream;
+                while (stream_ctx != NULL && stream_ctx->query_ctx != query_ctx) {
+                    stream_ctx = stream_ctx->next_stream;
+                }
+            }
+            if (stream_ctx == NULL) {
+                cnx_ctx = cnx_ctx->next_cnx;
+            }
+        }
+
+        if (stream_ctx != NULL) {
+            quicdoq_client_abandon_stream(cnx_ctx, stream_ctx);
+            /* The stream credit can be used by a waiting query */
+            quicdoq_pool_drain(cnx_ctx);
+            ret = 0;
         }
     }
 
     return ret;
 }
 
+/* Cancel a client query, and its hedge if one was sent.
+ * The final callback is delivered before returning. Returns -1 if the query
+ * is not known, e.g., if its final callback was already delivered.
+ */
 int quicdoq_cancel_query(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx)
 {
+    int ret = -1;
+
     if (quicdoq_ctx == NULL || query_ctx == NULL) {
         return -1;
     }
-    return 0;
+
+    if (quicdoq_ctx->first_hedge != NULL && quicdoq_hedge_cancel(quicdoq_ctx, query_ctx)) {
+        /* The query already failed, and was waiting for its hedge */
+        ret = 0;
+    }
+    else {
+        ret = quicdoq_client_withdraw_query(quicdoq_ctx, query_ctx);
+    }
+
+    if (ret == 0) {
+        query_ctx->return_code = quicdoq_query_cancelled;
+        quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_cancelled);
+        (void)quicdoq_ctx->app_cb_fn(quicdoq_query_cancelled, quicdoq_ctx->app_cb_ctx, query_ctx,
+            picoquic_get_quic_time(quicdoq_ctx->quic));
+    }
+
+    return ret;
 }
 
 int quicdoq_post_response(quicdoq_query_ctx_t* query_ctx)
 {
     quicdoq_stream_ctx_t* stream_ctx = (quicdoq_stream_ctx_t*)query_ctx->client_cb_ctx;
     quicdoq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
-    picoquic_log_app_message(cnx_ctx->cnx, "Response #%d received at cnx time: %"PRIu64 "us.\n", query_ctx->query_id, 
-        picoquic_get_quic_time(query_ctx->quic) - picoquic_get_cnx_start_time(cnx_ctx->cnx));
+    quicdoq_count_metric(cnx_ctx->quicdoq_ctx, quicdoq_metric_responses_sent);
+    uint64_t current_time = picoquic_get_quic_time(cnx_ctx->quicdoq_ctx->quic);
+    cnx_ctx->stats.nb_responses++;
+    quicdoq_mark_stage(stream_ctx, quicdoq_stage_response_posted, current_time);
+    quicdoq_deadline_stop(cnx_ctx->quicdoq_ctx, &stream_ctx->deadline);
+    quicdoq_log_event(cnx_ctx->quicdoq_ctx, cnx_ctx->cnx, quicdoq_log_event_response, query_ctx->query_id, stream_ctx->stream_id, 0);
+    if (quicdoq_update_response_priority(cnx_ctx, stream_ctx, current_time) != 0) {
+        DBG_PRINTF("Cannot set the priority of stream %" PRIu64, stream_ctx->stream_id);
+    }
     return picoquic_mark_active_stream(cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
 }
 
 
-int quicdoq_format_refuse_response(
+static int quicdoq_format_error_response(
     uint8_t* query, size_t query_length,
     uint8_t* response, size_t response_max_size, size_t* response_length,
-    uint16_t extended_dns_error)
+    uint8_t rcode, uint16_t extended_dns_error)
 {
     int ret = -1;
 
@@ -785,8 +1828,8 @@ int quicdoq_format_refuse_response(
             memcpy(response, query, after_q);
             /* Set the QR bit to 1 */
             response[2] |= 128;
-            /* Set the response code to refused */
-            response[3] = (query[3] & 0xF0) | 5;
+            /* Set the response code */
+            response[3] = (query[3] & 0xF0) | rcode;
             /* Set the AN, NS, AD counts to 0 */
             memset(response + 6, 0, 6);
             r_len = after_q;
@@ -825,6 +1868,15 @@ int quicdoq_format_refuse_response(
     return ret;
 }
 
+int quicdoq_format_refuse_response(
+    uint8_t* query, size_t query_length,
+    uint8_t* response, size_t response_max_size, size_t* response_length,
+    uint16_t extended_dns_error)
+{
+    return quicdoq_format_error_response(query, query_length, response, response_max_size, response_length,
+        QUICDOQ_RCODE_REFUSED, extended_dns_error);
+}
+
 int quicdoq_refuse_response(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx, uint16_t extended_dns_error)
 {
     int ret = 0;
@@ -838,8 +1890,15 @@ int quicdoq_refuse_response(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* que
         ret = quicdoq_format_refuse_response(query_ctx->query, query_ctx->query_length, query_ctx->response,
             query_ctx->response_max_size, &query_ctx->response_length, extended_dns_error);
         if (ret == 0) {
-            picoquic_log_app_message(cnx_ctx->cnx, "Query #%d refused with EDE 0x%x at cnx time: %"PRIu64 "us.\n", 
-                query_ctx->query_id, extended_dns_error, picoquic_get_quic_time(query_ctx->quic) - picoquic_get_cnx_start_time(cnx_ctx->cnx));
+            quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_refused);
+            cnx_ctx->stats.nb_refused++;
+            quicdoq_mark_stage(stream_ctx, quicdoq_stage_response_posted, picoquic_get_quic_time(quicdoq_ctx->quic));
+            quicdoq_deadline_stop(quicdoq_ctx, &stream_ctx->deadline);
+            quicdoq_log_event(quicdoq_ctx, cnx_ctx->cnx, quicdoq_log_event_refused, query_ctx->query_id, stream_ctx->stream_id,
+                extended_dns_error);
+            if (quicdoq_update_response_priority(cnx_ctx, stream_ctx, picoquic_get_quic_time(quicdoq_ctx->quic)) != 0) {
+                DBG_PRINTF("Cannot set the priority of stream %" PRIu64, stream_ctx->stream_id);
+            }
             return picoquic_mark_active_stream(cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx);
         }
     }
@@ -855,12 +1914,116 @@ int quicdoq_cancel_response(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* que
     } else {
         quicdoq_stream_ctx_t* stream_ctx = (quicdoq_stream_ctx_t*)query_ctx->client_cb_ctx;
         quicdoq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
+        quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_responses_cancelled);
+        quicdoq_deadline_stop(quicdoq_ctx, &stream_ctx->deadline);
         ret = picoquic_reset_stream(cnx_ctx->cnx, stream_ctx->stream_id, error_code);
+        /* No response will be sent: release the stream and the query now, so
+         * the query does not count against the load budget until the connection closes */
+        picoquic_unlink_app_stream_ctx(cnx_ctx->cnx, stream_ctx->stream_id);
+        quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
+    }
+
+    return ret;
+}
+
+/* Deadlines.
+ * The earliest deadline is at the top of the heap. Each expired entry is
+ * removed from the heap before its callback is delivered, and the heap is
+ * read again after the callback, since the application may cancel other
+ * queries from the callback.
+ */
+static void quicdoq_client_query_expired(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx, uint64_t current_time)
+{
+    query_ctx->return_code = quicdoq_query_failed;
+    quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_expired);
+    (void)quicdoq_client_callback(quicdoq_ctx, quicdoq_query_failed, query_ctx, current_time);
+}
+
+static int quicdoq_server_query_expired(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+    quicdoq_query_ctx_t* query_ctx = stream_ctx->query_ctx;
+
+    quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_queries_expired);
+    /* Let the application, e.g., the UDP relay, drop the query */
+    ret = quicdoq_ctx->app_cb_fn(quicdoq_query_cancelled, quicdoq_ctx->app_cb_ctx, query_ctx, current_time);
+
+    if (quicdoq_ctx->is_deadline_servfail &&
+        quicdoq_format_error_response(query_ctx->query, query_ctx->query_length, query_ctx->response,
+            query_ctx->response_max_size, &query_ctx->response_length, QUICDOQ_RCODE_SERVFAIL,
+            QUICDOQ_EDE_NO_REACHABLE_AUTHORITY) == 0) {
+        quicdoq_mark_stage(stream_ctx, quicdoq_stage_response_posted, current_time);
+        quicdoq_log_event(quicdoq_ctx, cnx_ctx->cnx, quicdoq_log_event_expired, query_ctx->query_id, stream_ctx->stream_id, 0);
+        (void)quicdoq_update_response_priority(cnx_ctx, stream_ctx, current_time);
+        if (picoquic_mark_active_stream(cnx_ctx->cnx, stream_ctx->stream_id, 1, stream_ctx) != 0) {
+            ret = -1;
+        }
+    }
+    else {
+        quicdoq_log_event(quicdoq_ctx, cnx_ctx->cnx, quicdoq_log_event_expired, query_ctx->query_id, stream_ctx->stream_id, 0);
+        (void)picoquic_reset_stream(cnx_ctx->cnx, stream_ctx->stream_id, QUICDOQ_ERROR_RESPONSE_TIME_OUT);
+        picoquic_unlink_app_stream_ctx(cnx_ctx->cnx, stream_ctx->stream_id);
+        quicdoq_delete_stream_ctx(cnx_ctx, stream_ctx);
     }
 
     return ret;
 }
 
+void quicdoq_check_deadlines(quicdoq_ctx_t* quicdoq_ctx, uint64_t current_time)
+{
+    while (quicdoq_ctx->nb_deadlines > 0 && quicdoq_ctx->deadline_heap[0]->deadline <= current_time) {
+        quicdoq_deadline_t* entry = quicdoq_ctx->deadline_heap[0];
+
+        quicdoq_deadline_stop(quicdoq_ctx, entry);
+
+        if (entry->kind == quicdoq_deadline_pending) {
+            /* Client query waiting for stream credit */
+            quicdoq_pending_query_t* pending = (quicdoq_pending_query_t*)entry->owner;
+            quicdoq_query_ctx_t* query_ctx = pending->query_ctx;
+
+            quicdoq_pool_dequeue(quicdoq_ctx, pending);
+            quicdoq_client_query_expired(quicdoq_ctx, query_ctx, current_time);
+        }
+        else if (entry->kind == quicdoq_deadline_stream) {
+            quicdoq_stream_ctx_t* stream_ctx = (quicdoq_stream_ctx_t*)entry->owner;
+            quicdoq_cnx_ctx_t* cnx_ctx = stream_ctx->cnx_ctx;
+            quicdoq_query_ctx_t* query_ctx = stream_ctx->query_ctx;
+
+            if (query_ctx == NULL) {
+                /* The query context was already returned to the application */
+            }
+            else if (cnx_ctx->is_server) {
+                /* The deadline is stopped when the response is posted */
+                if ((stream_ctx->stage_mask & (1u << quicdoq_stage_app_callback)) != 0 &&
+                    quicdoq_server_query_expired(cnx_ctx, stream_ctx, current_time) != 0) {
+                    quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_protocol_errors);
+                }
+            }
+            else {
+                quicdoq_client_abandon_stream(cnx_ctx, stream_ctx);
+                /* The stream credit can be used by a waiting query */
+                quicdoq_pool_drain(cnx_ctx);
+                quicdoq_client_query_expired(quicdoq_ctx, query_ctx, current_time);
+            }
+        }
+        else {
+            quicdoq_hedge_timer_expired(quicdoq_ctx, (quicdoq_hedge_t*)entry->owner, current_time);
+        }
+    }
+}
+
+uint64_t quicdoq_next_deadline(quicdoq_ctx_t* quicdoq_ctx)
+{
+    return (quicdoq_ctx->nb_deadlines > 0) ? quicdoq_ctx->deadline_heap[0]->deadline : UINT64_MAX;
+}
+
+void quicdoq_set_deadline_budget(quicdoq_ctx_t* quicdoq_ctx, uint64_t budget, int answer_servfail)
+{
+    quicdoq_ctx->deadline_budget = budget;
+    quicdoq_ctx->is_deadline_servfail = answer_servfail;
+}
+
 int quicdoq_is_closed(quicdoq_ctx_t* quicdoq_ctx)
 {
     quicdoq_cnx_ctx_t* cnx_ctx = quicdoq_ctx->first_cnx;
@@ -887,3 +2050,151 @@ int quicdoq_is_closed(quicdoq_ctx_t* quicdoq_ctx)
     }
     return is_empty;
 }
+
+void quicdoq_set_pool_params(quicdoq_ctx_t* quicdoq_ctx, uint16_t max_streams_per_cnx,
+    uint16_t max_cnx_per_server, uint16_t queue_threshold, uint64_t keep_alive_interval)
+{
+    quicdoq_ctx->pool_max_streams = (max_streams_per_cnx == 0) ? 1 : max_streams_per_cnx;
+    quicdoq_ctx->pool_max_cnx = (max_cnx_per_server == 0) ? 1 : max_cnx_per_server;
+    quicdoq_ctx->pool_queue_threshold = queue_threshold;
+    quicdoq_ctx->pool_keep_alive_interval = keep_alive_interval;
+}
+
+int quicdoq_prewarm_connections(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, int nb_cnx)
+{
+    int ret = 0;
+
+    while (ret == 0 && nb_cnx > 0 && quicdoq_count_cnx(quicdoq_ctx, sni, addr, 0) < quicdoq_ctx->pool_max_cnx) {
+        if (quicdoq_create_client_cnx(quicdoq_ctx, sni, addr, 0) == NULL) {
+            ret = -1;
+        }
+        nb_cnx--;
+    }
+
+    return ret;
+}
+
+void quicdoq_get_pool_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_pool_stats_t* stats)
+{
+    *stats = quicdoq_ctx->pool_stats;
+}
+
+void quicdoq_set_0rtt_policy(quicdoq_ctx_t* quicdoq_ctx, quicdoq_0rtt_policy_enum policy, uint64_t replay_window)
+{
+    quicdoq_ctx->early_policy = policy;
+    /* A replayed flight is accepted as long as its ticket is valid */
+    quicdoq_ctx->replay_window = (replay_window < QUICDOQ_TICKET_LIFETIME) ? QUICDOQ_TICKET_LIFETIME : replay_window;
+}
+
+void quicdoq_get_0rtt_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_0rtt_stats_t* stats)
+{
+    *stats = quicdoq_ctx->early_stats;
+    if (quicdoq_ctx->replay_cache != NULL) {
+        stats->nb_saturated = quicdoq_ctx->replay_cache->nb_saturated;
+    }
+}
+
+void quicdoq_set_load_budget(quicdoq_ctx_t* quicdoq_ctx, quicdoq_load_budget_t const* budget)
+{
+    quicdoq_ctx->load_budget = *budget;
+}
+
+void quicdoq_get_load_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_load_stats_t* stats)
+{
+    *stats = quicdoq_ctx->load_stats;
+}
+
+void quicdoq_set_response_priority(quicdoq_ctx_t* quicdoq_ctx, int is_enabled)
+{
+    quicdoq_ctx->is_response_priority = is_enabled;
+}
+
+void quicdoq_set_cdns_log(quicdoq_ctx_t* quicdoq_ctx, quicdoq_cdns_t* cdns)
+{
+    quicdoq_ctx->cdns_log = cdns;
+}
+
+void quicdoq_set_app_log(quicdoq_ctx_t* quicdoq_ctx, quicdoq_app_log_t* app_log)
+{
+    quicdoq_ctx->app_log = app_log;
+}
+
+void quicdoq_set_query_stage(quicdoq_query_ctx_t* query_ctx, quicdoq_stage_enum stage, uint64_t current_time)
+{
+    quicdoq_stream_ctx_t* stream_ctx = (quicdoq_stream_ctx_t*)query_ctx->client_cb_ctx;
+
+    if (stream_ctx != NULL && (unsigned int)stage < quicdoq_stage_max) {
+        quicdoq_mark_stage(stream_ctx, stage, current_time);
+    }
+}
+
+void quicdoq_get_latency_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_latency_stats_t* stats)
+{
+    *stats = quicdoq_ctx->latency_stats;
+}
+
+char const* quicdoq_stage_name(quicdoq_stage_enum stage)
+{
+    static char const* stage_names[quicdoq_stage_max] = {
+        "first_byte", "query_complete", "app_callback", "relay_send", "relay_reply", "response_posted", "last_byte_sent"
+    };
+
+    return ((unsigned int)stage < quicdoq_stage_max) ? stage_names[stage] : NULL;
+}
+
+int quicdoq_set_metrics(quicdoq_ctx_t* quicdoq_ctx, quicdoq_metrics_t* metrics)
+{
+    int ret = 0;
+
+    if (metrics == NULL) {
+        quicdoq_ctx->metrics_shard = NULL;
+    }
+    else if ((quicdoq_ctx->metrics_shard = quicdoq_metrics_add_shard(metrics)) == NULL) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+void quicdoq_count_metric(quicdoq_ctx_t* quicdoq_ctx, quicdoq_metric_enum metric)
+{
+    if (quicdoq_ctx->metrics_shard != NULL) {
+        quicdoq_metrics_increment(quicdoq_ctx->metrics_shard, metric, 1);
+    }
+}
+
+/* Log a per query event, in the application log if there is one, or
+ * inline. Inline messages are only formatted if picoquic logging is on. */
+void quicdoq_log_event(quicdoq_ctx_t* quicdoq_ctx, picoquic_cnx_t* cnx, quicdoq_log_event_enum event,
+    uint64_t query_id, uint64_t stream_id, uint64_t value)
+{
+    uint64_t current_time = picoquic_get_quic_time(quicdoq_ctx->quic);
+    uint64_t cnx_time = current_time - picoquic_get_cnx_start_time(cnx);
+
+    if (quicdoq_ctx->app_log != NULL) {
+        picoquic_connection_id_t cid = picoquic_get_logging_cnxid(cnx);
+
+        (void)quicdoq_app_log_event(quicdoq_ctx->app_log, current_time, &cid, event, query_id, stream_id, cnx_time, value);
+    }
+    else {
+        switch (event) {
+        case quicdoq_log_event_response:
+            picoquic_log_app_message(cnx, QUICDOQ_LOG_FMT_RESPONSE, query_id, cnx_time);
+            break;
+        case quicdoq_log_event_refused:
+            picoquic_log_app_message(cnx, QUICDOQ_LOG_FMT_REFUSED, query_id, value, cnx_time);
+            break;
+        case quicdoq_log_event_malformed:
+            picoquic_log_app_message(cnx, QUICDOQ_LOG_FMT_MALFORMED, stream_id);
+            break;
+        case quicdoq_log_event_replay:
+            picoquic_log_app_message(cnx, QUICDOQ_LOG_FMT_REPLAY, stream_id);
+            break;
+        case quicdoq_log_event_expired:
+            picoquic_log_app_message(cnx, QUICDOQ_LOG_FMT_EXPIRED, query_id, cnx_time);
+            break;
+        default:
+            break;
+        }
+    }
+}
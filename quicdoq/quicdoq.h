@@ -41,9 +41,9 @@
  * do that by posting a cancel. This will cause the DoQ client to issue a
  * stream reset message to cancel the original query, and a stop sending
  * message to ask the server to discard its response, and possibly cancel
- * transactions associated with it. The application that issued a cancellation
- * request has to wait the callback from the DoQ client before disposing
- * of the query context.
+ * transactions associated with it. The DoQ client then delivers the final
+ * callback for the query, with the code quicdoq_query_cancelled, before the
+ * cancel call returns. Data that the server sends afterwards is ignored.
  *
  * The queries posted by the application include:
  * - the server name
@@ -135,6 +135,9 @@ extern "C" {
 /* Max stream size, per RFC */
 #define QUICDOQ_MAX_STREAM_DATA 0xffff
 
+/* Number of connections a quicdoq context can hold, unless specified otherwise */
+#define QUICDOQ_DEFAULT_MAX_CONNECTIONS 64
+
 /* Doq client return codes
  */
     typedef enum {
@@ -157,6 +160,59 @@ extern "C" {
         quicdoq_query_ctx_t* query_ctx,
         uint64_t current_time);
 
+    /* Structured view of a DNS message.
+     * The view records the header fields, the first question, the start of
+     * each section and the offsets of the resource records in the message,
+     * without copying or allocating anything. Names are validated when the
+     * view is built: labels must not exceed 63 bytes, names must not exceed
+     * 255 bytes, and compression pointers must point to earlier positions
+     * in the message. The records past QUICDOQ_VIEW_MAX_RR are validated
+     * but not recorded.
+     */
+#define QUICDOQ_VIEW_MAX_RR 16
+
+    typedef struct st_quicdoq_rr_view_t {
+        uint16_t name_offset; /* Offset of the owner name in the message */
+        uint16_t rr_type;
+        uint16_t rr_class;
+        uint16_t rdata_offset; /* Offset of the RDATA in the message */
+        uint16_t rdata_length;
+        uint32_t ttl;
+    } quicdoq_rr_view_t;
+
+    typedef struct st_quicdoq_dns_view_t {
+        uint16_t id;
+        uint16_t flags; /* QR, Opcode, AA, TC, RD, RA, Z, AD, CD, RCODE */
+        uint16_t qdcount;
+        uint16_t ancount;
+        uint16_t nscount;
+        uint16_t arcount;
+        uint16_t qname_offset; /* Name of the first question, 0 if none */
+        uint16_t qname_length; /* Bytes taken by that name in the message */
+        uint16_t qtype;
+        uint16_t qclass;
+        uint16_t section_offset[3]; /* Start of the answer, authority and additional sections */
+        uint16_t message_length; /* End of the last record */
+        int has_opt; /* Whether the additional section carries an OPT record */
+        quicdoq_rr_view_t opt; /* The OPT record, class is the EDNS payload size */
+        uint16_t nb_rr; /* Number of records in rr[], at most QUICDOQ_VIEW_MAX_RR */
+        quicdoq_rr_view_t rr[QUICDOQ_VIEW_MAX_RR]; /* Answer, authority and additional records, in order */
+    } quicdoq_dns_view_t;
+
+#define QUICDOQ_VIEW_QR(view) (((view)->flags >> 15) & 1)
+#define QUICDOQ_VIEW_OPCODE(view) (((view)->flags >> 11) & 15)
+#define QUICDOQ_VIEW_TC(view) (((view)->flags >> 9) & 1)
+#define QUICDOQ_VIEW_RCODE(view) ((view)->flags & 15)
+
+    /* Build the view of a message. Returns 0 if the message is well formed, -1 otherwise. */
+    int quicdoq_dns_view_parse(quicdoq_dns_view_t* view, const uint8_t* packet, size_t length);
+    /* Same check as quicdoq_is_idempotent_query, on a view of the query */
+    int quicdoq_dns_view_is_idempotent(const quicdoq_dns_view_t* view);
+    /* Copy a name of a message checked by quicdoq_dns_view_parse, e.g. the qname,
+     * in wire format without compression pointers. Returns the length of the
+     * copy, or 0 if it does not fit in name_max bytes. */
+    size_t quicdoq_dns_view_copy_name(const uint8_t* packet, size_t length, size_t start, uint8_t* name, size_t name_max);
+
     /* Definition of the query context */
     /* TODO: add a flag to indicate whether the query requires multiple responses?
      * TODO: manage sending the length of the query, and the length of each response.
@@ -169,6 +225,7 @@ extern "C" {
         picoquic_connection_id_t cid; /* ID of the connection over which the query was sent. */
         uint64_t stream_id; /* ID of the stream on which the query is mapped. */
         uint64_t query_id; /* Unique ID of the query, assigned by the client */
+        uint64_t cnx_affinity; /* If not 0, queries with the same affinity share a dedicated connection */
         uint8_t* query; /* buffer holding the query */
         uint16_t query_max_size; /* length of the query */
         uint16_t query_length; /* length of the query */
@@ -178,6 +235,11 @@ extern "C" {
         quicdoq_app_cb_fn client_cb; /* Callback function for this query */
         void* client_cb_ctx; /* callback context for this query */
         quicdoq_query_return_enum return_code;
+        int is_query_view_valid; /* Set by the server if the incoming query is well formed */
+        quicdoq_dns_view_t query_view; /* View of the incoming query, if valid */
+        uint64_t deadline; /* Time at which the query is abandoned, in microseconds, 0 if none */
+        void* app_ctx; /* Reserved for the server application, not used by quicdoq */
+        struct st_quicdoq_hedge_t* hedge; /* Hedge of a client query, reserved for quicdoq */
     } quicdoq_query_ctx_t;
 
     /* Connection context management functions.
@@ -190,6 +252,13 @@ extern "C" {
         char const* ticket_store_file_name, char const* token_store_file_name,
         quicdoq_app_cb_fn app_cb_fn, void * app_cb_ctx,
         uint64_t* simulated_time);
+    /* Same as quicdoq_create, with an explicit maximum number of connections
+     * instead of QUICDOQ_DEFAULT_MAX_CONNECTIONS. */
+    quicdoq_ctx_t* quicdoq_create_ex(char const* alpn,
+        char const* cert_file_name, char const* key_file_name, char const* cert_root_file_name,
+        char const* ticket_store_file_name, char const* token_store_file_name,
+        quicdoq_app_cb_fn app_cb_fn, void* app_cb_ctx,
+        uint64_t* simulated_time, uint32_t max_nb_connections);
     void quicdoq_delete(quicdoq_ctx_t* ctx);
     void quicdoq_set_callback(quicdoq_ctx_t* ctx, quicdoq_app_cb_fn app_cb_fn, void* app_cb_ctx);
     picoquic_quic_t* quicdoq_get_quic_ctx(quicdoq_ctx_t* ctx);
@@ -202,7 +271,8 @@ extern "C" {
      *
      * Client side:
      *  - quicdoq_post_query(): Post a new query
-     *  - quicdoq_cancel_query(): Abandon a previously posted query
+     *  - quicdoq_cancel_query(): Abandon a previously posted query. Returns -1
+     *    if the final callback of the query was already delivered.
      *  - The response will come in a call to (*quicdoq_app_cb_fn)()
      * Server side:
      *  - the incoming query will come in a call to (*quicdoq_app_cb_fn)()
@@ -227,10 +297,468 @@ extern "C" {
 
     int quicdoq_refuse_response(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx, uint16_t extended_dns_error);
 
+    /* Reset the stream of a server query instead of responding. The query
+     * context is released, and must not be used after the call. */
     int quicdoq_cancel_response(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx, uint16_t error_code);
 
+    /* Building DNS messages.
+     * The builder appends records to a caller provided buffer, typically the
+     * response buffer of a query context, without any allocation. Names are
+     * passed in uncompressed wire format. Owner names and the names in the
+     * RDATA of the RR types defined in RFC 1035 can be compressed, using a
+     * table of up to QUICDOQ_BUILDER_MAX_NAMES names already in the message.
+     * Records must be added in section order. A record is started with
+     * quicdoq_builder_start_rr(), completed with the add_rdata functions and
+     * closed with quicdoq_builder_end_rr(). If a record does not fit in the
+     * buffer, it is removed, the function returns -1, and if the record was
+     * in the answer or authority section the TC bit will be set.
+     *  - quicdoq_builder_init(): start a message with the specified id and
+     *    flags, e.g. for a query.
+     *  - quicdoq_builder_init_response(): start the response to the query in
+     *    query_ctx, with the id, opcode, RD bit and question of the query.
+     *  - quicdoq_builder_start_opt(): start the OPT record in the additional
+     *    section, to which EDNS options can be added.
+     *  - quicdoq_builder_finish(): close the current record, write the section
+     *    counts in the header and return the length of the message.
+     *  - quicdoq_builder_finish_response(): same, setting the response length
+     *    of the query context.
+     */
+#define QUICDOQ_BUILDER_MAX_NAMES 32
+#define QUICDOQ_EDNS_OPTION_EDE 15
+
+    typedef enum {
+        quicdoq_section_question = 0,
+        quicdoq_section_answer,
+        quicdoq_section_authority,
+        quicdoq_section_additional
+    } quicdoq_section_enum;
+
+    typedef struct st_quicdoq_builder_t {
+        uint8_t* buffer;
+        size_t buffer_max;
+        size_t length;
+        quicdoq_section_enum section; /* Section of the last record */
+        uint16_t count[4]; /* Number of records in each section */
+        int is_truncated; /* Set if an answer or authority record did not fit */
+        int has_opt;
+        int is_opt_open; /* Set if the current record is the OPT record */
+        int is_rr_open;
+        size_t rr_start; /* Start of the current record, or question */
+        size_t rr_rdlength_offset; /* Position of the RDLENGTH of the current record */
+        int rr_nb_names; /* Number of names in the table before the current record */
+        int nb_names;
+        uint16_t name_offset[QUICDOQ_BUILDER_MAX_NAMES];
+    } quicdoq_builder_t;
+
+    int quicdoq_builder_init(quicdoq_builder_t* builder, uint8_t* buffer, size_t buffer_max, uint16_t id, uint16_t flags);
+    int quicdoq_builder_init_response(quicdoq_builder_t* builder, quicdoq_query_ctx_t* query_ctx, uint8_t rcode);
+    size_t quicdoq_builder_name_from_text(uint8_t* name, size_t name_max, char const* text);
+    int quicdoq_builder_add_question(quicdoq_builder_t* builder, const uint8_t* name, uint16_t qtype, uint16_t qclass);
+    int quicdoq_builder_start_rr(quicdoq_builder_t* builder, quicdoq_section_enum section,
+        const uint8_t* name, uint16_t rr_type, uint16_t rr_class, uint32_t ttl);
+    int quicdoq_builder_add_rdata(quicdoq_builder_t* builder, const uint8_t* data, size_t length);
+    int quicdoq_builder_add_rdata_uint16(quicdoq_builder_t* builder, uint16_t value);
+    int quicdoq_builder_add_rdata_uint32(quicdoq_builder_t* builder, uint32_t value);
+    int quicdoq_builder_add_rdata_name(quicdoq_builder_t* builder, const uint8_t* name, int is_compressible);
+    int quicdoq_builder_end_rr(quicdoq_builder_t* builder);
+    int quicdoq_builder_add_rr(quicdoq_builder_t* builder, quicdoq_section_enum section,
+        const uint8_t* name, uint16_t rr_type, uint16_t rr_class, uint32_t ttl,
+        const uint8_t* rdata, size_t rdata_length);
+    int quicdoq_builder_start_opt(quicdoq_builder_t* builder, uint16_t payload_size, uint8_t extended_rcode, uint16_t flags);
+    int quicdoq_builder_add_edns_option(quicdoq_builder_t* builder, uint16_t option_code, const uint8_t* data, size_t length);
+    int quicdoq_builder_add_ede(quicdoq_builder_t* builder, uint16_t info_code, char const* extra_text);
+    int quicdoq_builder_finish(quicdoq_builder_t* builder, size_t* length);
+    int quicdoq_builder_finish_response(quicdoq_builder_t* builder, quicdoq_query_ctx_t* query_ctx);
+
     int quicdoq_is_closed(quicdoq_ctx_t* quicdoq_ctx);
 
+    /* Client connection pool management.
+     *  - quicdoq_set_pool_params(): set the max number of queries in flight on
+     *    a connection, the max number of connections to a given server and SNI,
+     *    the number of queued queries that triggers opening an extra connection,
+     *    and the keep alive interval in microseconds (0 to disable keep alive).
+     *  - quicdoq_prewarm_connections(): open connections to a server before
+     *    any query is posted, so the first queries do not wait for a handshake.
+     * Queries with a non zero cnx_affinity bypass the pool: each affinity value
+     * gets its own connection to the server, for example to reproduce the
+     * connection pattern of distinct clients. That connection is opened at the
+     * first query, and queries wait in the queue when its stream credit is
+     * exhausted.
+     */
+    void quicdoq_set_pool_params(quicdoq_ctx_t* quicdoq_ctx, uint16_t max_streams_per_cnx,
+        uint16_t max_cnx_per_server, uint16_t queue_threshold, uint64_t keep_alive_interval);
+
+    int quicdoq_prewarm_connections(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, int nb_cnx);
+
+    typedef struct st_quicdoq_pool_stats_t {
+        uint64_t nb_cnx_started; /* Client connections started, i.e., handshakes */
+        uint64_t nb_cnx_0rtt; /* Client connections that could send queries in 0-RTT */
+        uint64_t nb_queries_queued; /* Queries that waited in the pending queue */
+    } quicdoq_pool_stats_t;
+
+    void quicdoq_get_pool_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_pool_stats_t* stats);
+
+    /* Server handling of queries received in 0-RTT.
+     * Queries that arrive in early data can be answered immediately, so the
+     * response leaves in the server's first flight, but early data can be
+     * replayed by an attacker. The policy decides which early queries are
+     * processed right away; the others are only passed to the application
+     * once the handshake completes, which a replayed flight never does.
+     *  - quicdoq_0rtt_accept_none: defer all early queries.
+     *  - quicdoq_0rtt_accept_idempotent: process standard queries without
+     *    side effects, as tested by quicdoq_is_idempotent_query() (default).
+     *  - quicdoq_0rtt_accept_all: process all early queries.
+     * Early queries that are processed are remembered for the duration of
+     * the replay window, keyed by initial connection ID and stream ID. A
+     * copy arriving within that window is deferred like an ineligible query.
+     * The window covers at least QUICDOQ_TICKET_LIFETIME, the lifetime of
+     * the session tickets issued by picoquic; smaller values are raised.
+     * The replay cache has a fixed size. It may take a new query for a
+     * replay, which then waits for the handshake; this becomes more frequent
+     * when the cache is saturated, as counted by nb_saturated.
+     */
+#define QUICDOQ_TICKET_LIFETIME 100000000000ull
+    typedef enum {
+        quicdoq_0rtt_accept_none = 0,
+        quicdoq_0rtt_accept_idempotent,
+        quicdoq_0rtt_accept_all
+    } quicdoq_0rtt_policy_enum;
+
+    typedef struct st_quicdoq_0rtt_stats_t {
+        uint64_t nb_accepted; /* Early queries passed to the application immediately */
+        uint64_t nb_deferred; /* Early queries held until the handshake completed */
+        uint64_t nb_replays; /* Early queries found in the replay cache, and deferred */
+        uint64_t nb_saturated; /* Early queries remembered while the replay cache was saturated */
+    } quicdoq_0rtt_stats_t;
+
+    void quicdoq_set_0rtt_policy(quicdoq_ctx_t* quicdoq_ctx, quicdoq_0rtt_policy_enum policy, uint64_t replay_window);
+    void quicdoq_get_0rtt_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_0rtt_stats_t* stats);
+
+    /* Server load shedding.
+     * Each incoming query normally gets buffers of QUICDOQ_MAX_STREAM_DATA
+     * bytes for the query and for the response. The budget limits the number
+     * of queries in flight, the number of queries waiting in the UDP relay,
+     * and the bytes held in query and response buffers; a value of 0 means no
+     * limit. The budget is checked when a new stream opens, before any buffer
+     * is allocated. If it would be exceeded, the stream is reset with the
+     * error QUICDOQ_ERROR_EXCESSIVE_LOAD or, if refuse_on_overload is set,
+     * the query is received in a buffer of its exact size and answered
+     * with quicdoq_refuse_response() and the extended DNS error overload_ede.
+     */
+#define QUICDOQ_EDE_NOT_READY 14
+#define QUICDOQ_EDE_NO_REACHABLE_AUTHORITY 22
+
+    typedef struct st_quicdoq_load_budget_t {
+        uint32_t max_inflight_queries; /* Server queries between first byte and end of response */
+        uint32_t max_relay_queue; /* Queries waiting for a response from the UDP relay */
+        uint64_t max_buffer_bytes; /* Bytes allocated for query and response buffers */
+        int refuse_on_overload; /* Send a refusal instead of resetting the stream */
+        uint16_t overload_ede; /* Extended DNS error of the refusal, e.g. QUICDOQ_EDE_NOT_READY */
+    } quicdoq_load_budget_t;
+
+    typedef struct st_quicdoq_load_stats_t {
+        uint32_t nb_inflight_queries;
+        uint32_t relay_queue_depth;
+        uint64_t buffer_bytes;
+        uint64_t nb_shed_reset; /* Streams reset with QUICDOQ_ERROR_EXCESSIVE_LOAD */
+        uint64_t nb_shed_refused; /* Queries refused because of the load */
+    } quicdoq_load_stats_t;
+
+    void quicdoq_set_load_budget(quicdoq_ctx_t* quicdoq_ctx, quicdoq_load_budget_t const* budget);
+    void quicdoq_get_load_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_load_stats_t* stats);
+
+    /* Server rate limiting per client prefix.
+     * Queries are counted against a token bucket per source prefix, by
+     * default /24 for IPv4 and /56 for IPv6. Each bucket holds up to burst
+     * tokens and refills at queries_per_second. The buckets are kept in a
+     * hash table of max_prefixes entries, which never grows: a new prefix
+     * takes an empty entry, an entry idle long enough for its bucket to be
+     * full again, or else the least recently used entry near its hash
+     * position. In that last case, the new bucket only holds the tokens
+     * refilled since the entry was last used, so a table saturated by many
+     * prefixes limits the new ones. The table is only accessed by the thread running the
+     * picoquic loop, so there are no locks. Queries over the limit are
+     * handled like queries over the load budget: the stream is reset with
+     * QUICDOQ_ERROR_EXCESSIVE_LOAD or, if refuse_over_limit is set, the query
+     * is refused with the extended DNS error over_limit_ede.
+     *  - quicdoq_set_rate_limit(): start rate limiting, or stop it if
+     *    config is NULL or queries_per_second is 0. Existing buckets are
+     *    discarded.
+     */
+#define QUICDOQ_RATE_LIMIT_DEFAULT_IPV4_PREFIX 24
+#define QUICDOQ_RATE_LIMIT_DEFAULT_IPV6_PREFIX 56
+#define QUICDOQ_RATE_LIMIT_DEFAULT_MAX_PREFIXES 4096
+
+    typedef struct st_quicdoq_rate_limit_t {
+        uint32_t queries_per_second; /* Refill rate of each bucket */
+        uint32_t burst; /* Size of each bucket, at least 1 */
+        uint8_t ipv4_prefix_length; /* 0 for the default */
+        uint8_t ipv6_prefix_length; /* 0 for the default */
+        uint32_t max_prefixes; /* Size of the table, 0 for the default */
+        int refuse_over_limit; /* Send a refusal instead of resetting the stream */
+        uint16_t over_limit_ede; /* Extended DNS error of the refusal */
+    } quicdoq_rate_limit_t;
+
+    typedef struct st_quicdoq_rate_limit_stats_t {
+        uint64_t nb_allowed; /* Queries within the limit */
+        uint64_t nb_limited; /* Queries over the limit */
+        uint64_t nb_evicted; /* Buckets of active prefixes reused for another prefix */
+        uint64_t nb_saturated; /* Queries over the limit, from a prefix that just evicted another */
+        uint32_t nb_prefixes; /* Entries in use */
+    } quicdoq_rate_limit_stats_t;
+
+    int quicdoq_set_rate_limit(quicdoq_ctx_t* quicdoq_ctx, quicdoq_rate_limit_t const* config);
+    void quicdoq_get_rate_limit_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_rate_limit_stats_t* stats);
+
+    /* Transport parameter profiles.
+     * The profile sets the flow control credit and timers announced in the
+     * transport parameters: by the server for all its connections, by the
+     * client for each connection it starts. Fields set to 0 take the default
+     * value. The profile applies to the connections created after it is set.
+     * It is rejected if initial_max_stream_data is below
+     * QUICDOQ_MAX_STREAM_DATA, since each stream must accept a full message.
+     * In adaptive mode, the connection credit follows the volume of the
+     * messages received, i.e., responses for a client and queries for a
+     * server: it grows to twice the average message size times the number of
+     * streams open on the connection, up to adaptive_max_data, and shrinks
+     * when that demand falls, or under memory pressure. New connections
+     * start with the current credit, and the client opens the credit of each
+     * new stream to twice the average response size. There is memory
+     * pressure if the credit times the number of connections exceeds
+     * adaptive_memory_limit, or if the query buffers of the server exceed
+     * three quarters of its load budget.
+     *  - quicdoq_get_default_tp_profile(): the default profile.
+     *  - quicdoq_set_tp_profile(): use the profile for new connections.
+     *  - quicdoq_get_tp_credit(): current state of the adaptive credit.
+     */
+#define QUICDOQ_TP_DEFAULT_MAX_DATA 0x10000
+#define QUICDOQ_TP_DEFAULT_MAX_STREAMS 256
+#define QUICDOQ_TP_DEFAULT_IDLE_TIMEOUT 20000
+#define QUICDOQ_TP_DEFAULT_ACK_DELAY 10000
+#define QUICDOQ_TP_DEFAULT_ADAPTIVE_MAX_DATA 0x400000
+
+    typedef struct st_quicdoq_tp_profile_t {
+        uint64_t initial_max_data; /* Connection credit */
+        uint64_t initial_max_stream_data; /* Credit of each stream, for the peer's messages */
+        uint64_t max_bidir_streams; /* Streams that a client may open, announced by servers */
+        uint64_t max_idle_timeout; /* In milliseconds */
+        uint64_t max_ack_delay; /* In microseconds */
+        int is_adaptive;
+        uint64_t adaptive_max_data; /* Largest connection credit in adaptive mode */
+        uint64_t adaptive_memory_limit; /* Credit of all connections, 0 if not limited */
+    } quicdoq_tp_profile_t;
+
+    typedef struct st_quicdoq_tp_credit_t {
+        uint64_t max_data; /* Connection credit for new connections */
+        uint64_t stream_data; /* Stream credit opened for new client streams */
+        uint64_t avg_message_size; /* Moving average of the messages received */
+        uint64_t nb_increases;
+        uint64_t nb_decreases;
+        int is_memory_pressure;
+    } quicdoq_tp_credit_t;
+
+    void quicdoq_get_default_tp_profile(quicdoq_tp_profile_t* profile);
+    int quicdoq_set_tp_profile(quicdoq_ctx_t* quicdoq_ctx, quicdoq_tp_profile_t const* profile);
+    void quicdoq_get_tp_credit(quicdoq_ctx_t* quicdoq_ctx, quicdoq_tp_credit_t* credit);
+
+    /* Query deadlines.
+     * Clients can set a deadline on a query before posting it. Servers set
+     * the deadline of incoming queries to the arrival of their first byte
+     * plus the deadline budget, if one is configured. The application drives
+     * the deadlines, by calling quicdoq_check_deadlines() when the time
+     * returned by quicdoq_next_deadline() is reached.
+     *  - A client query past its deadline is cancelled, as by
+     *    quicdoq_cancel_query(), and fails with quicdoq_query_failed.
+     *  - A server query past its deadline, for which the application did not
+     *    post a response, is passed to the application with the code
+     *    quicdoq_query_cancelled, so that e.g. the UDP relay stops sending it
+     *    upstream. The server then answers SERVFAIL with the extended DNS
+     *    error QUICDOQ_EDE_NO_REACHABLE_AUTHORITY if answer_servfail is set,
+     *    or resets the stream with QUICDOQ_ERROR_RESPONSE_TIME_OUT.
+     * Queries waiting for a client connection are queued by deadline.
+     */
+    void quicdoq_set_deadline_budget(quicdoq_ctx_t* quicdoq_ctx, uint64_t budget, int answer_servfail);
+    uint64_t quicdoq_next_deadline(quicdoq_ctx_t* quicdoq_ctx);
+    void quicdoq_check_deadlines(quicdoq_ctx_t* quicdoq_ctx, uint64_t current_time);
+
+    /* Hedged client queries.
+     * The servers between which queries can be hedged are declared with
+     * quicdoq_add_hedge_server(). The client measures the response time of
+     * each query posted to one of these servers. If no response arrives
+     * within the hedge delay of that server, a copy of the query is posted
+     * to the other declared server with the shortest hedge delay. The first
+     * response wins and the other query is cancelled. If one of the two
+     * fails, the client waits for the other. The application only sees the
+     * callbacks of the query that it posted.
+     *  - The hedge delay is the specified percentile of the response times
+     *    of the server, e.g. 95.0, once min_samples responses are measured,
+     *    or initial_delay before that. It is kept between min_delay and
+     *    max_delay.
+     *  - Hedges are only sent while they do not exceed budget_percent of the
+     *    queries posted to the declared servers. A budget of 0 disables hedging.
+     * The hedges are sent by quicdoq_check_deadlines(), at the time returned
+     * by quicdoq_next_deadline(). quicdoq_get_hedge_delay() returns the
+     * current hedge delay of a declared server, or UINT64_MAX if the server
+     * is not declared.
+     */
+#define QUICDOQ_HEDGE_DEFAULT_PERCENTILE 95.0
+#define QUICDOQ_HEDGE_DEFAULT_INITIAL_DELAY 200000
+#define QUICDOQ_HEDGE_DEFAULT_MIN_DELAY 10000
+#define QUICDOQ_HEDGE_DEFAULT_MAX_DELAY 2000000
+#define QUICDOQ_HEDGE_DEFAULT_MIN_SAMPLES 20
+#define QUICDOQ_HEDGE_DEFAULT_BUDGET_PERCENT 5
+
+    typedef struct st_quicdoq_hedge_policy_t {
+        double percentile; /* Percentile of the response times after which a hedge is sent */
+        uint64_t initial_delay; /* Hedge delay until min_samples responses are measured */
+        uint64_t min_delay;
+        uint64_t max_delay;
+        uint32_t min_samples;
+        uint32_t budget_percent; /* Max hedges per 100 queries */
+    } quicdoq_hedge_policy_t;
+
+    typedef struct st_quicdoq_hedge_stats_t {
+        uint64_t nb_queries; /* Queries posted to the declared servers */
+        uint64_t nb_hedges_sent;
+        uint64_t nb_hedges_won; /* Queries first answered by the hedge */
+        uint64_t nb_hedges_over_budget; /* Hedges not sent because of the budget */
+    } quicdoq_hedge_stats_t;
+
+    void quicdoq_get_default_hedge_policy(quicdoq_hedge_policy_t* policy);
+    void quicdoq_set_hedge_policy(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_policy_t const* policy);
+    int quicdoq_add_hedge_server(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr);
+    uint64_t quicdoq_get_hedge_delay(quicdoq_ctx_t* quicdoq_ctx, struct sockaddr* addr);
+    void quicdoq_get_hedge_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_stats_t* stats);
+
+    /* Response scheduling.
+     * When several responses are ready on a server connection, the shortest
+     * go first, so that a large answer does not delay the small answers
+     * queued behind it. The priority of a response stream is set from the
+     * bytes that remain to be sent, in classes of powers of 2 above 512
+     * bytes, and is raised by one class for every QUICDOQ_PRIORITY_AGE_STEP
+     * microseconds since the first byte of the query, so that large answers
+     * are not starved. It is updated as the response is sent. Response
+     * scheduling is on by default, quicdoq_set_response_priority() sets it.
+     */
+#define QUICDOQ_PRIORITY_AGE_STEP 50000
+
+    void quicdoq_set_response_priority(quicdoq_ctx_t* quicdoq_ctx, int is_enabled);
+
+    /* Latency histograms.
+     * Values are counted in log scale buckets, with 8 linear sub-buckets per
+     * power of 2, so the bucket of a value is within 12.5% of that value.
+     * Values above 2^40 are counted in the last bucket. The exact minimum, maximum and sum are also kept.
+     *  - quicdoq_histogram_record(): count a value.
+     *  - quicdoq_histogram_merge(): add the counts of a histogram to another.
+     *  - quicdoq_histogram_percentile(): value below which the specified
+     *    percentage of the values were counted, e.g. 99.0, rounded up to the
+     *    top of its bucket. Returns 0 if the histogram is empty.
+     */
+#define QUICDOQ_HISTOGRAM_SUB_BITS 3
+#define QUICDOQ_HISTOGRAM_NB_BUCKETS 304
+
+    typedef struct st_quicdoq_histogram_t {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+        uint64_t bucket[QUICDOQ_HISTOGRAM_NB_BUCKETS];
+    } quicdoq_histogram_t;
+
+    void quicdoq_histogram_record(quicdoq_histogram_t* histogram, uint64_t value);
+    void quicdoq_histogram_merge(quicdoq_histogram_t* histogram, const quicdoq_histogram_t* other);
+    uint64_t quicdoq_histogram_percentile(const quicdoq_histogram_t* histogram, double percentile);
+
+    /* Server latency per stage of the query lifecycle.
+     * The server notes the time at which a query reaches each stage. When
+     * the last byte of the response is sent, the time spent reaching each
+     * stage since the previous stage that was noted is added to the histogram
+     * of that stage, in microseconds, and the time from the first byte to
+     * the last byte to the end to end histogram. The relay stages are noted
+     * by the UDP relay. Applications that forward queries by other means can
+     * note them with quicdoq_set_query_stage().
+     */
+    typedef enum {
+        quicdoq_stage_first_byte = 0, /* First byte of the query received */
+        quicdoq_stage_query_complete, /* FIN of the query stream received */
+        quicdoq_stage_app_callback, /* Query passed to the application */
+        quicdoq_stage_relay_send, /* Query sent upstream */
+        quicdoq_stage_relay_reply, /* Reply received from upstream */
+        quicdoq_stage_response_posted, /* Response posted with quicdoq_post_response() */
+        quicdoq_stage_last_byte_sent, /* Last byte of the response sent */
+        quicdoq_stage_max
+    } quicdoq_stage_enum;
+
+    typedef struct st_quicdoq_latency_stats_t {
+        quicdoq_histogram_t stage[quicdoq_stage_max]; /* Time reaching each stage, none for the first byte */
+        quicdoq_histogram_t end_to_end; /* First byte of the query to last byte of the response */
+    } quicdoq_latency_stats_t;
+
+    void quicdoq_set_query_stage(quicdoq_query_ctx_t* query_ctx, quicdoq_stage_enum stage, uint64_t current_time);
+    void quicdoq_get_latency_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_latency_stats_t* stats);
+    char const* quicdoq_stage_name(quicdoq_stage_enum stage);
+
+    /* Per connection statistics.
+     * Each connection counts its queries, responses, refusals and stream
+     * resets, the bytes of DoQ messages received and sent, and the number of
+     * streams open. The path statistics of the connection are read from
+     * picoquic when the statistics are retrieved. Queries are those received
+     * by a server connection or sent by a client connection, and responses
+     * those sent by a server or received by a client.
+     *  - quicdoq_first_cnx(), quicdoq_next_cnx(): iterate over the connections
+     *    of the quicdoq context. The iteration must not be interleaved with
+     *    packet processing, which may delete connections.
+     *  - quicdoq_get_cnx_stats(): statistics of a connection.
+     *  - quicdoq_cnx_column_value(): value of a column of the statistics.
+     *  - quicdoq_cnx_column_name(), quicdoq_cnx_column_from_name(): names of
+     *    the columns, as used in the dump. The conversion from name returns
+     *    quicdoq_cnx_column_max if the name is not known.
+     *  - quicdoq_dump_top_cnx(): print the nb_top connections with the largest
+     *    values in the specified column, typically at a regular interval.
+     */
+    typedef enum {
+        quicdoq_cnx_column_queries = 0,
+        quicdoq_cnx_column_responses,
+        quicdoq_cnx_column_refused,
+        quicdoq_cnx_column_resets,
+        quicdoq_cnx_column_bytes_received,
+        quicdoq_cnx_column_bytes_sent,
+        quicdoq_cnx_column_open_streams,
+        quicdoq_cnx_column_peak_streams,
+        quicdoq_cnx_column_rtt,
+        quicdoq_cnx_column_cwin,
+        quicdoq_cnx_column_lost,
+        quicdoq_cnx_column_max
+    } quicdoq_cnx_column_enum;
+
+    typedef struct st_quicdoq_cnx_stats_t {
+        picoquic_connection_id_t cid; /* Logging ID of the connection */
+        struct sockaddr_storage peer_addr;
+        int is_server;
+        uint64_t start_time;
+        uint64_t nb_queries;
+        uint64_t nb_responses;
+        uint64_t nb_refused;
+        uint64_t nb_resets; /* Streams reset or stopped by the peer */
+        uint64_t bytes_received;
+        uint64_t bytes_sent;
+        uint64_t open_streams;
+        uint64_t peak_streams;
+        uint64_t rtt; /* Smoothed RTT, microseconds */
+        uint64_t rtt_min;
+        uint64_t cwin; /* Congestion window, bytes */
+        uint64_t bytes_in_transit;
+        uint64_t nb_lost; /* Packets lost */
+    } quicdoq_cnx_stats_t;
+
+    quicdoq_cnx_ctx_t* quicdoq_first_cnx(quicdoq_ctx_t* quicdoq_ctx);
+    quicdoq_cnx_ctx_t* quicdoq_next_cnx(quicdoq_cnx_ctx_t* cnx_ctx);
+    void quicdoq_get_cnx_stats(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_cnx_stats_t* stats);
+    uint64_t quicdoq_cnx_column_value(const quicdoq_cnx_stats_t* stats, quicdoq_cnx_column_enum column);
+    char const* quicdoq_cnx_column_name(quicdoq_cnx_column_enum column);
+    quicdoq_cnx_column_enum quicdoq_cnx_column_from_name(char const* name);
+    int quicdoq_dump_top_cnx(quicdoq_ctx_t* quicdoq_ctx, FILE* F, quicdoq_cnx_column_enum column, size_t nb_top);
+
     /* Utility functions for formatting DNS messages */
     typedef struct st_quicdoq_rr_entry_t {
         char const* rr_name;
@@ -242,11 +770,191 @@ extern "C" {
         uint16_t id, uint16_t qclass, uint16_t qtype, uint16_t l_max);
     size_t quicdoq_parse_dns_name(const uint8_t* packet, size_t length, size_t start,
         uint8_t** text_start, uint8_t* text_max);
+    uint8_t* NormalizeNamePart(size_t length, const uint8_t* value,
+        uint8_t* normalized, uint8_t* normalized_max);
+    size_t quicdoq_fold_dns_name(const uint8_t* packet, size_t length, size_t start,
+        uint8_t* folded, size_t folded_max, size_t* folded_length, uint64_t* name_hash);
     size_t quicdoq_skip_dns_name(const uint8_t* packet, size_t length, size_t start);
     size_t quicdoq_parse_dns_query(const uint8_t* packet, size_t length, size_t start,
         uint8_t** text_start, uint8_t* text_max);
 
+    int quicdoq_is_idempotent_query(const uint8_t* query, size_t query_length);
+    int quicdoq_format_query_from_text(quicdoq_query_ctx_t* query_ctx, char const* query_text);
     uint16_t quicdoq_get_rr_type(char const* rr_name);
+    char const* quicdoq_get_rr_name(uint16_t rr_type);
+
+    /* Reading DNS query traces, pcap files of UDP traffic to port 53 or
+     * dnstap files, for example to replay production traffic in tests.
+     *  - quicdoq_trace_open(): open the file and detect its format.
+     *  - quicdoq_trace_next(): get the next query in the trace, or set
+     *    *is_end at the end of the file. The query bytes point to a buffer
+     *    managed by the trace, valid until the next call. Records larger
+     *    than the trace buffer are skipped.
+     *  - quicdoq_trace_nb_skipped(): number of records skipped so far.
+     *  - quicdoq_trace_close(): close the file and free the trace.
+     */
+    typedef struct st_quicdoq_trace_t quicdoq_trace_t;
+
+    typedef struct st_quicdoq_trace_query_t {
+        uint64_t timestamp; /* Capture time in microseconds */
+        struct sockaddr_storage source_addr; /* Address and port of the client that sent the query */
+        const uint8_t* query;
+        size_t query_length;
+    } quicdoq_trace_query_t;
+
+    quicdoq_trace_t* quicdoq_trace_open(char const* file_name);
+    int quicdoq_trace_next(quicdoq_trace_t* trace, quicdoq_trace_query_t* query, int* is_end);
+    uint64_t quicdoq_trace_nb_skipped(quicdoq_trace_t* trace);
+    void quicdoq_trace_close(quicdoq_trace_t* trace);
+
+    /* Logging of queries and responses in C-DNS format, RFC 8618.
+     *  - quicdoq_cdns_open(): create the file and start the writer thread.
+     *    Blocks hold up to max_block_items query response items, and are
+     *    written when full or after flush_interval microseconds. The qr_type
+     *    describes the role of the logging node, e.g. 1 for queries received
+     *    by a resolver from clients. Zero values select the defaults.
+     *  - quicdoq_cdns_log(): log a query and its response, which may be NULL.
+     *    The query_view is the view of the query built by
+     *    quicdoq_dns_view_parse, or NULL if the query is malformed. The times
+     *    are in microseconds, as provided by picoquic. The call does not
+     *    allocate memory, take a lock or wait for the file, and returns -1 if
+     *    the query is malformed or if the item was dropped because the
+     *    writer is late.
+     *  - quicdoq_cdns_close(): write the remaining items and close the file.
+     *  - quicdoq_set_cdns_log(): log the queries and responses of a server.
+     */
+#define QUICDOQ_CDNS_DEFAULT_BLOCK_ITEMS 5000
+#define QUICDOQ_CDNS_DEFAULT_FLUSH_INTERVAL 1000000
+#define QUICDOQ_CDNS_QR_TYPE_CLIENT 1
+
+    typedef struct st_quicdoq_cdns_t quicdoq_cdns_t;
+
+    typedef struct st_quicdoq_cdns_stats_t {
+        uint64_t nb_items; /* Items added to the log */
+        uint64_t nb_dropped; /* Items dropped because the ring was full */
+        uint64_t nb_malformed; /* Queries that could not be parsed */
+        uint64_t nb_blocks; /* Blocks written */
+        uint64_t nb_write_errors; /* Blocks not completely written */
+    } quicdoq_cdns_stats_t;
+
+    quicdoq_cdns_t* quicdoq_cdns_open(char const* file_name, uint32_t max_block_items, uint64_t flush_interval, uint8_t qr_type);
+    int quicdoq_cdns_log(quicdoq_cdns_t* cdns, const quicdoq_dns_view_t* query_view, const uint8_t* query, size_t query_length,
+        const uint8_t* response, size_t response_length, const struct sockaddr* client_addr,
+        uint64_t query_time, uint64_t response_time);
+    void quicdoq_cdns_get_stats(quicdoq_cdns_t* cdns, quicdoq_cdns_stats_t* stats);
+    void quicdoq_cdns_close(quicdoq_cdns_t* cdns);
+    void quicdoq_set_cdns_log(quicdoq_ctx_t* quicdoq_ctx, quicdoq_cdns_t* cdns);
+
+    /* Asynchronous application log.
+     * Per query events are recorded as binary records in a fixed size ring,
+     * and formatted and written to the log file by a separate thread. The
+     * ring has a single producer, the Quic thread. If the ring is full, the
+     * event is dropped and counted. Without an application log, the events
+     * are logged inline with picoquic_log_app_message().
+     *  - quicdoq_app_log_open(): create the file and start the writer thread.
+     *    The number of records is rounded up to a power of 2, 0 selects the
+     *    default.
+     *  - quicdoq_app_log_event(): add an event to the ring.
+     *  - quicdoq_app_log_close(): write the remaining events and close the file.
+     *  - quicdoq_set_app_log(): use the application log for the events of
+     *    the quicdoq context.
+     */
+#define QUICDOQ_APP_LOG_DEFAULT_RECORDS 4096
+
+    typedef enum {
+        quicdoq_log_event_response = 0, /* value: none */
+        quicdoq_log_event_refused, /* value: extended DNS error */
+        quicdoq_log_event_malformed, /* value: none */
+        quicdoq_log_event_replay, /* value: none */
+        quicdoq_log_event_expired, /* value: none */
+        quicdoq_log_event_max
+    } quicdoq_log_event_enum;
+
+    typedef struct st_quicdoq_app_log_t quicdoq_app_log_t;
+
+    typedef struct st_quicdoq_app_log_stats_t {
+        uint64_t nb_events; /* Events added to the ring */
+        uint64_t nb_dropped; /* Events dropped because the ring was full */
+    } quicdoq_app_log_stats_t;
+
+    quicdoq_app_log_t* quicdoq_app_log_open(char const* file_name, uint32_t nb_records);
+    int quicdoq_app_log_event(quicdoq_app_log_t* app_log, uint64_t current_time, const picoquic_connection_id_t* cid,
+        quicdoq_log_event_enum event, uint64_t query_id, uint64_t stream_id, uint64_t cnx_time, uint64_t value);
+    void quicdoq_app_log_get_stats(quicdoq_app_log_t* app_log, quicdoq_app_log_stats_t* stats);
+    void quicdoq_app_log_close(quicdoq_app_log_t* app_log);
+    void quicdoq_set_app_log(quicdoq_ctx_t* quicdoq_ctx, quicdoq_app_log_t* app_log);
+
+    /* Metrics registry.
+     * Counters are kept in per thread shards. Each shard is only updated by
+     * the thread that added it, without locks, and the shards are summed
+     * when the counters are read.
+     *  - quicdoq_metrics_create(): create the registry.
+     *  - quicdoq_metrics_add_shard(): add the counters of a thread. The shard
+     *    remains valid until the registry is deleted.
+     *  - quicdoq_metrics_increment(): add a value to a counter of a shard.
+     *  - quicdoq_metrics_snapshot(): read the sum of the counters of all shards.
+     *  - quicdoq_metrics_format(): format a snapshot in the Prometheus text format.
+     *  - quicdoq_metrics_start_export(): start a thread that writes the Prometheus
+     *    text every interval microseconds, and once more when the registry is
+     *    deleted. The target is a file name, replaced at each export, or the
+     *    path of a Unix socket prefixed with "unix:".
+     *  - quicdoq_metrics_delete(): stop the export and delete the registry,
+     *    after deleting the quicdoq contexts that use it.
+     *  - quicdoq_set_metrics(): count the events of a quicdoq context and of
+     *    its UDP relays in a new shard of the registry.
+     */
+#define QUICDOQ_METRICS_DEFAULT_EXPORT_INTERVAL 10000000
+#define QUICDOQ_METRICS_UNIX_PREFIX "unix:"
+
+    typedef enum {
+        quicdoq_metric_queries_received = 0, /* Queries received by the server */
+        quicdoq_metric_responses_sent, /* Responses posted by the server application */
+        quicdoq_metric_queries_refused, /* Queries refused by the server application */
+        quicdoq_metric_responses_cancelled, /* Responses cancelled by the server application */
+        quicdoq_metric_queries_malformed, /* Queries that could not be parsed */
+        quicdoq_metric_queries_deferred, /* 0-RTT queries held until the handshake completes */
+        quicdoq_metric_queries_replayed, /* 0-RTT queries found in the replay cache */
+        quicdoq_metric_queries_shed, /* Queries reset or refused because the server is over its load budget */
+        quicdoq_metric_queries_rate_limited, /* Queries reset or refused because the client prefix is over its rate */
+        quicdoq_metric_streams_reset, /* Streams reset or stopped by the peer */
+        quicdoq_metric_queries_sent, /* Queries posted by the client application */
+        quicdoq_metric_queries_cancelled, /* Queries cancelled by the client application */
+        quicdoq_metric_responses_received, /* Responses received by the client */
+        quicdoq_metric_queries_failed, /* Client queries that failed */
+        quicdoq_metric_connections_opened, /* Connections created, client or server */
+        quicdoq_metric_connections_closed, /* Connections closed, client or server */
+        quicdoq_metric_protocol_errors, /* Streams or connections closed on protocol errors */
+        quicdoq_metric_relay_queries, /* Queries passed to the UDP relay */
+        quicdoq_metric_relay_packets_sent, /* UDP packets sent by the relay */
+        quicdoq_metric_relay_retransmits, /* UDP packets sent again after a timer */
+        quicdoq_metric_relay_responses, /* UDP responses passed back to the server */
+        quicdoq_metric_relay_timeouts, /* Relayed queries without UDP response */
+        quicdoq_metric_relay_errors, /* Relayed queries failed for other reasons */
+        quicdoq_metric_relay_cancelled, /* Relayed queries cancelled by the client before the UDP response */
+        quicdoq_metric_relay_packets_wasted, /* UDP packets sent for relayed queries later cancelled */
+        quicdoq_metric_queries_expired, /* Queries abandoned at their deadline, client or server */
+        quicdoq_metric_hedges_sent, /* Copies of client queries sent to a second server */
+        quicdoq_metric_hedges_won, /* Client queries first answered by the second server */
+        quicdoq_metric_relay_socket_errors, /* Receive errors on the socket connected to the backend server */
+        quicdoq_metric_max
+    } quicdoq_metric_enum;
+
+    typedef struct st_quicdoq_metrics_t quicdoq_metrics_t;
+    typedef struct st_quicdoq_metrics_shard_t quicdoq_metrics_shard_t;
+
+    typedef struct st_quicdoq_metrics_snapshot_t {
+        uint64_t counter[quicdoq_metric_max];
+    } quicdoq_metrics_snapshot_t;
+
+    quicdoq_metrics_t* quicdoq_metrics_create();
+    quicdoq_metrics_shard_t* quicdoq_metrics_add_shard(quicdoq_metrics_t* metrics);
+    void quicdoq_metrics_increment(quicdoq_metrics_shard_t* shard, quicdoq_metric_enum metric, uint64_t value);
+    void quicdoq_metrics_snapshot(quicdoq_metrics_t* metrics, quicdoq_metrics_snapshot_t* snapshot);
+    char const* quicdoq_metric_name(quicdoq_metric_enum metric);
+    int quicdoq_metrics_format(const quicdoq_metrics_snapshot_t* snapshot, char* text, size_t text_max, size_t* text_length);
+    int quicdoq_metrics_start_export(quicdoq_metrics_t* metrics, char const* target, uint64_t interval);
+    void quicdoq_metrics_delete(quicdoq_metrics_t* metrics);
+    int quicdoq_set_metrics(quicdoq_ctx_t* quicdoq_ctx, quicdoq_metrics_t* metrics);
 
     /* Handling of UDP callbacks */
     typedef struct st_quicdoq_udp_ctx_t quicdoq_udp_ctx_t;
@@ -261,6 +969,15 @@ extern "C" {
     void quicdoq_udp_incoming_packet(quicdoq_udp_ctx_t* udp_ctx, uint8_t* bytes, size_t length, 
         struct sockaddr* addr_to, int if_index_to, uint64_t current_time);
     uint64_t quicdoq_next_udp_time(quicdoq_udp_ctx_t* udp_ctx);
+    /* Signal that the application sends the relay traffic through a socket
+     * connected to the backend server. The relay then does not set the local
+     * address or interface of outgoing packets, and does not learn them from
+     * incoming packets. */
+    void quicdoq_udp_set_connected(quicdoq_udp_ctx_t* udp_ctx, int is_connected);
+    /* Count an error received on the connected socket, e.g., after an ICMP
+     * port unreachable from the backend. These errors are not fatal, the
+     * relay retransmits the queries that are still waiting. */
+    void quicdoq_udp_socket_error(quicdoq_udp_ctx_t* udp_ctx);
 
 #ifdef __cplusplus
 }
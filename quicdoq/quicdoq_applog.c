@@ -0,0 +1,271 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Asynchronous application log.
+ *
+ * The ring is a single producer, single consumer queue. The producer only
+ * writes the tail index, the consumer only writes the head index, and each
+ * reads the other index with acquire semantics, so the record contents are
+ * visible before the index that publishes them. The indexes increase
+ * monotonically, and the position in the ring is the index modulo the
+ * power of 2 ring size. The two indexes are kept in separate cache lines.
+ *
+ * The writer thread wakes up periodically, or when the producer finds the
+ * ring half full, and formats all the available records.
+ */
+
+#define QUICDOQ_APP_LOG_WAIT_INTERVAL 10000
+#define QUICDOQ_APP_LOG_LINE_MAX 256
+
+typedef struct st_quicdoq_app_log_record_t {
+    uint64_t current_time;
+    uint64_t cnx_time;
+    uint64_t query_id;
+    uint64_t stream_id;
+    uint64_t value;
+    picoquic_connection_id_t cid;
+    uint8_t event;
+} quicdoq_app_log_record_t;
+
+typedef struct st_quicdoq_app_log_t {
+    /* Producer side */
+    uint64_t tail;
+    uint64_t nb_dropped;
+    uint8_t tail_pad[QUICDOQ_CACHE_LINE - 2 * sizeof(uint64_t)];
+    /* Consumer side */
+    uint64_t head;
+    uint8_t head_pad[QUICDOQ_CACHE_LINE - sizeof(uint64_t)];
+    /* Shared, read only after creation */
+    quicdoq_app_log_record_t* records;
+    uint64_t mask;
+    FILE* F;
+    picoquic_event_t event;
+    picoquic_thread_t thread;
+    int is_thread_started;
+    uint64_t is_closing;
+} quicdoq_app_log_t;
+
+/* Format the text of an event. This is used by the writer thread, and for
+ * inline logging if there is no application log. */
+size_t quicdoq_app_log_format(char* text, size_t text_max, quicdoq_log_event_enum event,
+    uint64_t query_id, uint64_t stream_id, uint64_t cnx_time, uint64_t value)
+{
+    size_t text_length = 0;
+    int ret;
+
+    switch (event) {
+    case quicdoq_log_event_response:
+        ret = picoquic_sprintf(text, text_max, &text_length, QUICDOQ_LOG_FMT_RESPONSE, query_id, cnx_time);
+        break;
+    case quicdoq_log_event_refused:
+        ret = picoquic_sprintf(text, text_max, &text_length, QUICDOQ_LOG_FMT_REFUSED, query_id, value, cnx_time);
+        break;
+    case quicdoq_log_event_malformed:
+        ret = picoquic_sprintf(text, text_max, &text_length, QUICDOQ_LOG_FMT_MALFORMED, stream_id);
+        break;
+    case quicdoq_log_event_replay:
+        ret = picoquic_sprintf(text, text_max, &text_length, QUICDOQ_LOG_FMT_REPLAY, stream_id);
+        break;
+    case quicdoq_log_event_expired:
+        ret = picoquic_sprintf(text, text_max, &text_length, QUICDOQ_LOG_FMT_EXPIRED, query_id, cnx_time);
+        break;
+    default:
+        ret = picoquic_sprintf(text, text_max, &text_length, "Quicdoq: Unknown event %d.\n", (int)event);
+        break;
+    }
+
+    return (ret == 0) ? text_length : 0;
+}
+
+static void quicdoq_app_log_write_record(quicdoq_app_log_t* app_log, const quicdoq_app_log_record_t* record)
+{
+    char line[QUICDOQ_APP_LOG_LINE_MAX];
+    size_t line_length = 0;
+    static const char hex_digits[] = "0123456789abcdef";
+
+    (void)picoquic_sprintf(line, sizeof(line), &line_length, "%" PRIu64 " ", record->current_time);
+    for (uint8_t i = 0; i < record->cid.id_len && i < PICOQUIC_CONNECTION_ID_MAX_SIZE; i++) {
+        line[line_length++] = hex_digits[record->cid.id[i] >> 4];
+        line[line_length++] = hex_digits[record->cid.id[i] & 0x0F];
+    }
+    line[line_length++] = ':';
+    line[line_length++] = ' ';
+    line_length += quicdoq_app_log_format(line + line_length, sizeof(line) - line_length, (quicdoq_log_event_enum)record->event,
+        record->query_id, record->stream_id, record->cnx_time, record->value);
+    (void)fwrite(line, 1, line_length, app_log->F);
+}
+
+/* Format and write all the records in the ring. Returns the number of records. */
+static uint64_t quicdoq_app_log_drain(quicdoq_app_log_t* app_log)
+{
+    uint64_t head = app_log->head;
+    uint64_t tail = quicdoq_atomic_load(&app_log->tail);
+    uint64_t nb_records = tail - head;
+
+    while (head < tail) {
+        quicdoq_app_log_write_record(app_log, &app_log->records[head & app_log->mask]);
+        head++;
+        quicdoq_atomic_store(&app_log->head, head);
+    }
+    if (nb_records > 0) {
+        fflush(app_log->F);
+    }
+
+    return nb_records;
+}
+
+#ifdef _WINDOWS
+static DWORD WINAPI quicdoq_app_log_writer(LPVOID v_app_log)
+#else
+static void* quicdoq_app_log_writer(void* v_app_log)
+#endif
+{
+    quicdoq_app_log_t* app_log = (quicdoq_app_log_t*)v_app_log;
+
+    for (;;) {
+        /* Read the closing flag first, so the events logged before closing are written */
+        uint64_t is_closing = quicdoq_atomic_load(&app_log->is_closing);
+
+        if (quicdoq_app_log_drain(app_log) == 0) {
+            if (is_closing) {
+                break;
+            }
+            (void)picoquic_wait_for_event(&app_log->event, QUICDOQ_APP_LOG_WAIT_INTERVAL);
+        }
+    }
+
+#ifdef _WINDOWS
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+quicdoq_app_log_t* quicdoq_app_log_open(char const* file_name, uint32_t nb_records)
+{
+    quicdoq_app_log_t* app_log = (quicdoq_app_log_t*)malloc(sizeof(quicdoq_app_log_t));
+
+    if (app_log != NULL) {
+        uint64_t ring_size = 1;
+        int ret = 0;
+
+        memset(app_log, 0, sizeof(quicdoq_app_log_t));
+        if (nb_records == 0) {
+            nb_records = QUICDOQ_APP_LOG_DEFAULT_RECORDS;
+        }
+        while (ring_size < nb_records) {
+            ring_size <<= 1;
+        }
+        app_log->mask = ring_size - 1;
+        app_log->records = (quicdoq_app_log_record_t*)malloc((size_t)ring_size * sizeof(quicdoq_app_log_record_t));
+        if (app_log->records == NULL) {
+            ret = -1;
+        }
+        else if ((app_log->F = picoquic_file_open(file_name, "w")) == NULL) {
+            DBG_PRINTF("Cannot open application log %s", file_name);
+            ret = -1;
+        }
+        else if (picoquic_create_event(&app_log->event) != 0) {
+            ret = -1;
+        }
+        else if (picoquic_create_thread(&app_log->thread, quicdoq_app_log_writer, app_log) != 0) {
+            picoquic_delete_event(&app_log->event);
+            ret = -1;
+        }
+        else {
+            app_log->is_thread_started = 1;
+        }
+
+        if (ret != 0) {
+            quicdoq_app_log_close(app_log);
+            app_log = NULL;
+        }
+    }
+
+    return app_log;
+}
+
+void quicdoq_app_log_close(quicdoq_app_log_t* app_log)
+{
+    if (app_log->is_thread_started) {
+        quicdoq_atomic_store(&app_log->is_closing, 1);
+        picoquic_signal_event(&app_log->event);
+        picoquic_delete_thread(&app_log->thread);
+        picoquic_delete_event(&app_log->event);
+    }
+    if (app_log->F != NULL) {
+        app_log->F = picoquic_file_close(app_log->F);
+    }
+    if (app_log->records != NULL) {
+        free(app_log->records);
+    }
+    free(app_log);
+}
+
+int quicdoq_app_log_event(quicdoq_app_log_t* app_log, uint64_t current_time, const picoquic_connection_id_t* cid,
+    quicdoq_log_event_enum event, uint64_t query_id, uint64_t stream_id, uint64_t cnx_time, uint64_t value)
+{
+    int ret = 0;
+    uint64_t tail = app_log->tail;
+    uint64_t nb_queued = tail - quicdoq_atomic_load(&app_log->head);
+
+    if (nb_queued > app_log->mask) {
+        quicdoq_atomic_store(&app_log->nb_dropped, app_log->nb_dropped + 1);
+        ret = -1;
+    }
+    else {
+        quicdoq_app_log_record_t* record = &app_log->records[tail & app_log->mask];
+
+        record->current_time = current_time;
+        record->cnx_time = cnx_time;
+        record->query_id = query_id;
+        record->stream_id = stream_id;
+        record->value = value;
+        if (cid != NULL) {
+            record->cid = *cid;
+        }
+        else {
+            record->cid.id_len = 0;
+        }
+        record->event = (uint8_t)event;
+        quicdoq_atomic_store(&app_log->tail, tail + 1);
+        if (nb_queued + 1 == (app_log->mask + 1) / 2) {
+            picoquic_signal_event(&app_log->event);
+        }
+    }
+
+    return ret;
+}
+
+void quicdoq_app_log_get_stats(quicdoq_app_log_t* app_log, quicdoq_app_log_stats_t* stats)
+{
+    stats->nb_events = quicdoq_atomic_load(&app_log->tail);
+    stats->nb_dropped = quicdoq_atomic_load(&app_log->nb_dropped);
+}
@@ -0,0 +1,543 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+
+/* Append-only builder of DNS messages.
+ *
+ * The builder writes directly in the message buffer. The compression
+ * table holds the offsets of the names and name suffixes already
+ * written, so that a new name can be replaced by its longest suffix
+ * found in the table. All pointers written by the builder point to
+ * earlier names, which guarantees that decoders will terminate.
+ *
+ * A record is only counted when it is complete. If it does not fit, the
+ * buffer length and the compression table are restored to their state
+ * before the record, so the message stays well formed.
+ */
+
+#define QUICDOQ_BUILDER_HEADER_LENGTH 12
+#define QUICDOQ_BUILDER_MAX_NAME_LENGTH 255
+#define QUICDOQ_BUILDER_MAX_POINTER 0x3FFF
+
+/* Length of an uncompressed wire format name, or 0 if the name is not valid. */
+static size_t quicdoq_builder_name_length(const uint8_t* name)
+{
+    size_t l = 0;
+
+    while (l < QUICDOQ_BUILDER_MAX_NAME_LENGTH) {
+        uint8_t label_length = name[l];
+
+        if (label_length == 0) {
+            return l + 1;
+        }
+        else if (label_length > 63) {
+            break;
+        }
+        l += (size_t)label_length + 1;
+    }
+
+    return 0;
+}
+
+static uint8_t quicdoq_builder_lower(uint8_t c)
+{
+    return (c >= 'A' && c <= 'Z') ? (uint8_t)(c | 0x20) : c;
+}
+
+/* Compare the name with the name at "offset" in the message, ignoring case. */
+static int quicdoq_builder_name_match(const quicdoq_builder_t* builder, const uint8_t* name, size_t offset)
+{
+    size_t pos = 0;
+
+    while (offset < builder->length) {
+        uint8_t l = builder->buffer[offset];
+
+        if ((l & 0xC0) == 0xC0) {
+            size_t target = ((size_t)(l & 0x3F) << 8) | builder->buffer[offset + 1];
+            if (target >= offset) {
+                break;
+            }
+            offset = target;
+            continue;
+        }
+        if (l != name[pos]) {
+            break;
+        }
+        if (l == 0) {
+            return 1;
+        }
+        for (size_t i = 1; i <= l; i++) {
+            if (quicdoq_builder_lower(name[pos + i]) != quicdoq_builder_lower(builder->buffer[offset + i])) {
+                return 0;
+            }
+        }
+        pos += (size_t)l + 1;
+        offset += (size_t)l + 1;
+    }
+
+    return 0;
+}
+
+/* Write a name, using the longest suffix found in the compression table if
+ * compression is allowed. Returns 0 on success, -1 if the name is not valid
+ * and -2 if it does not fit.
+ */
+static int quicdoq_builder_write_name(quicdoq_builder_t* builder, const uint8_t* name, int is_compressible)
+{
+    size_t name_length = quicdoq_builder_name_length(name);
+    size_t prefix = 0;
+    size_t pointer = 0;
+    int has_pointer = 0;
+    size_t start = builder->length;
+
+    if (name_length == 0) {
+        return -1;
+    }
+
+    if (is_compressible) {
+        while (name[prefix] != 0 && !has_pointer) {
+            for (int i = 0; i < builder->nb_names; i++) {
+                if (quicdoq_builder_name_match(builder, name + prefix, builder->name_offset[i])) {
+                    pointer = builder->name_offset[i];
+                    has_pointer = 1;
+                    break;
+                }
+            }
+            if (!has_pointer) {
+                prefix += (size_t)name[prefix] + 1;
+            }
+        }
+    }
+
+    if (has_pointer) {
+        if (start + prefix + 2 > builder->buffer_max) {
+            return -2;
+        }
+        memcpy(builder->buffer + start, name, prefix);
+        builder->buffer[start + prefix] = (uint8_t)(0xC0 | (pointer >> 8));
+        builder->buffer[start + prefix + 1] = (uint8_t)(pointer & 0xFF);
+        builder->length += prefix + 2;
+    }
+    else {
+        if (start + name_length > builder->buffer_max) {
+            return -2;
+        }
+        memcpy(builder->buffer + start, name, name_length);
+        builder->length += name_length;
+        prefix = name_length - 1;
+    }
+
+    if (is_compressible) {
+        /* Remember the new suffixes, if they can be reached by a pointer */
+        for (size_t pos = 0; pos < prefix && builder->nb_names < QUICDOQ_BUILDER_MAX_NAMES; pos += (size_t)name[pos] + 1) {
+            if (start + pos > QUICDOQ_BUILDER_MAX_POINTER) {
+                break;
+            }
+            builder->name_offset[builder->nb_names++] = (uint16_t)(start + pos);
+        }
+    }
+
+    return 0;
+}
+
+static int quicdoq_builder_write_bytes(quicdoq_builder_t* builder, const uint8_t* data, size_t length)
+{
+    if (builder->length + length > builder->buffer_max) {
+        return -2;
+    }
+    if (length > 0) {
+        memcpy(builder->buffer + builder->length, data, length);
+        builder->length += length;
+    }
+    return 0;
+}
+
+static int quicdoq_builder_write_uint16(quicdoq_builder_t* builder, uint16_t value)
+{
+    uint8_t bytes[2];
+
+    bytes[0] = (uint8_t)(value >> 8);
+    bytes[1] = (uint8_t)(value & 0xFF);
+
+    return quicdoq_builder_write_bytes(builder, bytes, 2);
+}
+
+static int quicdoq_builder_write_uint32(quicdoq_builder_t* builder, uint32_t value)
+{
+    uint8_t bytes[4];
+
+    bytes[0] = (uint8_t)(value >> 24);
+    bytes[1] = (uint8_t)((value >> 16) & 0xFF);
+    bytes[2] = (uint8_t)((value >> 8) & 0xFF);
+    bytes[3] = (uint8_t)(value & 0xFF);
+
+    return quicdoq_builder_write_bytes(builder, bytes, 4);
+}
+
+/* Remove the current record or question after an error. If it was removed
+ * for lack of space from the answer or authority sections, the response
+ * is incomplete and the TC bit will be set. Missing additional records do
+ * not cause truncation, see RFC 2181 section 9.
+ */
+static int quicdoq_builder_abort_rr(quicdoq_builder_t* builder, int ret)
+{
+    builder->length = builder->rr_start;
+    builder->nb_names = builder->rr_nb_names;
+    builder->is_rr_open = 0;
+    if (builder->is_opt_open) {
+        builder->is_opt_open = 0;
+        builder->has_opt = 0;
+    }
+    if (ret == -2 && (builder->section == quicdoq_section_answer || builder->section == quicdoq_section_authority)) {
+        builder->is_truncated = 1;
+    }
+
+    return -1;
+}
+
+int quicdoq_builder_init(quicdoq_builder_t* builder, uint8_t* buffer, size_t buffer_max, uint16_t id, uint16_t flags)
+{
+    int ret = 0;
+
+    memset(builder, 0, sizeof(quicdoq_builder_t));
+    if (buffer == NULL || buffer_max < QUICDOQ_BUILDER_HEADER_LENGTH) {
+        ret = -1;
+    }
+    else {
+        builder->buffer = buffer;
+        builder->buffer_max = buffer_max;
+        memset(buffer, 0, QUICDOQ_BUILDER_HEADER_LENGTH);
+        buffer[0] = (uint8_t)(id >> 8);
+        buffer[1] = (uint8_t)(id & 0xFF);
+        buffer[2] = (uint8_t)(flags >> 8);
+        buffer[3] = (uint8_t)(flags & 0xFF);
+        builder->length = QUICDOQ_BUILDER_HEADER_LENGTH;
+        builder->section = quicdoq_section_question;
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_init_response(quicdoq_builder_t* builder, quicdoq_query_ctx_t* query_ctx, uint8_t rcode)
+{
+    int ret = 0;
+    quicdoq_dns_view_t local_view;
+    const quicdoq_dns_view_t* view = &query_ctx->query_view;
+
+    if (!query_ctx->is_query_view_valid) {
+        if (quicdoq_dns_view_parse(&local_view, query_ctx->query, query_ctx->query_length) != 0) {
+            view = NULL;
+        }
+        else {
+            view = &local_view;
+        }
+    }
+
+    if (view == NULL || QUICDOQ_VIEW_QR(view) != 0) {
+        memset(builder, 0, sizeof(quicdoq_builder_t));
+        ret = -1;
+    }
+    else {
+        /* QR = 1, copy the opcode and the RD bit of the query */
+        uint16_t flags = (uint16_t)(0x8000 | (view->flags & 0x7900) | (rcode & 0x0F));
+
+        ret = quicdoq_builder_init(builder, query_ctx->response, query_ctx->response_max_size, view->id, flags);
+        if (ret == 0 && view->qdcount > 0) {
+            ret = quicdoq_builder_add_question(builder, query_ctx->query + view->qname_offset, view->qtype, view->qclass);
+        }
+    }
+
+    return ret;
+}
+
+size_t quicdoq_builder_name_from_text(uint8_t* name, size_t name_max, char const* text)
+{
+    size_t name_length = 0;
+
+    if (text[0] == 0 || (text[0] == '.' && text[1] == 0)) {
+        /* Root name */
+        if (name_max > 0) {
+            name[0] = 0;
+            name_length = 1;
+        }
+    }
+    else {
+        uint8_t* name_end = quicdog_format_dns_name(name, name + name_max, text);
+
+        if (name_end != NULL) {
+            name_length = name_end - name;
+            if (quicdoq_builder_name_length(name) != name_length) {
+                name_length = 0;
+            }
+        }
+    }
+
+    return name_length;
+}
+
+int quicdoq_builder_add_question(quicdoq_builder_t* builder, const uint8_t* name, uint16_t qtype, uint16_t qclass)
+{
+    int ret = 0;
+
+    if (builder->buffer == NULL || builder->is_rr_open || builder->section != quicdoq_section_question) {
+        ret = -1;
+    }
+    else {
+        builder->rr_start = builder->length;
+        builder->rr_nb_names = builder->nb_names;
+        if ((ret = quicdoq_builder_write_name(builder, name, 1)) == 0 &&
+            (ret = quicdoq_builder_write_uint16(builder, qtype)) == 0 &&
+            (ret = quicdoq_builder_write_uint16(builder, qclass)) == 0) {
+            builder->count[quicdoq_section_question]++;
+        }
+        else {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_start_rr(quicdoq_builder_t* builder, quicdoq_section_enum section,
+    const uint8_t* name, uint16_t rr_type, uint16_t rr_class, uint32_t ttl)
+{
+    int ret = 0;
+
+    if (builder->is_rr_open) {
+        ret = quicdoq_builder_end_rr(builder);
+    }
+
+    if (ret != 0 || builder->buffer == NULL || section < builder->section || section > quicdoq_section_additional ||
+        section == quicdoq_section_question) {
+        ret = -1;
+    }
+    else {
+        builder->section = section;
+        builder->rr_start = builder->length;
+        builder->rr_nb_names = builder->nb_names;
+        builder->is_rr_open = 1;
+        if ((ret = quicdoq_builder_write_name(builder, name, 1)) == 0 &&
+            (ret = quicdoq_builder_write_uint16(builder, rr_type)) == 0 &&
+            (ret = quicdoq_builder_write_uint16(builder, rr_class)) == 0 &&
+            (ret = quicdoq_builder_write_uint32(builder, ttl)) == 0) {
+            builder->rr_rdlength_offset = builder->length;
+            ret = quicdoq_builder_write_uint16(builder, 0);
+        }
+        if (ret != 0) {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_add_rdata(quicdoq_builder_t* builder, const uint8_t* data, size_t length)
+{
+    int ret = -1;
+
+    if (builder->is_rr_open) {
+        if ((ret = quicdoq_builder_write_bytes(builder, data, length)) != 0) {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_add_rdata_uint16(quicdoq_builder_t* builder, uint16_t value)
+{
+    int ret = -1;
+
+    if (builder->is_rr_open) {
+        if ((ret = quicdoq_builder_write_uint16(builder, value)) != 0) {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_add_rdata_uint32(quicdoq_builder_t* builder, uint32_t value)
+{
+    int ret = -1;
+
+    if (builder->is_rr_open) {
+        if ((ret = quicdoq_builder_write_uint32(builder, value)) != 0) {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_add_rdata_name(quicdoq_builder_t* builder, const uint8_t* name, int is_compressible)
+{
+    int ret = -1;
+
+    if (builder->is_rr_open) {
+        if ((ret = quicdoq_builder_write_name(builder, name, is_compressible)) != 0) {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_end_rr(quicdoq_builder_t* builder)
+{
+    int ret = 0;
+
+    if (!builder->is_rr_open) {
+        ret = -1;
+    }
+    else {
+        size_t rdlength = builder->length - builder->rr_rdlength_offset - 2;
+
+        if (rdlength > 0xFFFF) {
+            ret = quicdoq_builder_abort_rr(builder, -1);
+        }
+        else {
+            builder->buffer[builder->rr_rdlength_offset] = (uint8_t)(rdlength >> 8);
+            builder->buffer[builder->rr_rdlength_offset + 1] = (uint8_t)(rdlength & 0xFF);
+            builder->count[builder->section]++;
+            builder->is_rr_open = 0;
+            builder->is_opt_open = 0;
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_add_rr(quicdoq_builder_t* builder, quicdoq_section_enum section,
+    const uint8_t* name, uint16_t rr_type, uint16_t rr_class, uint32_t ttl,
+    const uint8_t* rdata, size_t rdata_length)
+{
+    int ret = quicdoq_builder_start_rr(builder, section, name, rr_type, rr_class, ttl);
+
+    if (ret == 0 && (ret = quicdoq_builder_add_rdata(builder, rdata, rdata_length)) == 0) {
+        ret = quicdoq_builder_end_rr(builder);
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_start_opt(quicdoq_builder_t* builder, uint16_t payload_size, uint8_t extended_rcode, uint16_t flags)
+{
+    int ret = 0;
+
+    if (builder->has_opt) {
+        ret = -1;
+    }
+    else {
+        uint8_t root = 0;
+        /* The TTL holds the extended RCODE, the EDNS version 0, and the flags */
+        uint32_t ttl = ((uint32_t)extended_rcode << 24) | flags;
+
+        ret = quicdoq_builder_start_rr(builder, quicdoq_section_additional, &root, 41, payload_size, ttl);
+        if (ret == 0) {
+            builder->has_opt = 1;
+            builder->is_opt_open = 1;
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_add_edns_option(quicdoq_builder_t* builder, uint16_t option_code, const uint8_t* data, size_t length)
+{
+    int ret = -1;
+
+    if (builder->is_opt_open && length <= 0xFFFF) {
+        if ((ret = quicdoq_builder_write_uint16(builder, option_code)) != 0 ||
+            (ret = quicdoq_builder_write_uint16(builder, (uint16_t)length)) != 0 ||
+            (ret = quicdoq_builder_write_bytes(builder, data, length)) != 0) {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+/* Extended DNS Error option, RFC 8914: 16 bits info code, then UTF-8 text */
+int quicdoq_builder_add_ede(quicdoq_builder_t* builder, uint16_t info_code, char const* extra_text)
+{
+    int ret = -1;
+    size_t text_length = (extra_text == NULL) ? 0 : strlen(extra_text);
+
+    if (builder->is_opt_open && text_length <= 0xFFFD) {
+        uint8_t code[2];
+
+        code[0] = (uint8_t)(info_code >> 8);
+        code[1] = (uint8_t)(info_code & 0xFF);
+        if ((ret = quicdoq_builder_write_uint16(builder, QUICDOQ_EDNS_OPTION_EDE)) != 0 ||
+            (ret = quicdoq_builder_write_uint16(builder, (uint16_t)(text_length + 2))) != 0 ||
+            (ret = quicdoq_builder_write_bytes(builder, code, 2)) != 0 ||
+            (ret = quicdoq_builder_write_bytes(builder, (const uint8_t*)extra_text, text_length)) != 0) {
+            ret = quicdoq_builder_abort_rr(builder, ret);
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_finish(quicdoq_builder_t* builder, size_t* length)
+{
+    int ret = 0;
+
+    if (builder->buffer == NULL) {
+        ret = -1;
+    }
+    else {
+        if (builder->is_rr_open) {
+            ret = quicdoq_builder_end_rr(builder);
+        }
+        for (int i = 0; i < 4; i++) {
+            builder->buffer[4 + 2 * i] = (uint8_t)(builder->count[i] >> 8);
+            builder->buffer[5 + 2 * i] = (uint8_t)(builder->count[i] & 0xFF);
+        }
+        if (builder->is_truncated) {
+            builder->buffer[2] |= 0x02;
+        }
+        *length = builder->length;
+    }
+
+    return ret;
+}
+
+int quicdoq_builder_finish_response(quicdoq_builder_t* builder, quicdoq_query_ctx_t* query_ctx)
+{
+    int ret = -1;
+    size_t length = 0;
+
+    if (builder->buffer == query_ctx->response) {
+        ret = quicdoq_builder_finish(builder, &length);
+        query_ctx->response_length = length;
+    }
+
+    return ret;
+}
@@ -0,0 +1,830 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Logging of queries and responses in the C-DNS format, RFC 8618.
+ *
+ * The logging function is called on the Quic thread. It takes the header
+ * fields and the question from the view of the query built by the server,
+ * reads the header and the OPT record of the response, and copies them in
+ * the next item of a single producer, single consumer ring, with the same
+ * index protocol as the application log. If the ring is full, the item is
+ * dropped rather than delaying the Quic thread.
+ *
+ * The writer thread takes the items from the ring in blocks of up to
+ * max_block_items, builds the block tables, removing duplicate names,
+ * addresses, class-type pairs and query signatures, and encodes the block
+ * in CBOR. The items are only released after the block is written. The
+ * writer is signalled when a block is full, and checks the ring at least
+ * every QUICDOQ_CDNS_WAIT_INTERVAL, so a missed signal only delays the
+ * block. Blocks that are not full are written after the flush interval.
+ * The file contains a single indefinite length array of blocks, which is
+ * closed when the log is closed. Times are in microseconds, and table
+ * indexes start at 0.
+ */
+
+#define QUICDOQ_CDNS_OUT_BUFFER_SIZE 4096
+#define QUICDOQ_CDNS_WAIT_INTERVAL 10000
+#define QUICDOQ_CDNS_MAX_NAME_LENGTH 255
+
+/* Keys of the C-DNS maps */
+#define QUICDOQ_CDNS_FILE_MAJOR_VERSION 0
+#define QUICDOQ_CDNS_FILE_MINOR_VERSION 1
+#define QUICDOQ_CDNS_FILE_BLOCK_PARAMETERS 3
+#define QUICDOQ_CDNS_PARAM_STORAGE 0
+#define QUICDOQ_CDNS_STORAGE_TICKS_PER_SECOND 0
+#define QUICDOQ_CDNS_STORAGE_MAX_BLOCK_ITEMS 1
+#define QUICDOQ_CDNS_STORAGE_HINTS 2
+#define QUICDOQ_CDNS_STORAGE_OPCODES 3
+#define QUICDOQ_CDNS_STORAGE_RR_TYPES 4
+#define QUICDOQ_CDNS_HINTS_QR 0
+#define QUICDOQ_CDNS_HINTS_QR_SIG 1
+#define QUICDOQ_CDNS_HINTS_RR 2
+#define QUICDOQ_CDNS_HINTS_OTHER_DATA 3
+#define QUICDOQ_CDNS_BLOCK_PREAMBLE 0
+#define QUICDOQ_CDNS_BLOCK_STATISTICS 1
+#define QUICDOQ_CDNS_BLOCK_TABLES 2
+#define QUICDOQ_CDNS_BLOCK_QUERY_RESPONSES 3
+#define QUICDOQ_CDNS_PREAMBLE_EARLIEST_TIME 0
+#define QUICDOQ_CDNS_STATS_PROCESSED_MESSAGES 0
+#define QUICDOQ_CDNS_STATS_QR_DATA_ITEMS 1
+#define QUICDOQ_CDNS_TABLE_IP_ADDRESS 0
+#define QUICDOQ_CDNS_TABLE_CLASSTYPE 1
+#define QUICDOQ_CDNS_TABLE_NAME_RDATA 2
+#define QUICDOQ_CDNS_TABLE_QR_SIG 3
+#define QUICDOQ_CDNS_CLASSTYPE_TYPE 0
+#define QUICDOQ_CDNS_CLASSTYPE_CLASS 1
+#define QUICDOQ_CDNS_SIG_TRANSPORT_FLAGS 2
+#define QUICDOQ_CDNS_SIG_QR_TYPE 3
+#define QUICDOQ_CDNS_SIG_QR_SIG_FLAGS 4
+#define QUICDOQ_CDNS_SIG_QUERY_OPCODE 5
+#define QUICDOQ_CDNS_SIG_QR_DNS_FLAGS 6
+#define QUICDOQ_CDNS_SIG_QUERY_CLASSTYPE_INDEX 8
+#define QUICDOQ_CDNS_SIG_QUERY_QDCOUNT 9
+#define QUICDOQ_CDNS_SIG_QUERY_ANCOUNT 10
+#define QUICDOQ_CDNS_SIG_QUERY_NSCOUNT 11
+#define QUICDOQ_CDNS_SIG_QUERY_ARCOUNT 12
+#define QUICDOQ_CDNS_SIG_QUERY_EDNS_VERSION 13
+#define QUICDOQ_CDNS_SIG_QUERY_UDP_SIZE 14
+#define QUICDOQ_CDNS_SIG_RESPONSE_RCODE 16
+#define QUICDOQ_CDNS_QR_TIME_OFFSET 0
+#define QUICDOQ_CDNS_QR_CLIENT_ADDRESS_INDEX 1
+#define QUICDOQ_CDNS_QR_CLIENT_PORT 2
+#define QUICDOQ_CDNS_QR_TRANSACTION_ID 3
+#define QUICDOQ_CDNS_QR_SIGNATURE_INDEX 4
+#define QUICDOQ_CDNS_QR_RESPONSE_DELAY 6
+#define QUICDOQ_CDNS_QR_QUERY_NAME_INDEX 7
+#define QUICDOQ_CDNS_QR_QUERY_SIZE 8
+#define QUICDOQ_CDNS_QR_RESPONSE_SIZE 9
+
+/* Fields present in the query response items and signatures, as declared
+ * in the storage hints */
+#define QUICDOQ_CDNS_QR_HINTS 0x3DF
+#define QUICDOQ_CDNS_QR_SIG_HINTS 0x17F7C
+
+/* Bits of the qr-sig-flags */
+#define QUICDOQ_CDNS_HAS_QUERY 0x01
+#define QUICDOQ_CDNS_HAS_RESPONSE 0x02
+#define QUICDOQ_CDNS_QUERY_HAS_QUESTION 0x04
+#define QUICDOQ_CDNS_QUERY_HAS_OPT 0x08
+#define QUICDOQ_CDNS_RESPONSE_HAS_OPT 0x10
+#define QUICDOQ_CDNS_RESPONSE_HAS_NO_QUESTION 0x20
+
+/* DNS over QUIC has no transport code point in RFC 8618, use "non-standard" */
+#define QUICDOQ_CDNS_TRANSPORT_NON_STANDARD 15
+
+/* Query signature. The structure has no padding, and is set to zero before
+ * being filled, so signatures can be hashed and compared as bytes. */
+typedef struct st_quicdoq_cdns_sig_t {
+    uint32_t sig_flags;
+    uint32_t dns_flags;
+    uint16_t qtype;
+    uint16_t qclass;
+    uint16_t qdcount;
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+    uint16_t udp_size;
+    uint16_t response_rcode;
+    uint8_t transport_flags;
+    uint8_t opcode;
+    uint8_t edns_version;
+    uint8_t reserved;
+} quicdoq_cdns_sig_t;
+
+typedef struct st_quicdoq_cdns_item_t {
+    uint64_t query_time;
+    uint64_t response_delay;
+    quicdoq_cdns_sig_t sig;
+    uint32_t response_size;
+    uint16_t query_size;
+    uint16_t transaction_id;
+    uint16_t client_port;
+    uint8_t client_addr_length;
+    uint8_t qname_length;
+    uint8_t client_addr[16];
+    uint8_t qname[QUICDOQ_CDNS_MAX_NAME_LENGTH];
+} quicdoq_cdns_item_t;
+
+/* Block of items, at consecutive positions in the ring */
+typedef struct st_quicdoq_cdns_block_t {
+    uint64_t first;
+    uint32_t nb_items;
+} quicdoq_cdns_block_t;
+
+/* Block table, built by the writer. The hash table holds 1 + the
+ * index of the entry in the table, or 0 if the slot is empty. Each entry
+ * records the first item in which the value appears. */
+typedef struct st_quicdoq_cdns_table_t {
+    uint32_t* slots;
+    uint32_t* entry_item;
+    uint32_t nb_entries;
+} quicdoq_cdns_table_t;
+
+typedef const uint8_t* (*quicdoq_cdns_key_fn)(const quicdoq_cdns_item_t* item, size_t* key_length);
+
+typedef struct st_quicdoq_cdns_t {
+    /* Producer side */
+    uint64_t tail;
+    uint64_t nb_dropped;
+    uint64_t nb_malformed;
+    uint8_t tail_pad[QUICDOQ_CACHE_LINE - 3 * sizeof(uint64_t)];
+    /* Consumer side */
+    uint64_t head;
+    uint64_t nb_blocks;
+    uint64_t nb_write_errors;
+    uint8_t head_pad[QUICDOQ_CACHE_LINE - 3 * sizeof(uint64_t)];
+    /* Shared, read only after creation */
+    quicdoq_cdns_item_t* items;
+    uint64_t mask;
+    FILE* F;
+    uint32_t max_block_items;
+    uint64_t flush_interval;
+    uint8_t qr_type;
+    picoquic_event_t event;
+    picoquic_thread_t thread;
+    int is_thread_started;
+    uint64_t is_closing;
+    /* Writer state */
+    uint32_t slot_mask;
+    quicdoq_cdns_table_t address_table;
+    quicdoq_cdns_table_t name_table;
+    quicdoq_cdns_table_t classtype_table;
+    quicdoq_cdns_table_t sig_table;
+    uint32_t* item_index; /* 4 table indexes per item */
+    uint8_t out[QUICDOQ_CDNS_OUT_BUFFER_SIZE];
+    size_t out_length;
+    int is_write_error;
+} quicdoq_cdns_t;
+
+#define quicdoq_cdns_block_item(cdns, block, item_id) (&(cdns)->items[((block)->first + (item_id)) & (cdns)->mask])
+
+/* CBOR encoding, buffered before writing to the file */
+static void quicdoq_cdns_flush_out(quicdoq_cdns_t* cdns)
+{
+    if (cdns->out_length > 0) {
+        if (fwrite(cdns->out, 1, cdns->out_length, cdns->F) != cdns->out_length) {
+            cdns->is_write_error = 1;
+        }
+        cdns->out_length = 0;
+    }
+}
+
+static void quicdoq_cdns_put(quicdoq_cdns_t* cdns, const uint8_t* bytes, size_t length)
+{
+    while (length > 0) {
+        size_t available = QUICDOQ_CDNS_OUT_BUFFER_SIZE - cdns->out_length;
+
+        if (available == 0) {
+            quicdoq_cdns_flush_out(cdns);
+            available = QUICDOQ_CDNS_OUT_BUFFER_SIZE;
+        }
+        if (available > length) {
+            available = length;
+        }
+        memcpy(cdns->out + cdns->out_length, bytes, available);
+        cdns->out_length += available;
+        bytes += available;
+        length -= available;
+    }
+}
+
+static void quicdoq_cdns_put_head(quicdoq_cdns_t* cdns, uint8_t major_type, uint64_t value)
+{
+    uint8_t head[9];
+    size_t head_length = 1;
+
+    if (value < 24) {
+        head[0] = (uint8_t)((major_type << 5) | value);
+    }
+    else if (value <= UINT8_MAX) {
+        head[0] = (uint8_t)((major_type << 5) | 24);
+        head_length = 2;
+    }
+    else if (value <= UINT16_MAX) {
+        head[0] = (uint8_t)((major_type << 5) | 25);
+        head_length = 3;
+    }
+    else if (value <= UINT32_MAX) {
+        head[0] = (uint8_t)((major_type << 5) | 26);
+        head_length = 5;
+    }
+    else {
+        head[0] = (uint8_t)((major_type << 5) | 27);
+        head_length = 9;
+    }
+    for (size_t i = 1; i < head_length; i++) {
+        head[i] = (uint8_t)(value >> (8 * (head_length - 1 - i)));
+    }
+    quicdoq_cdns_put(cdns, head, head_length);
+}
+
+#define quicdoq_cdns_put_uint(cdns, v) quicdoq_cdns_put_head(cdns, 0, v)
+#define quicdoq_cdns_put_array(cdns, n) quicdoq_cdns_put_head(cdns, 4, n)
+#define quicdoq_cdns_put_map(cdns, n) quicdoq_cdns_put_head(cdns, 5, n)
+
+static void quicdoq_cdns_put_key_uint(quicdoq_cdns_t* cdns, uint64_t key, uint64_t value)
+{
+    quicdoq_cdns_put_uint(cdns, key);
+    quicdoq_cdns_put_uint(cdns, value);
+}
+
+static void quicdoq_cdns_put_bytes(quicdoq_cdns_t* cdns, const uint8_t* bytes, size_t length)
+{
+    quicdoq_cdns_put_head(cdns, 2, length);
+    quicdoq_cdns_put(cdns, bytes, length);
+}
+
+/* File header: file type, file preamble, and start of the array of blocks */
+static void quicdoq_cdns_write_header(quicdoq_cdns_t* cdns)
+{
+    const uint8_t indefinite_array = 0x9F;
+    const uint8_t opcodes[] = { 0, 1, 2, 4, 5, 6 };
+    int nb_rr_types = 0;
+
+    quicdoq_cdns_put_array(cdns, 3);
+    quicdoq_cdns_put_head(cdns, 3, 5);
+    quicdoq_cdns_put(cdns, (const uint8_t*)"C-DNS", 5);
+
+    quicdoq_cdns_put_map(cdns, 3);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_FILE_MAJOR_VERSION, 1);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_FILE_MINOR_VERSION, 0);
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_FILE_BLOCK_PARAMETERS);
+    quicdoq_cdns_put_array(cdns, 1);
+    quicdoq_cdns_put_map(cdns, 1);
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_PARAM_STORAGE);
+    quicdoq_cdns_put_map(cdns, 5);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_STORAGE_TICKS_PER_SECOND, 1000000);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_STORAGE_MAX_BLOCK_ITEMS, cdns->max_block_items);
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_STORAGE_HINTS);
+    quicdoq_cdns_put_map(cdns, 4);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_HINTS_QR, QUICDOQ_CDNS_QR_HINTS);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_HINTS_QR_SIG, QUICDOQ_CDNS_QR_SIG_HINTS);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_HINTS_RR, 0);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_HINTS_OTHER_DATA, 0);
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_STORAGE_OPCODES);
+    quicdoq_cdns_put_array(cdns, sizeof(opcodes));
+    for (size_t i = 0; i < sizeof(opcodes); i++) {
+        quicdoq_cdns_put_uint(cdns, opcodes[i]);
+    }
+    /* The query types that can be recorded are those of the RR table */
+    for (uint32_t rr_type = 0; rr_type <= UINT16_MAX; rr_type++) {
+        nb_rr_types += (quicdoq_get_rr_name((uint16_t)rr_type) != NULL);
+    }
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_STORAGE_RR_TYPES);
+    quicdoq_cdns_put_array(cdns, nb_rr_types);
+    for (uint32_t rr_type = 0; rr_type <= UINT16_MAX; rr_type++) {
+        if (quicdoq_get_rr_name((uint16_t)rr_type) != NULL) {
+            quicdoq_cdns_put_uint(cdns, rr_type);
+        }
+    }
+
+    quicdoq_cdns_put(cdns, &indefinite_array, 1);
+}
+
+/* Keys of the block tables */
+static const uint8_t* quicdoq_cdns_address_key(const quicdoq_cdns_item_t* item, size_t* key_length)
+{
+    *key_length = item->client_addr_length;
+    return item->client_addr;
+}
+
+static const uint8_t* quicdoq_cdns_name_key(const quicdoq_cdns_item_t* item, size_t* key_length)
+{
+    *key_length = item->qname_length;
+    return item->qname;
+}
+
+static const uint8_t* quicdoq_cdns_classtype_key(const quicdoq_cdns_item_t* item, size_t* key_length)
+{
+    *key_length = 2 * sizeof(uint16_t);
+    return (const uint8_t*)&item->sig.qtype;
+}
+
+static const uint8_t* quicdoq_cdns_sig_key(const quicdoq_cdns_item_t* item, size_t* key_length)
+{
+    *key_length = sizeof(quicdoq_cdns_sig_t);
+    return (const uint8_t*)&item->sig;
+}
+
+static int quicdoq_cdns_table_init(quicdoq_cdns_table_t* table, uint32_t nb_slots, uint32_t nb_entries)
+{
+    table->slots = (uint32_t*)malloc(nb_slots * sizeof(uint32_t));
+    table->entry_item = (uint32_t*)malloc(nb_entries * sizeof(uint32_t));
+    table->nb_entries = 0;
+
+    return (table->slots == NULL || table->entry_item == NULL) ? -1 : 0;
+}
+
+static void quicdoq_cdns_table_release(quicdoq_cdns_table_t* table)
+{
+    if (table->slots != NULL) {
+        free(table->slots);
+        table->slots = NULL;
+    }
+    if (table->entry_item != NULL) {
+        free(table->entry_item);
+        table->entry_item = NULL;
+    }
+}
+
+/* Find the value of the item in the table, or add it. Returns the index
+ * of the value in the table. */
+static uint32_t quicdoq_cdns_table_index(quicdoq_cdns_t* cdns, quicdoq_cdns_table_t* table,
+    const quicdoq_cdns_block_t* block, uint32_t item_id, quicdoq_cdns_key_fn key_fn)
+{
+    size_t key_length;
+    const uint8_t* key = key_fn(quicdoq_cdns_block_item(cdns, block, item_id), &key_length);
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint32_t slot;
+
+    for (size_t i = 0; i < key_length; i++) {
+        hash ^= key[i];
+        hash *= 0x100000001b3ull;
+    }
+    slot = (uint32_t)(hash ^ (hash >> 32)) & cdns->slot_mask;
+
+    while (table->slots[slot] != 0) {
+        uint32_t entry = table->slots[slot] - 1;
+        size_t other_length;
+        const uint8_t* other = key_fn(quicdoq_cdns_block_item(cdns, block, table->entry_item[entry]), &other_length);
+
+        if (other_length == key_length && memcmp(other, key, key_length) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & cdns->slot_mask;
+    }
+    table->entry_item[table->nb_entries] = item_id;
+    table->slots[slot] = ++table->nb_entries;
+
+    return table->nb_entries - 1;
+}
+
+static void quicdoq_cdns_table_reset(quicdoq_cdns_t* cdns, quicdoq_cdns_table_t* table)
+{
+    memset(table->slots, 0, ((size_t)cdns->slot_mask + 1) * sizeof(uint32_t));
+    table->nb_entries = 0;
+}
+
+/* Encode a block: preamble, statistics, tables and query response items */
+static void quicdoq_cdns_write_block(quicdoq_cdns_t* cdns, const quicdoq_cdns_block_t* block)
+{
+    uint64_t earliest_time = UINT64_MAX;
+    uint64_t nb_messages = 0;
+    quicdoq_cdns_table_t* tables[4];
+    quicdoq_cdns_key_fn key_fns[4];
+
+    tables[0] = &cdns->address_table;
+    tables[1] = &cdns->name_table;
+    tables[2] = &cdns->classtype_table;
+    tables[3] = &cdns->sig_table;
+    key_fns[0] = quicdoq_cdns_address_key;
+    key_fns[1] = quicdoq_cdns_name_key;
+    key_fns[2] = quicdoq_cdns_classtype_key;
+    key_fns[3] = quicdoq_cdns_sig_key;
+
+    for (int t = 0; t < 4; t++) {
+        quicdoq_cdns_table_reset(cdns, tables[t]);
+    }
+
+    for (uint32_t i = 0; i < block->nb_items; i++) {
+        const quicdoq_cdns_item_t* item = quicdoq_cdns_block_item(cdns, block, i);
+
+        if (item->query_time < earliest_time) {
+            earliest_time = item->query_time;
+        }
+        nb_messages += ((item->sig.sig_flags & QUICDOQ_CDNS_HAS_RESPONSE) != 0) ? 2 : 1;
+        for (int t = 0; t < 4; t++) {
+            if (t == 0 || t == 3 || (item->sig.sig_flags & QUICDOQ_CDNS_QUERY_HAS_QUESTION) != 0) {
+                cdns->item_index[4 * i + t] = quicdoq_cdns_table_index(cdns, tables[t], block, i, key_fns[t]);
+            }
+        }
+    }
+
+    quicdoq_cdns_put_map(cdns, 4);
+    /* Block preamble */
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_BLOCK_PREAMBLE);
+    quicdoq_cdns_put_map(cdns, 1);
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_PREAMBLE_EARLIEST_TIME);
+    quicdoq_cdns_put_array(cdns, 2);
+    quicdoq_cdns_put_uint(cdns, earliest_time / 1000000);
+    quicdoq_cdns_put_uint(cdns, earliest_time % 1000000);
+    /* Block statistics */
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_BLOCK_STATISTICS);
+    quicdoq_cdns_put_map(cdns, 2);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_STATS_PROCESSED_MESSAGES, nb_messages);
+    quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_STATS_QR_DATA_ITEMS, block->nb_items);
+    /* Block tables */
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_BLOCK_TABLES);
+    quicdoq_cdns_put_map(cdns, 4);
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_TABLE_IP_ADDRESS);
+    quicdoq_cdns_put_array(cdns, cdns->address_table.nb_entries);
+    for (uint32_t e = 0; e < cdns->address_table.nb_entries; e++) {
+        const quicdoq_cdns_item_t* item = quicdoq_cdns_block_item(cdns, block, cdns->address_table.entry_item[e]);
+        quicdoq_cdns_put_bytes(cdns, item->client_addr, item->client_addr_length);
+    }
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_TABLE_CLASSTYPE);
+    quicdoq_cdns_put_array(cdns, cdns->classtype_table.nb_entries);
+    for (uint32_t e = 0; e < cdns->classtype_table.nb_entries; e++) {
+        const quicdoq_cdns_item_t* item = quicdoq_cdns_block_item(cdns, block, cdns->classtype_table.entry_item[e]);
+        quicdoq_cdns_put_map(cdns, 2);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_CLASSTYPE_TYPE, item->sig.qtype);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_CLASSTYPE_CLASS, item->sig.qclass);
+    }
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_TABLE_NAME_RDATA);
+    quicdoq_cdns_put_array(cdns, cdns->name_table.nb_entries);
+    for (uint32_t e = 0; e < cdns->name_table.nb_entries; e++) {
+        const quicdoq_cdns_item_t* item = quicdoq_cdns_block_item(cdns, block, cdns->name_table.entry_item[e]);
+        quicdoq_cdns_put_bytes(cdns, item->qname, item->qname_length);
+    }
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_TABLE_QR_SIG);
+    quicdoq_cdns_put_array(cdns, cdns->sig_table.nb_entries);
+    for (uint32_t e = 0; e < cdns->sig_table.nb_entries; e++) {
+        uint32_t item_id = cdns->sig_table.entry_item[e];
+        const quicdoq_cdns_sig_t* sig = &quicdoq_cdns_block_item(cdns, block, item_id)->sig;
+        int has_question = (sig->sig_flags & QUICDOQ_CDNS_QUERY_HAS_QUESTION) != 0;
+        int has_opt = (sig->sig_flags & QUICDOQ_CDNS_QUERY_HAS_OPT) != 0;
+        int has_response = (sig->sig_flags & QUICDOQ_CDNS_HAS_RESPONSE) != 0;
+
+        quicdoq_cdns_put_map(cdns, 9 + has_question + 2 * has_opt + has_response);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_TRANSPORT_FLAGS, sig->transport_flags);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QR_TYPE, cdns->qr_type);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QR_SIG_FLAGS, sig->sig_flags);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_OPCODE, sig->opcode);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QR_DNS_FLAGS, sig->dns_flags);
+        if (has_question) {
+            quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_CLASSTYPE_INDEX, cdns->item_index[4 * item_id + 2]);
+        }
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_QDCOUNT, sig->qdcount);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_ANCOUNT, sig->ancount);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_NSCOUNT, sig->nscount);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_ARCOUNT, sig->arcount);
+        if (has_opt) {
+            quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_EDNS_VERSION, sig->edns_version);
+            quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_QUERY_UDP_SIZE, sig->udp_size);
+        }
+        if (has_response) {
+            quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_SIG_RESPONSE_RCODE, sig->response_rcode);
+        }
+    }
+    /* Query response items */
+    quicdoq_cdns_put_uint(cdns, QUICDOQ_CDNS_BLOCK_QUERY_RESPONSES);
+    quicdoq_cdns_put_array(cdns, block->nb_items);
+    for (uint32_t i = 0; i < block->nb_items; i++) {
+        const quicdoq_cdns_item_t* item = quicdoq_cdns_block_item(cdns, block, i);
+        int has_question = (item->sig.sig_flags & QUICDOQ_CDNS_QUERY_HAS_QUESTION) != 0;
+        int has_response = (item->sig.sig_flags & QUICDOQ_CDNS_HAS_RESPONSE) != 0;
+
+        quicdoq_cdns_put_map(cdns, 6 + has_question + 2 * has_response);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_TIME_OFFSET, item->query_time - earliest_time);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_CLIENT_ADDRESS_INDEX, cdns->item_index[4 * i]);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_CLIENT_PORT, item->client_port);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_TRANSACTION_ID, item->transaction_id);
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_SIGNATURE_INDEX, cdns->item_index[4 * i + 3]);
+        if (has_response) {
+            quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_RESPONSE_DELAY, item->response_delay);
+        }
+        if (has_question) {
+            quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_QUERY_NAME_INDEX, cdns->item_index[4 * i + 1]);
+        }
+        quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_QUERY_SIZE, item->query_size);
+        if (has_response) {
+            quicdoq_cdns_put_key_uint(cdns, QUICDOQ_CDNS_QR_RESPONSE_SIZE, item->response_size);
+        }
+    }
+
+    quicdoq_cdns_flush_out(cdns);
+    fflush(cdns->F);
+}
+
+/* Writer thread. Write a block when max_block_items are queued, or when
+ * items are queued and the flush interval has elapsed or the log is
+ * closing. Otherwise, wait for the producer signal or the next check. */
+#ifdef _WINDOWS
+static DWORD WINAPI quicdoq_cdns_writer(LPVOID v_cdns)
+#else
+static void* quicdoq_cdns_writer(void* v_cdns)
+#endif
+{
+    quicdoq_cdns_t* cdns = (quicdoq_cdns_t*)v_cdns;
+    uint64_t next_flush_time = picoquic_current_time() + cdns->flush_interval;
+
+    for (;;) {
+        /* Read the closing flag first, so the items logged before closing are written */
+        uint64_t is_closing = quicdoq_atomic_load(&cdns->is_closing);
+        uint64_t nb_queued = quicdoq_atomic_load(&cdns->tail) - cdns->head;
+        uint64_t current_time = picoquic_current_time();
+
+        if (nb_queued >= cdns->max_block_items ||
+            (nb_queued > 0 && (is_closing || current_time >= next_flush_time))) {
+            quicdoq_cdns_block_t block;
+
+            block.first = cdns->head;
+            block.nb_items = (nb_queued > cdns->max_block_items) ? cdns->max_block_items : (uint32_t)nb_queued;
+            quicdoq_cdns_write_block(cdns, &block);
+            quicdoq_atomic_store(&cdns->head, cdns->head + block.nb_items);
+            quicdoq_atomic_store(&cdns->nb_blocks, cdns->nb_blocks + 1);
+            if (cdns->is_write_error) {
+                quicdoq_atomic_store(&cdns->nb_write_errors, cdns->nb_write_errors + 1);
+                cdns->is_write_error = 0;
+            }
+            next_flush_time = current_time + cdns->flush_interval;
+        }
+        else if (is_closing) {
+            break;
+        }
+        else {
+            uint64_t wait_time = QUICDOQ_CDNS_WAIT_INTERVAL;
+
+            if (nb_queued == 0 && current_time >= next_flush_time) {
+                next_flush_time = current_time + cdns->flush_interval;
+            }
+            if (next_flush_time - current_time < wait_time) {
+                wait_time = next_flush_time - current_time;
+            }
+            (void)picoquic_wait_for_event(&cdns->event, wait_time);
+        }
+    }
+
+#ifdef _WINDOWS
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+quicdoq_cdns_t* quicdoq_cdns_open(char const* file_name, uint32_t max_block_items, uint64_t flush_interval, uint8_t qr_type)
+{
+    quicdoq_cdns_t* cdns = (quicdoq_cdns_t*)malloc(sizeof(quicdoq_cdns_t));
+
+    if (cdns != NULL) {
+        uint32_t nb_slots = 1;
+        uint64_t ring_size = 1;
+        int ret = 0;
+
+        memset(cdns, 0, sizeof(quicdoq_cdns_t));
+        cdns->max_block_items = (max_block_items == 0) ? QUICDOQ_CDNS_DEFAULT_BLOCK_ITEMS : max_block_items;
+        cdns->flush_interval = (flush_interval == 0) ? QUICDOQ_CDNS_DEFAULT_FLUSH_INTERVAL : flush_interval;
+        cdns->qr_type = qr_type;
+        while (nb_slots < 2 * cdns->max_block_items) {
+            nb_slots <<= 1;
+        }
+        cdns->slot_mask = nb_slots - 1;
+        /* Room for the block being written and the next one */
+        while (ring_size < 2 * (uint64_t)cdns->max_block_items) {
+            ring_size <<= 1;
+        }
+        cdns->mask = ring_size - 1;
+
+        cdns->items = (quicdoq_cdns_item_t*)malloc((size_t)ring_size * sizeof(quicdoq_cdns_item_t));
+        if (cdns->items == NULL) {
+            ret = -1;
+        }
+        else {
+            cdns->item_index = (uint32_t*)malloc(4 * (size_t)cdns->max_block_items * sizeof(uint32_t));
+            if (cdns->item_index == NULL ||
+                quicdoq_cdns_table_init(&cdns->address_table, nb_slots, cdns->max_block_items) != 0 ||
+                quicdoq_cdns_table_init(&cdns->name_table, nb_slots, cdns->max_block_items) != 0 ||
+                quicdoq_cdns_table_init(&cdns->classtype_table, nb_slots, cdns->max_block_items) != 0 ||
+                quicdoq_cdns_table_init(&cdns->sig_table, nb_slots, cdns->max_block_items) != 0) {
+                ret = -1;
+            }
+        }
+        if (ret == 0 && (cdns->F = picoquic_file_open(file_name, "wb")) == NULL) {
+            DBG_PRINTF("Cannot open C-DNS file %s", file_name);
+            ret = -1;
+        }
+        if (ret == 0) {
+            quicdoq_cdns_write_header(cdns);
+            quicdoq_cdns_flush_out(cdns);
+            if (picoquic_create_event(&cdns->event) != 0) {
+                ret = -1;
+            }
+            else if (picoquic_create_thread(&cdns->thread, quicdoq_cdns_writer, cdns) != 0) {
+                picoquic_delete_event(&cdns->event);
+                ret = -1;
+            }
+            else {
+                cdns->is_thread_started = 1;
+            }
+        }
+        if (ret != 0) {
+            quicdoq_cdns_close(cdns);
+            cdns = NULL;
+        }
+    }
+
+    return cdns;
+}
+
+void quicdoq_cdns_close(quicdoq_cdns_t* cdns)
+{
+    if (cdns->is_thread_started) {
+        quicdoq_atomic_store(&cdns->is_closing, 1);
+        picoquic_signal_event(&cdns->event);
+        picoquic_delete_thread(&cdns->thread);
+        picoquic_delete_event(&cdns->event);
+    }
+    if (cdns->F != NULL) {
+        const uint8_t cbor_break = 0xFF;
+
+        quicdoq_cdns_put(cdns, &cbor_break, 1);
+        quicdoq_cdns_flush_out(cdns);
+        cdns->F = picoquic_file_close(cdns->F);
+    }
+    if (cdns->items != NULL) {
+        free(cdns->items);
+    }
+    if (cdns->item_index != NULL) {
+        free(cdns->item_index);
+    }
+    quicdoq_cdns_table_release(&cdns->address_table);
+    quicdoq_cdns_table_release(&cdns->name_table);
+    quicdoq_cdns_table_release(&cdns->classtype_table);
+    quicdoq_cdns_table_release(&cdns->sig_table);
+    free(cdns);
+}
+
+/* Find the OPT record in the additional section of the response, without
+ * building the view of the response. Returns 1 and the TTL field of the
+ * record if found. */
+static int quicdoq_cdns_find_opt(const uint8_t* response, size_t length, uint32_t* opt_ttl)
+{
+    uint32_t qdcount = (uint32_t)((response[4] << 8) | response[5]);
+    uint32_t nb_before = (uint32_t)((response[6] << 8) | response[7]) + (uint32_t)((response[8] << 8) | response[9]);
+    uint32_t nb_rr = nb_before + (uint32_t)((response[10] << 8) | response[11]);
+    size_t pos = 12;
+
+    if (nb_rr == nb_before) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < qdcount; i++) {
+        size_t next = quicdoq_skip_dns_name(response, length, pos);
+
+        if (next == 0 || next + 4 > length) {
+            return 0;
+        }
+        pos = next + 4;
+    }
+    for (uint32_t i = 0; i < nb_rr; i++) {
+        size_t next = quicdoq_skip_dns_name(response, length, pos);
+
+        if (next == 0 || next + 10 > length) {
+            break;
+        }
+        if (i >= nb_before && response[next] == 0 && response[next + 1] == 41) {
+            *opt_ttl = ((uint32_t)response[next + 4] << 24) | ((uint32_t)response[next + 5] << 16) |
+                ((uint32_t)response[next + 6] << 8) | response[next + 7];
+            return 1;
+        }
+        pos = next + 10 + (((size_t)response[next + 8] << 8) | response[next + 9]);
+    }
+
+    return 0;
+}
+
+int quicdoq_cdns_log(quicdoq_cdns_t* cdns, const quicdoq_dns_view_t* query_view, const uint8_t* query, size_t query_length,
+    const uint8_t* response, size_t response_length, const struct sockaddr* client_addr,
+    uint64_t query_time, uint64_t response_time)
+{
+    uint64_t tail = cdns->tail;
+    uint64_t nb_queued = tail - quicdoq_atomic_load(&cdns->head);
+    quicdoq_cdns_item_t* item;
+    quicdoq_cdns_sig_t* sig;
+
+    if (query_view == NULL) {
+        quicdoq_atomic_store(&cdns->nb_malformed, cdns->nb_malformed + 1);
+        return -1;
+    }
+    if (nb_queued > cdns->mask) {
+        quicdoq_atomic_store(&cdns->nb_dropped, cdns->nb_dropped + 1);
+        return -1;
+    }
+
+    item = &cdns->items[tail & cdns->mask];
+    sig = &item->sig;
+    memset(sig, 0, sizeof(quicdoq_cdns_sig_t));
+    item->query_time = query_time;
+    item->query_size = (uint16_t)query_length;
+    item->transaction_id = query_view->id;
+    item->client_addr_length = 0;
+    item->client_port = 0;
+    if (client_addr != NULL && client_addr->sa_family == AF_INET) {
+        const struct sockaddr_in* addr4 = (const struct sockaddr_in*)client_addr;
+        memcpy(item->client_addr, &addr4->sin_addr, 4);
+        item->client_addr_length = 4;
+        item->client_port = ntohs(addr4->sin_port);
+    }
+    else if (client_addr != NULL && client_addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)client_addr;
+        memcpy(item->client_addr, &addr6->sin6_addr, 16);
+        item->client_addr_length = 16;
+        item->client_port = ntohs(addr6->sin6_port);
+        sig->transport_flags = 1;
+    }
+    sig->transport_flags |= QUICDOQ_CDNS_TRANSPORT_NON_STANDARD << 1;
+    sig->sig_flags = QUICDOQ_CDNS_HAS_QUERY;
+    sig->opcode = (uint8_t)QUICDOQ_VIEW_OPCODE(query_view);
+    /* The DNS flags CD to AA are in the same order in the header and in qr-dns-flags */
+    sig->dns_flags = (query_view->flags >> 4) & 0x7F;
+    sig->qdcount = query_view->qdcount;
+    sig->ancount = query_view->ancount;
+    sig->nscount = query_view->nscount;
+    sig->arcount = query_view->arcount;
+    item->qname_length = 0;
+    if (query_view->qdcount > 0) {
+        sig->sig_flags |= QUICDOQ_CDNS_QUERY_HAS_QUESTION;
+        sig->qtype = query_view->qtype;
+        sig->qclass = query_view->qclass;
+        /* The name table holds complete names, the qname may be compressed */
+        item->qname_length = (uint8_t)quicdoq_dns_view_copy_name(query, query_length, query_view->qname_offset,
+            item->qname, sizeof(item->qname));
+    }
+    if (query_view->has_opt) {
+        sig->sig_flags |= QUICDOQ_CDNS_QUERY_HAS_OPT;
+        sig->udp_size = query_view->opt.rr_class;
+        sig->edns_version = (uint8_t)(query_view->opt.ttl >> 16);
+        sig->dns_flags |= ((query_view->opt.ttl >> 15) & 1) << 7;
+    }
+    item->response_delay = 0;
+    item->response_size = 0;
+    if (response != NULL && response_length >= 12) {
+        uint16_t response_flags = (uint16_t)((response[2] << 8) | response[3]);
+        uint32_t opt_ttl = 0;
+
+        sig->sig_flags |= QUICDOQ_CDNS_HAS_RESPONSE;
+        sig->dns_flags |= (uint32_t)((response_flags >> 4) & 0x7F) << 8;
+        sig->response_rcode = response_flags & 0x0F;
+        if (response[4] == 0 && response[5] == 0) {
+            sig->sig_flags |= QUICDOQ_CDNS_RESPONSE_HAS_NO_QUESTION;
+        }
+        if (quicdoq_cdns_find_opt(response, response_length, &opt_ttl)) {
+            sig->sig_flags |= QUICDOQ_CDNS_RESPONSE_HAS_OPT;
+            sig->response_rcode |= (uint16_t)((opt_ttl >> 24) << 4);
+        }
+        item->response_size = (uint32_t)response_length;
+        item->response_delay = (response_time > query_time) ? response_time - query_time : 0;
+    }
+
+    quicdoq_atomic_store(&cdns->tail, tail + 1);
+    if (nb_queued + 1 == cdns->max_block_items) {
+        picoquic_signal_event(&cdns->event);
+    }
+
+    return 0;
+}
+
+void quicdoq_cdns_get_stats(quicdoq_cdns_t* cdns, quicdoq_cdns_stats_t* stats)
+{
+    stats->nb_items = quicdoq_atomic_load(&cdns->tail);
+    stats->nb_dropped = quicdoq_atomic_load(&cdns->nb_dropped);
+    stats->nb_malformed = quicdoq_atomic_load(&cdns->nb_malformed);
+    stats->nb_blocks = quicdoq_atomic_load(&cdns->nb_blocks);
+    stats->nb_write_errors = quicdoq_atomic_load(&cdns->nb_write_errors);
+}
@@ -0,0 +1,231 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Per connection statistics.
+ *
+ * The DoQ counters are updated by the callbacks in quicdoq.c. The path
+ * statistics are only read from picoquic when the statistics of a
+ * connection are requested, so keeping the counters costs nothing on the
+ * packet path.
+ */
+
+static char const* quicdoq_cnx_column_names[quicdoq_cnx_column_max] = {
+    "queries", "responses", "refused", "resets", "bytes_in", "bytes_out", "streams", "peak", "rtt", "cwin", "lost"
+};
+
+typedef struct st_quicdoq_cnx_sort_t {
+    uint64_t key;
+    quicdoq_cnx_stats_t stats;
+} quicdoq_cnx_sort_t;
+
+quicdoq_cnx_ctx_t* quicdoq_first_cnx(quicdoq_ctx_t* quicdoq_ctx)
+{
+    return quicdoq_ctx->first_cnx;
+}
+
+quicdoq_cnx_ctx_t* quicdoq_next_cnx(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    return cnx_ctx->next_cnx;
+}
+
+void quicdoq_get_cnx_stats(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_cnx_stats_t* stats)
+{
+    *stats = cnx_ctx->stats;
+    stats->is_server = cnx_ctx->is_server;
+    if (cnx_ctx->cnx != NULL) {
+        picoquic_path_quality_t quality;
+        struct sockaddr* peer_addr = NULL;
+
+        stats->cid = picoquic_get_logging_cnxid(cnx_ctx->cnx);
+        stats->start_time = picoquic_get_cnx_start_time(cnx_ctx->cnx);
+        picoquic_get_peer_addr(cnx_ctx->cnx, &peer_addr);
+        if (peer_addr != NULL) {
+            picoquic_store_addr(&stats->peer_addr, peer_addr);
+        }
+        memset(&quality, 0, sizeof(quality));
+        picoquic_get_default_path_quality(cnx_ctx->cnx, &quality);
+        stats->rtt = quality.rtt;
+        stats->rtt_min = quality.rtt_min;
+        stats->cwin = quality.cwin;
+        stats->bytes_in_transit = quality.bytes_in_transit;
+        stats->nb_lost = quality.lost;
+    }
+}
+
+uint64_t quicdoq_cnx_column_value(const quicdoq_cnx_stats_t* stats, quicdoq_cnx_column_enum column)
+{
+    uint64_t value = 0;
+
+    switch (column) {
+    case quicdoq_cnx_column_queries:
+        value = stats->nb_queries;
+        break;
+    case quicdoq_cnx_column_responses:
+        value = stats->nb_responses;
+        break;
+    case quicdoq_cnx_column_refused:
+        value = stats->nb_refused;
+        break;
+    case quicdoq_cnx_column_resets:
+        value = stats->nb_resets;
+        break;
+    case quicdoq_cnx_column_bytes_received:
+        value = stats->bytes_received;
+        break;
+    case quicdoq_cnx_column_bytes_sent:
+        value = stats->bytes_sent;
+        break;
+    case quicdoq_cnx_column_open_streams:
+        value = stats->open_streams;
+        break;
+    case quicdoq_cnx_column_peak_streams:
+        value = stats->peak_streams;
+        break;
+    case quicdoq_cnx_column_rtt:
+        value = stats->rtt;
+        break;
+    case quicdoq_cnx_column_cwin:
+        value = stats->cwin;
+        break;
+    case quicdoq_cnx_column_lost:
+        value = stats->nb_lost;
+        break;
+    default:
+        break;
+    }
+
+    return value;
+}
+
+char const* quicdoq_cnx_column_name(quicdoq_cnx_column_enum column)
+{
+    return ((unsigned int)column < quicdoq_cnx_column_max) ? quicdoq_cnx_column_names[column] : NULL;
+}
+
+quicdoq_cnx_column_enum quicdoq_cnx_column_from_name(char const* name)
+{
+    int column = 0;
+
+    while (column < quicdoq_cnx_column_max && strcmp(name, quicdoq_cnx_column_names[column]) != 0) {
+        column++;
+    }
+
+    return (quicdoq_cnx_column_enum)column;
+}
+
+/* Sort by decreasing key */
+static int quicdoq_cnx_sort_compare(const void* a, const void* b)
+{
+    uint64_t key_a = ((const quicdoq_cnx_sort_t*)a)->key;
+    uint64_t key_b = ((const quicdoq_cnx_sort_t*)b)->key;
+
+    return (key_a < key_b) ? 1 : ((key_a > key_b) ? -1 : 0);
+}
+
+static void quicdoq_dump_cnx_line(FILE* F, const quicdoq_cnx_stats_t* stats)
+{
+    char cid_text[2 * PICOQUIC_CONNECTION_ID_MAX_SIZE + 1];
+    char addr_text[128];
+    static const char hex_digits[] = "0123456789abcdef";
+    size_t cid_length = 0;
+
+    for (uint8_t i = 0; i < stats->cid.id_len && i < PICOQUIC_CONNECTION_ID_MAX_SIZE; i++) {
+        cid_text[cid_length++] = hex_digits[stats->cid.id[i] >> 4];
+        cid_text[cid_length++] = hex_digits[stats->cid.id[i] & 0x0F];
+    }
+    cid_text[cid_length] = 0;
+    if (stats->peer_addr.ss_family == 0 ||
+        picoquic_addr_text((const struct sockaddr*)&stats->peer_addr, addr_text, sizeof(addr_text)) == NULL) {
+        addr_text[0] = '-';
+        addr_text[1] = 0;
+    }
+
+    fprintf(F, "%s %s %s", cid_text, addr_text, (stats->is_server) ? "server" : "client");
+    for (int column = 0; column < quicdoq_cnx_column_max; column++) {
+        fprintf(F, " %" PRIu64, quicdoq_cnx_column_value(stats, (quicdoq_cnx_column_enum)column));
+    }
+    fprintf(F, "\n");
+}
+
+int quicdoq_dump_top_cnx(quicdoq_ctx_t* quicdoq_ctx, FILE* F, quicdoq_cnx_column_enum column, size_t nb_top)
+{
+    int ret = 0;
+    size_t nb_cnx = 0;
+    quicdoq_cnx_ctx_t* cnx_ctx = quicdoq_ctx->first_cnx;
+    quicdoq_cnx_sort_t* sorted = NULL;
+
+    if ((unsigned int)column >= quicdoq_cnx_column_max) {
+        return -1;
+    }
+
+    while (cnx_ctx != NULL) {
+        nb_cnx++;
+        cnx_ctx = cnx_ctx->next_cnx;
+    }
+
+    if (nb_cnx > 0) {
+        sorted = (quicdoq_cnx_sort_t*)malloc(nb_cnx * sizeof(quicdoq_cnx_sort_t));
+        if (sorted == NULL) {
+            ret = -1;
+        }
+        else {
+            size_t i = 0;
+
+            for (cnx_ctx = quicdoq_ctx->first_cnx; cnx_ctx != NULL; cnx_ctx = cnx_ctx->next_cnx) {
+                quicdoq_get_cnx_stats(cnx_ctx, &sorted[i].stats);
+                sorted[i].key = quicdoq_cnx_column_value(&sorted[i].stats, column);
+                i++;
+            }
+            qsort(sorted, nb_cnx, sizeof(quicdoq_cnx_sort_t), quicdoq_cnx_sort_compare);
+        }
+    }
+
+    if (ret == 0) {
+        if (nb_top > nb_cnx) {
+            nb_top = nb_cnx;
+        }
+        fprintf(F, "Top %" PRIu64 " of %" PRIu64 " connections by %s\ncid peer role", (uint64_t)nb_top, (uint64_t)nb_cnx, quicdoq_cnx_column_names[column]);
+        for (int c = 0; c < quicdoq_cnx_column_max; c++) {
+            fprintf(F, " %s", quicdoq_cnx_column_names[c]);
+        }
+        fprintf(F, "\n");
+        for (size_t i = 0; i < nb_top; i++) {
+            quicdoq_dump_cnx_line(F, &sorted[i].stats);
+        }
+        fflush(F);
+    }
+
+    if (sorted != NULL) {
+        free(sorted);
+    }
+
+    return ret;
+}
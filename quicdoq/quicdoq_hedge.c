@@ -0,0 +1,456 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Hedged queries.
+ *
+ * Each query posted to a declared server gets a hedge record, which holds
+ * the time at which the query was posted and the timer of the hedge. The
+ * record is created before the query is posted, and deleted if the post
+ * fails. The copy of the query sent as a hedge is allocated with its query
+ * and response buffers in a single block, and freed when its final callback
+ * is received or when it is withdrawn. The callbacks of the copy are
+ * delivered to the application as callbacks of the original query.
+ *
+ * When a query loses to its hedge or fails, its server did not answer
+ * within the time elapsed since the query was posted. That time is
+ * recorded as a sample of the server response time, so that slow servers
+ * are not only measured by the responses that beat the hedge.
+ */
+
+void quicdoq_get_default_hedge_policy(quicdoq_hedge_policy_t* policy)
+{
+    memset(policy, 0, sizeof(quicdoq_hedge_policy_t));
+    policy->percentile = QUICDOQ_HEDGE_DEFAULT_PERCENTILE;
+    policy->initial_delay = QUICDOQ_HEDGE_DEFAULT_INITIAL_DELAY;
+    policy->min_delay = QUICDOQ_HEDGE_DEFAULT_MIN_DELAY;
+    policy->max_delay = QUICDOQ_HEDGE_DEFAULT_MAX_DELAY;
+    policy->min_samples = QUICDOQ_HEDGE_DEFAULT_MIN_SAMPLES;
+    policy->budget_percent = QUICDOQ_HEDGE_DEFAULT_BUDGET_PERCENT;
+}
+
+void quicdoq_set_hedge_policy(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_policy_t const* policy)
+{
+    quicdoq_hedge_policy_t p = *policy;
+    quicdoq_hedge_policy_t d;
+
+    quicdoq_get_default_hedge_policy(&d);
+    if (p.percentile <= 0.0 || p.percentile > 100.0) {
+        p.percentile = d.percentile;
+    }
+    if (p.initial_delay == 0) {
+        p.initial_delay = d.initial_delay;
+    }
+    if (p.min_delay == 0) {
+        p.min_delay = d.min_delay;
+    }
+    if (p.max_delay == 0) {
+        p.max_delay = d.max_delay;
+    }
+    if (p.max_delay < p.min_delay) {
+        p.max_delay = p.min_delay;
+    }
+    if (p.min_samples == 0) {
+        p.min_samples = d.min_samples;
+    }
+    if (p.budget_percent > 100) {
+        p.budget_percent = 100;
+    }
+    quicdoq_ctx->hedge_policy = p;
+}
+
+static quicdoq_hedge_server_t* quicdoq_hedge_find_server(quicdoq_ctx_t* quicdoq_ctx, struct sockaddr* addr)
+{
+    quicdoq_hedge_server_t* server = quicdoq_ctx->first_hedge_server;
+
+    while (server != NULL && picoquic_compare_addr(addr, (struct sockaddr*)&server->addr) != 0) {
+        server = server->next_server;
+    }
+
+    return server;
+}
+
+int quicdoq_add_hedge_server(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr)
+{
+    int ret = 0;
+
+    if (quicdoq_hedge_find_server(quicdoq_ctx, addr) == NULL) {
+        quicdoq_hedge_server_t* server = (quicdoq_hedge_server_t*)malloc(sizeof(quicdoq_hedge_server_t));
+
+        if (server == NULL) {
+            ret = -1;
+        }
+        else {
+            memset(server, 0, sizeof(quicdoq_hedge_server_t));
+            picoquic_store_addr(&server->addr, addr);
+            if (sni != NULL && (server->sni = picoquic_string_duplicate(sni)) == NULL) {
+                free(server);
+                ret = -1;
+            }
+            else {
+                /* Keep the order of declaration, which breaks ties between servers */
+                quicdoq_hedge_server_t** p_next = &quicdoq_ctx->first_hedge_server;
+
+                while (*p_next != NULL) {
+                    p_next = &(*p_next)->next_server;
+                }
+                *p_next = server;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static uint64_t quicdoq_hedge_server_delay(quicdoq_hedge_policy_t const* policy, quicdoq_hedge_server_t* server)
+{
+    uint64_t delay = policy->initial_delay;
+
+    if (server->response_time.count >= policy->min_samples) {
+        delay = quicdoq_histogram_percentile(&server->response_time, policy->percentile);
+    }
+    if (delay < policy->min_delay) {
+        delay = policy->min_delay;
+    }
+    else if (delay > policy->max_delay) {
+        delay = policy->max_delay;
+    }
+
+    return delay;
+}
+
+uint64_t quicdoq_get_hedge_delay(quicdoq_ctx_t* quicdoq_ctx, struct sockaddr* addr)
+{
+    quicdoq_hedge_server_t* server = quicdoq_hedge_find_server(quicdoq_ctx, addr);
+
+    return (server == NULL) ? UINT64_MAX : quicdoq_hedge_server_delay(&quicdoq_ctx->hedge_policy, server);
+}
+
+void quicdoq_get_hedge_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_stats_t* stats)
+{
+    *stats = quicdoq_ctx->hedge_stats;
+}
+
+static void quicdoq_hedge_record_time(quicdoq_hedge_server_t* server, uint64_t response_time)
+{
+    if (server->response_time.count >= QUICDOQ_HEDGE_MAX_SAMPLES) {
+        /* Age the samples, so that the percentile follows the current latency */
+        server->response_time.count = 0;
+        for (size_t i = 0; i < QUICDOQ_HISTOGRAM_NB_BUCKETS; i++) {
+            server->response_time.bucket[i] /= 2;
+            server->response_time.count += server->response_time.bucket[i];
+        }
+        server->response_time.sum /= 2;
+    }
+    quicdoq_histogram_record(&server->response_time, response_time);
+}
+
+/* The original query and its copy point to their hedge record. The link of
+ * the original is cleared before its final callback, since the application
+ * may then release the query context. */
+static quicdoq_hedge_t* quicdoq_hedge_find(quicdoq_query_ctx_t* query_ctx)
+{
+    return query_ctx->hedge;
+}
+
+static void quicdoq_hedge_unlink(quicdoq_hedge_t* hedge)
+{
+    hedge->query_ctx->hedge = NULL;
+}
+
+/* Cancel the copy of the query if it is still in flight, and free it */
+static void quicdoq_hedge_withdraw_copy(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_t* hedge)
+{
+    if (hedge->hedge_query_ctx != NULL) {
+        quicdoq_query_ctx_t* hedge_query_ctx = hedge->hedge_query_ctx;
+
+        /* Clear the link first, since withdrawing the copy may start other queries */
+        hedge->hedge_query_ctx = NULL;
+        (void)quicdoq_client_withdraw_query(quicdoq_ctx, hedge_query_ctx);
+        free(hedge_query_ctx);
+    }
+}
+
+static void quicdoq_hedge_delete(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_t* hedge)
+{
+    quicdoq_deadline_stop(quicdoq_ctx, &hedge->hedge_timer);
+    quicdoq_hedge_withdraw_copy(quicdoq_ctx, hedge);
+
+    if (hedge->previous == NULL) {
+        quicdoq_ctx->first_hedge = hedge->next;
+    }
+    else {
+        hedge->previous->next = hedge->next;
+    }
+    if (hedge->next != NULL) {
+        hedge->next->previous = hedge->previous;
+    }
+    free(hedge);
+}
+
+void quicdoq_hedge_prepare_post(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx, uint64_t current_time)
+{
+    quicdoq_hedge_server_t* server;
+    quicdoq_hedge_t* hedge;
+
+    if (quicdoq_hedge_find(query_ctx) != NULL && quicdoq_hedge_find(query_ctx)->hedge_query_ctx == query_ctx) {
+        /* This is the copy sent as a hedge */
+    }
+    else if ((server = quicdoq_hedge_find_server(quicdoq_ctx, query_ctx->server_addr)) != NULL &&
+        (hedge = (quicdoq_hedge_t*)malloc(sizeof(quicdoq_hedge_t))) != NULL) {
+        memset(hedge, 0, sizeof(quicdoq_hedge_t));
+        hedge->query_ctx = query_ctx;
+        query_ctx->hedge = hedge;
+        hedge->server = server;
+        hedge->start_time = current_time;
+        hedge->hedge_timer.kind = quicdoq_deadline_hedge;
+        hedge->hedge_timer.owner = hedge;
+        quicdoq_ctx->hedge_stats.nb_queries++;
+        if (quicdoq_ctx->hedge_policy.budget_percent > 0 &&
+            (server != quicdoq_ctx->first_hedge_server || server->next_server != NULL)) {
+            hedge->hedge_timer.deadline = current_time + quicdoq_hedge_server_delay(&quicdoq_ctx->hedge_policy, server);
+            if (quicdoq_deadline_start(quicdoq_ctx, &hedge->hedge_timer) != 0) {
+                DBG_PRINTF("Cannot plan the hedge of query #%" PRIu64, query_ctx->query_id);
+            }
+        }
+        hedge->next = quicdoq_ctx->first_hedge;
+        if (hedge->next != NULL) {
+            hedge->next->previous = hedge;
+        }
+        quicdoq_ctx->first_hedge = hedge;
+    }
+}
+
+void quicdoq_hedge_post_failed(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx)
+{
+    quicdoq_hedge_t* hedge = quicdoq_hedge_find(query_ctx);
+
+    if (hedge != NULL && hedge->query_ctx == query_ctx) {
+        quicdoq_ctx->hedge_stats.nb_queries--;
+        quicdoq_hedge_unlink(hedge);
+        quicdoq_hedge_delete(quicdoq_ctx, hedge);
+    }
+}
+
+/* Post a copy of the query to the other declared server with the shortest hedge delay */
+static int quicdoq_hedge_send(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_t* hedge, uint64_t current_time)
+{
+    int ret = 0;
+    quicdoq_query_ctx_t* query_ctx = hedge->query_ctx;
+    quicdoq_hedge_server_t* server = NULL;
+    quicdoq_hedge_server_t* next_server = quicdoq_ctx->first_hedge_server;
+    uint64_t server_delay = UINT64_MAX;
+    quicdoq_query_ctx_t* hedge_query_ctx;
+
+    while (next_server != NULL) {
+        if (next_server != hedge->server) {
+            uint64_t delay = quicdoq_hedge_server_delay(&quicdoq_ctx->hedge_policy, next_server);
+            if (delay < server_delay) {
+                server = next_server;
+                server_delay = delay;
+            }
+        }
+        next_server = next_server->next_server;
+    }
+
+    if (server == NULL || (hedge_query_ctx = (quicdoq_query_ctx_t*)malloc(sizeof(quicdoq_query_ctx_t) +
+        (size_t)query_ctx->query_length + (size_t)query_ctx->response_max_size)) == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(hedge_query_ctx, 0, sizeof(quicdoq_query_ctx_t));
+        hedge_query_ctx->server_name = server->sni;
+        hedge_query_ctx->server_addr = (struct sockaddr*)&server->addr;
+        hedge_query_ctx->query_id = query_ctx->query_id;
+        hedge_query_ctx->query = (uint8_t*)(hedge_query_ctx + 1);
+        hedge_query_ctx->query_max_size = query_ctx->query_length;
+        hedge_query_ctx->query_length = query_ctx->query_length;
+        memcpy(hedge_query_ctx->query, query_ctx->query, query_ctx->query_length);
+        hedge_query_ctx->response = hedge_query_ctx->query + query_ctx->query_length;
+        hedge_query_ctx->response_max_size = query_ctx->response_max_size;
+        hedge_query_ctx->deadline = query_ctx->deadline;
+        hedge_query_ctx->hedge = hedge;
+
+        hedge->hedge_query_ctx = hedge_query_ctx;
+        hedge->hedge_server = server;
+        hedge->hedge_start_time = current_time;
+        if ((ret = quicdoq_post_query(quicdoq_ctx, hedge_query_ctx)) != 0) {
+            hedge->hedge_query_ctx = NULL;
+            free(hedge_query_ctx);
+        }
+        else {
+            quicdoq_ctx->hedge_stats.nb_hedges_sent++;
+            quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_hedges_sent);
+        }
+    }
+
+    return ret;
+}
+
+void quicdoq_hedge_timer_expired(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_t* hedge, uint64_t current_time)
+{
+    if ((quicdoq_ctx->hedge_stats.nb_hedges_sent + 1) * 100 >
+        quicdoq_ctx->hedge_policy.budget_percent * quicdoq_ctx->hedge_stats.nb_queries) {
+        quicdoq_ctx->hedge_stats.nb_hedges_over_budget++;
+    }
+    else if (quicdoq_hedge_send(quicdoq_ctx, hedge, current_time) != 0) {
+        DBG_PRINTF("Cannot send the hedge of query #%" PRIu64, hedge->query_ctx->query_id);
+    }
+}
+
+int quicdoq_hedge_callback(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_return_enum callback_code,
+    quicdoq_query_ctx_t* query_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    int is_response = (callback_code == quicdoq_response_complete || callback_code == quicdoq_response_partial);
+    quicdoq_hedge_t* hedge = quicdoq_hedge_find(query_ctx);
+
+    if (hedge == NULL) {
+        ret = quicdoq_ctx->app_cb_fn(callback_code, quicdoq_ctx->app_cb_ctx, query_ctx, current_time);
+    }
+    else if (query_ctx == hedge->query_ctx) {
+        if (is_response) {
+            if (!hedge->is_answered) {
+                hedge->is_answered = 1;
+                quicdoq_deadline_stop(quicdoq_ctx, &hedge->hedge_timer);
+                quicdoq_hedge_record_time(hedge->server, current_time - hedge->start_time);
+                /* The hedge lost, if it was sent */
+                if (hedge->hedge_query_ctx != NULL) {
+                    quicdoq_hedge_record_time(hedge->hedge_server, current_time - hedge->hedge_start_time);
+                    quicdoq_hedge_withdraw_copy(quicdoq_ctx, hedge);
+                }
+            }
+        }
+        else {
+            if (!hedge->is_answered) {
+                /* Censored sample: the server did not answer in that time */
+                quicdoq_hedge_record_time(hedge->server, current_time - hedge->start_time);
+            }
+            if (hedge->hedge_query_ctx != NULL) {
+                /* Wait for the response to the hedge */
+                hedge->is_query_failed = 1;
+                hedge->failed_code = callback_code;
+                return 0;
+            }
+        }
+
+        if (callback_code != quicdoq_response_partial) {
+            quicdoq_hedge_unlink(hedge);
+        }
+        ret = quicdoq_ctx->app_cb_fn(callback_code, quicdoq_ctx->app_cb_ctx, query_ctx, current_time);
+        if (callback_code != quicdoq_response_partial) {
+            quicdoq_hedge_delete(quicdoq_ctx, hedge);
+        }
+    }
+    else {
+        /* Callback of the copy sent as a hedge, delivered as a callback of the original query */
+        quicdoq_query_ctx_t* original_ctx = hedge->query_ctx;
+
+        if (is_response) {
+            if (!hedge->is_answered) {
+                hedge->is_answered = 1;
+                quicdoq_hedge_record_time(hedge->hedge_server, current_time - hedge->hedge_start_time);
+                quicdoq_ctx->hedge_stats.nb_hedges_won++;
+                quicdoq_count_metric(quicdoq_ctx, quicdoq_metric_hedges_won);
+                if (!hedge->is_query_failed) {
+                    /* The original query lost, its server did not answer in that time */
+                    quicdoq_hedge_record_time(hedge->server, current_time - hedge->start_time);
+                    (void)quicdoq_client_withdraw_query(quicdoq_ctx, original_ctx);
+                }
+            }
+            /* Both buffers have the same size */
+            memcpy(original_ctx->response, query_ctx->response, query_ctx->response_length);
+            original_ctx->response_length = query_ctx->response_length;
+            original_ctx->return_code = callback_code;
+            if (callback_code == quicdoq_response_complete) {
+                quicdoq_hedge_unlink(hedge);
+            }
+            ret = quicdoq_ctx->app_cb_fn(callback_code, quicdoq_ctx->app_cb_ctx, original_ctx, current_time);
+            if (callback_code == quicdoq_response_complete) {
+                /* The stream of the copy is closed by the caller */
+                hedge->hedge_query_ctx = NULL;
+                free(query_ctx);
+                quicdoq_hedge_delete(quicdoq_ctx, hedge);
+            }
+        }
+        else {
+            /* The copy is no longer referenced by quicdoq */
+            hedge->hedge_query_ctx = NULL;
+            free(query_ctx);
+            if (hedge->is_query_failed || hedge->is_answered) {
+                callback_code = (hedge->is_query_failed) ? hedge->failed_code : callback_code;
+                original_ctx->return_code = callback_code;
+                quicdoq_hedge_unlink(hedge);
+                ret = quicdoq_ctx->app_cb_fn(callback_code, quicdoq_ctx->app_cb_ctx, original_ctx, current_time);
+                quicdoq_hedge_delete(quicdoq_ctx, hedge);
+            }
+        }
+    }
+
+    return ret;
+}
+
+int quicdoq_hedge_cancel(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx)
+{
+    int is_query_failed = 0;
+    quicdoq_hedge_t* hedge = quicdoq_hedge_find(query_ctx);
+
+    if (hedge != NULL && hedge->query_ctx == query_ctx) {
+        is_query_failed = hedge->is_query_failed;
+        quicdoq_hedge_unlink(hedge);
+        quicdoq_hedge_delete(quicdoq_ctx, hedge);
+    }
+
+    return is_query_failed;
+}
+
+void quicdoq_hedge_clear(quicdoq_ctx_t* quicdoq_ctx)
+{
+    /* The connections are already deleted, the copies are simply freed */
+    while (quicdoq_ctx->first_hedge != NULL) {
+        quicdoq_hedge_t* hedge = quicdoq_ctx->first_hedge;
+
+        quicdoq_ctx->first_hedge = hedge->next;
+        if (hedge->hedge_query_ctx != NULL) {
+            free(hedge->hedge_query_ctx);
+        }
+        free(hedge);
+    }
+
+    while (quicdoq_ctx->first_hedge_server != NULL) {
+        quicdoq_hedge_server_t* server = quicdoq_ctx->first_hedge_server;
+
+        quicdoq_ctx->first_hedge_server = server->next_server;
+        if (server->sni != NULL) {
+            free(server->sni);
+        }
+        free(server);
+    }
+}
@@ -0,0 +1,162 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Log bucketed histograms.
+ *
+ * Values below 2^(SUB_BITS+1) have a bucket each. Above that, the bucket is
+ * found from the position of the most significant bit, and the SUB_BITS
+ * bits that follow it. Recording a value costs a bit scan and a few
+ * additions, which is cheap enough to keep the histograms always on.
+ */
+
+#define QUICDOQ_HISTOGRAM_SUB_COUNT (1 << QUICDOQ_HISTOGRAM_SUB_BITS)
+#define QUICDOQ_HISTOGRAM_SUB_MASK (QUICDOQ_HISTOGRAM_SUB_COUNT - 1)
+
+static int quicdoq_histogram_msb(uint64_t value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(value);
+#else
+    int msb = 0;
+
+    for (int shift = 32; shift > 0; shift >>= 1) {
+        if ((value >> shift) != 0) {
+            value >>= shift;
+            msb += shift;
+        }
+    }
+    return msb;
+#endif
+}
+
+static size_t quicdoq_histogram_index(uint64_t value)
+{
+    size_t index;
+
+    if (value < QUICDOQ_HISTOGRAM_SUB_COUNT) {
+        index = (size_t)value;
+    }
+    else {
+        int msb = quicdoq_histogram_msb(value);
+        index = ((size_t)(msb - QUICDOQ_HISTOGRAM_SUB_BITS + 1) << QUICDOQ_HISTOGRAM_SUB_BITS) +
+            (size_t)((value >> (msb - QUICDOQ_HISTOGRAM_SUB_BITS)) & QUICDOQ_HISTOGRAM_SUB_MASK);
+        if (index >= QUICDOQ_HISTOGRAM_NB_BUCKETS) {
+            index = QUICDOQ_HISTOGRAM_NB_BUCKETS - 1;
+        }
+    }
+
+    return index;
+}
+
+/* Smallest value counted in a bucket */
+static uint64_t quicdoq_histogram_bucket_low(size_t index)
+{
+    uint64_t low;
+
+    if (index < QUICDOQ_HISTOGRAM_SUB_COUNT) {
+        low = index;
+    }
+    else {
+        int shift = (int)(index >> QUICDOQ_HISTOGRAM_SUB_BITS) - 1;
+        low = ((uint64_t)QUICDOQ_HISTOGRAM_SUB_COUNT + (index & QUICDOQ_HISTOGRAM_SUB_MASK)) << shift;
+    }
+
+    return low;
+}
+
+void quicdoq_histogram_record(quicdoq_histogram_t* histogram, uint64_t value)
+{
+    if (histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+    histogram->count++;
+    histogram->sum += value;
+    histogram->bucket[quicdoq_histogram_index(value)]++;
+}
+
+void quicdoq_histogram_merge(quicdoq_histogram_t* histogram, const quicdoq_histogram_t* other)
+{
+    if (other->count > 0) {
+        if (histogram->count == 0 || other->min < histogram->min) {
+            histogram->min = other->min;
+        }
+        if (other->max > histogram->max) {
+            histogram->max = other->max;
+        }
+        histogram->count += other->count;
+        histogram->sum += other->sum;
+        for (size_t i = 0; i < QUICDOQ_HISTOGRAM_NB_BUCKETS; i++) {
+            histogram->bucket[i] += other->bucket[i];
+        }
+    }
+}
+
+uint64_t quicdoq_histogram_percentile(const quicdoq_histogram_t* histogram, double percentile)
+{
+    uint64_t value = 0;
+
+    if (histogram->count > 0) {
+        double target_count = percentile * (double)histogram->count / 100.0;
+        uint64_t target = (uint64_t)target_count;
+        uint64_t cumulated = 0;
+        size_t index = 0;
+
+        if ((double)target < target_count) {
+            target++;
+        }
+        if (target == 0) {
+            target = 1;
+        }
+        else if (target > histogram->count) {
+            target = histogram->count;
+        }
+
+        while (index < QUICDOQ_HISTOGRAM_NB_BUCKETS - 1) {
+            cumulated += histogram->bucket[index];
+            if (cumulated >= target) {
+                break;
+            }
+            index++;
+        }
+
+        value = (index < QUICDOQ_HISTOGRAM_NB_BUCKETS - 1) ? quicdoq_histogram_bucket_low(index + 1) - 1 : histogram->max;
+        if (value > histogram->max) {
+            value = histogram->max;
+        }
+        if (value < histogram->min) {
+            value = histogram->min;
+        }
+    }
+
+    return value;
+}
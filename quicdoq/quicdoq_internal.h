@@ -37,6 +37,24 @@ extern "C" {
 /* Forward reference */
 typedef struct st_quicdoq_stream_ctx_t quicdoq_stream_ctx_t;
 
+/* Deadlines of queries and hedge timers, see quicdoq_check_deadlines().
+ * The deadlines that are running are kept in a binary heap, ordered by
+ * deadline. Each entry is embedded in its owner, and removed from the heap
+ * when the owner completes or is deleted.
+ */
+typedef enum {
+    quicdoq_deadline_pending = 0, /* Client query waiting for a connection, owner is quicdoq_pending_query_t */
+    quicdoq_deadline_stream, /* Client query in flight or server query, owner is quicdoq_stream_ctx_t */
+    quicdoq_deadline_hedge /* Time at which a hedge is sent, owner is quicdoq_hedge_t */
+} quicdoq_deadline_kind_enum;
+
+typedef struct st_quicdoq_deadline_t {
+    uint64_t deadline;
+    size_t heap_index; /* 1 + position in the heap, 0 if not running */
+    quicdoq_deadline_kind_enum kind;
+    void* owner;
+} quicdoq_deadline_t;
+
 /* Quicdoc per connection context
  * This is the argument passed by the callback context.
  * The Quic context provides by default an instance of this context in
@@ -51,15 +69,127 @@ typedef struct st_quicdoq_cnx_ctx_t {
 
     char* sni;
     struct sockaddr_storage addr;
+    uint64_t affinity; /* 0 for pooled connections, see cnx_affinity in the query context */
     picoquic_cnx_t* cnx;
     int is_server;
 
     uint64_t next_available_stream_id; /* starts with stream 0 on client */
     quicdoq_stream_ctx_t* first_stream;
     quicdoq_stream_ctx_t* last_stream;
+    uint16_t nb_open_streams; /* number of client queries in flight */
+    uint16_t max_open_streams; /* stream credit, learned from the server's transport parameters */
+    int is_0rtt_attempted; /* a session ticket was available when the connection started */
+    uint16_t nb_early_queries; /* number of queries sent in 0-RTT */
+    quicdoq_cnx_stats_t stats; /* DoQ counters, path statistics are read on demand */
 
 } quicdoq_cnx_ctx_t;
 
+/* Client connection pool.
+ * Client connections are pooled per server address and SNI. Queries are
+ * posted on the least loaded connection that is not closing and still has
+ * stream credit. If all connections are busy, queries wait in a pending
+ * queue, and an extra connection is opened when the number of queries
+ * waiting for a server crosses the queue threshold.
+ */
+#define QUICDOQ_POOL_DEFAULT_MAX_STREAMS 64
+#define QUICDOQ_POOL_DEFAULT_MAX_CNX 4
+#define QUICDOQ_POOL_DEFAULT_QUEUE_THRESHOLD 16
+
+typedef struct st_quicdoq_pending_query_t {
+    struct st_quicdoq_pending_query_t* next;
+    struct st_quicdoq_pending_query_t* previous;
+    quicdoq_query_ctx_t* query_ctx;
+    uint64_t queued_time;
+    quicdoq_deadline_t deadline;
+} quicdoq_pending_query_t;
+
+/* Server replay cache for queries accepted in 0-RTT.
+ * The cache is a rotating Bloom filter. Each generation covers a slice of
+ * the replay window; lookups test all generations, and new entries go to the
+ * newest one. When its slice ends, the oldest generation is cleared and
+ * becomes the newest, so entries are kept for at least the replay window.
+ * The memory is allocated with the context. A false positive only defers an
+ * early query until the handshake completes. Past QUICDOQ_REPLAY_GENERATION_MAX
+ * entries, a generation is saturated: entries are still added, but false
+ * positives become more frequent.
+ */
+#define QUICDOQ_REPLAY_WINDOW_DEFAULT QUICDOQ_TICKET_LIFETIME
+#define QUICDOQ_REPLAY_GENERATIONS 4
+#define QUICDOQ_REPLAY_FILTER_BITS 0x40000
+#define QUICDOQ_REPLAY_FILTER_HASHES 3
+#define QUICDOQ_REPLAY_GENERATION_MAX (QUICDOQ_REPLAY_FILTER_BITS / 10)
+
+typedef struct st_quicdoq_replay_cache_t {
+    uint64_t filter[QUICDOQ_REPLAY_GENERATIONS][QUICDOQ_REPLAY_FILTER_BITS / 64];
+    size_t nb_entries[QUICDOQ_REPLAY_GENERATIONS];
+    int newest; /* Generation receiving the new entries */
+    int is_started;
+    uint64_t generation_start; /* Start of the slice of the newest generation */
+    uint64_t nb_saturated; /* Entries added to a saturated generation */
+} quicdoq_replay_cache_t;
+
+int quicdoq_replay_check(quicdoq_replay_cache_t* cache, picoquic_connection_id_t const* initial_cid,
+    uint64_t stream_id, uint64_t current_time, uint64_t replay_window);
+void quicdoq_replay_cache_clear(quicdoq_replay_cache_t* cache);
+
+/* Rate limiter, see quicdoq_set_rate_limit().
+ * Token counts are kept in millionths of a token, so that a bucket refills
+ * by queries_per_second for each elapsed microsecond. Entries are found by
+ * linear probing over at most QUICDOQ_RATE_LIMIT_PROBES slots, from a
+ * position given by a hash keyed with a random value per limiter.
+ */
+#define QUICDOQ_RATE_LIMIT_PROBES 8
+#define QUICDOQ_RATE_LIMIT_TOKEN 1000000ull
+
+typedef struct st_quicdoq_rate_bucket_t {
+    uint8_t key[17]; /* Address family, then the masked prefix */
+    uint8_t is_used;
+    uint64_t tokens;
+    uint64_t last_time;
+} quicdoq_rate_bucket_t;
+
+typedef struct st_quicdoq_rate_limiter_t {
+    quicdoq_rate_limit_t config;
+    uint64_t full_refill_time; /* Idle time after which a bucket is full */
+    size_t nb_slots; /* Power of 2 */
+    quicdoq_rate_bucket_t* slots;
+    uint64_t hash_key[2]; /* SipHash key, so that clients cannot choose colliding prefixes */
+    quicdoq_rate_limit_stats_t stats;
+} quicdoq_rate_limiter_t;
+
+quicdoq_rate_limiter_t* quicdoq_rate_limiter_create(quicdoq_rate_limit_t const* config);
+void quicdoq_rate_limiter_delete(quicdoq_rate_limiter_t* limiter);
+/* Returns 0 if the query is allowed, 1 if the prefix is over its limit */
+int quicdoq_rate_limiter_check(quicdoq_rate_limiter_t* limiter, const struct sockaddr* addr, uint64_t current_time);
+
+/* Hedged queries, see quicdoq_add_hedge_server().
+ * The response times of a server are halved when QUICDOQ_HEDGE_MAX_SAMPLES
+ * are counted, so that the hedge delay follows changes in the server latency.
+ */
+#define QUICDOQ_HEDGE_MAX_SAMPLES 1024
+
+typedef struct st_quicdoq_hedge_server_t {
+    struct st_quicdoq_hedge_server_t* next_server;
+    char* sni;
+    struct sockaddr_storage addr;
+    quicdoq_histogram_t response_time;
+} quicdoq_hedge_server_t;
+
+typedef struct st_quicdoq_hedge_t {
+    struct st_quicdoq_hedge_t* next;
+    struct st_quicdoq_hedge_t* previous;
+    quicdoq_query_ctx_t* query_ctx; /* Query posted by the application */
+    quicdoq_hedge_server_t* server;
+    uint64_t start_time;
+    quicdoq_deadline_t hedge_timer; /* Running until the hedge is sent or the query is answered */
+    quicdoq_query_ctx_t* hedge_query_ctx; /* Copy of the query, if sent and not complete */
+    quicdoq_hedge_server_t* hedge_server;
+    uint64_t hedge_start_time;
+    quicdoq_query_return_enum failed_code; /* Final code of the query, if it failed before the hedge */
+    unsigned int is_query_failed : 1;
+    unsigned int is_answered : 1;
+} quicdoq_hedge_t;
+
 /* Quicdoq context */
 typedef struct st_quicdoq_ctx_t {
     picoquic_quic_t* quic; /* The quic context for the DoQ service */
@@ -71,8 +201,67 @@ typedef struct st_quicdoq_ctx_t {
     struct st_quicdoq_cnx_ctx_t* first_cnx; /* First in double linked list of open connections in this context */
     struct st_quicdoq_cnx_ctx_t* last_cnx; /* last in list of open connections in this context */
     uint64_t next_query_id; /* Assign a unique ID to each new context */
+    quicdoq_pending_query_t* first_pending; /* Queries waiting for stream credit */
+    quicdoq_pending_query_t* last_pending;
+    uint16_t pool_max_streams; /* Max queries in flight per client connection */
+    uint16_t pool_max_cnx; /* Max client connections per server and SNI */
+    uint16_t pool_queue_threshold; /* Queue depth that triggers an extra connection */
+    uint64_t pool_keep_alive_interval; /* Keep alive for client connections, 0 if disabled */
+    int is_deleting; /* Set while the context is being deleted */
+    quicdoq_pool_stats_t pool_stats;
+    quicdoq_0rtt_policy_enum early_policy; /* Which queries received in 0-RTT are processed immediately */
+    uint64_t replay_window; /* Duration of replay cache entries */
+    quicdoq_replay_cache_t* replay_cache;
+    quicdoq_0rtt_stats_t early_stats;
+    quicdoq_cdns_t* cdns_log; /* If not NULL, log of the server queries and responses */
+    quicdoq_app_log_t* app_log; /* If not NULL, asynchronous log of the per query events */
+    quicdoq_metrics_shard_t* metrics_shard; /* If not NULL, counters of this context */
+    quicdoq_latency_stats_t latency_stats; /* Server latency per stage */
+    quicdoq_load_budget_t load_budget; /* Limits checked before accepting a new query */
+    quicdoq_load_stats_t load_stats; /* Current load, and queries shed */
+    quicdoq_rate_limiter_t* rate_limiter; /* If not NULL, rate limits per client prefix */
+    quicdoq_tp_profile_t tp_profile; /* Transport parameters of new connections */
+    quicdoq_tp_credit_t tp_credit; /* Current credit, adapted to the traffic in adaptive mode */
+    uint32_t nb_cnx; /* Number of connection contexts */
+    int is_response_priority; /* Send the shortest responses first */
+    uint64_t deadline_budget; /* Time allowed to answer a server query, 0 if no limit */
+    int is_deadline_servfail; /* Answer SERVFAIL to expired server queries instead of resetting the stream */
+    quicdoq_deadline_t** deadline_heap; /* Running deadlines, earliest first */
+    size_t nb_deadlines;
+    size_t deadline_heap_max;
+    quicdoq_hedge_policy_t hedge_policy;
+    quicdoq_hedge_server_t* first_hedge_server; /* Servers declared for hedging */
+    quicdoq_hedge_t* first_hedge; /* Client queries posted to these servers */
+    quicdoq_hedge_stats_t hedge_stats;
 } quicdoq_ctx_t;
 
+/* Text of the per query log events, used for inline logging and by the
+ * asynchronous application log */
+#define QUICDOQ_LOG_FMT_RESPONSE "Response #%" PRIu64 " received at cnx time: %" PRIu64 "us.\n"
+#define QUICDOQ_LOG_FMT_REFUSED "Query #%" PRIu64 " refused with EDE 0x%" PRIx64 " at cnx time: %" PRIu64 "us.\n"
+#define QUICDOQ_LOG_FMT_MALFORMED "Quicdoq: Malformed query on stream #%" PRIu64 ".\n"
+#define QUICDOQ_LOG_FMT_REPLAY "Quicdoq: Early query on stream #%" PRIu64 " is a replay.\n"
+#define QUICDOQ_LOG_FMT_EXPIRED "Query #%" PRIu64 " expired at cnx time: %" PRIu64 "us.\n"
+
+/* Indexes shared by the producer and the consumer of the single producer,
+ * single consumer rings of the application log and of the C-DNS log, and
+ * counters of the metrics shards. The load has acquire semantics and the
+ * store has release semantics. */
+#define QUICDOQ_CACHE_LINE 64
+#ifdef _WINDOWS
+#define quicdoq_atomic_load(p) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(p), 0, 0))
+#define quicdoq_atomic_store(p, v) ((void)InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v)))
+#else
+#define quicdoq_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define quicdoq_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+size_t quicdoq_app_log_format(char* text, size_t text_max, quicdoq_log_event_enum event,
+    uint64_t query_id, uint64_t stream_id, uint64_t cnx_time, uint64_t value);
+void quicdoq_log_event(quicdoq_ctx_t* quicdoq_ctx, picoquic_cnx_t* cnx, quicdoq_log_event_enum event,
+    uint64_t query_id, uint64_t stream_id, uint64_t value);
+void quicdoq_count_metric(quicdoq_ctx_t* quicdoq_ctx, quicdoq_metric_enum metric);
+
 /* DoQ stream handling */
 typedef struct st_quicdoq_stream_ctx_t {
     uint64_t stream_id;
@@ -83,8 +272,17 @@ typedef struct st_quicdoq_stream_ctx_t {
     size_t bytes_sent;
     size_t bytes_received;
     uint16_t length_received;
+    uint16_t shed_ede; /* Extended DNS error of the refusal if the query is shed */
+    uint64_t stage_time[quicdoq_stage_max]; /* Time at which the server query reached each stage */
+    unsigned int stage_mask; /* Stages for which the time is set */
+    uint8_t priority; /* Priority of the response stream, 0 if not set */
+    quicdoq_deadline_t deadline; /* Running until the response is posted or received */
 
     unsigned int client_mode : 1;
+    unsigned int is_deferred : 1; /* Early query waiting for the handshake to complete */
+    unsigned int is_shed : 1; /* Query rejected because the server is over its load budget */
+    unsigned int is_reset : 1; /* Stream reset by the server, remaining data is ignored */
+    unsigned int is_rate_limited : 1; /* Query rejected because the client prefix is over its rate */
 } quicdoq_stream_ctx_t;
 
 quicdoq_stream_ctx_t* quicdoq_find_or_create_stream(
@@ -94,6 +292,30 @@ quicdoq_stream_ctx_t* quicdoq_find_or_create_stream(
 
 void quicdoq_delete_stream_ctx(quicdoq_cnx_ctx_t* cnx_ctx, quicdoq_stream_ctx_t* stream_ctx);
 
+quicdoq_cnx_ctx_t* quicdoq_find_cnx_ctx(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, uint64_t affinity);
+quicdoq_cnx_ctx_t* quicdoq_create_client_cnx(quicdoq_ctx_t* quicdoq_ctx, char const* sni, struct sockaddr* addr, uint64_t affinity);
+void quicdoq_pool_drain(quicdoq_cnx_ctx_t* cnx_ctx);
+/* Remove a client query from the pool or abandon its stream, without callback.
+ * Returns -1 if the query is not known. */
+int quicdoq_client_withdraw_query(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx);
+/* Start or restart a deadline, returns -1 if memory is lacking. Stop a
+ * deadline, if it is running. */
+int quicdoq_deadline_start(quicdoq_ctx_t* quicdoq_ctx, quicdoq_deadline_t* entry);
+void quicdoq_deadline_stop(quicdoq_ctx_t* quicdoq_ctx, quicdoq_deadline_t* entry);
+
+/* Hedged queries: track the queries posted to the hedge servers, deliver
+ * the client callbacks, send a hedge when its timer expires and cancel the hedge
+ * of a query. quicdoq_hedge_prepare_post() is called before posting a query,
+ * and quicdoq_hedge_post_failed() if the post fails. quicdoq_hedge_cancel()
+ * returns 1 if the query already failed and was only waiting for its hedge. */
+void quicdoq_hedge_prepare_post(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx, uint64_t current_time);
+void quicdoq_hedge_post_failed(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx);
+int quicdoq_hedge_callback(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_return_enum callback_code,
+    quicdoq_query_ctx_t* query_ctx, uint64_t current_time);
+void quicdoq_hedge_timer_expired(quicdoq_ctx_t* quicdoq_ctx, quicdoq_hedge_t* hedge, uint64_t current_time);
+int quicdoq_hedge_cancel(quicdoq_ctx_t* quicdoq_ctx, quicdoq_query_ctx_t* query_ctx);
+void quicdoq_hedge_clear(quicdoq_ctx_t* quicdoq_ctx);
+
 int quicdoq_callback(picoquic_cnx_t* cnx,
     uint64_t stream_id, uint8_t* bytes, size_t length,
     picoquic_call_back_event_t fin_or_event, void* callback_ctx, void* v_stream_ctx);
@@ -104,10 +326,27 @@ int quicdoq_callback_data(picoquic_cnx_t* cnx, quicdoq_stream_ctx_t* stream_ctx,
 int quicdoq_callback_prepare_to_send(picoquic_cnx_t* cnx, uint64_t stream_id, quicdoq_stream_ctx_t* stream_ctx,
     void* bytes, size_t length, quicdoq_cnx_ctx_t* cnx_ctx);
 
-/* Set the parameters to the preferred DoQ values for the client */
-void quicdoq_set_tp(picoquic_cnx_t* cnx);
-/* Set default transport parameters to adequate value for quicdoq server. */
+/* Set the parameters of a client connection per the transport profile */
+void quicdoq_set_tp(quicdoq_ctx_t* quicdoq_ctx, picoquic_cnx_t* cnx);
+/* Set default transport parameters of the server per the transport profile */
 int quicdoq_set_default_tp(quicdoq_ctx_t* quicdoq_ctx);
+/* Adaptive credit: account for a message received on the connection, and
+ * open the credit of a new client stream */
+void quicdoq_tp_message_received(quicdoq_cnx_ctx_t* cnx_ctx, size_t message_size);
+void quicdoq_tp_open_stream_credit(quicdoq_cnx_ctx_t* cnx_ctx, uint64_t stream_id);
+/* Conversion between a number of streams and the stream limit of picoquic's
+ * transport parameters, see quicdoq_tp.c */
+uint64_t quicdoq_tp_stream_limit_from_count(uint64_t nb_streams);
+uint64_t quicdoq_tp_stream_count_from_limit(uint64_t stream_limit);
+
+/* DNS response codes used in responses formatted by quicdoq */
+#define QUICDOQ_RCODE_SERVFAIL 2
+#define QUICDOQ_RCODE_REFUSED 5
+
+/* Priority of a response stream, lower values are sent first */
+#define QUICDOQ_PRIORITY_MIN_SIZE 512
+#define QUICDOQ_PRIORITY_NB_CLASSES 8
+uint8_t quicdoq_response_priority(size_t remaining_bytes, uint64_t age);
 
 /* Verify that transport parameters have the expected value */
 int quicdoq_check_tp(quicdoq_cnx_ctx_t* cnx_ctx, picoquic_cnx_t* cnx);
@@ -134,6 +373,7 @@ typedef struct st_quicdoq_udp_ctx_t {
     struct sockaddr_storage udp_addr;
     struct sockaddr_storage local_addr;
     int if_index;
+    int is_connected; /* Backend reached through a connected socket, no address tracking */
 
     quicdog_udp_queued_t* first_query;
     quicdog_udp_queued_t* last_query;
@@ -146,6 +386,24 @@ typedef struct st_quicdoq_udp_ctx_t {
     uint16_t next_id;
 } quicdoq_udp_ctx_t;
 
+/* Perfect hash of the RR names, see quicdoq_util.c */
+#define QUICDOQ_RR_HASH_BUCKETS 32
+#define QUICDOQ_RR_TYPE_INDEX_MAX 261
+
+extern const quicdoq_rr_entry_t rr_table[];
+extern const size_t nb_rr_table;
+extern const uint8_t rr_hash_displacement[QUICDOQ_RR_HASH_BUCKETS];
+extern const uint8_t rr_hash_index[];
+extern const uint8_t rr_type_index[QUICDOQ_RR_TYPE_INDEX_MAX];
+
+uint32_t quicdoq_rr_hash(char const* rr_name, uint32_t seed);
+
+/* Byte per byte versions of the name functions, for tests and benchmarks */
+uint8_t* quicdoq_normalize_name_part_scalar(size_t length, const uint8_t* value,
+    uint8_t* normalized, uint8_t* normalized_max);
+size_t quicdoq_fold_dns_name_scalar(const uint8_t* packet, size_t length, size_t start,
+    uint8_t* folded, size_t folded_max, size_t* folded_length, uint64_t* name_hash);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,438 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#ifndef _WINDOWS
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Metrics registry.
+ *
+ * Each shard is written by a single thread, so the increment does not need
+ * an atomic read-modify-write: the owner reads its own counter and stores
+ * the new value. The store and the loads done by the readers use
+ * quicdoq_atomic_store and quicdoq_atomic_load, so a reader never sees a
+ * torn value, including on 32 bit targets. The shards are
+ * padded so that the counters of different threads do not share a cache
+ * line.
+ *
+ * The export thread formats a snapshot at each interval. Files are written
+ * under a temporary name and then renamed, so that a collector never reads
+ * a partial file. Unix sockets receive one connection per export.
+ */
+
+#define QUICDOQ_METRICS_LINE_OVERHEAD 96 /* Fixed text of the three lines of a metric, and a 20 digit value */
+#define QUICDOQ_METRICS_WAIT_MAX 100000
+
+typedef struct st_quicdoq_metrics_shard_t {
+    uint8_t head_pad[QUICDOQ_CACHE_LINE];
+    uint64_t counter[quicdoq_metric_max];
+    struct st_quicdoq_metrics_shard_t* next_shard;
+    uint8_t tail_pad[QUICDOQ_CACHE_LINE];
+} quicdoq_metrics_shard_t;
+
+typedef struct st_quicdoq_metrics_t {
+    picoquic_mutex_t mutex;
+    quicdoq_metrics_shard_t* first_shard;
+    quicdoq_metrics_shard_t* last_shard;
+    char* export_target;
+    char* export_temp;
+    char* export_text;
+    size_t export_text_max;
+    uint64_t export_interval;
+    picoquic_event_t event;
+    picoquic_thread_t thread;
+    int is_thread_started;
+    int is_closing;
+} quicdoq_metrics_t;
+
+typedef struct st_quicdoq_metric_desc_t {
+    char const* name;
+    char const* help;
+} quicdoq_metric_desc_t;
+
+static const quicdoq_metric_desc_t quicdoq_metric_desc[quicdoq_metric_max] = {
+    { "queries_received", "Queries received by the server." },
+    { "responses_sent", "Responses posted by the server application." },
+    { "queries_refused", "Queries refused by the server application." },
+    { "responses_cancelled", "Responses cancelled by the server application." },
+    { "queries_malformed", "Queries that could not be parsed." },
+    { "queries_deferred", "Queries received in 0-RTT and held until the handshake completes." },
+    { "queries_replayed", "Queries received in 0-RTT and found in the replay cache." },
+    { "queries_shed", "Queries reset or refused because the server was over its load budget." },
+    { "queries_rate_limited", "Queries reset or refused because the client prefix was over its rate limit." },
+    { "streams_reset", "Streams reset or stopped by the peer." },
+    { "queries_sent", "Queries posted by the client application." },
+    { "queries_cancelled", "Queries cancelled by the client application." },
+    { "responses_received", "Responses received by the client." },
+    { "queries_failed", "Client queries that failed." },
+    { "connections_opened", "Connections created." },
+    { "connections_closed", "Connections closed." },
+    { "protocol_errors", "Streams or connections closed on protocol errors." },
+    { "relay_queries", "Queries passed to the UDP relay." },
+    { "relay_packets_sent", "UDP packets sent by the relay." },
+    { "relay_retransmits", "UDP packets sent again by the relay after a timer." },
+    { "relay_responses", "UDP responses passed back by the relay." },
+    { "relay_timeouts", "Relayed queries that received no UDP response." },
+    { "relay_errors", "Relayed queries that failed for other reasons." },
+    { "relay_cancelled", "Relayed queries cancelled by the client before the UDP response." },
+    { "relay_packets_wasted", "UDP packets sent by the relay for queries later cancelled." },
+    { "queries_expired", "Queries abandoned at their deadline, by the client or the server." },
+    { "hedges_sent", "Copies of client queries sent to a second server." },
+    { "hedges_won", "Client queries first answered by the second server." },
+    { "relay_socket_errors", "Receive errors on the socket connected to the backend server." }
+};
+
+char const* quicdoq_metric_name(quicdoq_metric_enum metric)
+{
+    return ((unsigned int)metric < quicdoq_metric_max) ? quicdoq_metric_desc[metric].name : NULL;
+}
+
+quicdoq_metrics_t* quicdoq_metrics_create()
+{
+    quicdoq_metrics_t* metrics = (quicdoq_metrics_t*)malloc(sizeof(quicdoq_metrics_t));
+
+    if (metrics != NULL) {
+        memset(metrics, 0, sizeof(quicdoq_metrics_t));
+        if (picoquic_create_mutex(&metrics->mutex) != 0) {
+            free(metrics);
+            metrics = NULL;
+        }
+    }
+
+    return metrics;
+}
+
+quicdoq_metrics_shard_t* quicdoq_metrics_add_shard(quicdoq_metrics_t* metrics)
+{
+    quicdoq_metrics_shard_t* shard = (quicdoq_metrics_shard_t*)malloc(sizeof(quicdoq_metrics_shard_t));
+
+    if (shard != NULL) {
+        memset(shard, 0, sizeof(quicdoq_metrics_shard_t));
+        picoquic_lock_mutex(&metrics->mutex);
+        if (metrics->last_shard == NULL) {
+            metrics->first_shard = shard;
+        }
+        else {
+            metrics->last_shard->next_shard = shard;
+        }
+        metrics->last_shard = shard;
+        picoquic_unlock_mutex(&metrics->mutex);
+    }
+
+    return shard;
+}
+
+void quicdoq_metrics_increment(quicdoq_metrics_shard_t* shard, quicdoq_metric_enum metric, uint64_t value)
+{
+    if ((unsigned int)metric < quicdoq_metric_max) {
+        quicdoq_atomic_store(&shard->counter[metric], shard->counter[metric] + value);
+    }
+}
+
+void quicdoq_metrics_snapshot(quicdoq_metrics_t* metrics, quicdoq_metrics_snapshot_t* snapshot)
+{
+    quicdoq_metrics_shard_t* shard;
+
+    memset(snapshot, 0, sizeof(quicdoq_metrics_snapshot_t));
+    picoquic_lock_mutex(&metrics->mutex);
+    shard = metrics->first_shard;
+    while (shard != NULL) {
+        for (int i = 0; i < quicdoq_metric_max; i++) {
+            snapshot->counter[i] += quicdoq_atomic_load(&shard->counter[i]);
+        }
+        shard = shard->next_shard;
+    }
+    picoquic_unlock_mutex(&metrics->mutex);
+}
+
+/* Format the snapshot as Prometheus counters. Returns -1 if the text does not fit. */
+int quicdoq_metrics_format(const quicdoq_metrics_snapshot_t* snapshot, char* text, size_t text_max, size_t* text_length)
+{
+    int ret = 0;
+
+    *text_length = 0;
+    for (int i = 0; ret == 0 && i < quicdoq_metric_max; i++) {
+        size_t line_length = 0;
+
+        ret = picoquic_sprintf(text + *text_length, text_max - *text_length, &line_length,
+            "# HELP quicdoq_%s_total %s\n# TYPE quicdoq_%s_total counter\nquicdoq_%s_total %" PRIu64 "\n",
+            quicdoq_metric_desc[i].name, quicdoq_metric_desc[i].help, quicdoq_metric_desc[i].name,
+            quicdoq_metric_desc[i].name, snapshot->counter[i]);
+        if (ret == 0) {
+            *text_length += line_length;
+        }
+    }
+
+    return ret;
+}
+
+static int quicdoq_metrics_export_file(quicdoq_metrics_t* metrics, const char* text, size_t text_length)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(metrics->export_temp, "w");
+
+    if (F == NULL) {
+        ret = -1;
+    }
+    else {
+        if (fwrite(text, 1, text_length, F) != text_length) {
+            ret = -1;
+        }
+        (void)picoquic_file_close(F);
+#ifdef _WINDOWS
+        /* Rename does not replace an existing file on Windows */
+        (void)remove(metrics->export_target);
+#endif
+        if (ret == 0 && rename(metrics->export_temp, metrics->export_target) != 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int quicdoq_metrics_export_socket(quicdoq_metrics_t* metrics, const char* text, size_t text_length)
+{
+    int ret = -1;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(metrics);
+    UNREFERENCED_PARAMETER(text);
+    UNREFERENCED_PARAMETER(text_length);
+#else
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, metrics->export_target, sizeof(addr.sun_path) - 1);
+
+    if (fd >= 0) {
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            size_t sent = 0;
+
+            while (sent < text_length) {
+                ssize_t n = send(fd, text + sent, text_length - sent, flags);
+                if (n <= 0) {
+                    break;
+                }
+                sent += (size_t)n;
+            }
+            if (sent == text_length) {
+                ret = 0;
+            }
+        }
+        close(fd);
+    }
+#endif
+    return ret;
+}
+
+/* Size of the text of all metrics, computed from the metric descriptions
+ * so that the export buffer grows with the list of metrics. */
+static size_t quicdoq_metrics_text_max()
+{
+    size_t text_max = 1;
+
+    for (int i = 0; i < quicdoq_metric_max; i++) {
+        text_max += 3 * strlen(quicdoq_metric_desc[i].name) + strlen(quicdoq_metric_desc[i].help) +
+            QUICDOQ_METRICS_LINE_OVERHEAD;
+    }
+
+    return text_max;
+}
+
+static void quicdoq_metrics_export(quicdoq_metrics_t* metrics)
+{
+    quicdoq_metrics_snapshot_t snapshot;
+    size_t text_length = 0;
+    int ret;
+
+    quicdoq_metrics_snapshot(metrics, &snapshot);
+    ret = quicdoq_metrics_format(&snapshot, metrics->export_text, metrics->export_text_max, &text_length);
+    if (ret == 0) {
+        if (metrics->export_temp == NULL) {
+            ret = quicdoq_metrics_export_socket(metrics, metrics->export_text, text_length);
+        }
+        else {
+            ret = quicdoq_metrics_export_file(metrics, metrics->export_text, text_length);
+        }
+    }
+    if (ret != 0) {
+        DBG_PRINTF("Cannot export the metrics to %s", metrics->export_target);
+    }
+}
+
+#ifdef _WINDOWS
+static DWORD WINAPI quicdoq_metrics_exporter(LPVOID v_metrics)
+#else
+static void* quicdoq_metrics_exporter(void* v_metrics)
+#endif
+{
+    quicdoq_metrics_t* metrics = (quicdoq_metrics_t*)v_metrics;
+    uint64_t next_export_time = 0;
+
+    for (;;) {
+        uint64_t current_time = picoquic_current_time();
+        int is_closing;
+
+        picoquic_lock_mutex(&metrics->mutex);
+        is_closing = metrics->is_closing;
+        picoquic_unlock_mutex(&metrics->mutex);
+
+        if (is_closing || current_time >= next_export_time) {
+            quicdoq_metrics_export(metrics);
+            if (is_closing) {
+                break;
+            }
+            next_export_time = current_time + metrics->export_interval;
+        }
+        else {
+            /* Wait in short steps, so closing is not delayed by a missed signal */
+            uint64_t wait_time = next_export_time - current_time;
+
+            if (wait_time > QUICDOQ_METRICS_WAIT_MAX) {
+                wait_time = QUICDOQ_METRICS_WAIT_MAX;
+            }
+            (void)picoquic_wait_for_event(&metrics->event, wait_time);
+        }
+    }
+
+#ifdef _WINDOWS
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+int quicdoq_metrics_start_export(quicdoq_metrics_t* metrics, char const* target, uint64_t interval)
+{
+    int ret = 0;
+    size_t prefix_length = strlen(QUICDOQ_METRICS_UNIX_PREFIX);
+    int is_socket = (strncmp(target, QUICDOQ_METRICS_UNIX_PREFIX, prefix_length) == 0);
+
+    if (metrics->is_thread_started || metrics->export_target != NULL) {
+        ret = -1;
+    }
+    else if (is_socket) {
+#ifdef _WINDOWS
+        DBG_PRINTF("%s", "Metrics export to Unix sockets is not supported.");
+        ret = -1;
+#else
+        if (strlen(target + prefix_length) >= sizeof(((struct sockaddr_un*)NULL)->sun_path) ||
+            (metrics->export_target = picoquic_string_duplicate(target + prefix_length)) == NULL) {
+            ret = -1;
+        }
+#endif
+    }
+    else {
+        size_t target_length = strlen(target);
+
+        if ((metrics->export_target = picoquic_string_duplicate(target)) == NULL ||
+            (metrics->export_temp = (char*)malloc(target_length + 5)) == NULL) {
+            ret = -1;
+        }
+        else {
+            memcpy(metrics->export_temp, target, target_length);
+            memcpy(metrics->export_temp + target_length, ".tmp", 5);
+        }
+    }
+
+    if (ret == 0) {
+        metrics->export_text_max = quicdoq_metrics_text_max();
+        if ((metrics->export_text = (char*)malloc(metrics->export_text_max)) == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        metrics->export_interval = (interval == 0) ? QUICDOQ_METRICS_DEFAULT_EXPORT_INTERVAL : interval;
+        if (picoquic_create_event(&metrics->event) != 0) {
+            ret = -1;
+        }
+        else if (picoquic_create_thread(&metrics->thread, quicdoq_metrics_exporter, metrics) != 0) {
+            picoquic_delete_event(&metrics->event);
+            ret = -1;
+        }
+        else {
+            metrics->is_thread_started = 1;
+        }
+    }
+
+    if (ret != 0) {
+        if (metrics->export_target != NULL) {
+            free(metrics->export_target);
+            metrics->export_target = NULL;
+        }
+        if (metrics->export_temp != NULL) {
+            free(metrics->export_temp);
+            metrics->export_temp = NULL;
+        }
+        if (metrics->export_text != NULL) {
+            free(metrics->export_text);
+            metrics->export_text = NULL;
+        }
+    }
+
+    return ret;
+}
+
+void quicdoq_metrics_delete(quicdoq_metrics_t* metrics)
+{
+    if (metrics->is_thread_started) {
+        picoquic_lock_mutex(&metrics->mutex);
+        metrics->is_closing = 1;
+        picoquic_unlock_mutex(&metrics->mutex);
+        picoquic_signal_event(&metrics->event);
+        picoquic_delete_thread(&metrics->thread);
+        picoquic_delete_event(&metrics->event);
+    }
+    if (metrics->export_target != NULL) {
+        free(metrics->export_target);
+    }
+    if (metrics->export_temp != NULL) {
+        free(metrics->export_temp);
+    }
+    if (metrics->export_text != NULL) {
+        free(metrics->export_text);
+    }
+    while (metrics->first_shard != NULL) {
+        quicdoq_metrics_shard_t* shard = metrics->first_shard;
+        metrics->first_shard = shard->next_shard;
+        free(shard);
+    }
+    picoquic_delete_mutex(&metrics->mutex);
+    free(metrics);
+}
@@ -0,0 +1,314 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Token bucket rate limiting per client prefix.
+ *
+ * The limiter is checked when a server stream opens, before the query
+ * buffers are allocated. The table is allocated once, when rate limiting
+ * is configured, and entries are reused in place, so checking a query
+ * costs a keyed hash and at most QUICDOQ_RATE_LIMIT_PROBES comparisons.
+ */
+
+static void quicdoq_rate_limit_mask(uint8_t* key, const uint8_t* addr, size_t addr_length, uint8_t prefix_length)
+{
+    size_t nb_bytes = prefix_length / 8;
+    uint8_t nb_bits = prefix_length % 8;
+
+    if (nb_bytes >= addr_length) {
+        memcpy(key, addr, addr_length);
+    }
+    else {
+        memcpy(key, addr, nb_bytes);
+        if (nb_bits > 0) {
+            key[nb_bytes] = addr[nb_bytes] & (uint8_t)(0xFF << (8 - nb_bits));
+        }
+    }
+}
+
+/* Build the bucket key, family then masked prefix. IPv4 addresses mapped
+ * in IPv6 are treated as IPv4, so dual stack sockets share the buckets.
+ * Returns -1 if the address family is not supported. */
+static int quicdoq_rate_limit_key(quicdoq_rate_limiter_t* limiter, const struct sockaddr* addr, uint8_t* key)
+{
+    static const uint8_t v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+    int ret = 0;
+
+    memset(key, 0, sizeof(((quicdoq_rate_bucket_t*)NULL)->key));
+    if (addr == NULL) {
+        ret = -1;
+    }
+    else if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+        key[0] = 4;
+        quicdoq_rate_limit_mask(key + 1, (const uint8_t*)&addr4->sin_addr, 4, limiter->config.ipv4_prefix_length);
+    }
+    else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)addr;
+        const uint8_t* bytes = (const uint8_t*)&addr6->sin6_addr;
+
+        if (memcmp(bytes, v4_mapped, sizeof(v4_mapped)) == 0) {
+            key[0] = 4;
+            quicdoq_rate_limit_mask(key + 1, bytes + 12, 4, limiter->config.ipv4_prefix_length);
+        }
+        else {
+            key[0] = 6;
+            quicdoq_rate_limit_mask(key + 1, bytes, 16, limiter->config.ipv6_prefix_length);
+        }
+    }
+    else {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* SipHash-2-4 of the key. An unkeyed hash would let a client pick prefixes
+ * that fall in the probe window of another one, and evict it repeatedly. */
+#define QUICDOQ_SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define QUICDOQ_SIP_ROUND(v0, v1, v2, v3) \
+    v0 += v1; v1 = QUICDOQ_SIP_ROTL(v1, 13); v1 ^= v0; v0 = QUICDOQ_SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = QUICDOQ_SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = QUICDOQ_SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = QUICDOQ_SIP_ROTL(v1, 17); v1 ^= v2; v2 = QUICDOQ_SIP_ROTL(v2, 32)
+
+static size_t quicdoq_rate_limit_hash(const uint64_t* hash_key, const uint8_t* key, size_t key_length)
+{
+    uint64_t v0 = hash_key[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = hash_key[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = hash_key[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = hash_key[1] ^ 0x7465646279746573ull;
+    uint64_t m;
+    size_t i = 0;
+
+    for (; i + 8 <= key_length; i += 8) {
+        m = 0;
+        for (int j = 0; j < 8; j++) {
+            m |= ((uint64_t)key[i + j]) << (8 * j);
+        }
+        v3 ^= m;
+        QUICDOQ_SIP_ROUND(v0, v1, v2, v3);
+        QUICDOQ_SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    m = ((uint64_t)key_length) << 56;
+    for (int j = 0; i + j < key_length; j++) {
+        m |= ((uint64_t)key[i + j]) << (8 * j);
+    }
+    v3 ^= m;
+    QUICDOQ_SIP_ROUND(v0, v1, v2, v3);
+    QUICDOQ_SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v2 ^= 0xff;
+    for (int r = 0; r < 4; r++) {
+        QUICDOQ_SIP_ROUND(v0, v1, v2, v3);
+    }
+
+    return (size_t)(v0 ^ v1 ^ v2 ^ v3);
+}
+
+quicdoq_rate_limiter_t* quicdoq_rate_limiter_create(quicdoq_rate_limit_t const* config)
+{
+    quicdoq_rate_limiter_t* limiter = NULL;
+
+    if (config != NULL && config->queries_per_second > 0) {
+        limiter = (quicdoq_rate_limiter_t*)malloc(sizeof(quicdoq_rate_limiter_t));
+        if (limiter != NULL) {
+            uint32_t max_prefixes = (config->max_prefixes == 0) ? QUICDOQ_RATE_LIMIT_DEFAULT_MAX_PREFIXES : config->max_prefixes;
+
+            memset(limiter, 0, sizeof(quicdoq_rate_limiter_t));
+            limiter->config = *config;
+            picoquic_public_random(limiter->hash_key, sizeof(limiter->hash_key));
+            if (limiter->config.burst == 0) {
+                limiter->config.burst = 1;
+            }
+            if (limiter->config.ipv4_prefix_length == 0 || limiter->config.ipv4_prefix_length > 32) {
+                limiter->config.ipv4_prefix_length = QUICDOQ_RATE_LIMIT_DEFAULT_IPV4_PREFIX;
+            }
+            if (limiter->config.ipv6_prefix_length == 0 || limiter->config.ipv6_prefix_length > 128) {
+                limiter->config.ipv6_prefix_length = QUICDOQ_RATE_LIMIT_DEFAULT_IPV6_PREFIX;
+            }
+            limiter->full_refill_time = (limiter->config.burst * QUICDOQ_RATE_LIMIT_TOKEN) / limiter->config.queries_per_second;
+            limiter->nb_slots = QUICDOQ_RATE_LIMIT_PROBES;
+            while (limiter->nb_slots < max_prefixes) {
+                limiter->nb_slots *= 2;
+            }
+            limiter->slots = (quicdoq_rate_bucket_t*)malloc(limiter->nb_slots * sizeof(quicdoq_rate_bucket_t));
+            if (limiter->slots == NULL) {
+                free(limiter);
+                limiter = NULL;
+            }
+            else {
+                memset(limiter->slots, 0, limiter->nb_slots * sizeof(quicdoq_rate_bucket_t));
+            }
+        }
+    }
+
+    return limiter;
+}
+
+void quicdoq_rate_limiter_delete(quicdoq_rate_limiter_t* limiter)
+{
+    if (limiter->slots != NULL) {
+        free(limiter->slots);
+    }
+    free(limiter);
+}
+
+int quicdoq_rate_limiter_check(quicdoq_rate_limiter_t* limiter, const struct sockaddr* addr, uint64_t current_time)
+{
+    uint8_t key[sizeof(((quicdoq_rate_bucket_t*)NULL)->key)];
+    quicdoq_rate_bucket_t* bucket = NULL;
+    quicdoq_rate_bucket_t* reusable = NULL;
+    quicdoq_rate_bucket_t* oldest = NULL;
+    uint64_t full_tokens = limiter->config.burst * QUICDOQ_RATE_LIMIT_TOKEN;
+    size_t index;
+    int is_limited = 0;
+    int is_evicted = 0;
+
+    if (quicdoq_rate_limit_key(limiter, addr, key) != 0) {
+        /* Unknown family: not rate limited */
+        limiter->stats.nb_allowed++;
+        return 0;
+    }
+
+    index = quicdoq_rate_limit_hash(limiter->hash_key, key, sizeof(key));
+    for (int i = 0; i < QUICDOQ_RATE_LIMIT_PROBES; i++) {
+        quicdoq_rate_bucket_t* slot = &limiter->slots[(index + i) & (limiter->nb_slots - 1)];
+
+        if (!slot->is_used) {
+            if (reusable == NULL) {
+                reusable = slot;
+            }
+        }
+        else if (memcmp(slot->key, key, sizeof(key)) == 0) {
+            bucket = slot;
+            break;
+        }
+        else {
+            if (reusable == NULL && current_time >= slot->last_time + limiter->full_refill_time) {
+                /* This bucket is full again, forgetting it loses nothing */
+                reusable = slot;
+            }
+            if (oldest == NULL || slot->last_time < oldest->last_time) {
+                oldest = slot;
+            }
+        }
+    }
+
+    if (bucket != NULL) {
+        /* Refill the bucket for the time elapsed since the last query */
+        uint64_t elapsed = (current_time > bucket->last_time) ? current_time - bucket->last_time : 0;
+
+        if (elapsed >= limiter->full_refill_time) {
+            bucket->tokens = full_tokens;
+        }
+        else {
+            bucket->tokens += elapsed * limiter->config.queries_per_second;
+            if (bucket->tokens > full_tokens) {
+                bucket->tokens = full_tokens;
+            }
+        }
+        bucket->last_time = current_time;
+    }
+    else {
+        if (reusable != NULL) {
+            bucket = reusable;
+            if (!bucket->is_used) {
+                bucket->is_used = 1;
+                limiter->stats.nb_prefixes++;
+            }
+        }
+        else {
+            bucket = oldest;
+        }
+        memcpy(bucket->key, key, sizeof(key));
+        if (bucket != reusable) {
+            /* All the entries near the hash position are active. Reuse the
+             * least recently used, but start the new bucket empty and refill
+             * it for the time since that entry was last used, so prefixes
+             * that keep evicting each other do not get a fresh burst. */
+            uint64_t elapsed = (current_time > bucket->last_time) ? current_time - bucket->last_time : 0;
+
+            bucket->tokens = elapsed * limiter->config.queries_per_second;
+            if (bucket->tokens > full_tokens) {
+                bucket->tokens = full_tokens;
+            }
+            is_evicted = 1;
+            limiter->stats.nb_evicted++;
+        }
+        else {
+            bucket->tokens = full_tokens;
+        }
+        bucket->last_time = current_time;
+    }
+
+    if (bucket->tokens >= QUICDOQ_RATE_LIMIT_TOKEN) {
+        bucket->tokens -= QUICDOQ_RATE_LIMIT_TOKEN;
+        limiter->stats.nb_allowed++;
+    }
+    else {
+        is_limited = 1;
+        limiter->stats.nb_limited++;
+        if (is_evicted) {
+            limiter->stats.nb_saturated++;
+        }
+    }
+
+    return is_limited;
+}
+
+int quicdoq_set_rate_limit(quicdoq_ctx_t* quicdoq_ctx, quicdoq_rate_limit_t const* config)
+{
+    int ret = 0;
+
+    if (quicdoq_ctx->rate_limiter != NULL) {
+        quicdoq_rate_limiter_delete(quicdoq_ctx->rate_limiter);
+        quicdoq_ctx->rate_limiter = NULL;
+    }
+
+    if (config != NULL && config->queries_per_second > 0) {
+        quicdoq_ctx->rate_limiter = quicdoq_rate_limiter_create(config);
+        if (quicdoq_ctx->rate_limiter == NULL) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+void quicdoq_get_rate_limit_stats(quicdoq_ctx_t* quicdoq_ctx, quicdoq_rate_limit_stats_t* stats)
+{
+    if (quicdoq_ctx->rate_limiter == NULL) {
+        memset(stats, 0, sizeof(quicdoq_rate_limit_stats_t));
+    }
+    else {
+        *stats = quicdoq_ctx->rate_limiter->stats;
+    }
+}
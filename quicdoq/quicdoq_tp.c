@@ -0,0 +1,229 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Transport parameter profiles.
+ *
+ * The credit is adapted when a message is received, i.e., at most once per
+ * query. The server transport parameters are shared by all its connections,
+ * so they are only reset when the credit changes. Connections already
+ * established keep the credit that they started with, but clients open the
+ * credit of each new stream to the expected size of the response.
+ */
+
+/* picoquic keeps the stream limits of the transport parameters
+ * (initial_max_stream_id_bidir) as the largest stream ID that the peer may
+ * open, while the wire carries a number of streams. It encodes a local limit
+ * as the count stream_id / 4 + 1, omitted if the limit is 0, and decodes the
+ * count N of the peer as the ID of its Nth stream, or UINT64_MAX if N is 0.
+ * The profile and the pool use counts, converted here in both directions. */
+uint64_t quicdoq_tp_stream_limit_from_count(uint64_t nb_streams)
+{
+    return (nb_streams == 0) ? 0 : 4 * nb_streams - 1;
+}
+
+uint64_t quicdoq_tp_stream_count_from_limit(uint64_t stream_limit)
+{
+    return (stream_limit == UINT64_MAX) ? 0 : stream_limit / 4 + 1;
+}
+
+void quicdoq_get_default_tp_profile(quicdoq_tp_profile_t* profile)
+{
+    memset(profile, 0, sizeof(quicdoq_tp_profile_t));
+    profile->initial_max_data = QUICDOQ_TP_DEFAULT_MAX_DATA;
+    profile->initial_max_stream_data = QUICDOQ_MAX_STREAM_DATA;
+    profile->max_bidir_streams = QUICDOQ_TP_DEFAULT_MAX_STREAMS;
+    profile->max_idle_timeout = QUICDOQ_TP_DEFAULT_IDLE_TIMEOUT;
+    profile->max_ack_delay = QUICDOQ_TP_DEFAULT_ACK_DELAY;
+    profile->is_adaptive = 0;
+    profile->adaptive_max_data = QUICDOQ_TP_DEFAULT_ADAPTIVE_MAX_DATA;
+    profile->adaptive_memory_limit = 0;
+}
+
+int quicdoq_set_tp_profile(quicdoq_ctx_t* quicdoq_ctx, quicdoq_tp_profile_t const* profile)
+{
+    int ret = 0;
+    quicdoq_tp_profile_t p = *profile;
+    quicdoq_tp_profile_t d;
+
+    quicdoq_get_default_tp_profile(&d);
+    if (p.initial_max_data == 0) {
+        p.initial_max_data = d.initial_max_data;
+    }
+    if (p.initial_max_stream_data == 0) {
+        p.initial_max_stream_data = d.initial_max_stream_data;
+    }
+    if (p.max_bidir_streams == 0) {
+        p.max_bidir_streams = d.max_bidir_streams;
+    }
+    if (p.max_idle_timeout == 0) {
+        p.max_idle_timeout = d.max_idle_timeout;
+    }
+    if (p.max_ack_delay == 0) {
+        p.max_ack_delay = d.max_ack_delay;
+    }
+    if (p.adaptive_max_data == 0) {
+        p.adaptive_max_data = (d.adaptive_max_data > p.initial_max_data) ? d.adaptive_max_data : p.initial_max_data;
+    }
+
+    if (p.adaptive_max_data < p.initial_max_data || p.initial_max_stream_data < QUICDOQ_MAX_STREAM_DATA) {
+        /* A stream must be able to carry the largest DNS message */
+        ret = -1;
+    }
+    else {
+        quicdoq_ctx->tp_profile = p;
+        memset(&quicdoq_ctx->tp_credit, 0, sizeof(quicdoq_tp_credit_t));
+        quicdoq_ctx->tp_credit.max_data = p.initial_max_data;
+        quicdoq_ctx->tp_credit.stream_data = p.initial_max_stream_data;
+        ret = quicdoq_set_default_tp(quicdoq_ctx);
+    }
+
+    return ret;
+}
+
+void quicdoq_get_tp_credit(quicdoq_ctx_t* quicdoq_ctx, quicdoq_tp_credit_t* credit)
+{
+    *credit = quicdoq_ctx->tp_credit;
+}
+
+static int quicdoq_tp_is_memory_pressure(quicdoq_ctx_t* quicdoq_ctx)
+{
+    int is_pressure = 0;
+
+    if (quicdoq_ctx->tp_profile.adaptive_memory_limit > 0 &&
+        quicdoq_ctx->tp_credit.max_data * quicdoq_ctx->nb_cnx > quicdoq_ctx->tp_profile.adaptive_memory_limit) {
+        is_pressure = 1;
+    }
+    else if (quicdoq_ctx->load_budget.max_buffer_bytes > 0 &&
+        quicdoq_ctx->load_stats.buffer_bytes * 4 > quicdoq_ctx->load_budget.max_buffer_bytes * 3) {
+        is_pressure = 1;
+    }
+
+    return is_pressure;
+}
+
+static uint64_t quicdoq_tp_open_streams(quicdoq_cnx_ctx_t* cnx_ctx)
+{
+    uint64_t nb_streams = 0;
+
+    if (cnx_ctx->is_server) {
+        quicdoq_stream_ctx_t* stream_ctx = cnx_ctx->first_stream;
+
+        while (stream_ctx != NULL) {
+            nb_streams++;
+            stream_ctx = stream_ctx->next_stream;
+        }
+    }
+    else {
+        nb_streams = cnx_ctx->nb_open_streams;
+    }
+
+    return (nb_streams > 0) ? nb_streams : 1;
+}
+
+void quicdoq_tp_message_received(quicdoq_cnx_ctx_t* cnx_ctx, size_t message_size)
+{
+    quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+    quicdoq_tp_profile_t* profile = &quicdoq_ctx->tp_profile;
+    quicdoq_tp_credit_t* credit = &quicdoq_ctx->tp_credit;
+    uint64_t demand;
+    uint64_t max_data = credit->max_data;
+    uint64_t stream_data;
+
+    if (!profile->is_adaptive) {
+        return;
+    }
+
+    if (credit->avg_message_size == 0) {
+        credit->avg_message_size = message_size;
+    }
+    else {
+        credit->avg_message_size = (7 * credit->avg_message_size + message_size) / 8;
+    }
+
+    demand = credit->avg_message_size * quicdoq_tp_open_streams(cnx_ctx) * 2;
+    if (demand < profile->initial_max_data) {
+        demand = profile->initial_max_data;
+    }
+    else if (demand > profile->adaptive_max_data) {
+        demand = profile->adaptive_max_data;
+    }
+
+    credit->is_memory_pressure = quicdoq_tp_is_memory_pressure(quicdoq_ctx);
+    if (credit->is_memory_pressure) {
+        uint64_t share = profile->initial_max_data;
+
+        if (profile->adaptive_memory_limit > 0 && quicdoq_ctx->nb_cnx > 0) {
+            share = profile->adaptive_memory_limit / quicdoq_ctx->nb_cnx;
+        }
+        if (share < profile->initial_max_data) {
+            share = profile->initial_max_data;
+        }
+        if (share < max_data) {
+            max_data = share;
+        }
+    }
+    else if (demand > (max_data * 5) / 4 || demand < max_data / 2) {
+        max_data = demand;
+    }
+
+    stream_data = 2 * credit->avg_message_size;
+    if (stream_data < profile->initial_max_stream_data) {
+        stream_data = profile->initial_max_stream_data;
+    }
+    if (stream_data > QUICDOQ_MAX_STREAM_DATA + 2) {
+        stream_data = QUICDOQ_MAX_STREAM_DATA + 2;
+    }
+    credit->stream_data = stream_data;
+
+    if (max_data != credit->max_data) {
+        if (max_data > credit->max_data) {
+            credit->nb_increases++;
+        }
+        else {
+            credit->nb_decreases++;
+        }
+        credit->max_data = max_data;
+        picoquic_log_app_message(cnx_ctx->cnx, "Adaptive connection credit set to %" PRIu64, max_data);
+        if (cnx_ctx->is_server) {
+            (void)quicdoq_set_default_tp(quicdoq_ctx);
+        }
+    }
+}
+
+void quicdoq_tp_open_stream_credit(quicdoq_cnx_ctx_t* cnx_ctx, uint64_t stream_id)
+{
+    quicdoq_ctx_t* quicdoq_ctx = cnx_ctx->quicdoq_ctx;
+
+    if (!cnx_ctx->is_server && quicdoq_ctx->tp_profile.is_adaptive && !quicdoq_ctx->tp_credit.is_memory_pressure &&
+        quicdoq_ctx->tp_credit.stream_data > quicdoq_ctx->tp_profile.initial_max_stream_data) {
+        (void)picoquic_open_flow_control(cnx_ctx->cnx, stream_id, quicdoq_ctx->tp_credit.stream_data);
+    }
+}
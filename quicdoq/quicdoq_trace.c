@@ -0,0 +1,619 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+
+/* Reading of DNS query traces.
+ *
+ * Two formats are supported:
+ * - pcap files, with Ethernet, Linux cooked, BSD loopback or raw IP link
+ *   types. The reader extracts the UDP packets sent to port 53 that carry
+ *   a DNS query. Fragmented IPv4 packets and IPv6 packets with extension
+ *   headers are ignored.
+ * - dnstap files, i.e., Frame Streams files carrying Dnstap protobuf
+ *   messages. The reader extracts the messages of any of the "query" types
+ *   that include a copy of the query.
+ */
+
+#define QUICDOQ_PCAP_MAGIC_USEC 0xa1b2c3d4
+#define QUICDOQ_PCAP_MAGIC_NSEC 0xa1b23c4d
+#define QUICDOQ_PCAP_LINKTYPE_NULL 0
+#define QUICDOQ_PCAP_LINKTYPE_ETHERNET 1
+#define QUICDOQ_PCAP_LINKTYPE_RAW 101
+#define QUICDOQ_PCAP_LINKTYPE_LINUX_SLL 113
+#define QUICDOQ_PCAP_LINKTYPE_IPV4 228
+#define QUICDOQ_PCAP_LINKTYPE_IPV6 229
+
+#define QUICDOQ_FSTRM_CONTROL_START 2
+#define QUICDOQ_FSTRM_CONTROL_STOP 3
+#define QUICDOQ_DNSTAP_TYPE_MESSAGE 1
+
+#define QUICDOQ_TRACE_MAX_RECORD 0x40000
+#define QUICDOQ_DNS_PORT 53
+
+typedef enum {
+    quicdoq_trace_format_pcap = 0,
+    quicdoq_trace_format_dnstap
+} quicdoq_trace_format_enum;
+
+typedef struct st_quicdoq_trace_t {
+    FILE* F;
+    quicdoq_trace_format_enum format;
+    int is_little_endian; /* pcap file written in little endian order */
+    int is_nsec; /* pcap with nanosecond timestamps */
+    uint32_t link_type;
+    uint8_t* buffer;
+    size_t buffer_size;
+    uint64_t nb_skipped; /* Records larger than the buffer */
+} quicdoq_trace_t;
+
+static uint32_t quicdoq_trace_get32(const uint8_t* bytes, int is_little_endian)
+{
+    uint32_t v;
+
+    if (is_little_endian) {
+        v = ((uint32_t)bytes[3] << 24) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[1] << 8) | bytes[0];
+    }
+    else {
+        v = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    }
+
+    return v;
+}
+
+static uint16_t quicdoq_trace_get16(const uint8_t* bytes)
+{
+    return (uint16_t)((bytes[0] << 8) | bytes[1]);
+}
+
+/* Read a record in the buffer. A record larger than the buffer is read in
+ * chunks, discarded and counted, and the function returns 1. */
+static int quicdoq_trace_read_record(quicdoq_trace_t* trace, size_t length)
+{
+    int ret = 0;
+
+    if (length > trace->buffer_size) {
+        while (ret == 0 && length > 0) {
+            size_t chunk = (length > trace->buffer_size) ? trace->buffer_size : length;
+
+            if (fread(trace->buffer, 1, chunk, trace->F) != chunk) {
+                ret = -1;
+            }
+            length -= chunk;
+        }
+        if (ret == 0) {
+            trace->nb_skipped++;
+            ret = 1;
+        }
+    }
+    else if (length > 0 && fread(trace->buffer, 1, length, trace->F) != length) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/* Extract the DNS query from an IP packet. Returns 0 if the packet is a
+ * UDP packet to port 53 carrying a DNS query. */
+static int quicdoq_trace_parse_ip(const uint8_t* bytes, size_t length, quicdoq_trace_query_t* query)
+{
+    int ret = -1;
+    size_t udp_offset = 0;
+
+    if (length >= 20 && (bytes[0] >> 4) == 4) {
+        size_t header_length = (size_t)(bytes[0] & 0x0F) * 4;
+        size_t ip_length = quicdoq_trace_get16(bytes + 2);
+        uint16_t fragment = quicdoq_trace_get16(bytes + 6);
+
+        if (header_length >= 20 && ip_length >= header_length && ip_length <= length &&
+            bytes[9] == 17 && (fragment & 0x3FFF) == 0) {
+            struct sockaddr_in* addr = (struct sockaddr_in*)&query->source_addr;
+
+            memset(&query->source_addr, 0, sizeof(query->source_addr));
+            addr->sin_family = AF_INET;
+            memcpy(&addr->sin_addr, bytes + 12, 4);
+            udp_offset = header_length;
+            length = ip_length;
+            ret = 0;
+        }
+    }
+    else if (length >= 40 && (bytes[0] >> 4) == 6) {
+        size_t ip_length = 40 + (size_t)quicdoq_trace_get16(bytes + 4);
+
+        if (ip_length <= length && bytes[6] == 17) {
+            struct sockaddr_in6* addr = (struct sockaddr_in6*)&query->source_addr;
+
+            memset(&query->source_addr, 0, sizeof(query->source_addr));
+            addr->sin6_family = AF_INET6;
+            memcpy(&addr->sin6_addr, bytes + 8, 16);
+            udp_offset = 40;
+            length = ip_length;
+            ret = 0;
+        }
+    }
+
+    if (ret == 0) {
+        if (udp_offset + 8 + 12 > length || quicdoq_trace_get16(bytes + udp_offset + 2) != QUICDOQ_DNS_PORT ||
+            (bytes[udp_offset + 8 + 2] & 0x80) != 0) {
+            /* Not a DNS query */
+            ret = -1;
+        }
+        else {
+            uint16_t port = quicdoq_trace_get16(bytes + udp_offset);
+
+            if (query->source_addr.ss_family == AF_INET) {
+                ((struct sockaddr_in*)&query->source_addr)->sin_port = htons(port);
+            }
+            else {
+                ((struct sockaddr_in6*)&query->source_addr)->sin6_port = htons(port);
+            }
+            query->query = bytes + udp_offset + 8;
+            query->query_length = length - udp_offset - 8;
+        }
+    }
+
+    return ret;
+}
+
+/* Skip the link layer header, return the offset of the IP header, or -1. */
+static int quicdoq_trace_parse_link(quicdoq_trace_t* trace, const uint8_t* bytes, size_t length, size_t* ip_offset)
+{
+    int ret = 0;
+    size_t offset = 0;
+    uint16_t ether_type = 0;
+
+    switch (trace->link_type) {
+    case QUICDOQ_PCAP_LINKTYPE_NULL:
+        offset = 4;
+        break;
+    case QUICDOQ_PCAP_LINKTYPE_ETHERNET:
+        offset = 14;
+        if (length >= offset) {
+            ether_type = quicdoq_trace_get16(bytes + 12);
+            while (ether_type == 0x8100 && length >= offset + 4) {
+                /* Skip VLAN tags */
+                ether_type = quicdoq_trace_get16(bytes + offset + 2);
+                offset += 4;
+            }
+            if (ether_type != 0x0800 && ether_type != 0x86DD) {
+                ret = -1;
+            }
+        }
+        break;
+    case QUICDOQ_PCAP_LINKTYPE_LINUX_SLL:
+        offset = 16;
+        break;
+    case QUICDOQ_PCAP_LINKTYPE_RAW:
+    case QUICDOQ_PCAP_LINKTYPE_IPV4:
+    case QUICDOQ_PCAP_LINKTYPE_IPV6:
+        offset = 0;
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+
+    if (ret == 0 && offset > length) {
+        ret = -1;
+    }
+    *ip_offset = offset;
+
+    return ret;
+}
+
+static int quicdoq_trace_open_pcap(quicdoq_trace_t* trace, const uint8_t* header)
+{
+    int ret = 0;
+    uint8_t file_header[24];
+
+    memcpy(file_header, header, 8);
+    if (fread(file_header + 8, 1, 16, trace->F) != 16) {
+        ret = -1;
+    }
+    else {
+        uint32_t magic = quicdoq_trace_get32(file_header, 0);
+
+        if (magic == QUICDOQ_PCAP_MAGIC_USEC || magic == QUICDOQ_PCAP_MAGIC_NSEC) {
+            trace->is_little_endian = 0;
+        }
+        else {
+            magic = quicdoq_trace_get32(file_header, 1);
+            trace->is_little_endian = 1;
+        }
+        trace->is_nsec = (magic == QUICDOQ_PCAP_MAGIC_NSEC);
+        trace->link_type = quicdoq_trace_get32(file_header + 20, trace->is_little_endian) & 0xFFFF;
+        trace->format = quicdoq_trace_format_pcap;
+    }
+
+    return ret;
+}
+
+static int quicdoq_trace_next_pcap(quicdoq_trace_t* trace, quicdoq_trace_query_t* query, int* is_end)
+{
+    int ret = 0;
+    int is_found = 0;
+    uint8_t record_header[16];
+
+    while (ret == 0 && !is_found) {
+        size_t nb_read = fread(record_header, 1, 16, trace->F);
+
+        if (nb_read == 0) {
+            *is_end = 1;
+            break;
+        }
+        else if (nb_read != 16) {
+            ret = -1;
+        }
+        else {
+            uint64_t ts_sec = quicdoq_trace_get32(record_header, trace->is_little_endian);
+            uint64_t ts_frac = quicdoq_trace_get32(record_header + 4, trace->is_little_endian);
+            size_t incl_len = quicdoq_trace_get32(record_header + 8, trace->is_little_endian);
+            size_t ip_offset = 0;
+
+            if ((ret = quicdoq_trace_read_record(trace, incl_len)) > 0) {
+                /* Skipped */
+                ret = 0;
+            }
+            else if (ret == 0 &&
+                quicdoq_trace_parse_link(trace, trace->buffer, incl_len, &ip_offset) == 0 &&
+                quicdoq_trace_parse_ip(trace->buffer + ip_offset, incl_len - ip_offset, query) == 0) {
+                query->timestamp = ts_sec * 1000000ull + ((trace->is_nsec) ? ts_frac / 1000 : ts_frac);
+                is_found = 1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Minimal protobuf decoding, sufficient for the Dnstap messages */
+static const uint8_t* quicdoq_trace_pb_varint(const uint8_t* bytes, const uint8_t* bytes_max, uint64_t* v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (bytes != NULL && bytes < bytes_max) {
+        uint8_t b = *bytes++;
+        if (shift < 64) {
+            *v |= ((uint64_t)(b & 0x7F)) << shift;
+        }
+        shift += 7;
+        if ((b & 0x80) == 0) {
+            return bytes;
+        }
+    }
+
+    return NULL;
+}
+
+static const uint8_t* quicdoq_trace_pb_field(const uint8_t* bytes, const uint8_t* bytes_max,
+    uint64_t* field, int* wire_type, uint64_t* v, const uint8_t** data)
+{
+    uint64_t tag;
+
+    *data = NULL;
+    bytes = quicdoq_trace_pb_varint(bytes, bytes_max, &tag);
+    if (bytes != NULL) {
+        *field = tag >> 3;
+        *wire_type = (int)(tag & 7);
+        switch (*wire_type) {
+        case 0:
+            bytes = quicdoq_trace_pb_varint(bytes, bytes_max, v);
+            break;
+        case 1:
+            if (bytes + 8 > bytes_max) {
+                bytes = NULL;
+            }
+            else {
+                *v = ((uint64_t)quicdoq_trace_get32(bytes + 4, 1) << 32) | quicdoq_trace_get32(bytes, 1);
+                bytes += 8;
+            }
+            break;
+        case 2:
+            bytes = quicdoq_trace_pb_varint(bytes, bytes_max, v);
+            if (bytes != NULL) {
+                if (*v > (uint64_t)(bytes_max - bytes)) {
+                    bytes = NULL;
+                }
+                else {
+                    *data = bytes;
+                    bytes += *v;
+                }
+            }
+            break;
+        case 5:
+            if (bytes + 4 > bytes_max) {
+                bytes = NULL;
+            }
+            else {
+                *v = quicdoq_trace_get32(bytes, 1);
+                bytes += 4;
+            }
+            break;
+        default:
+            bytes = NULL;
+            break;
+        }
+    }
+
+    return bytes;
+}
+
+/* Parse the Dnstap.Message. The query types have odd values: AUTH_QUERY (1),
+ * RESOLVER_QUERY (3), CLIENT_QUERY (5), FORWARDER_QUERY (7), STUB_QUERY (9),
+ * TOOL_QUERY (11), UPDATE_QUERY (13). */
+static int quicdoq_trace_parse_dnstap_message(const uint8_t* bytes, const uint8_t* bytes_max, quicdoq_trace_query_t* query)
+{
+    int ret = 0;
+    uint64_t message_type = 0;
+    uint64_t family = 0;
+    const uint8_t* address = NULL;
+    size_t address_length = 0;
+    uint64_t port = 0;
+    uint64_t time_sec = 0;
+    uint64_t time_nsec = 0;
+
+    query->query = NULL;
+    query->query_length = 0;
+
+    while (ret == 0 && bytes < bytes_max) {
+        uint64_t field;
+        int wire_type;
+        uint64_t v = 0;
+        const uint8_t* data;
+
+        bytes = quicdoq_trace_pb_field(bytes, bytes_max, &field, &wire_type, &v, &data);
+        if (bytes == NULL) {
+            ret = -1;
+        }
+        else {
+            switch (field) {
+            case 1:
+                message_type = v;
+                break;
+            case 2:
+                family = v;
+                break;
+            case 4:
+                address = data;
+                address_length = (size_t)v;
+                break;
+            case 6:
+                port = v;
+                break;
+            case 8:
+                time_sec = v;
+                break;
+            case 9:
+                time_nsec = v;
+                break;
+            case 10:
+                query->query = data;
+                query->query_length = (size_t)v;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    if (ret == 0 && ((message_type & 1) == 0 || query->query == NULL || query->query_length < 12)) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        memset(&query->source_addr, 0, sizeof(query->source_addr));
+        if (family == 1 && address_length == 4) {
+            struct sockaddr_in* addr = (struct sockaddr_in*)&query->source_addr;
+            addr->sin_family = AF_INET;
+            memcpy(&addr->sin_addr, address, 4);
+            addr->sin_port = htons((uint16_t)port);
+        }
+        else if (family == 2 && address_length == 16) {
+            struct sockaddr_in6* addr = (struct sockaddr_in6*)&query->source_addr;
+            addr->sin6_family = AF_INET6;
+            memcpy(&addr->sin6_addr, address, 16);
+            addr->sin6_port = htons((uint16_t)port);
+        }
+        query->timestamp = time_sec * 1000000ull + time_nsec / 1000;
+    }
+
+    return ret;
+}
+
+/* Parse the Dnstap envelope: field 14 is the message, field 15 the type,
+ * 1 for MESSAGE. Encoders write the fields in order, so the type follows
+ * the message. */
+static int quicdoq_trace_parse_dnstap(const uint8_t* bytes, size_t length, quicdoq_trace_query_t* query)
+{
+    int ret = -1;
+    const uint8_t* bytes_max = bytes + length;
+    const uint8_t* message = NULL;
+    size_t message_length = 0;
+    uint64_t dnstap_type = 0;
+
+    while (bytes != NULL && bytes < bytes_max) {
+        uint64_t field;
+        int wire_type;
+        uint64_t v = 0;
+        const uint8_t* data;
+
+        bytes = quicdoq_trace_pb_field(bytes, bytes_max, &field, &wire_type, &v, &data);
+        if (bytes != NULL) {
+            if (field == 14 && wire_type == 2) {
+                message = data;
+                message_length = (size_t)v;
+            }
+            else if (field == 15 && wire_type == 0) {
+                dnstap_type = v;
+            }
+        }
+    }
+
+    if (bytes != NULL && message != NULL && dnstap_type == QUICDOQ_DNSTAP_TYPE_MESSAGE) {
+        ret = quicdoq_trace_parse_dnstap_message(message, message + message_length, query);
+    }
+
+    return ret;
+}
+
+static int quicdoq_trace_open_dnstap(quicdoq_trace_t* trace, const uint8_t* header)
+{
+    int ret = 0;
+    /* The file starts with an escape (zero length), then the length of the start frame. */
+    size_t control_length = quicdoq_trace_get32(header + 4, 0);
+
+    if (control_length < 4 || (ret = quicdoq_trace_read_record(trace, control_length)) != 0 ||
+        quicdoq_trace_get32(trace->buffer, 0) != QUICDOQ_FSTRM_CONTROL_START) {
+        ret = -1;
+    }
+    else {
+        trace->format = quicdoq_trace_format_dnstap;
+    }
+
+    return ret;
+}
+
+static int quicdoq_trace_next_dnstap(quicdoq_trace_t* trace, quicdoq_trace_query_t* query, int* is_end)
+{
+    int ret = 0;
+    int is_found = 0;
+    uint8_t length_bytes[4];
+
+    while (ret == 0 && !is_found) {
+        size_t nb_read = fread(length_bytes, 1, 4, trace->F);
+
+        if (nb_read == 0) {
+            *is_end = 1;
+            break;
+        }
+        else if (nb_read != 4) {
+            ret = -1;
+        }
+        else {
+            size_t frame_length = quicdoq_trace_get32(length_bytes, 0);
+
+            if (frame_length == 0) {
+                /* Control frame. Stop at the end of the stream. */
+                if (fread(length_bytes, 1, 4, trace->F) != 4 ||
+                    (ret = quicdoq_trace_read_record(trace, quicdoq_trace_get32(length_bytes, 0))) < 0) {
+                    ret = -1;
+                }
+                else if (ret == 0 && quicdoq_trace_get32(length_bytes, 0) >= 4 &&
+                    quicdoq_trace_get32(trace->buffer, 0) == QUICDOQ_FSTRM_CONTROL_STOP) {
+                    *is_end = 1;
+                    break;
+                }
+                else {
+                    ret = 0;
+                }
+            }
+            else if ((ret = quicdoq_trace_read_record(trace, frame_length)) > 0) {
+                /* Skipped */
+                ret = 0;
+            }
+            else if (ret == 0 && quicdoq_trace_parse_dnstap(trace->buffer, frame_length, query) == 0) {
+                is_found = 1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+quicdoq_trace_t* quicdoq_trace_open(char const* file_name)
+{
+    quicdoq_trace_t* trace = (quicdoq_trace_t*)malloc(sizeof(quicdoq_trace_t));
+
+    if (trace != NULL) {
+        int ret = 0;
+        uint8_t header[8];
+
+        memset(trace, 0, sizeof(quicdoq_trace_t));
+        trace->buffer_size = QUICDOQ_TRACE_MAX_RECORD;
+        trace->buffer = (uint8_t*)malloc(trace->buffer_size);
+        trace->F = picoquic_file_open(file_name, "rb");
+
+        if (trace->buffer == NULL || trace->F == NULL || fread(header, 1, 8, trace->F) != 8) {
+            ret = -1;
+        }
+        else if (quicdoq_trace_get32(header, 0) == 0) {
+            ret = quicdoq_trace_open_dnstap(trace, header);
+        }
+        else {
+            uint32_t magic = quicdoq_trace_get32(header, 0);
+            uint32_t swapped = quicdoq_trace_get32(header, 1);
+
+            if (magic == QUICDOQ_PCAP_MAGIC_USEC || magic == QUICDOQ_PCAP_MAGIC_NSEC ||
+                swapped == QUICDOQ_PCAP_MAGIC_USEC || swapped == QUICDOQ_PCAP_MAGIC_NSEC) {
+                ret = quicdoq_trace_open_pcap(trace, header);
+            }
+            else {
+                DBG_PRINTF("Unsupported trace format: %s", file_name);
+                ret = -1;
+            }
+        }
+
+        if (ret != 0) {
+            quicdoq_trace_close(trace);
+            trace = NULL;
+        }
+    }
+
+    return trace;
+}
+
+int quicdoq_trace_next(quicdoq_trace_t* trace, quicdoq_trace_query_t* query, int* is_end)
+{
+    int ret = 0;
+
+    *is_end = 0;
+    if (trace->format == quicdoq_trace_format_pcap) {
+        ret = quicdoq_trace_next_pcap(trace, query, is_end);
+    }
+    else {
+        ret = quicdoq_trace_next_dnstap(trace, query, is_end);
+    }
+
+    return ret;
+}
+
+uint64_t quicdoq_trace_nb_skipped(quicdoq_trace_t* trace)
+{
+    return trace->nb_skipped;
+}
+
+void quicdoq_trace_close(quicdoq_trace_t* trace)
+{
+    if (trace->F != NULL) {
+        (void)picoquic_file_close(trace->F);
+    }
+    if (trace->buffer != NULL) {
+        free(trace->buffer);
+    }
+    free(trace);
+}
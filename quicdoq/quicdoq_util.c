@@ -122,65 +122,324 @@ uint8_t* quicdoq_add_hex(uint8_t* text, uint8_t* text_max, const uint8_t* data,
     return text;
 }
 
+/* Name normalization and case folding.
+ * The label bytes are processed 16 at a time with SSE2, which is always
+ * available on x86-64, or 32 at a time with AVX2 if the library is built
+ * with -mavx2. Other platforms, or builds with QUICDOQ_NO_SIMD, use the
+ * byte per byte code. Both give the same results, which the tests verify.
+ */
+#if !defined(QUICDOQ_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define QUICDOQ_SIMD_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define QUICDOQ_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static size_t quicdoq_ctz32(uint32_t x)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (size_t)index;
+#else
+    return (size_t)__builtin_ctz(x);
+#endif
+}
+
+/* Bit mask of the 16 bytes that cannot be copied as is: control
+ * characters, spaces, DEL, non ASCII bytes, and dots. Spaces only need
+ * escaping at the start or end of a label, this is checked byte per byte.
+ */
+static uint32_t quicdoq_unsafe_mask16(const uint8_t* value)
+{
+    __m128i c = _mm_loadu_si128((const __m128i*)value);
+    __m128i safe = _mm_cmpgt_epi8(c, _mm_set1_epi8(0x20));
+    __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(0x7F)), _mm_cmpeq_epi8(c, _mm_set1_epi8('.')));
+
+    return (uint32_t)_mm_movemask_epi8(_mm_andnot_si128(bad, safe)) ^ 0xFFFFu;
+}
+
+static void quicdoq_fold16(uint8_t* folded, const uint8_t* value)
+{
+    __m128i c = _mm_loadu_si128((const __m128i*)value);
+    __m128i is_upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+
+    _mm_storeu_si128((__m128i*)folded, _mm_add_epi8(c, _mm_and_si128(is_upper, _mm_set1_epi8(0x20))));
+}
+
+#ifdef QUICDOQ_SIMD_AVX2
+static uint32_t quicdoq_unsafe_mask32(const uint8_t* value)
+{
+    __m256i c = _mm256_loadu_si256((const __m256i*)value);
+    __m256i safe = _mm256_cmpgt_epi8(c, _mm256_set1_epi8(0x20));
+    __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(0x7F)), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('.')));
+
+    return ~(uint32_t)_mm256_movemask_epi8(_mm256_andnot_si256(bad, safe));
+}
+
+static void quicdoq_fold32(uint8_t* folded, const uint8_t* value)
+{
+    __m256i c = _mm256_loadu_si256((const __m256i*)value);
+    __m256i is_upper = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+
+    _mm256_storeu_si256((__m256i*)folded, _mm256_add_epi8(c, _mm256_and_si256(is_upper, _mm256_set1_epi8(0x20))));
+}
+#endif
+#endif
+
+/* Copy or escape one character of a name part. Returns NULL if there is
+ * not enough room in the output.
+ */
+static uint8_t* quicdoq_normalize_char(uint8_t c, int is_edge, uint8_t* normalized, uint8_t* normalized_max)
+{
+    unsigned int need_escape = 1;
+
+    if (normalized + 1 >= normalized_max) {
+        return NULL;
+    }
+
+    if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '-' || c == '_'))
+    {
+        need_escape = 0;
+    }
+    else if (c == 127 || c < ' ' || c > 127) {
+        need_escape = 1;
+    }
+    else if (c == ' ')
+    {
+        need_escape = is_edge;
+    }
+    else
+    {
+        need_escape = (c == '.');
+    }
+    if (need_escape) {
+        if (normalized + 4 < normalized_max) {
+            int dec[3];
+            dec[0] = c / 100;
+            dec[1] = (c % 100) / 10;
+            dec[2] = c % 10;
+
+            *normalized++ = '\\';
+            for (int x = 0; x < 3; x++) {
+                *normalized++ = (uint8_t)('0' + dec[x]);
+            }
+        }
+        else {
+            normalized = NULL;
+        }
+    }
+    else {
+        *normalized++ = c;
+    }
+
+    return normalized;
+}
+
+uint8_t* quicdoq_normalize_name_part_scalar(size_t length, const uint8_t* value,
+    uint8_t* normalized, uint8_t* normalized_max)
+{
+    for (size_t i = 0; normalized != NULL && i < length; i++) {
+        normalized = quicdoq_normalize_char(value[i], (i == 0 || i == (length - 1)), normalized, normalized_max);
+    }
+    if (normalized != NULL) {
+        *normalized = 0;
+    }
+
+    return normalized;
+}
+
 uint8_t * NormalizeNamePart(size_t length, const uint8_t* value,
     uint8_t* normalized, uint8_t * normalized_max)
 {
+#ifdef QUICDOQ_SIMD_SSE2
+    size_t i = 0;
+
+    /* Copy the runs of safe bytes, escape the others one by one. The
+     * vector stores may write past the run, but stay within the output. */
+#ifdef QUICDOQ_SIMD_AVX2
+    while (normalized != NULL && i + 32 <= length && normalized + 32 < normalized_max) {
+        uint32_t unsafe = quicdoq_unsafe_mask32(value + i);
+        size_t n = (unsafe == 0) ? 32 : quicdoq_ctz32(unsafe);
+
+        _mm256_storeu_si256((__m256i*)normalized, _mm256_loadu_si256((const __m256i*)(value + i)));
+        normalized += n;
+        i += n;
+        if (n < 32) {
+            normalized = quicdoq_normalize_char(value[i], (i == 0 || i == (length - 1)), normalized, normalized_max);
+            i++;
+        }
+    }
+#endif
+    while (normalized != NULL && i + 16 <= length && normalized + 16 < normalized_max) {
+        uint32_t unsafe = quicdoq_unsafe_mask16(value + i);
+        size_t n = (unsafe == 0) ? 16 : quicdoq_ctz32(unsafe);
+
+        _mm_storeu_si128((__m128i*)normalized, _mm_loadu_si128((const __m128i*)(value + i)));
+        normalized += n;
+        i += n;
+        if (n < 16) {
+            normalized = quicdoq_normalize_char(value[i], (i == 0 || i == (length - 1)), normalized, normalized_max);
+            i++;
+        }
+    }
+    for (; normalized != NULL && i < length; i++) {
+        normalized = quicdoq_normalize_char(value[i], (i == 0 || i == (length - 1)), normalized, normalized_max);
+    }
     if (normalized != NULL) {
-        for (uint32_t i = 0; i < length ; i++)
-        {
-            uint8_t c = value[i];
-            unsigned int need_escape = 1;
+        *normalized = 0;
+    }
 
+    return normalized;
+#else
+    return quicdoq_normalize_name_part_scalar(length, value, normalized, normalized_max);
+#endif
+}
 
-            if (normalized + 1 >= normalized_max) {
-                normalized = NULL;
-                break;
+/* Hash of the folded name, mixing 8 bytes at a time as soon as they are
+ * available, so the name is only read once. The words are read in host
+ * order: the hash is meant for lookups within the process, and its value
+ * differs between little and big endian hosts.
+ */
+#define QUICDOQ_NAME_HASH_SEED 0x243F6A8885A308D3ull
+#define QUICDOQ_NAME_HASH_MULT 0x9E3779B97F4A7C15ull
+
+static uint64_t quicdoq_name_hash_mix(uint64_t h, const uint8_t* bytes)
+{
+    uint64_t w;
+
+    memcpy(&w, bytes, sizeof(w));
+    h = (h ^ w) * QUICDOQ_NAME_HASH_MULT;
+    h ^= h >> 29;
+
+    return h;
+}
+
+static void quicdoq_fold_label_scalar(uint8_t* folded, const uint8_t* value, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = value[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        folded[i] = c;
+    }
+}
+
+static void quicdoq_fold_label(uint8_t* folded, const uint8_t* value, size_t length)
+{
+    size_t i = 0;
+
+#ifdef QUICDOQ_SIMD_AVX2
+    for (; i + 32 <= length; i += 32) {
+        quicdoq_fold32(folded + i, value + i);
+    }
+#endif
+#ifdef QUICDOQ_SIMD_SSE2
+    for (; i + 16 <= length; i += 16) {
+        quicdoq_fold16(folded + i, value + i);
+    }
+#endif
+    quicdoq_fold_label_scalar(folded + i, value + i, length - i);
+}
+
+static size_t quicdoq_fold_dns_name_ex(const uint8_t* packet, size_t length, size_t start,
+    uint8_t* folded, size_t folded_max, size_t* folded_length, uint64_t* name_hash, int use_simd)
+{
+    size_t pos = start;
+    size_t limit = start;
+    size_t next = 0;
+    size_t f_len = 0;
+    size_t hashed = 0;
+    uint64_t h = QUICDOQ_NAME_HASH_SEED;
+
+    while (pos < length) {
+        uint8_t l = packet[pos];
+
+        if (l == 0) {
+            if (next == 0) {
+                next = pos + 1;
             }
-            else {
+            break;
+        }
+        else if ((l & 0xC0) == 0xC0) {
+            size_t target;
 
-                if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c == '-' || c == '_'))
-                {
-                    need_escape = 0;
-                }
-                else if (c == 127 || c < ' ' || c > 127) {
-                    need_escape = 1;
-                }
-                else if (c == ' ')
-                {
-                    need_escape = (i == 0 || i == (length - 1));
-                }
-                else
-                {
-                    need_escape = (c == '.');
-                }
-                if (need_escape) {
-                    if (normalized + 4 < normalized_max) {
-                        int dec[3];
-                        dec[0] = c / 100;
-                        dec[1] = (c % 100) / 10;
-                        dec[2] = c % 10;
-
-                        *normalized++ = '\\';
-                        for (int x = 0; x < 3; x++) {
-                            *normalized++ = (uint8_t)('0' + dec[x]);
-                        }
-                    }
-                    else {
-                        normalized = NULL;
-                        break;
-                    }
-                }
-                else {
-                    *normalized++ = c;
-                }
+            if (pos + 2 > length) {
+                return 0;
+            }
+            target = (((size_t)l & 0x3F) << 8) | packet[pos + 1];
+            if (target < 12 || target >= limit) {
+                return 0;
+            }
+            if (next == 0) {
+                next = pos + 2;
+            }
+            limit = target;
+            pos = target;
+        }
+        else if (l > 63 || pos + l + 1 > length || f_len + l + 2 > folded_max || f_len + l + 2 > 255) {
+            return 0;
+        }
+        else {
+            folded[f_len] = l;
+            if (use_simd) {
+                quicdoq_fold_label(folded + f_len + 1, packet + pos + 1, l);
+            }
+            else {
+                quicdoq_fold_label_scalar(folded + f_len + 1, packet + pos + 1, l);
+            }
+            f_len += (size_t)l + 1;
+            pos += (size_t)l + 1;
+            while (hashed + 8 <= f_len) {
+                h = quicdoq_name_hash_mix(h, folded + hashed);
+                hashed += 8;
             }
         }
     }
-    if (normalized != NULL) {
-        *normalized = 0;
+
+    if (next == 0 || f_len + 1 > folded_max) {
+        return 0;
     }
+    folded[f_len++] = 0;
 
-    return normalized;
+    if (name_hash != NULL) {
+        uint8_t tail[8];
+
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, folded + hashed, f_len - hashed);
+        h = quicdoq_name_hash_mix(h, tail);
+        h = (h ^ f_len) * QUICDOQ_NAME_HASH_MULT;
+        h ^= h >> 32;
+        *name_hash = h;
+    }
+    *folded_length = f_len;
+
+    return next;
+}
+
+/* Copy the name found at "start" in the message to "folded", in
+ * uncompressed wire format with ASCII letters in lower case, and compute
+ * a hash of the folded name. Names that differ only by case get the same
+ * folded form and the same hash, e.g., for cache keys. Returns the offset
+ * of the first byte after the name in the message, or 0 if the name is
+ * malformed or does not fit in the output.
+ */
+size_t quicdoq_fold_dns_name(const uint8_t* packet, size_t length, size_t start,
+    uint8_t* folded, size_t folded_max, size_t* folded_length, uint64_t* name_hash)
+{
+    return quicdoq_fold_dns_name_ex(packet, length, start, folded, folded_max, folded_length, name_hash, 1);
+}
+
+size_t quicdoq_fold_dns_name_scalar(const uint8_t* packet, size_t length, size_t start,
+    uint8_t* folded, size_t folded_max, size_t* folded_length, uint64_t* name_hash)
+{
+    return quicdoq_fold_dns_name_ex(packet, length, start, folded, folded_max, folded_length, name_hash, 0);
 }
 
 /* Create a DNS Request from name and type.
@@ -648,7 +907,81 @@ size_t quicdoq_parse_dns_query(const uint8_t* packet, size_t length, size_t star
     return start;
 }
 
-/* Get RR Code from RR Name
+/* Format a query from a text description, "name:TYPE", e.g.,
+ * "example.com:AAAA". The type defaults to "A" if not specified.
+ */
+int quicdoq_format_query_from_text(quicdoq_query_ctx_t* query_ctx, char const* query_text)
+{
+    int ret = 0;
+    char name[256];
+    int l_n;
+    int i_rr = -1;
+    uint16_t rr_type = 1; /* Default to "A" */
+
+    for (l_n = 0; l_n < 256; l_n++) {
+        if (query_text[l_n] == ':') {
+            name[l_n] = 0;
+            i_rr = l_n + 1;
+            break;
+        }
+        else if (query_text[l_n] == 0) {
+            name[l_n] = 0;
+            break;
+        }
+        else {
+            name[l_n] = query_text[l_n];
+        }
+    }
+
+    if (l_n >= 256) {
+        ret = -1;
+    }
+    else if (i_rr > 0) {
+        /* Get rr type from text */
+        if ((rr_type = quicdoq_get_rr_type(&query_text[i_rr])) == UINT16_MAX) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        uint8_t* query_end = quicdog_format_dns_query(query_ctx->query, query_ctx->query + query_ctx->query_max_size,
+            name, 0, 1, rr_type, query_ctx->response_max_size);
+
+        if (query_end == NULL) {
+            ret = -1;
+        }
+        else {
+            query_ctx->query_length = (uint16_t)(query_end - query_ctx->query);
+        }
+    }
+
+    return ret;
+}
+
+/* Check whether a query can be replayed without side effects, and thus
+ * can be sent in 0-RTT. RFC 9250 requires that only replay-safe
+ * transactions be sent in early data. We only accept standard queries
+ * with a single question, and exclude zone transfers.
+ */
+int quicdoq_is_idempotent_query(const uint8_t* query, size_t query_length)
+{
+    int is_idempotent = 0;
+
+    if (query_length > 12 && (query[2] & 0x80) == 0 && ((query[2] >> 3) & 15) == 0 &&
+        query[4] == 0 && query[5] == 1) {
+        size_t after_name = quicdoq_skip_dns_name(query, query_length, 12);
+
+        if (after_name + 4 <= query_length) {
+            uint16_t qtype = (((uint16_t)query[after_name]) << 8) | query[after_name + 1];
+            /* IXFR = 251, AXFR = 252 */
+            is_idempotent = (qtype != 251 && qtype != 252);
+        }
+    }
+
+    return is_idempotent;
+}
+
+/* Table of RR names, sorted by RR type.
  */
 
 const quicdoq_rr_entry_t rr_table[] = {
@@ -744,15 +1077,108 @@ const quicdoq_rr_entry_t rr_table[] = {
 
 const size_t nb_rr_table = sizeof(rr_table) / sizeof(quicdoq_rr_entry_t);
 
+/* The RR names are found with a minimal perfect hash, using the "hash and
+ * displace" method. The hash of the name with seed 0 selects a bucket, and
+ * the hash of the name seeded with the displacement of that bucket selects
+ * a slot in rr_hash_index, which holds the position of the name in rr_table.
+ * The reverse table gives the position in rr_table of each type number.
+ * These tables are derived from rr_table, and must be updated if rr_table
+ * changes: rr_hash_test() checks them, and prints the new values if they
+ * do not match.
+ */
+const uint8_t rr_hash_displacement[QUICDOQ_RR_HASH_BUCKETS] = {
+    4, 16, 23, 34, 17, 4, 8, 1, 1, 5, 8, 26, 6, 1, 12, 1,
+    0, 9, 0, 16, 111, 91, 15, 7, 0, 66, 6, 32, 3, 23, 56, 1
+};
+
+const uint8_t rr_hash_index[] = {
+    27, 15, 74, 46, 23, 31, 85, 59, 55, 71, 20, 10, 81, 75, 24, 52,
+    37, 47, 63, 22, 0, 13, 72, 9, 86, 51, 45, 26, 80, 41, 34, 44,
+    79, 35, 16, 4, 30, 88, 36, 87, 50, 42, 65, 62, 70, 11, 73, 17,
+    57, 1, 53, 21, 49, 33, 84, 83, 43, 54, 38, 48, 3, 60, 39, 66,
+    2, 82, 56, 14, 5, 40, 64, 29, 25, 76, 19, 68, 61, 6, 7, 8,
+    12, 67, 32, 18, 69, 77, 28, 58, 78
+};
+
+const uint8_t rr_type_index[QUICDOQ_RR_TYPE_INDEX_MAX] = {
+    255, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30,
+    31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46,
+    47, 48, 49, 50, 51, 52, 255, 54, 55, 56, 57, 58, 59, 60, 61, 62,
+    255, 63, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73, 74, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 75, 76, 77, 78, 79, 80, 81,
+    82, 83, 84, 85, 86
+};
+
+/* Private use types, TA and DLV */
+#define QUICDOQ_RR_TYPE_PRIVATE 32768
+#define QUICDOQ_RR_TYPE_PRIVATE_INDEX 87
+#define QUICDOQ_RR_TYPE_PRIVATE_MAX 32770
+
+/* Hash of the upper case version of the name, FNV-1a followed by a
+ * final mix so that the low order bits depend on all characters.
+ */
+uint32_t quicdoq_rr_hash(char const* rr_name, uint32_t seed)
+{
+    uint32_t h = 0x811C9DC5u ^ seed;
+
+    for (size_t i = 0; rr_name[i] != 0; i++) {
+        uint8_t c = (uint8_t)rr_name[i];
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        h ^= c;
+        h *= 0x01000193u;
+    }
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+
+    return h;
+}
+
+static int quicdoq_rr_name_equal(char const* rr_name, char const* table_name)
+{
+    size_t i = 0;
+
+    for (; rr_name[i] != 0; i++) {
+        uint8_t c = (uint8_t)rr_name[i];
+        uint8_t t = (uint8_t)table_name[i];
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        if (t >= 'a' && t <= 'z') {
+            t -= 'a' - 'A';
+        }
+        if (c != t) {
+            return 0;
+        }
+    }
+
+    return table_name[i] == 0;
+}
+
+/* Get RR type from RR name, ignoring case, or from the decimal
+ * value of the type. Returns UINT16_MAX if the name is not valid.
+ */
 uint16_t quicdoq_get_rr_type(char const* rr_name) {
-    size_t x;
+    uint32_t bucket = quicdoq_rr_hash(rr_name, 0) % QUICDOQ_RR_HASH_BUCKETS;
+    uint32_t slot = quicdoq_rr_hash(rr_name, rr_hash_displacement[bucket]) % (uint32_t)nb_rr_table;
     uint16_t rr_type = 0;
+    size_t x = rr_hash_index[slot];
 
-    for (x = 0; x < nb_rr_table; x++) {
-        if (strcmp(rr_name, rr_table[x].rr_name) == 0) {
-            rr_type = rr_table[x].rr_type;
-            break;
-        }
+    if (quicdoq_rr_name_equal(rr_name, rr_table[x].rr_name)) {
+        rr_type = rr_table[x].rr_type;
     }
 
     if (rr_type == 0) {
@@ -773,3 +1199,21 @@ uint16_t quicdoq_get_rr_type(char const* rr_name) {
 
     return rr_type;
 }
+
+/* Get the name of an RR type, or NULL if the type has no name.
+ */
+char const* quicdoq_get_rr_name(uint16_t rr_type)
+{
+    char const* rr_name = NULL;
+
+    if (rr_type < QUICDOQ_RR_TYPE_INDEX_MAX) {
+        if (rr_type_index[rr_type] != UINT8_MAX) {
+            rr_name = rr_table[rr_type_index[rr_type]].rr_name;
+        }
+    }
+    else if (rr_type >= QUICDOQ_RR_TYPE_PRIVATE && rr_type < QUICDOQ_RR_TYPE_PRIVATE_MAX) {
+        rr_name = rr_table[QUICDOQ_RR_TYPE_PRIVATE_INDEX + rr_type - QUICDOQ_RR_TYPE_PRIVATE].rr_name;
+    }
+
+    return rr_name;
+}
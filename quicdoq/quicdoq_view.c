@@ -0,0 +1,287 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+
+/* Structured view of DNS messages.
+ *
+ * The message is decoded in a single pass. Each name is checked by
+ * following its labels and compression pointers. To guarantee that the
+ * decoding terminates, each pointer in a name must point before the
+ * target of the previous pointer, or before the start of the name for
+ * the first one, and never inside the header. The same checks apply to the
+ * names in the RDATA of NS, CNAME, PTR, DNAME, MX and SOA records.
+ */
+
+#define QUICDOQ_VIEW_HEADER_LENGTH 12
+#define QUICDOQ_VIEW_MAX_NAME_LENGTH 255
+
+/* Check the name starting at "start". On success, set "next" to the first
+ * byte after the name, i.e. after the terminating null label or after the
+ * first compression pointer.
+ */
+static int quicdoq_dns_view_check_name(const uint8_t* packet, size_t length, size_t start, size_t* next)
+{
+    size_t pos = start;
+    size_t limit = start;
+    size_t name_length = 1;
+
+    *next = 0;
+
+    while (pos < length) {
+        uint8_t l = packet[pos];
+
+        if (l == 0) {
+            if (*next == 0) {
+                *next = pos + 1;
+            }
+            return 0;
+        }
+        else if ((l & 0xC0) == 0xC0) {
+            size_t target;
+
+            if (pos + 2 > length) {
+                break;
+            }
+            target = (((size_t)l & 0x3F) << 8) | packet[pos + 1];
+            if (target < QUICDOQ_VIEW_HEADER_LENGTH || target >= limit) {
+                break;
+            }
+            if (*next == 0) {
+                *next = pos + 2;
+            }
+            limit = target;
+            pos = target;
+        }
+        else if (l > 63) {
+            /* Extended label types are obsolete */
+            break;
+        }
+        else {
+            name_length += (size_t)l + 1;
+            if (name_length > QUICDOQ_VIEW_MAX_NAME_LENGTH || pos + l + 1 > length) {
+                break;
+            }
+            pos += (size_t)l + 1;
+        }
+    }
+
+    return -1;
+}
+
+/* Check the names embedded in the RDATA of the common record types that
+ * use compression. The names must end within the RDATA.
+ */
+static int quicdoq_dns_view_check_rdata(const uint8_t* packet, const quicdoq_rr_view_t* rr)
+{
+    int ret = 0;
+    size_t rdata_end = (size_t)rr->rdata_offset + rr->rdata_length;
+    size_t next = 0;
+
+    switch (rr->rr_type) {
+    case 2: /* NS */
+    case 5: /* CNAME */
+    case 12: /* PTR */
+    case 39: /* DNAME */
+        ret = quicdoq_dns_view_check_name(packet, rdata_end, rr->rdata_offset, &next);
+        if (ret == 0 && next != rdata_end) {
+            ret = -1;
+        }
+        break;
+    case 15: /* MX */
+        if (rr->rdata_length < 3) {
+            ret = -1;
+        }
+        else {
+            ret = quicdoq_dns_view_check_name(packet, rdata_end, (size_t)rr->rdata_offset + 2, &next);
+            if (ret == 0 && next != rdata_end) {
+                ret = -1;
+            }
+        }
+        break;
+    case 6: /* SOA: MNAME, RNAME, then 5 32 bits numbers */
+        ret = quicdoq_dns_view_check_name(packet, rdata_end, rr->rdata_offset, &next);
+        if (ret == 0) {
+            ret = quicdoq_dns_view_check_name(packet, rdata_end, next, &next);
+        }
+        if (ret == 0 && next + 20 != rdata_end) {
+            ret = -1;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return ret;
+}
+
+int quicdoq_dns_view_parse(quicdoq_dns_view_t* view, const uint8_t* packet, size_t length)
+{
+    int ret = 0;
+    size_t pos = QUICDOQ_VIEW_HEADER_LENGTH;
+    size_t next = 0;
+    uint32_t nb_rr_total;
+
+    view->nb_rr = 0;
+    view->has_opt = 0;
+    view->qname_offset = 0;
+    view->qname_length = 0;
+    view->qtype = 0;
+    view->qclass = 0;
+    view->message_length = 0;
+
+    if (length < QUICDOQ_VIEW_HEADER_LENGTH || length > UINT16_MAX) {
+        return -1;
+    }
+
+    view->id = (uint16_t)((packet[0] << 8) | packet[1]);
+    view->flags = (uint16_t)((packet[2] << 8) | packet[3]);
+    view->qdcount = (uint16_t)((packet[4] << 8) | packet[5]);
+    view->ancount = (uint16_t)((packet[6] << 8) | packet[7]);
+    view->nscount = (uint16_t)((packet[8] << 8) | packet[9]);
+    view->arcount = (uint16_t)((packet[10] << 8) | packet[11]);
+
+    for (uint16_t i = 0; ret == 0 && i < view->qdcount; i++) {
+        if (quicdoq_dns_view_check_name(packet, length, pos, &next) != 0 || next + 4 > length) {
+            ret = -1;
+        }
+        else {
+            if (i == 0) {
+                view->qname_offset = (uint16_t)pos;
+                view->qname_length = (uint16_t)(next - pos);
+                view->qtype = (uint16_t)((packet[next] << 8) | packet[next + 1]);
+                view->qclass = (uint16_t)((packet[next + 2] << 8) | packet[next + 3]);
+            }
+            pos = next + 4;
+        }
+    }
+
+    nb_rr_total = (uint32_t)view->ancount + view->nscount + view->arcount;
+
+    for (uint32_t i = 0; ret == 0 && i < nb_rr_total; i++) {
+        quicdoq_rr_view_t rr;
+
+        if (i == 0) {
+            view->section_offset[0] = (uint16_t)pos;
+        }
+        if (i == view->ancount) {
+            view->section_offset[1] = (uint16_t)pos;
+        }
+        if (i == (uint32_t)view->ancount + view->nscount) {
+            view->section_offset[2] = (uint16_t)pos;
+        }
+
+        if (quicdoq_dns_view_check_name(packet, length, pos, &next) != 0 || next + 10 > length) {
+            ret = -1;
+            break;
+        }
+        rr.name_offset = (uint16_t)pos;
+        rr.rr_type = (uint16_t)((packet[next] << 8) | packet[next + 1]);
+        rr.rr_class = (uint16_t)((packet[next + 2] << 8) | packet[next + 3]);
+        rr.ttl = ((uint32_t)packet[next + 4] << 24) | ((uint32_t)packet[next + 5] << 16) |
+            ((uint32_t)packet[next + 6] << 8) | packet[next + 7];
+        rr.rdata_length = (uint16_t)((packet[next + 8] << 8) | packet[next + 9]);
+        rr.rdata_offset = (uint16_t)(next + 10);
+
+        if ((size_t)rr.rdata_offset + rr.rdata_length > length ||
+            quicdoq_dns_view_check_rdata(packet, &rr) != 0) {
+            ret = -1;
+        }
+        else if (rr.rr_type == 41) {
+            /* A single OPT record, with the root name, in the additional section */
+            if (view->has_opt || i < (uint32_t)view->ancount + view->nscount || packet[pos] != 0) {
+                ret = -1;
+            }
+            else {
+                view->has_opt = 1;
+                view->opt = rr;
+            }
+        }
+
+        if (ret == 0) {
+            if (view->nb_rr < QUICDOQ_VIEW_MAX_RR) {
+                view->rr[view->nb_rr++] = rr;
+            }
+            pos = (size_t)rr.rdata_offset + rr.rdata_length;
+        }
+    }
+
+    if (ret == 0) {
+        /* Empty sections start where the next one would */
+        if (nb_rr_total == 0) {
+            view->section_offset[0] = (uint16_t)pos;
+        }
+        if (view->nscount == 0 && view->arcount == 0) {
+            view->section_offset[1] = (uint16_t)pos;
+        }
+        if (view->arcount == 0) {
+            view->section_offset[2] = (uint16_t)pos;
+        }
+        view->message_length = (uint16_t)pos;
+    }
+
+    return ret;
+}
+
+int quicdoq_dns_view_is_idempotent(const quicdoq_dns_view_t* view)
+{
+    return (QUICDOQ_VIEW_QR(view) == 0 && QUICDOQ_VIEW_OPCODE(view) == 0 && view->qdcount == 1 &&
+        view->qtype != 251 && view->qtype != 252);
+}
+
+size_t quicdoq_dns_view_copy_name(const uint8_t* packet, size_t length, size_t start, uint8_t* name, size_t name_max)
+{
+    size_t pos = start;
+    size_t name_length = 0;
+    size_t nb_pointers = 0;
+
+    while (pos < length) {
+        uint8_t l = packet[pos];
+
+        if ((l & 0xC0) == 0xC0) {
+            /* The view checks that pointers go backwards, the count only
+             * protects against names that were not checked */
+            if (pos + 2 > length || ++nb_pointers > QUICDOQ_VIEW_MAX_NAME_LENGTH) {
+                break;
+            }
+            pos = (((size_t)l & 0x3F) << 8) | packet[pos + 1];
+        }
+        else if (l > 63 || name_length + l + 1 > name_max || pos + l + 1 > length) {
+            break;
+        }
+        else {
+            memcpy(name + name_length, packet + pos, (size_t)l + 1);
+            name_length += (size_t)l + 1;
+            if (l == 0) {
+                return name_length;
+            }
+            pos += (size_t)l + 1;
+        }
+    }
+
+    return 0;
+}
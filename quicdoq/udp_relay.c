@@ -54,6 +54,13 @@ quicdog_udp_queued_t* quicdoq_udp_find_by_id(quicdoq_udp_ctx_t* udp_ctx, uint16_
     return next;
 }
 
+/* Each queued query keeps a back-pointer to its relay entry in app_ctx,
+ * so that cancellations do not require a scan of the queue. */
+static quicdog_udp_queued_t* quicdoq_udp_find_by_query(quicdoq_query_ctx_t* query_ctx)
+{
+    return (quicdog_udp_queued_t*)query_ctx->app_ctx;
+}
+
 void quicdoq_udp_insert_in_list(quicdoq_udp_ctx_t* udp_ctx, quicdog_udp_queued_t* quq_ctx)
 {
     quicdog_udp_queued_t* previous = NULL;
@@ -106,12 +113,28 @@ void quicdoq_udp_reinsert_in_list(quicdoq_udp_ctx_t* udp_ctx, quicdog_udp_queued
     quicdoq_udp_insert_in_list(udp_ctx, quq_ctx);
 }
 
-int quicdoq_udp_cancel_query(quicdoq_udp_ctx_t* udp_ctx, quicdog_udp_queued_t* quq_ctx, uint16_t error_code)
+/* The depth of the relay queue is part of the server load, see quicdoq_set_load_budget() */
+static void quicdoq_udp_delete_queued(quicdoq_udp_ctx_t* udp_ctx, quicdog_udp_queued_t* quq_ctx)
 {
-    int ret = quicdoq_cancel_response(udp_ctx->quicdoq_ctx, quq_ctx->query_ctx, error_code);
-    /* Remove the context from the list and delete it */
     quicdoq_udp_remove_from_list(udp_ctx, quq_ctx);
+    if (quq_ctx->query_ctx->app_ctx == quq_ctx) {
+        quq_ctx->query_ctx->app_ctx = NULL;
+    }
     free(quq_ctx);
+    if (udp_ctx->quicdoq_ctx->load_stats.relay_queue_depth > 0) {
+        udp_ctx->quicdoq_ctx->load_stats.relay_queue_depth--;
+    }
+}
+
+int quicdoq_udp_cancel_query(quicdoq_udp_ctx_t* udp_ctx, quicdog_udp_queued_t* quq_ctx, uint16_t error_code)
+{
+    quicdoq_query_ctx_t* query_ctx = quq_ctx->query_ctx;
+    int ret;
+
+    /* Remove the context from the list and delete it before the query
+     * context is released by the cancellation */
+    quicdoq_udp_delete_queued(udp_ctx, quq_ctx);
+    ret = quicdoq_cancel_response(udp_ctx->quicdoq_ctx, query_ctx, error_code);
 
     if (udp_ctx->first_query == NULL) {
         udp_ctx->next_wake_time = UINT64_MAX;
@@ -166,15 +189,34 @@ int quicdoq_udp_callback(
                 quq_ctx->query_arrival_time = current_time;
                 quq_ctx->next_send_time = current_time;
                 quq_ctx->udp_query_id = udp_ctx->next_id++;
+                query_ctx->app_ctx = quq_ctx;
 
                 quicdoq_udp_insert_in_list(udp_ctx, quq_ctx);
+                udp_ctx->quicdoq_ctx->load_stats.relay_queue_depth++;
+                quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_queries);
             }
         }
 
+        if (ret != 0) {
+            quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_errors);
+        }
         break;
     case quicdoq_query_cancelled: /* Query cancelled before response provided */
     case quicdoq_query_failed: /* Query failed for reasons other than cancelled. */
-        /* remove response from queue, mark it cancelled */
+        /* remove the query from the queue. The server releases the query
+         * context, so the stream must not be reset again. */
+        quq_ctx = quicdoq_udp_find_by_query(query_ctx);
+        if (quq_ctx != NULL) {
+            if (callback_code == quicdoq_query_cancelled) {
+                quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_cancelled);
+                if (quq_ctx->nb_sent > 0 && udp_ctx->quicdoq_ctx->metrics_shard != NULL) {
+                    quicdoq_metrics_increment(udp_ctx->quicdoq_ctx->metrics_shard, quicdoq_metric_relay_packets_wasted,
+                        (uint64_t)quq_ctx->nb_sent);
+                }
+            }
+            quicdoq_udp_delete_queued(udp_ctx, quq_ctx);
+            udp_ctx->next_wake_time = (udp_ctx->first_query == NULL) ? UINT64_MAX : udp_ctx->first_query->next_send_time;
+        }
         break;
     default: /* callback code not expected on server */
         ret = -1;
@@ -202,10 +244,12 @@ void quicdoq_udp_prepare_next_packet(quicdoq_udp_ctx_t* udp_ctx,
     } else {
         if (quq_ctx->nb_sent > QUICDOQ_UDP_MAX_REPEAT) {
             /* Query failed. Delete, report failure */
+            quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_timeouts);
             (void)quicdoq_udp_cancel_query(udp_ctx, quq_ctx, QUICDOQ_ERROR_RESPONSE_TIME_OUT);
         }
         else if (quq_ctx->query_ctx->query_length > send_buffer_max) {
             /* Cannot be sent. Delete, send back a query too long failure */
+            quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_errors);
             (void)quicdoq_udp_cancel_query(udp_ctx, quq_ctx, QUICDOQ_ERROR_QUERY_TOO_LONG);
         }
         else {
@@ -214,13 +258,26 @@ void quicdoq_udp_prepare_next_packet(quicdoq_udp_ctx_t* udp_ctx,
             memcpy(send_buffer + 2, quq_ctx->query_ctx->query + 2, quq_ctx->query_ctx->query_length - 2);
             *send_length = quq_ctx->query_ctx->query_length;
 
+            quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_packets_sent);
+            if (quq_ctx->nb_sent > 0) {
+                quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_retransmits);
+            }
+            else {
+                quicdoq_set_query_stage(quq_ctx->query_ctx, quicdoq_stage_relay_send, current_time);
+            }
             quq_ctx->nb_sent++;
             quq_ctx->next_send_time = current_time + udp_ctx->rto;
             quicdoq_udp_reinsert_in_list(udp_ctx, quq_ctx);
             picoquic_store_addr(p_addr_to, (struct sockaddr*)&udp_ctx->udp_addr);
-            picoquic_store_addr(p_addr_from, (struct sockaddr*) & udp_ctx->local_addr);
-            if (udp_ctx->if_index >= 0) {
-                *if_index = udp_ctx->if_index;
+            if (udp_ctx->is_connected) {
+                /* The connected socket picks the source address */
+                memset(p_addr_from, 0, sizeof(struct sockaddr_storage));
+            }
+            else {
+                picoquic_store_addr(p_addr_from, (struct sockaddr*) & udp_ctx->local_addr);
+                if (udp_ctx->if_index >= 0) {
+                    *if_index = udp_ctx->if_index;
+                }
             }
         }
     }
@@ -234,9 +291,6 @@ void quicdoq_udp_incoming_packet(
     int if_index_to,
     uint64_t current_time)
 {
-#ifdef _WINDOWS
-    UNREFERENCED_PARAMETER(current_time);
-#endif
     if (length < 2) {
         /* Bad packet */
     }
@@ -249,24 +303,31 @@ void quicdoq_udp_incoming_packet(
         }
         else if (length > quq_ctx->query_ctx->response_max_size) {
             /* Reponse is too long */
+            quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_errors);
             (void)quicdoq_udp_cancel_query(udp_ctx, quq_ctx, QUICDOQ_ERROR_RESPONSE_TOO_LONG);
         }
         else
         {
-            /* Update the local address */
-            picoquic_store_addr(&udp_ctx->local_addr, addr_to);
-            udp_ctx->if_index = if_index_to;
+            quicdoq_query_ctx_t* query_ctx;
+
+            if (!udp_ctx->is_connected) {
+                /* Update the local address */
+                picoquic_store_addr(&udp_ctx->local_addr, addr_to);
+                udp_ctx->if_index = if_index_to;
+            }
 
             /* Store the response */
             quq_ctx->query_ctx->response[0] = quq_ctx->query_ctx->query[0];
             quq_ctx->query_ctx->response[1] = quq_ctx->query_ctx->query[1];
             memcpy(quq_ctx->query_ctx->response + 2, bytes + 2, length - 2);
             quq_ctx->query_ctx->response_length = length;
-            /* Post to the quicdoq server */
-            (void)quicdoq_post_response(quq_ctx->query_ctx);
-            /* Remove the context from the list and delete it */
-            quicdoq_udp_remove_from_list(udp_ctx, quq_ctx);
-            free(quq_ctx);
+            quicdoq_set_query_stage(quq_ctx->query_ctx, quicdoq_stage_relay_reply, current_time);
+            quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_responses);
+            query_ctx = quq_ctx->query_ctx;
+            /* Remove the context from the list and delete it, then post
+             * to the quicdoq server, which may release the query context */
+            quicdoq_udp_delete_queued(udp_ctx, quq_ctx);
+            (void)quicdoq_post_response(query_ctx);
         }
     }
 
@@ -283,6 +344,20 @@ uint64_t quicdoq_next_udp_time(quicdoq_udp_ctx_t* udp_ctx)
     return udp_ctx->next_wake_time;
 }
 
+void quicdoq_udp_set_connected(quicdoq_udp_ctx_t* udp_ctx, int is_connected)
+{
+    udp_ctx->is_connected = is_connected;
+    if (is_connected) {
+        memset(&udp_ctx->local_addr, 0, sizeof(struct sockaddr_storage));
+        udp_ctx->if_index = -1;
+    }
+}
+
+void quicdoq_udp_socket_error(quicdoq_udp_ctx_t* udp_ctx)
+{
+    quicdoq_count_metric(udp_ctx->quicdoq_ctx, quicdoq_metric_relay_socket_errors);
+}
+
 quicdoq_udp_ctx_t* quicdoq_create_udp_ctx(quicdoq_ctx_t* quicdoq_ctx, struct sockaddr* addr)
 {
     quicdoq_udp_ctx_t* udp_ctx = (quicdoq_udp_ctx_t*)malloc(sizeof(quicdoq_udp_ctx_t));
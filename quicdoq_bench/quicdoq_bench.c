@@ -0,0 +1,834 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Quicdoq codec microbenchmarks.
+ *
+ * Measure the cost of the DNS message utilities of quicdoq_util.c, which
+ * are used when refusing queries, logging, or computing cache keys. The
+ * tool builds a corpus of queries for a set of typical names and types,
+ * and of the matching responses, with answer, authority and additional
+ * records using name compression. Each benchmark runs a function a fixed
+ * number of times over the corpus, and reports the time per operation
+ * and the number of message bytes processed per operation and per CPU
+ * cycle, as text on stdout and optionally as JSON. The "_scalar" variants
+ * measure the byte per byte code, for comparison with the vector code.
+ */
+
+#ifdef _WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include "getopt.h"
+#include <Windows.h>
+#include <intrin.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+#else /* Linux */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+#endif
+
+#define QUICDOQ_BENCH_DEFAULT_OPS 1000000
+#define QUICDOQ_BENCH_MAX_PACKET 1232
+#define QUICDOQ_BENCH_TEXT_MAX 8192
+#define QUICDOQ_BENCH_MAX_LABELS 512
+
+typedef struct st_quicdoq_bench_packet_t {
+    uint8_t data[QUICDOQ_BENCH_MAX_PACKET];
+    size_t length;
+} quicdoq_bench_packet_t;
+
+typedef struct st_quicdoq_bench_label_t {
+    const uint8_t* value;
+    size_t length;
+} quicdoq_bench_label_t;
+
+typedef struct st_quicdoq_bench_ctx_t {
+    quicdoq_bench_packet_t* queries;
+    quicdoq_bench_packet_t* responses;
+    size_t nb_packets;
+    quicdoq_bench_label_t labels[QUICDOQ_BENCH_MAX_LABELS];
+    size_t nb_labels;
+    uint8_t buffer[QUICDOQ_BENCH_MAX_PACKET];
+    uint8_t text[QUICDOQ_BENCH_TEXT_MAX];
+    quicdoq_dns_view_t view;
+    quicdoq_query_ctx_t query_ctx;
+    quicdoq_builder_t builder;
+    uint64_t checksum; /* Accumulates the results, so the work cannot be optimized out */
+} quicdoq_bench_ctx_t;
+
+/* Each benchmark function performs one operation on the item of the corpus
+ * selected by the operation index, and returns the number of message bytes
+ * processed. */
+typedef size_t (*quicdoq_bench_fn)(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+
+typedef struct st_quicdoq_bench_def_t {
+    char const* name;
+    quicdoq_bench_fn fn;
+} quicdoq_bench_def_t;
+
+typedef struct st_quicdoq_bench_result_t {
+    uint64_t nb_ops;
+    uint64_t nb_bytes;
+    uint64_t elapsed_us;
+    uint64_t cycles; /* 0 if there is no cycle counter */
+} quicdoq_bench_result_t;
+
+#define QUICDOQ_BENCH_NS_PER_OP(r) (((double)(r)->elapsed_us * 1000.0) / (double)(r)->nb_ops)
+#define QUICDOQ_BENCH_BYTES_PER_OP(r) ((double)(r)->nb_bytes / (double)(r)->nb_ops)
+#define QUICDOQ_BENCH_BYTES_PER_CYCLE(r) (((r)->cycles == 0) ? 0.0 : (double)(r)->nb_bytes / (double)(r)->cycles)
+
+/* Corpus of names and query types, loosely modelled on the traffic seen
+ * by a recursive resolver: popular domains, CDN aliases, reverse lookups,
+ * service names, and a few names requiring escapes. */
+static char const* bench_names[] = {
+    "example.com",
+    "www.example.com",
+    "www.google.com",
+    "mail.private-octopus.com",
+    "a.root-servers.net",
+    "_dns._udp.example.org",
+    "_sip._tcp.voip.example.net",
+    "xn--bcher-kva.example",
+    "e1234.dscb.akamaiedge.net",
+    "d3ag4hukkh62yn.cloudfront.net",
+    "stun.l.google.com",
+    "api-global.eu-west-1.prod.example-service.com",
+    "1.0.0.127.in-addr.arpa",
+    "35.2.0.192.in-addr.arpa",
+    "b.a.9.8.7.6.5.0.4.0.0.0.3.0.0.0.2.0.0.0.1.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa",
+    "www.wikipedia.org",
+    "clients4.google.com",
+    "graph.facebook.com",
+    "time.apple.com",
+    "ocsp.digicert.com",
+    "odd\\046dot.example.com",
+    "space\\032inside.example.org",
+    "www.very-long-label-used-by-some-tracking-services-0123456789abcdef.example.net",
+    "com"
+};
+
+static const uint16_t bench_qtypes[] = {
+    1, /* A */
+    28, /* AAAA */
+    65, /* HTTPS */
+    15, /* MX */
+    16, /* TXT */
+    2, /* NS */
+    12, /* PTR */
+    33, /* SRV */
+    6, /* SOA */
+    43, /* DS */
+    48, /* DNSKEY */
+    257 /* CAA */
+};
+
+static char const* bench_rr_names[] = {
+    "A", "AAAA", "HTTPS", "MX", "TXT", "NS", "PTR", "SRV", "CNAME", "SOA",
+    "DS", "DNSKEY", "RRSIG", "NSEC3", "CAA", "SVCB", "DLV", "65", "12345", "BOGUS"
+};
+
+/* Long labels, as found in CDN, tracking or DNSSEC related names, used to
+ * measure the per byte cost of name normalization. */
+static char const* bench_long_labels[] = {
+    "very-long-label-used-by-some-tracking-services-0123456789abcdef",
+    "d3ag4hukkh62yn5e8tqv2lbzk0x7c1mrs9fh4j6p",
+    "xn--80ak6aa92e-with-a-long-suffix-for-testing",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ-abcdefghijklmnopqrstuvwxyz-0123456789",
+    "api-global-eu-west-1-prod-example-service-edge-cache",
+    "a1b2c3d4e5f6a7b8c9d0e1f2a3b4c5d6"
+};
+
+#define QUICDOQ_BENCH_NB_NAMES (sizeof(bench_names) / sizeof(char const*))
+#define QUICDOQ_BENCH_NB_QTYPES (sizeof(bench_qtypes) / sizeof(uint16_t))
+#define QUICDOQ_BENCH_NB_RR_NAMES (sizeof(bench_rr_names) / sizeof(char const*))
+#define QUICDOQ_BENCH_NB_LONG_LABELS (sizeof(bench_long_labels) / sizeof(char const*))
+
+void usage();
+uint8_t* quicdoq_bench_add_rr(uint8_t* data, uint8_t* data_max, uint16_t name_offset,
+    uint16_t rr_type, uint16_t rr_class, uint32_t ttl, const uint8_t* rdata, size_t rdata_length);
+int quicdoq_bench_format_response(quicdoq_bench_packet_t* response, char const* qname, uint16_t id, uint16_t qtype);
+int quicdoq_bench_init(quicdoq_bench_ctx_t* bench_ctx);
+void quicdoq_bench_release(quicdoq_bench_ctx_t* bench_ctx);
+size_t quicdoq_bench_parse_query(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_parse_response(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_skip_names(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_view_query(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_view_response(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_format_query(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_build_response(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_normalize(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_normalize_scalar(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_normalize_long(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_normalize_long_scalar(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_fold(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+size_t quicdoq_bench_fold_scalar(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+uint64_t quicdoq_bench_cycles();
+size_t quicdoq_bench_get_rr_type(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index);
+void quicdoq_bench_run(quicdoq_bench_ctx_t* bench_ctx, quicdoq_bench_fn fn, uint64_t nb_ops, quicdoq_bench_result_t* result);
+
+static const quicdoq_bench_def_t bench_table[] = {
+    { "parse_dns_query", quicdoq_bench_parse_query },
+    { "parse_dns_response", quicdoq_bench_parse_response },
+    { "skip_dns_name", quicdoq_bench_skip_names },
+    { "dns_view_query", quicdoq_bench_view_query },
+    { "dns_view_response", quicdoq_bench_view_response },
+    { "format_dns_query", quicdoq_bench_format_query },
+    { "build_response", quicdoq_bench_build_response },
+    { "normalize_name_part", quicdoq_bench_normalize },
+    { "normalize_name_part_scalar", quicdoq_bench_normalize_scalar },
+    { "normalize_long_label", quicdoq_bench_normalize_long },
+    { "normalize_long_label_scalar", quicdoq_bench_normalize_long_scalar },
+    { "fold_dns_name", quicdoq_bench_fold },
+    { "fold_dns_name_scalar", quicdoq_bench_fold_scalar },
+    { "get_rr_type", quicdoq_bench_get_rr_type }
+};
+
+#define QUICDOQ_BENCH_NB_BENCH (sizeof(bench_table) / sizeof(quicdoq_bench_def_t))
+
+int main(int argc, char** argv)
+{
+    int ret = 0;
+    quicdoq_bench_ctx_t* bench_ctx = NULL;
+    quicdoq_bench_result_t results[QUICDOQ_BENCH_NB_BENCH];
+    uint64_t nb_ops = QUICDOQ_BENCH_DEFAULT_OPS;
+    char const* bench_name = NULL;
+    char const* json_file = NULL;
+    FILE* F_json = NULL;
+    int is_first = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:j:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            nb_ops = (uint64_t)strtoull(optarg, NULL, 10);
+            if (nb_ops == 0) {
+                fprintf(stderr, "Invalid number of operations: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'b':
+            bench_name = optarg;
+            break;
+        case 'j':
+            json_file = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            break;
+        }
+    }
+
+    if (bench_name != NULL) {
+        size_t i;
+        for (i = 0; i < QUICDOQ_BENCH_NB_BENCH; i++) {
+            if (strcmp(bench_name, bench_table[i].name) == 0) {
+                break;
+            }
+        }
+        if (i >= QUICDOQ_BENCH_NB_BENCH) {
+            fprintf(stderr, "Unknown benchmark: %s\n", bench_name);
+            usage();
+        }
+    }
+
+    if ((bench_ctx = (quicdoq_bench_ctx_t*)malloc(sizeof(quicdoq_bench_ctx_t))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        ret = -1;
+    }
+    else {
+        ret = quicdoq_bench_init(bench_ctx);
+    }
+
+    if (ret == 0 && json_file != NULL) {
+        if (strcmp(json_file, "-") == 0) {
+            F_json = stdout;
+        }
+        else if ((F_json = picoquic_file_open(json_file, "w")) == NULL) {
+            fprintf(stderr, "Cannot open the JSON file: %s\n", json_file);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* If the JSON goes to stdout, the text report goes to stderr */
+        FILE* F_text = (F_json == stdout) ? stderr : stdout;
+        size_t query_bytes = 0;
+        size_t response_bytes = 0;
+
+        for (size_t i = 0; i < bench_ctx->nb_packets; i++) {
+            query_bytes += bench_ctx->queries[i].length;
+            response_bytes += bench_ctx->responses[i].length;
+        }
+
+        fprintf(F_text, "Corpus: %zu queries (%zu bytes), %zu responses (%zu bytes), %zu labels\n",
+            bench_ctx->nb_packets, query_bytes, bench_ctx->nb_packets, response_bytes, bench_ctx->nb_labels);
+        fprintf(F_text, "%-28s %12s %10s %10s %12s\n", "benchmark", "ops", "ns/op", "bytes/op", "bytes/cycle");
+
+        for (size_t i = 0; i < QUICDOQ_BENCH_NB_BENCH; i++) {
+            if (bench_name != NULL && strcmp(bench_name, bench_table[i].name) != 0) {
+                memset(&results[i], 0, sizeof(quicdoq_bench_result_t));
+                continue;
+            }
+
+            quicdoq_bench_run(bench_ctx, bench_table[i].fn, nb_ops, &results[i]);
+            fprintf(F_text, "%-28s %12" PRIu64 " %10.1f %10.1f %12.3f\n", bench_table[i].name, results[i].nb_ops,
+                QUICDOQ_BENCH_NS_PER_OP(&results[i]), QUICDOQ_BENCH_BYTES_PER_OP(&results[i]),
+                QUICDOQ_BENCH_BYTES_PER_CYCLE(&results[i]));
+        }
+
+        fprintf(F_text, "Checksum: %" PRIu64 "\n", bench_ctx->checksum);
+
+        if (F_json != NULL) {
+            fprintf(F_json, "{\n");
+            fprintf(F_json, "  \"corpus\": { \"queries\": %zu, \"query_bytes\": %zu, \"responses\": %zu, \"response_bytes\": %zu, \"labels\": %zu },\n",
+                bench_ctx->nb_packets, query_bytes, bench_ctx->nb_packets, response_bytes, bench_ctx->nb_labels);
+            fprintf(F_json, "  \"benchmarks\": [");
+            for (size_t i = 0; i < QUICDOQ_BENCH_NB_BENCH; i++) {
+                if (results[i].nb_ops == 0) {
+                    continue;
+                }
+                fprintf(F_json, "%s\n    { \"name\": \"%s\", \"ops\": %" PRIu64 ", \"elapsed_us\": %" PRIu64
+                    ", \"cycles\": %" PRIu64 ", \"ns_per_op\": %.1f, \"bytes_per_op\": %.1f, \"bytes_per_cycle\": %.3f }",
+                    (is_first) ? "" : ",", bench_table[i].name, results[i].nb_ops, results[i].elapsed_us, results[i].cycles,
+                    QUICDOQ_BENCH_NS_PER_OP(&results[i]), QUICDOQ_BENCH_BYTES_PER_OP(&results[i]),
+                    QUICDOQ_BENCH_BYTES_PER_CYCLE(&results[i]));
+                is_first = 0;
+            }
+            fprintf(F_json, "\n  ],\n");
+            fprintf(F_json, "  \"checksum\": %" PRIu64 "\n", bench_ctx->checksum);
+            fprintf(F_json, "}\n");
+        }
+    }
+
+    if (F_json != NULL && F_json != stdout) {
+        (void)picoquic_file_close(F_json);
+    }
+
+    if (bench_ctx != NULL) {
+        quicdoq_bench_release(bench_ctx);
+        free(bench_ctx);
+    }
+
+    return ret;
+}
+
+void usage()
+{
+    fprintf(stderr, "Quicdoq codec microbenchmarks\n");
+    fprintf(stderr, "Usage: quicdoq_bench <options>\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -n nb_ops             Number of operations per benchmark (default: %d)\n",
+        QUICDOQ_BENCH_DEFAULT_OPS);
+    fprintf(stderr, "  -b name               Only run this benchmark, one of:\n");
+    for (size_t i = 0; i < QUICDOQ_BENCH_NB_BENCH; i++) {
+        fprintf(stderr, "                            %s\n", bench_table[i].name);
+    }
+    fprintf(stderr, "  -j file               Write the results as JSON to this file, \"-\" for stdout\n");
+    fprintf(stderr, "  -h                    This help message\n");
+
+    exit(1);
+}
+
+/* Add a resource record whose name is a compression pointer to the
+ * specified offset in the message, or the root if the offset is 0.
+ */
+uint8_t* quicdoq_bench_add_rr(uint8_t* data, uint8_t* data_max, uint16_t name_offset,
+    uint16_t rr_type, uint16_t rr_class, uint32_t ttl, const uint8_t* rdata, size_t rdata_length)
+{
+    if (data == NULL || data + 12 + rdata_length > data_max) {
+        data = NULL;
+    }
+    else {
+        if (name_offset == 0) {
+            *data++ = 0;
+        }
+        else {
+            *data++ = (uint8_t)(0xC0 | (name_offset >> 8));
+            *data++ = (uint8_t)(name_offset & 0xFF);
+        }
+        *data++ = (uint8_t)(rr_type >> 8);
+        *data++ = (uint8_t)(rr_type & 0xFF);
+        *data++ = (uint8_t)(rr_class >> 8);
+        *data++ = (uint8_t)(rr_class & 0xFF);
+        *data++ = (uint8_t)(ttl >> 24);
+        *data++ = (uint8_t)((ttl >> 16) & 0xFF);
+        *data++ = (uint8_t)((ttl >> 8) & 0xFF);
+        *data++ = (uint8_t)(ttl & 0xFF);
+        *data++ = (uint8_t)(rdata_length >> 8);
+        *data++ = (uint8_t)(rdata_length & 0xFF);
+        if (rdata_length > 0) {
+            memcpy(data, rdata, rdata_length);
+            data += rdata_length;
+        }
+    }
+
+    return data;
+}
+
+/* Build a plausible response to a query. Address queries for "www" names
+ * get a CNAME to an edge server followed by the address of that server,
+ * other address queries get two addresses, NS, PTR, MX and SOA queries
+ * get a record with compressed names, other types get a single record
+ * with opaque data. All responses carry an NS record in the
+ * authority section and an OPT record in the additional section.
+ */
+int quicdoq_bench_format_response(quicdoq_bench_packet_t* response, char const* qname, uint16_t id, uint16_t qtype)
+{
+    const uint8_t cname_rdata[] = { 4, 'e', 'd', 'g', 'e', 0xC0, 12 };
+    const uint8_t ns_rdata[] = { 3, 'n', 's', '1', 0xC0, 12 };
+    const uint8_t mx_rdata[] = { 0, 10, 4, 'm', 'a', 'i', 'l', 0xC0, 12 };
+    const uint8_t soa_rdata[] = { 3, 'n', 's', '1', 0xC0, 12, 10, 'h', 'o', 's', 't', 'm', 'a', 's', 't', 'e', 'r', 0xC0, 12,
+        0x78, 0x49, 0x2B, 0x01, 0, 0, 0x1C, 0x20, 0, 0, 0x0E, 0x10, 0, 0x12, 0x75, 0, 0, 0, 0x0E, 0x10 };
+    const uint8_t a_rdata[] = { 192, 0, 2, 1, 192, 0, 2, 2 };
+    const uint8_t aaaa_rdata[] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x35 };
+    uint8_t opaque_rdata[48];
+    uint8_t* data = response->data;
+    uint8_t* data_max = response->data + sizeof(response->data);
+    uint16_t ancount = 0;
+
+    for (size_t i = 0; i < sizeof(opaque_rdata); i++) {
+        opaque_rdata[i] = (uint8_t)(i * 7 + qtype);
+    }
+
+    memset(data, 0, 12);
+    data[0] = (uint8_t)(id >> 8);
+    data[1] = (uint8_t)(id & 0xFF);
+    data[2] = 0x81; /* QR = 1, RD = 1 */
+    data[3] = 0x80; /* RA = 1 */
+    data[5] = 1; /* qdcount */
+    data[9] = 1; /* nscount */
+    data[11] = 1; /* arcount */
+
+    data = quicdog_format_dns_name(data + 12, data_max, qname);
+    if (data != NULL && data + 4 <= data_max) {
+        *data++ = (uint8_t)(qtype >> 8);
+        *data++ = (uint8_t)(qtype & 0xFF);
+        *data++ = 0;
+        *data++ = 1;
+    }
+    else {
+        data = NULL;
+    }
+
+    if (data != NULL) {
+        if (qtype == 1 && strncmp(qname, "www.", 4) == 0) {
+            uint16_t cname_offset = (uint16_t)(data - response->data + 12);
+            data = quicdoq_bench_add_rr(data, data_max, 12, 5, 1, 3600, cname_rdata, sizeof(cname_rdata));
+            data = quicdoq_bench_add_rr(data, data_max, cname_offset, 1, 1, 60, a_rdata, 4);
+            ancount = 2;
+        }
+        else if (qtype == 1) {
+            data = quicdoq_bench_add_rr(data, data_max, 12, 1, 1, 300, a_rdata, 4);
+            data = quicdoq_bench_add_rr(data, data_max, 12, 1, 1, 300, a_rdata + 4, 4);
+            ancount = 2;
+        }
+        else if (qtype == 28) {
+            data = quicdoq_bench_add_rr(data, data_max, 12, 28, 1, 300, aaaa_rdata, sizeof(aaaa_rdata));
+            ancount = 1;
+        }
+        else if (qtype == 2 || qtype == 12) {
+            data = quicdoq_bench_add_rr(data, data_max, 12, qtype, 1, 3600, ns_rdata, sizeof(ns_rdata));
+            ancount = 1;
+        }
+        else if (qtype == 15) {
+            data = quicdoq_bench_add_rr(data, data_max, 12, qtype, 1, 3600, mx_rdata, sizeof(mx_rdata));
+            ancount = 1;
+        }
+        else if (qtype == 6) {
+            data = quicdoq_bench_add_rr(data, data_max, 12, qtype, 1, 3600, soa_rdata, sizeof(soa_rdata));
+            ancount = 1;
+        }
+        else {
+            data = quicdoq_bench_add_rr(data, data_max, 12, qtype, 1, 3600, opaque_rdata, sizeof(opaque_rdata));
+            ancount = 1;
+        }
+        data = quicdoq_bench_add_rr(data, data_max, 12, 2, 1, 86400, ns_rdata, sizeof(ns_rdata));
+        data = quicdoq_bench_add_rr(data, data_max, 0, 41, QUICDOQ_BENCH_MAX_PACKET, 0, NULL, 0);
+    }
+
+    if (data == NULL) {
+        response->length = 0;
+        return -1;
+    }
+
+    response->data[7] = (uint8_t)ancount;
+    response->length = data - response->data;
+
+    return 0;
+}
+
+/* Build the corpus: one query and one response per name, with query
+ * types cycling through the list, and the list of all name labels.
+ * Verify that every message parses before running the benchmarks.
+ */
+int quicdoq_bench_init(quicdoq_bench_ctx_t* bench_ctx)
+{
+    int ret = 0;
+
+    memset(bench_ctx, 0, sizeof(quicdoq_bench_ctx_t));
+    bench_ctx->nb_packets = QUICDOQ_BENCH_NB_NAMES;
+    bench_ctx->queries = (quicdoq_bench_packet_t*)malloc(sizeof(quicdoq_bench_packet_t) * bench_ctx->nb_packets);
+    bench_ctx->responses = (quicdoq_bench_packet_t*)malloc(sizeof(quicdoq_bench_packet_t) * bench_ctx->nb_packets);
+
+    if (bench_ctx->queries == NULL || bench_ctx->responses == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        ret = -1;
+    }
+
+    for (size_t i = 0; ret == 0 && i < bench_ctx->nb_packets; i++) {
+        quicdoq_bench_packet_t* query = &bench_ctx->queries[i];
+        uint16_t id = (uint16_t)(0x1000 + i);
+        uint16_t qtype = bench_qtypes[i % QUICDOQ_BENCH_NB_QTYPES];
+        uint8_t* data = quicdog_format_dns_query(query->data, query->data + sizeof(query->data),
+            bench_names[i], id, 1, qtype, QUICDOQ_BENCH_MAX_PACKET);
+
+        if (data == NULL || quicdoq_bench_format_response(&bench_ctx->responses[i], bench_names[i], id, qtype) != 0) {
+            fprintf(stderr, "Cannot format the messages for: %s\n", bench_names[i]);
+            ret = -1;
+        }
+        else {
+            size_t start = 12;
+            query->length = data - query->data;
+
+            while (start < query->length && query->data[start] != 0 && bench_ctx->nb_labels < QUICDOQ_BENCH_MAX_LABELS) {
+                bench_ctx->labels[bench_ctx->nb_labels].value = &query->data[start + 1];
+                bench_ctx->labels[bench_ctx->nb_labels].length = query->data[start];
+                bench_ctx->nb_labels++;
+                start += (size_t)query->data[start] + 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < bench_ctx->nb_packets; i++) {
+        if (quicdoq_bench_parse_query(bench_ctx, i) == 0 || quicdoq_bench_parse_response(bench_ctx, i) == 0 ||
+            quicdoq_bench_skip_names(bench_ctx, i) == 0 || quicdoq_bench_view_query(bench_ctx, i) == 0 ||
+            quicdoq_bench_view_response(bench_ctx, i) == 0 || quicdoq_bench_fold(bench_ctx, i) == 0) {
+            fprintf(stderr, "Cannot parse the messages for: %s\n", bench_names[i]);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+void quicdoq_bench_release(quicdoq_bench_ctx_t* bench_ctx)
+{
+    if (bench_ctx->queries != NULL) {
+        free(bench_ctx->queries);
+        bench_ctx->queries = NULL;
+    }
+    if (bench_ctx->responses != NULL) {
+        free(bench_ctx->responses);
+        bench_ctx->responses = NULL;
+    }
+}
+
+/* The benchmark functions return 0 if the operation failed, which
+ * is used when checking the corpus. */
+size_t quicdoq_bench_parse_query(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_packet_t* query = &bench_ctx->queries[op_index % bench_ctx->nb_packets];
+    uint8_t* text = bench_ctx->text;
+
+    (void)quicdoq_parse_dns_query(query->data, query->length, 0, &text, bench_ctx->text + sizeof(bench_ctx->text));
+    if (text == NULL) {
+        return 0;
+    }
+    bench_ctx->checksum += text - bench_ctx->text;
+
+    return query->length;
+}
+
+size_t quicdoq_bench_parse_response(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_packet_t* response = &bench_ctx->responses[op_index % bench_ctx->nb_packets];
+    uint8_t* text = bench_ctx->text;
+
+    (void)quicdoq_parse_dns_query(response->data, response->length, 0, &text, bench_ctx->text + sizeof(bench_ctx->text));
+    if (text == NULL) {
+        return 0;
+    }
+    bench_ctx->checksum += text - bench_ctx->text;
+
+    return response->length;
+}
+
+/* Walk all the records of a response, skipping the names, as done
+ * when looking for a specific section or record. */
+size_t quicdoq_bench_skip_names(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_packet_t* response = &bench_ctx->responses[op_index % bench_ctx->nb_packets];
+    const uint8_t* packet = response->data;
+    size_t length = response->length;
+    size_t qdcount = ((size_t)packet[4] << 8) | packet[5];
+    size_t nb_rr = (((size_t)packet[6] << 8) | packet[7]) + (((size_t)packet[8] << 8) | packet[9]) +
+        (((size_t)packet[10] << 8) | packet[11]);
+    size_t start = 12;
+
+    for (size_t i = 0; start < length && i < qdcount; i++) {
+        start = quicdoq_skip_dns_name(packet, length, start) + 4;
+    }
+    for (size_t i = 0; start < length && i < nb_rr; i++) {
+        start = quicdoq_skip_dns_name(packet, length, start);
+        if (start + 10 > length) {
+            start = length + 1;
+            break;
+        }
+        start += 10 + (((size_t)packet[start + 8] << 8) | packet[start + 9]);
+    }
+    if (start != length) {
+        return 0;
+    }
+    bench_ctx->checksum += start;
+
+    return length;
+}
+
+/* Build a response to the query with the message builder, including the
+ * parse of the query: a CNAME to a name under the query name, an address,
+ * an NS record in the authority section and an OPT record with EDE. */
+size_t quicdoq_bench_build_response(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    static const uint8_t edge_label[] = { 4, 'e', 'd', 'g', 'e' };
+    static const uint8_t ns1_name[] = { 3, 'n', 's', '1', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'n', 'e', 't', 0 };
+    static const uint8_t a_rdata[] = { 192, 0, 2, 1 };
+    quicdoq_bench_packet_t* query = &bench_ctx->queries[op_index % bench_ctx->nb_packets];
+    quicdoq_query_ctx_t* query_ctx = &bench_ctx->query_ctx;
+    quicdoq_builder_t* builder = &bench_ctx->builder;
+    uint8_t target[256];
+    size_t qname_length = quicdoq_skip_dns_name(query->data, query->length, 12) - 12;
+
+    if (qname_length + sizeof(edge_label) > sizeof(target)) {
+        qname_length = 1;
+    }
+    memcpy(target, edge_label, sizeof(edge_label));
+    memcpy(target + sizeof(edge_label), query->data + 12, qname_length);
+
+    query_ctx->query = query->data;
+    query_ctx->query_length = (uint16_t)query->length;
+    query_ctx->response = bench_ctx->buffer;
+    query_ctx->response_max_size = (uint16_t)sizeof(bench_ctx->buffer);
+    query_ctx->is_query_view_valid = 0;
+
+    if (quicdoq_builder_init_response(builder, query_ctx, 0) != 0 ||
+        quicdoq_builder_start_rr(builder, quicdoq_section_answer, query->data + 12, 5, 1, 3600) != 0 ||
+        quicdoq_builder_add_rdata_name(builder, target, 1) != 0 ||
+        quicdoq_builder_add_rr(builder, quicdoq_section_answer, target, 1, 1, 60, a_rdata, sizeof(a_rdata)) != 0 ||
+        quicdoq_builder_start_rr(builder, quicdoq_section_authority, ns1_name + 4, 2, 1, 86400) != 0 ||
+        quicdoq_builder_add_rdata_name(builder, ns1_name, 1) != 0 ||
+        quicdoq_builder_start_opt(builder, 1232, 0, 0) != 0 ||
+        quicdoq_builder_add_ede(builder, 3, NULL) != 0 ||
+        quicdoq_builder_finish_response(builder, query_ctx) != 0) {
+        return 0;
+    }
+    bench_ctx->checksum += query_ctx->response_length;
+
+    return query_ctx->response_length;
+}
+
+size_t quicdoq_bench_view_query(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_packet_t* query = &bench_ctx->queries[op_index % bench_ctx->nb_packets];
+
+    if (quicdoq_dns_view_parse(&bench_ctx->view, query->data, query->length) != 0) {
+        return 0;
+    }
+    bench_ctx->checksum += bench_ctx->view.qtype;
+
+    return query->length;
+}
+
+size_t quicdoq_bench_view_response(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_packet_t* response = &bench_ctx->responses[op_index % bench_ctx->nb_packets];
+
+    if (quicdoq_dns_view_parse(&bench_ctx->view, response->data, response->length) != 0) {
+        return 0;
+    }
+    bench_ctx->checksum += bench_ctx->view.nb_rr;
+
+    return response->length;
+}
+
+size_t quicdoq_bench_format_query(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    size_t i = (size_t)(op_index % QUICDOQ_BENCH_NB_NAMES);
+    uint8_t* data = quicdog_format_dns_query(bench_ctx->buffer, bench_ctx->buffer + sizeof(bench_ctx->buffer),
+        bench_names[i], (uint16_t)op_index, 1, bench_qtypes[i % QUICDOQ_BENCH_NB_QTYPES], QUICDOQ_BENCH_MAX_PACKET);
+
+    if (data == NULL) {
+        return 0;
+    }
+    bench_ctx->checksum += data[-1];
+
+    return data - bench_ctx->buffer;
+}
+
+size_t quicdoq_bench_normalize(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_label_t* label = &bench_ctx->labels[op_index % bench_ctx->nb_labels];
+    uint8_t* text = NormalizeNamePart(label->length, label->value, bench_ctx->text, bench_ctx->text + sizeof(bench_ctx->text));
+
+    if (text == NULL) {
+        return 0;
+    }
+    bench_ctx->checksum += text - bench_ctx->text;
+
+    return label->length;
+}
+
+size_t quicdoq_bench_normalize_scalar(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_label_t* label = &bench_ctx->labels[op_index % bench_ctx->nb_labels];
+    uint8_t* text = quicdoq_normalize_name_part_scalar(label->length, label->value, bench_ctx->text,
+        bench_ctx->text + sizeof(bench_ctx->text));
+
+    if (text == NULL) {
+        return 0;
+    }
+    bench_ctx->checksum += text - bench_ctx->text;
+
+    return label->length;
+}
+
+size_t quicdoq_bench_normalize_long(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    char const* label = bench_long_labels[op_index % QUICDOQ_BENCH_NB_LONG_LABELS];
+    size_t length = strlen(label);
+    uint8_t* text = NormalizeNamePart(length, (const uint8_t*)label, bench_ctx->text,
+        bench_ctx->text + sizeof(bench_ctx->text));
+
+    if (text == NULL) {
+        return 0;
+    }
+    bench_ctx->checksum += text - bench_ctx->text;
+
+    return length;
+}
+
+size_t quicdoq_bench_normalize_long_scalar(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    char const* label = bench_long_labels[op_index % QUICDOQ_BENCH_NB_LONG_LABELS];
+    size_t length = strlen(label);
+    uint8_t* text = quicdoq_normalize_name_part_scalar(length, (const uint8_t*)label, bench_ctx->text,
+        bench_ctx->text + sizeof(bench_ctx->text));
+
+    if (text == NULL) {
+        return 0;
+    }
+    bench_ctx->checksum += text - bench_ctx->text;
+
+    return length;
+}
+
+/* Fold the question name of the responses, as done to compute cache keys */
+size_t quicdoq_bench_fold(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_packet_t* response = &bench_ctx->responses[op_index % bench_ctx->nb_packets];
+    size_t folded_length = 0;
+    uint64_t name_hash = 0;
+
+    if (quicdoq_fold_dns_name(response->data, response->length, 12, bench_ctx->buffer, sizeof(bench_ctx->buffer),
+        &folded_length, &name_hash) == 0) {
+        return 0;
+    }
+    bench_ctx->checksum += name_hash;
+
+    return folded_length;
+}
+
+size_t quicdoq_bench_fold_scalar(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    quicdoq_bench_packet_t* response = &bench_ctx->responses[op_index % bench_ctx->nb_packets];
+    size_t folded_length = 0;
+    uint64_t name_hash = 0;
+
+    if (quicdoq_fold_dns_name_scalar(response->data, response->length, 12, bench_ctx->buffer, sizeof(bench_ctx->buffer),
+        &folded_length, &name_hash) == 0) {
+        return 0;
+    }
+    bench_ctx->checksum += name_hash;
+
+    return folded_length;
+}
+
+size_t quicdoq_bench_get_rr_type(quicdoq_bench_ctx_t* bench_ctx, uint64_t op_index)
+{
+    char const* rr_name = bench_rr_names[op_index % QUICDOQ_BENCH_NB_RR_NAMES];
+
+    bench_ctx->checksum += quicdoq_get_rr_type(rr_name);
+
+    return strlen(rr_name);
+}
+
+/* Read the time stamp counter, if the platform has one */
+uint64_t quicdoq_bench_cycles()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    return (uint64_t)__rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Run a benchmark, after a short warm up to load the caches. */
+void quicdoq_bench_run(quicdoq_bench_ctx_t* bench_ctx, quicdoq_bench_fn fn, uint64_t nb_ops, quicdoq_bench_result_t* result)
+{
+    uint64_t nb_warmup = nb_ops / 10;
+    uint64_t start_time;
+    uint64_t start_cycles;
+
+    memset(result, 0, sizeof(quicdoq_bench_result_t));
+
+    for (uint64_t i = 0; i < nb_warmup; i++) {
+        (void)fn(bench_ctx, i);
+    }
+
+    start_time = picoquic_current_time();
+    start_cycles = quicdoq_bench_cycles();
+    for (uint64_t i = 0; i < nb_ops; i++) {
+        result->nb_bytes += fn(bench_ctx, i);
+    }
+    result->cycles = quicdoq_bench_cycles() - start_cycles;
+    result->elapsed_us = picoquic_current_time() - start_time;
+    result->nb_ops = nb_ops;
+}
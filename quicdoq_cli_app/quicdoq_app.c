@@ -90,6 +90,9 @@
 #include "picoquic_binlog.h"
 #include "picoquic_logger.h"
 
+#define QUICDOQ_DEMO_CNX_DUMP_INTERVAL 10000000
+#define QUICDOQ_DEMO_CNX_DUMP_TOP 10
+
 typedef struct st_quicdoq_demo_client_ctx_t {
     quicdoq_ctx_t* qd_client;
     char test_server_cert_store_file[512];
@@ -108,7 +111,8 @@ int quicdoq_demo_server(
     const char* alpn, const char* server_cert_file, const char* server_key_file, const char* log_file,
     const char* binlog_dir, char const* qlog_dir, const char* backend_dns_server, const char* solution_dir,
     int use_long_log, int server_port, int dest_if, int mtu_max, int do_retry,
-    uint64_t* reset_seed, char const* cc_algo_id);
+    uint64_t* reset_seed, char const* cc_algo_id, char const* cdns_file, char const* app_log_file,
+    char const* metrics_target, char const* cnx_dump_column, int deadline_budget_ms);
 int quicdoq_client(const char* server_name, int server_port, int dest_if,
     const char* sni, const char* alpn, const char* root_crt,
     int mtu_max, const char* log_file, char const* binlog_dir, char const* qlog_dir, int use_long_log,
@@ -117,6 +121,7 @@ int quicdoq_client(const char* server_name, int server_port, int dest_if,
 int quicdoq_demo_client_init_context(quicdoq_ctx_t* qd_client, quicdoq_demo_client_ctx_t * client_ctx, int nb_client_queries, char const** client_query_text,
     char const* server_name, struct sockaddr* server_addr, struct sockaddr* client_addr, uint64_t current_time);
 void quicdoq_demo_client_reset_context(quicdoq_ctx_t* qd_client, quicdoq_demo_client_ctx_t * client_ctx);
+SOCKET_TYPE quicdoq_demo_open_backend_socket(struct sockaddr* backend_addr);
 int quicdoq_demo_client_cb(quicdoq_query_return_enum callback_code, void* callback_ctx, quicdoq_query_ctx_t* query_ctx, uint64_t current_time);
 
 int main(int argc, char** argv)
@@ -134,6 +139,10 @@ int main(int argc, char** argv)
     const char* backend_dns_server = NULL;
     const char* solution_dir = NULL;
     const char* cc_algo_id = NULL;
+    const char* cdns_file = NULL;
+    const char* app_log_file = NULL;
+    const char* metrics_target = NULL;
+    const char* cnx_dump_column = NULL;
 
     int use_long_log = 0;
     int server_port = QUICDOQ_PORT;
@@ -148,6 +157,7 @@ int main(int argc, char** argv)
     const char* default_query = "example.com:A";
     const char* default_query_query_list[2]; 
     int nb_client_queries = 0;
+    int deadline_budget_ms = 0;
 
 #ifdef _WINDOWS
     WSADATA wsaData = { 0 };
@@ -156,7 +166,7 @@ int main(int argc, char** argv)
 
     /* Get the parameters */
     int opt;
-    while ((opt = getopt(argc, argv, "c:k:K:E:l:b:q:Lp:e:m:n:a:rs:t:v:I:G:S:d:h")) != -1) {
+    while ((opt = getopt(argc, argv, "c:k:K:E:l:b:q:Lp:e:m:n:a:rs:t:v:I:G:S:d:D:A:M:C:B:h")) != -1) {
         switch (opt) {
         case 'c':
             server_cert_file = optarg;
@@ -235,6 +245,28 @@ int main(int argc, char** argv)
         case 'd':
             backend_dns_server = optarg;
             break;
+        case 'D':
+            cdns_file = optarg;
+            break;
+        case 'A':
+            app_log_file = optarg;
+            break;
+        case 'M':
+            metrics_target = optarg;
+            break;
+        case 'C':
+            if (quicdoq_cnx_column_from_name(optarg) == quicdoq_cnx_column_max) {
+                fprintf(stderr, "Unknown connection statistics column: %s\n", optarg);
+                usage();
+            }
+            cnx_dump_column = optarg;
+            break;
+        case 'B':
+            if ((deadline_budget_ms = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid deadline budget: %s\n", optarg);
+                usage();
+            }
+            break;
         case 'h':
             usage();
             break;
@@ -275,7 +307,8 @@ int main(int argc, char** argv)
         /* start server using specified options */
         ret = quicdoq_demo_server(alpn, server_cert_file, server_key_file, 
             log_file, binlog_dir, qlog_dir, backend_dns_server, solution_dir, use_long_log, server_port, dest_if, 
-            mtu_max, do_retry, reset_seed, cc_algo_id);
+            mtu_max, do_retry, reset_seed, cc_algo_id, cdns_file, app_log_file, metrics_target, cnx_dump_column,
+            deadline_budget_ms);
     }
 
     return ret;
@@ -315,6 +348,14 @@ void usage()
     fprintf(stderr, "                        reno, cubic, bbr or fast. Defaults to bbr.\n");
     fprintf(stderr, "  -S solution_dir       Set the path to the solution folder, to find the default files\n");
     fprintf(stderr, "  -d dns_server         name or address of backend DNS server (default 1.1.1.1).\n");
+    fprintf(stderr, "  -D file               Log the queries and responses to this C-DNS file.\n");
+    fprintf(stderr, "  -A file               Log the query events to this file, from a separate thread.\n");
+    fprintf(stderr, "  -M target             Write the metrics in Prometheus text format every 10 seconds\n");
+    fprintf(stderr, "  -C column             Print the top 10 connections sorted by column every 10 seconds,\n");
+    fprintf(stderr, "                        column is one of queries, responses, refused, resets, bytes_in,\n");
+    fprintf(stderr, "                        bytes_out, streams, peak, rtt, cwin, lost\n");
+    fprintf(stderr, "                        to this file, or to a Unix socket if target is unix:path.\n");
+    fprintf(stderr, "  -B budget_ms          Answer SERVFAIL to the queries not resolved within budget_ms.\n");
 
     fprintf(stderr, "\nIn client mode, the scenario provides the list of names to be resolved\n");
     fprintf(stderr, "and the record type, e.g.:\n");
@@ -372,15 +413,22 @@ int quicdoq_demo_server(
     const char* alpn, const char* server_cert_file, const char* server_key_file, const char* log_file,
     const char* binlog_dir, char const* qlog_dir, const char* backend_dns_server, const char* solution_dir,
     int use_long_log, int server_port, int dest_if, int mtu_max, int do_retry,
-    uint64_t* reset_seed, char const * cc_algo_id)
+    uint64_t* reset_seed, char const * cc_algo_id, char const* cdns_file, char const* app_log_file,
+    char const* metrics_target, char const* cnx_dump_column, int deadline_budget_ms)
 {
     int ret = 0;
     char default_server_cert_file[512];
     char default_server_key_file[512];
     quicdoq_ctx_t * qd_server = NULL;
     quicdoq_udp_ctx_t * udp_ctx = NULL;
+    quicdoq_cdns_t* cdns = NULL;
+    quicdoq_app_log_t* app_log = NULL;
+    quicdoq_metrics_t* metrics = NULL;
+    uint64_t next_cnx_dump_time = UINT64_MAX;
     struct sockaddr_storage udp_addr;
     picoquic_server_sockets_t server_sockets;
+    SOCKET_TYPE s_socket[PICOQUIC_NB_SERVER_SOCKETS + 1];
+    SOCKET_TYPE backend_socket = INVALID_SOCKET;
     struct sockaddr_storage addr_from;
     struct sockaddr_storage addr_to;
     int if_index_to;
@@ -453,6 +501,44 @@ int quicdoq_demo_server(
         }
     }
 
+    /* Start the C-DNS log if requested */
+    if (ret == 0 && cdns_file != NULL) {
+        cdns = quicdoq_cdns_open(cdns_file, 0, 0, QUICDOQ_CDNS_QR_TYPE_CLIENT);
+        if (cdns == NULL) {
+            fprintf(stderr, "Cannot open the C-DNS log file: %s\n", cdns_file);
+            ret = -1;
+        }
+        else {
+            quicdoq_set_cdns_log(qd_server, cdns);
+        }
+    }
+
+    /* Start the asynchronous application log if requested */
+    if (ret == 0 && app_log_file != NULL) {
+        app_log = quicdoq_app_log_open(app_log_file, 0);
+        if (app_log == NULL) {
+            fprintf(stderr, "Cannot open the application log file: %s\n", app_log_file);
+            ret = -1;
+        }
+        else {
+            quicdoq_set_app_log(qd_server, app_log);
+        }
+    }
+
+    /* Start the metrics export if requested */
+    if (ret == 0 && metrics_target != NULL) {
+        metrics = quicdoq_metrics_create();
+        if (metrics == NULL || quicdoq_set_metrics(qd_server, metrics) != 0 ||
+            quicdoq_metrics_start_export(metrics, metrics_target, QUICDOQ_METRICS_DEFAULT_EXPORT_INTERVAL) != 0) {
+            fprintf(stderr, "Cannot export the metrics to: %s\n", metrics_target);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && deadline_budget_ms > 0) {
+        quicdoq_set_deadline_budget(qd_server, ((uint64_t)deadline_budget_ms) * 1000, 1);
+    }
+
     if (ret == 0) {
         /* set the extra server parameters */
         picoquic_quic_t* quic = quicdoq_get_quic_ctx(qd_server);
@@ -487,11 +573,27 @@ int quicdoq_demo_server(
         ret = picoquic_open_server_sockets(&server_sockets, server_port);
     }
 
+    if (ret == 0) {
+        /* Open the socket connected to the backend server */
+        backend_socket = quicdoq_demo_open_backend_socket((struct sockaddr*) & udp_addr);
+        if (backend_socket == INVALID_SOCKET) {
+            printf("Cannot open a socket to the backend dns server: %s\n", backend_dns_server);
+            ret = -1;
+        }
+        else {
+            quicdoq_udp_set_connected(udp_ctx, 1);
+            for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++) {
+                s_socket[i] = server_sockets.s_socket[i];
+            }
+            s_socket[PICOQUIC_NB_SERVER_SOCKETS] = backend_socket;
+        }
+    }
 
     while (ret == 0) {
         /* do the server loop */
         unsigned char received_ecn;
         int bytes_recv;
+        int socket_rank = -1;
         uint64_t delta_t = 0;
         uint64_t current_time = picoquic_current_time();
         uint64_t next_time = picoquic_get_next_wake_time(quicdoq_get_quic_ctx(qd_server), current_time);
@@ -500,6 +602,24 @@ int quicdoq_demo_server(
             next_time = quicdoq_next_udp_time(udp_ctx);
         }
 
+        if (quicdoq_next_deadline(qd_server) < next_time) {
+            next_time = quicdoq_next_deadline(qd_server);
+        }
+
+        if (cnx_dump_column != NULL) {
+            /* Print the busiest connections at regular intervals */
+            if (next_cnx_dump_time == UINT64_MAX) {
+                next_cnx_dump_time = current_time + QUICDOQ_DEMO_CNX_DUMP_INTERVAL;
+            }
+            else if (current_time >= next_cnx_dump_time) {
+                (void)quicdoq_dump_top_cnx(qd_server, stdout, quicdoq_cnx_column_from_name(cnx_dump_column), QUICDOQ_DEMO_CNX_DUMP_TOP);
+                next_cnx_dump_time = current_time + QUICDOQ_DEMO_CNX_DUMP_INTERVAL;
+            }
+            if (next_cnx_dump_time < next_time) {
+                next_time = next_cnx_dump_time;
+            }
+        }
+
         if (next_time > current_time) {
             delta_t = next_time - current_time;
 
@@ -510,13 +630,20 @@ int quicdoq_demo_server(
 
         if_index_to = 0;
         
-        bytes_recv = picoquic_select(server_sockets.s_socket, PICOQUIC_NB_SERVER_SOCKETS,
+        bytes_recv = picoquic_select_ex(s_socket, PICOQUIC_NB_SERVER_SOCKETS + 1,
                 &addr_from,
                 &addr_to, &if_index_to, &received_ecn,
                 buffer, sizeof(buffer),
-                (int64_t)delta_t, &current_time);
-
-        if (bytes_recv < 0) {
+                (int64_t)delta_t, &socket_rank, &current_time);
+
+        if (bytes_recv < 0 && socket_rank == PICOQUIC_NB_SERVER_SOCKETS) {
+            /* Errors on the backend socket, e.g., ECONNREFUSED after an ICMP port
+             * unreachable, do not stop the server. The relay retransmits the queries. */
+            picoquic_log_context_free_app_message(quicdoq_get_quic_ctx(qd_server), &picoquic_null_connection_id,
+                "Receive error on the backend socket, ret=%d", bytes_recv);
+            quicdoq_udp_socket_error(udp_ctx);
+        }
+        else if (bytes_recv < 0) {
             ret = -1;
         }
         else {
@@ -525,8 +652,8 @@ int quicdoq_demo_server(
             size_t send_length = 0;
 
             if (bytes_recv > 0) {
-                if (picoquic_compare_addr((struct sockaddr*) & addr_from, (struct sockaddr*) & udp_addr) == 0) {
-                    /* This is a packet from the UDP server. Send it there */
+                if (socket_rank == PICOQUIC_NB_SERVER_SOCKETS) {
+                    /* This is a packet from the UDP server, filtered by the connected socket. Send it there */
                     quicdoq_udp_incoming_packet(udp_ctx, buffer, (uint32_t)bytes_recv, (struct sockaddr*) & addr_to, if_index_to, current_time);
                 }
                 else {
@@ -549,14 +676,27 @@ int quicdoq_demo_server(
 
                 send_length = 0;
 
+                quicdoq_check_deadlines(qd_server, loop_time);
+
                 if (quicdoq_next_udp_time(udp_ctx) <= current_time) {
                     /* check whether there is something to send */
                     quicdoq_udp_prepare_next_packet(udp_ctx, loop_time,
                         send_buffer, sizeof(send_buffer), &send_length,
                         &peer_addr, &local_addr, &if_index);
+
+                    if (send_length > 0) {
+                        /* Relay traffic goes through the connected backend socket */
+                        int bytes_sent = (int)send(backend_socket, (const char*)send_buffer, (int)send_length, 0);
+
+                        if (bytes_sent <= 0) {
+                            picoquic_log_context_free_app_message(quicdoq_get_quic_ctx(qd_server), &log_cid,
+                                "Could not send query to backend server, ret=%d", bytes_sent);
+                        }
+                        continue;
+                    }
                 }
 
-                if (send_length == 0 && picoquic_get_next_wake_time(quicdoq_get_quic_ctx(qd_server), current_time) <= current_time) {
+                if (picoquic_get_next_wake_time(quicdoq_get_quic_ctx(qd_server), current_time) <= current_time) {
                     ret = picoquic_prepare_next_packet(quicdoq_get_quic_ctx(qd_server), loop_time,
                         send_buffer, sizeof(send_buffer), &send_length,
                         &peer_addr, &local_addr, &if_index, &log_cid, &last_cnx);
@@ -594,6 +734,10 @@ int quicdoq_demo_server(
     /* Clean up */
     picoquic_close_server_sockets(&server_sockets);
 
+    if (backend_socket != INVALID_SOCKET) {
+        SOCKET_CLOSE(backend_socket);
+    }
+
     if (udp_ctx != NULL) {
         quicdoq_delete_udp_ctx(udp_ctx);
     }
@@ -602,6 +746,18 @@ int quicdoq_demo_server(
         quicdoq_delete(qd_server);
     }
 
+    if (cdns != NULL) {
+        quicdoq_cdns_close(cdns);
+    }
+
+    if (app_log != NULL) {
+        quicdoq_app_log_close(app_log);
+    }
+
+    if (metrics != NULL) {
+        quicdoq_metrics_delete(metrics);
+    }
+
     if (F_log != NULL) {
         (void) picoquic_file_close(F_log);
     }
@@ -609,6 +765,24 @@ int quicdoq_demo_server(
     return ret;
 }
 
+/* Open a UDP socket connected to the backend server.
+ * The kernel filters packets from other sources, caches the route to
+ * the backend, and keeps the relay traffic separate from the Quic traffic
+ * arriving on the server sockets.
+ */
+SOCKET_TYPE quicdoq_demo_open_backend_socket(struct sockaddr* backend_addr)
+{
+    SOCKET_TYPE fd = socket(backend_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (fd != INVALID_SOCKET &&
+        connect(fd, backend_addr, picoquic_addr_length(backend_addr)) != 0) {
+        SOCKET_CLOSE(fd);
+        fd = INVALID_SOCKET;
+    }
+
+    return fd;
+}
+
 #define QUICDOQ_DEMO_CLIENT_MAX_RECEIVE_BATCH 16
 
 /* Quic Client */
@@ -807,56 +981,6 @@ int quicdoq_client(const char* server_name, int server_port, int dest_if,
     return ret;
 }
 
-/* Init a client query from the text query */
-int quicdoq_demo_client_init_query(quicdoq_query_ctx_t* query_ctx, char const* client_query_text)
-{
-    /* Parse txt query into text & rr type */
-    int ret = 0;
-    char name[256];
-    int l_n;
-    int i_rr = -1;
-    uint16_t rr_type = 1; /* Default to "A" */
-
-    for (l_n = 0; l_n < 256; l_n++) {
-        if (client_query_text[l_n] == ':') {
-            name[l_n] = 0;
-            i_rr = l_n + 1;
-            break;
-        }
-        else if (client_query_text[l_n] == 0) {
-            name[l_n] = 0;
-            break;
-        }
-        else {
-            name[l_n] = client_query_text[l_n];
-        }
-    }
-
-    if (l_n >= 256) {
-        ret = -1;
-    }
-    else if (i_rr > 0) {
-        /* Get rr type from text */
-        if ((rr_type = quicdoq_get_rr_type(&client_query_text[i_rr])) == UINT16_MAX) {
-            ret = -1;
-        }
-    }
-        
-    /* Create query context in client ctx */
-    if (ret == 0) {
-        uint8_t* query_end = quicdog_format_dns_query(query_ctx->query, query_ctx->query + query_ctx->query_max_size, name, 0, 1, rr_type, query_ctx->response_max_size);
-
-        if (query_end == NULL) {
-            ret = -1;
-        }
-        else {
-            query_ctx->query_length = (uint16_t)(query_end - query_ctx->query);
-        }
-    }
-
-    return ret;
-}
-
 /* Creation of a client context from a list of text queries */
 
 int quicdoq_demo_client_init_context(quicdoq_ctx_t* qd_client, quicdoq_demo_client_ctx_t * client_ctx, int nb_client_queries, char const** client_query_text,
@@ -890,7 +1014,7 @@ int quicdoq_demo_client_init_context(quicdoq_ctx_t* qd_client, quicdoq_demo_clie
                 client_ctx->query_ctx[i]->query_id = (uint16_t)i;
                 client_ctx->query_ctx[i]->client_cb = quicdoq_demo_client_cb;
                 client_ctx->query_ctx[i]->client_cb_ctx = client_ctx;
-                ret = quicdoq_demo_client_init_query(client_ctx->query_ctx[i], client_query_text[i]);
+                ret = quicdoq_format_query_from_text(client_ctx->query_ctx[i], client_query_text[i]);
             }
         }
     }
@@ -975,6 +1099,9 @@ int quicdoq_demo_client_cb(
             /* tabulate cancelled & cancel time */
             fprintf(stdout, "Query #%d was cancelled.\n", qid);
             break;
+        case quicdoq_query_cancelled: /* The query was cancelled by the client. */
+            fprintf(stdout, "Query #%d was abandoned.\n", qid);
+            break;
         case quicdoq_query_failed:  /* Query failed for reasons other than cancelled. */
             /* tabulate failed & fail time  */
             fprintf(stdout, "Query #%d failed.\n", qid);
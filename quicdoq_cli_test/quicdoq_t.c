@@ -52,7 +52,39 @@ static const picoquic_test_def_t test_table[] = {
     { "multi_udp", quicdoq_multi_udp_test },
     { "one_loss", quicdoq_one_loss_test },
     { "quicdoq_one_loss_udp", quicdoq_one_loss_udp_test },
-    { "dns_refuse_format", dns_refuse_format_test}
+    { "dns_refuse_format", dns_refuse_format_test},
+    { "connected_udp", quicdoq_connected_udp_test },
+    { "pool", quicdoq_pool_test },
+    { "zero_rtt", quicdoq_zero_rtt_test },
+    { "zero_rtt_defer", quicdoq_zero_rtt_defer_test },
+    { "replay_cache", quicdoq_replay_cache_test },
+    { "affinity", quicdoq_affinity_test },
+    { "trace_pcap", quicdoq_trace_pcap_test },
+    { "trace_dnstap", quicdoq_trace_dnstap_test },
+    { "scale", quicdoq_scale_test },
+    { "scale_udp", quicdoq_scale_udp_test },
+    { "rr_hash", rr_hash_test },
+    { "dns_view", dns_view_test },
+    { "dns_name_simd", dns_name_simd_test },
+    { "dns_builder", dns_builder_test },
+    { "cdns", quicdoq_cdns_test },
+    { "app_log", quicdoq_app_log_test },
+    { "metrics", quicdoq_metrics_test },
+    { "latency_udp", quicdoq_latency_udp_test },
+    { "histogram", quicdoq_histogram_test },
+    { "cnx_stats", quicdoq_cnx_stats_test },
+    { "load_shed", quicdoq_load_shed_test },
+    { "load_shed_refuse", quicdoq_load_shed_refuse_test },
+    { "rate_limit", quicdoq_rate_limit_test },
+    { "rate_limit_cnx", quicdoq_rate_limit_cnx_test },
+    { "tp_profile", quicdoq_tp_profile_test },
+    { "tp_adaptive", quicdoq_tp_adaptive_test },
+    { "response_priority", quicdoq_response_priority_test },
+    { "cancel_query", quicdoq_cancel_query_test },
+    { "relay_cancel", quicdoq_relay_cancel_test },
+    { "relay_timeout", quicdoq_relay_timeout_test },
+    { "deadline", quicdoq_deadline_test },
+    { "hedge", quicdoq_hedge_test }
 };
 
 static size_t const nb_tests = sizeof(test_table) / sizeof(picoquic_test_def_t);
@@ -0,0 +1,1183 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Quicdoq load generator.
+ *
+ * Replay a list of queries against a DoQ server, either at a target
+ * rate (open loop) or keeping a target number of queries in flight
+ * (closed loop), over a set of client connections. Alternatively,
+ * replay a pcap or dnstap trace with its original timing, possibly
+ * accelerated, with the queries of each source IP address sent over
+ * a connection of their own. By default, the
+ * tool starts its own DoQ server on the loopback address, which
+ * answers every query immediately, so the measurement only covers
+ * the quicdoq and picoquic code paths. The tool reports throughput,
+ * handshake counts and the latency distribution, as text on stdout
+ * and optionally as JSON.
+ */
+
+#ifdef _WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include "getopt.h"
+#include <WinSock2.h>
+#include <Windows.h>
+#include <assert.h>
+#include <iphlpapi.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ws2tcpip.h>
+#include "picoquic.h"
+#include "picosocks.h"
+#include "picoquic_utils.h"
+#include "quicdoq.h"
+
+#else /* Linux */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifndef __USE_XOPEN2K
+#define __USE_XOPEN2K
+#endif
+#ifndef __USE_POSIX
+#define __USE_POSIX
+#endif
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include "picoquic.h"
+#include "picoquic_utils.h"
+#include "quicdoq.h"
+#include "picosocks.h"
+
+#endif
+
+#define QUICDOQ_PERF_DEFAULT_PORT 8853
+#define QUICDOQ_PERF_DEFAULT_DURATION 10
+#define QUICDOQ_PERF_DEFAULT_CONCURRENCY 64
+#define QUICDOQ_PERF_MAX_IN_FLIGHT 4096
+#define QUICDOQ_PERF_DRAIN_TIME 2000000
+#define QUICDOQ_PERF_MAX_LINE 256
+#define QUICDOQ_PERF_SOURCE_BINS 4096
+
+typedef struct st_quicdoq_perf_slot_t {
+    quicdoq_query_ctx_t* query_ctx;
+    uint64_t send_time;
+    int next_free;
+} quicdoq_perf_slot_t;
+
+/* Source addresses found in a trace, numbered in the order in which
+ * they first appear. */
+typedef struct st_quicdoq_perf_source_t {
+    struct sockaddr_storage addr;
+    int next_in_bin;
+} quicdoq_perf_source_t;
+
+typedef struct st_quicdoq_perf_ctx_t {
+    /* Parameters */
+    char** query_text;
+    int nb_query_text;
+    quicdoq_trace_t* trace; /* Trace replay if not NULL */
+    double time_scale; /* Trace replay speed, 2.0 is twice as fast */
+    uint64_t target_qps; /* Open loop if > 0 */
+    int concurrency; /* Closed loop if target_qps == 0 */
+    int nb_cnx;
+    uint64_t duration;
+    char const* server_name;
+    struct sockaddr* server_addr;
+    struct sockaddr* client_addr;
+    /* Load generation state */
+    quicdoq_perf_slot_t* slots;
+    int nb_slots;
+    int first_free;
+    int nb_in_flight;
+    int next_text;
+    uint64_t start_time;
+    uint64_t end_time;
+    uint64_t last_completion_time;
+    uint64_t nb_scheduled;
+    quicdoq_trace_query_t trace_query; /* Next query in the trace */
+    int has_trace_query;
+    uint64_t trace_start;
+    quicdoq_perf_source_t* sources;
+    int nb_sources;
+    int sources_alloc;
+    int source_bins[QUICDOQ_PERF_SOURCE_BINS];
+    /* Results */
+    uint64_t nb_sent;
+    uint64_t nb_completed;
+    uint64_t nb_cancelled;
+    uint64_t nb_failed;
+    uint64_t nb_not_sent;
+    uint64_t* latency;
+    size_t nb_latency;
+    size_t latency_alloc;
+} quicdoq_perf_ctx_t;
+
+void usage();
+int quicdoq_perf_server_cb(quicdoq_query_return_enum callback_code, void* callback_ctx,
+    quicdoq_query_ctx_t* query_ctx, uint64_t current_time);
+int quicdoq_perf_client_cb(quicdoq_query_return_enum callback_code, void* callback_ctx,
+    quicdoq_query_ctx_t* query_ctx, uint64_t current_time);
+int quicdoq_perf_load_queries(quicdoq_perf_ctx_t* perf_ctx, char const* query_file);
+int quicdoq_perf_open_trace(quicdoq_perf_ctx_t* perf_ctx, char const* trace_file);
+int quicdoq_perf_init_slots(quicdoq_perf_ctx_t* perf_ctx);
+void quicdoq_perf_release(quicdoq_perf_ctx_t* perf_ctx);
+int quicdoq_perf_send_queries(quicdoq_ctx_t* qd_client, quicdoq_perf_ctx_t* perf_ctx, uint64_t current_time);
+void quicdoq_perf_report(quicdoq_ctx_t* qd_client, quicdoq_perf_ctx_t* perf_ctx, FILE* F_json);
+int quicdoq_perf_run(quicdoq_perf_ctx_t* perf_ctx, char const* server_text, int server_port, int is_embedded,
+    char const* sni, char const* root_crt, char const* server_cert_file, char const* server_key_file,
+    char const* solution_dir, char const* json_file);
+
+int main(int argc, char** argv)
+{
+    int ret = 0;
+    quicdoq_perf_ctx_t perf_ctx;
+    char const* query_file = NULL;
+    char const* server_text = NULL;
+    char const* sni = NULL;
+    char const* root_crt = NULL;
+    char const* server_cert_file = NULL;
+    char const* server_key_file = NULL;
+    char const* solution_dir = NULL;
+    char const* json_file = NULL;
+    char const* trace_file = NULL;
+    int server_port = QUICDOQ_PERF_DEFAULT_PORT;
+    int opt;
+
+#ifdef _WINDOWS
+    WSADATA wsaData = { 0 };
+    (void)WSA_START(MAKEWORD(2, 2), &wsaData);
+#endif
+
+    memset(&perf_ctx, 0, sizeof(quicdoq_perf_ctx_t));
+    perf_ctx.nb_cnx = 0;
+    perf_ctx.time_scale = 1.0;
+
+    while ((opt = getopt(argc, argv, "f:T:x:r:C:N:d:p:n:t:c:k:S:j:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            query_file = optarg;
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'x':
+            perf_ctx.time_scale = atof(optarg);
+            if (perf_ctx.time_scale <= 0) {
+                fprintf(stderr, "Invalid time scale: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'r':
+            perf_ctx.target_qps = (uint64_t)strtoull(optarg, NULL, 10);
+            if (perf_ctx.target_qps == 0) {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'C':
+            perf_ctx.concurrency = atoi(optarg);
+            if (perf_ctx.concurrency <= 0 || perf_ctx.concurrency > QUICDOQ_PERF_MAX_IN_FLIGHT) {
+                fprintf(stderr, "Invalid concurrency: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'N':
+            perf_ctx.nb_cnx = atoi(optarg);
+            if (perf_ctx.nb_cnx <= 0) {
+                fprintf(stderr, "Invalid number of connections: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'd':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Invalid duration: %s\n", optarg);
+                usage();
+            }
+            perf_ctx.duration = ((uint64_t)atoi(optarg)) * 1000000ull;
+            break;
+        case 'p':
+            if ((server_port = atoi(optarg)) <= 0) {
+                fprintf(stderr, "Invalid port: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'n':
+            sni = optarg;
+            break;
+        case 't':
+            root_crt = optarg;
+            break;
+        case 'c':
+            server_cert_file = optarg;
+            break;
+        case 'k':
+            server_key_file = optarg;
+            break;
+        case 'S':
+            solution_dir = optarg;
+            break;
+        case 'j':
+            json_file = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            break;
+        }
+    }
+
+    if (optind < argc) {
+        server_text = argv[optind++];
+    }
+
+    if (trace_file != NULL) {
+        if (query_file != NULL || perf_ctx.target_qps > 0 || perf_ctx.concurrency > 0) {
+            fprintf(stderr, "A trace (-T) cannot be combined with a query file, a rate or a concurrency.\n");
+            usage();
+        }
+        /* In trace mode, each source gets its own connection unless the
+         * number of connections is set, see quicdoq_perf_open_trace() */
+    }
+    else {
+        if (perf_ctx.target_qps > 0 && perf_ctx.concurrency > 0) {
+            fprintf(stderr, "Specify either a rate (-r) or a concurrency (-C), not both.\n");
+            usage();
+        }
+        else if (perf_ctx.target_qps == 0 && perf_ctx.concurrency == 0) {
+            perf_ctx.concurrency = QUICDOQ_PERF_DEFAULT_CONCURRENCY;
+        }
+        if (perf_ctx.nb_cnx == 0) {
+            perf_ctx.nb_cnx = 1;
+        }
+        if (perf_ctx.duration == 0) {
+            perf_ctx.duration = QUICDOQ_PERF_DEFAULT_DURATION * 1000000ull;
+        }
+    }
+
+    if (trace_file != NULL) {
+        ret = quicdoq_perf_open_trace(&perf_ctx, trace_file);
+    }
+    else {
+        ret = quicdoq_perf_load_queries(&perf_ctx, query_file);
+    }
+
+    if (ret == 0) {
+        ret = quicdoq_perf_init_slots(&perf_ctx);
+    }
+
+    if (ret == 0) {
+        ret = quicdoq_perf_run(&perf_ctx, server_text, server_port, server_text == NULL,
+            sni, root_crt, server_cert_file, server_key_file, solution_dir, json_file);
+    }
+
+    quicdoq_perf_release(&perf_ctx);
+
+    return ret;
+}
+
+void usage()
+{
+    fprintf(stderr, "Quicdoq load generator\n");
+    fprintf(stderr, "Usage: quicdoq_perf <options> [server_address]\n");
+    fprintf(stderr, "If no server address is specified, quicdoq_perf starts a DoQ server\n");
+    fprintf(stderr, "on the loopback address and sends the queries to it.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -f file               Query file, one query per line, e.g. example.com:AAAA\n");
+    fprintf(stderr, "                        (default: example.com:A)\n");
+    fprintf(stderr, "  -T file               Replay the queries in a pcap or dnstap trace, with their\n");
+    fprintf(stderr, "                        original timing and one connection per source address\n");
+    fprintf(stderr, "  -x scale              Trace replay speed, e.g. 2.0 for twice as fast (default: 1.0)\n");
+    fprintf(stderr, "  -r qps                Open loop: send queries at this rate\n");
+    fprintf(stderr, "  -C concurrency        Closed loop: keep this many queries in flight (default: %d)\n",
+        QUICDOQ_PERF_DEFAULT_CONCURRENCY);
+    fprintf(stderr, "  -N nb_cnx             Number of client connections (default: 1, or one per\n");
+    fprintf(stderr, "                        source address for a trace)\n");
+    fprintf(stderr, "  -d seconds            Duration of the test (default: %d, or the whole trace)\n",
+        QUICDOQ_PERF_DEFAULT_DURATION);
+    fprintf(stderr, "  -p port               Server port (default: %d)\n", QUICDOQ_PERF_DEFAULT_PORT);
+    fprintf(stderr, "  -n sni                SNI (default: %s with the embedded server)\n", PICOQUIC_TEST_SNI);
+    fprintf(stderr, "  -t file               Root trust file\n");
+    fprintf(stderr, "  -c file               Cert file of the embedded server\n");
+    fprintf(stderr, "  -k file               Key file of the embedded server\n");
+    fprintf(stderr, "  -S solution_dir       Path to the picoquic folder, to find the default certs\n");
+    fprintf(stderr, "  -j file               Write the results as JSON to this file, \"-\" for stdout\n");
+    fprintf(stderr, "  -h                    This help message\n");
+
+    exit(1);
+}
+
+/* Embedded server: answer every query with a copy of the query, marked
+ * as a response with no error. The callback context is the server's
+ * quicdoq context. */
+int quicdoq_perf_server_cb(quicdoq_query_return_enum callback_code, void* callback_ctx,
+    quicdoq_query_ctx_t* query_ctx, uint64_t current_time)
+{
+    int ret = 0;
+#ifdef _WINDOWS
+    UNREFERENCED_PARAMETER(current_time);
+#endif
+
+    if (callback_code == quicdoq_incoming_query) {
+        if (query_ctx->query_length < 12 || query_ctx->query_length > query_ctx->response_max_size) {
+            ret = quicdoq_cancel_response((quicdoq_ctx_t*)callback_ctx, query_ctx, QUICDOQ_ERROR_INTERNAL);
+        }
+        else {
+            memcpy(query_ctx->response, query_ctx->query, query_ctx->query_length);
+            query_ctx->response_length = query_ctx->query_length;
+            /* Set the QR bit and the RA bit, RCODE = 0 */
+            query_ctx->response[2] |= 0x80;
+            query_ctx->response[3] = 0x80;
+            ret = quicdoq_post_response(query_ctx);
+        }
+    }
+
+    return ret;
+}
+
+/* Client callback: tabulate the result and return the slot to the free list. */
+int quicdoq_perf_client_cb(quicdoq_query_return_enum callback_code, void* callback_ctx,
+    quicdoq_query_ctx_t* query_ctx, uint64_t current_time)
+{
+    int ret = 0;
+    quicdoq_perf_ctx_t* perf_ctx = (quicdoq_perf_ctx_t*)callback_ctx;
+    int slot_id = (int)query_ctx->query_id;
+
+    if (slot_id < 0 || slot_id >= perf_ctx->nb_slots || perf_ctx->slots[slot_id].query_ctx != query_ctx) {
+        ret = -1;
+    }
+    else if (callback_code != quicdoq_response_partial) {
+        switch (callback_code) {
+        case quicdoq_response_complete:
+            perf_ctx->nb_completed++;
+            if (perf_ctx->nb_latency >= perf_ctx->latency_alloc) {
+                size_t new_alloc = (perf_ctx->latency_alloc == 0) ? 4096 : 2 * perf_ctx->latency_alloc;
+                uint64_t* new_latency = (uint64_t*)realloc(perf_ctx->latency, new_alloc * sizeof(uint64_t));
+                if (new_latency != NULL) {
+                    perf_ctx->latency = new_latency;
+                    perf_ctx->latency_alloc = new_alloc;
+                }
+            }
+            if (perf_ctx->nb_latency < perf_ctx->latency_alloc) {
+                perf_ctx->latency[perf_ctx->nb_latency++] = current_time - perf_ctx->slots[slot_id].send_time;
+            }
+            break;
+        case quicdoq_response_cancelled:
+        case quicdoq_query_cancelled:
+            perf_ctx->nb_cancelled++;
+            break;
+        default:
+            perf_ctx->nb_failed++;
+            break;
+        }
+        perf_ctx->last_completion_time = current_time;
+        perf_ctx->slots[slot_id].next_free = perf_ctx->first_free;
+        perf_ctx->first_free = slot_id;
+        perf_ctx->nb_in_flight--;
+    }
+
+    return ret;
+}
+
+/* Load the query file, one query per line. Empty lines and lines
+ * starting with '#' are ignored. */
+int quicdoq_perf_load_queries(quicdoq_perf_ctx_t* perf_ctx, char const* query_file)
+{
+    int ret = 0;
+    int nb_alloc = 0;
+
+    if (query_file == NULL) {
+        perf_ctx->query_text = (char**)malloc(sizeof(char*));
+        if (perf_ctx->query_text == NULL ||
+            (perf_ctx->query_text[0] = picoquic_string_duplicate("example.com:A")) == NULL) {
+            ret = -1;
+        }
+        else {
+            perf_ctx->nb_query_text = 1;
+        }
+    }
+    else {
+        FILE* F = picoquic_file_open(query_file, "r");
+
+        if (F == NULL) {
+            fprintf(stderr, "Cannot open query file: %s\n", query_file);
+            ret = -1;
+        }
+        else {
+            char line[QUICDOQ_PERF_MAX_LINE];
+
+            while (ret == 0 && fgets(line, sizeof(line), F) != NULL) {
+                size_t l = strlen(line);
+
+                while (l > 0 && (line[l - 1] == '\n' || line[l - 1] == '\r' || line[l - 1] == ' ' || line[l - 1] == '\t')) {
+                    line[--l] = 0;
+                }
+                if (l == 0 || line[0] == '#') {
+                    continue;
+                }
+                if (perf_ctx->nb_query_text >= nb_alloc) {
+                    int new_alloc = (nb_alloc == 0) ? 256 : 2 * nb_alloc;
+                    char** new_text = (char**)realloc(perf_ctx->query_text, new_alloc * sizeof(char*));
+                    if (new_text == NULL) {
+                        ret = -1;
+                        break;
+                    }
+                    perf_ctx->query_text = new_text;
+                    nb_alloc = new_alloc;
+                }
+                if ((perf_ctx->query_text[perf_ctx->nb_query_text] = picoquic_string_duplicate(line)) == NULL) {
+                    ret = -1;
+                }
+                else {
+                    perf_ctx->nb_query_text++;
+                }
+            }
+            (void)picoquic_file_close(F);
+
+            if (ret == 0 && perf_ctx->nb_query_text == 0) {
+                fprintf(stderr, "No query in file: %s\n", query_file);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Allocate one query context per query that can be in flight. */
+int quicdoq_perf_init_slots(quicdoq_perf_ctx_t* perf_ctx)
+{
+    int ret = 0;
+
+    perf_ctx->nb_slots = (perf_ctx->target_qps > 0 || perf_ctx->trace != NULL) ?
+        QUICDOQ_PERF_MAX_IN_FLIGHT : perf_ctx->concurrency;
+    perf_ctx->slots = (quicdoq_perf_slot_t*)malloc(perf_ctx->nb_slots * sizeof(quicdoq_perf_slot_t));
+
+    if (perf_ctx->slots == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(perf_ctx->slots, 0, perf_ctx->nb_slots * sizeof(quicdoq_perf_slot_t));
+        for (int i = 0; ret == 0 && i < perf_ctx->nb_slots; i++) {
+            perf_ctx->slots[i].query_ctx = quicdoq_create_query_ctx(QUICDOQ_MAX_STREAM_DATA, QUICDOQ_MAX_STREAM_DATA);
+            if (perf_ctx->slots[i].query_ctx == NULL) {
+                ret = -1;
+            }
+            else {
+                perf_ctx->slots[i].query_ctx->query_id = (uint64_t)i;
+                perf_ctx->slots[i].next_free = i + 1;
+            }
+        }
+        perf_ctx->slots[perf_ctx->nb_slots - 1].next_free = -1;
+        perf_ctx->first_free = 0;
+    }
+
+    return ret;
+}
+
+void quicdoq_perf_release(quicdoq_perf_ctx_t* perf_ctx)
+{
+    if (perf_ctx->slots != NULL) {
+        for (int i = 0; i < perf_ctx->nb_slots; i++) {
+            if (perf_ctx->slots[i].query_ctx != NULL) {
+                quicdoq_delete_query_ctx(perf_ctx->slots[i].query_ctx);
+            }
+        }
+        free(perf_ctx->slots);
+        perf_ctx->slots = NULL;
+    }
+
+    if (perf_ctx->query_text != NULL) {
+        for (int i = 0; i < perf_ctx->nb_query_text; i++) {
+            free(perf_ctx->query_text[i]);
+        }
+        free(perf_ctx->query_text);
+        perf_ctx->query_text = NULL;
+    }
+
+    if (perf_ctx->latency != NULL) {
+        free(perf_ctx->latency);
+        perf_ctx->latency = NULL;
+    }
+
+    if (perf_ctx->trace != NULL) {
+        quicdoq_trace_close(perf_ctx->trace);
+        perf_ctx->trace = NULL;
+    }
+
+    if (perf_ctx->sources != NULL) {
+        free(perf_ctx->sources);
+        perf_ctx->sources = NULL;
+    }
+}
+
+/* Get the next query in the trace. At the end of the trace, stop sending
+ * queries. */
+static int quicdoq_perf_read_trace(quicdoq_perf_ctx_t* perf_ctx, uint64_t current_time)
+{
+    int is_end = 0;
+    int ret = quicdoq_trace_next(perf_ctx->trace, &perf_ctx->trace_query, &is_end);
+
+    if (ret != 0) {
+        fprintf(stderr, "Error reading the trace\n");
+        perf_ctx->has_trace_query = 0;
+    }
+    else if (is_end) {
+        perf_ctx->has_trace_query = 0;
+        if (current_time < perf_ctx->end_time) {
+            perf_ctx->end_time = current_time;
+        }
+    }
+    else {
+        perf_ctx->has_trace_query = 1;
+    }
+
+    return ret;
+}
+
+/* Find the source IP address of a trace query, adding it if it is new.
+ * The port is ignored, so all queries from a host share a connection.
+ * Returns -1 if the source cannot be added. */
+static int quicdoq_perf_find_source(quicdoq_perf_ctx_t* perf_ctx, struct sockaddr_storage* addr)
+{
+    uint8_t* ip = NULL;
+    size_t ip_length = 0;
+    uint32_t hash = 2166136261u;
+    int bin;
+    int source_id;
+
+    if (addr->ss_family == AF_INET) {
+        ip = (uint8_t*)&((struct sockaddr_in*)addr)->sin_addr;
+        ip_length = 4;
+    }
+    else if (addr->ss_family == AF_INET6) {
+        ip = (uint8_t*)&((struct sockaddr_in6*)addr)->sin6_addr;
+        ip_length = 16;
+    }
+
+    for (size_t i = 0; i < ip_length; i++) {
+        hash = (hash ^ ip[i]) * 16777619u;
+    }
+    bin = (int)(hash % QUICDOQ_PERF_SOURCE_BINS);
+
+    for (source_id = perf_ctx->source_bins[bin]; source_id >= 0; source_id = perf_ctx->sources[source_id].next_in_bin) {
+        struct sockaddr_storage* source_addr = &perf_ctx->sources[source_id].addr;
+        if (source_addr->ss_family == addr->ss_family &&
+            (ip_length == 0 || memcmp((source_addr->ss_family == AF_INET) ?
+                (uint8_t*)&((struct sockaddr_in*)source_addr)->sin_addr :
+                (uint8_t*)&((struct sockaddr_in6*)source_addr)->sin6_addr, ip, ip_length) == 0)) {
+            break;
+        }
+    }
+
+    if (source_id < 0) {
+        if (perf_ctx->nb_sources >= perf_ctx->sources_alloc) {
+            int new_alloc = (perf_ctx->sources_alloc == 0) ? 256 : 2 * perf_ctx->sources_alloc;
+            quicdoq_perf_source_t* new_sources = (quicdoq_perf_source_t*)realloc(perf_ctx->sources,
+                new_alloc * sizeof(quicdoq_perf_source_t));
+            if (new_sources != NULL) {
+                perf_ctx->sources = new_sources;
+                perf_ctx->sources_alloc = new_alloc;
+            }
+        }
+        if (perf_ctx->nb_sources < perf_ctx->sources_alloc) {
+            source_id = perf_ctx->nb_sources++;
+            perf_ctx->sources[source_id].addr = *addr;
+            perf_ctx->sources[source_id].next_in_bin = perf_ctx->source_bins[bin];
+            perf_ctx->source_bins[bin] = source_id;
+        }
+    }
+
+    return source_id;
+}
+
+/* Map the source of a trace query to a connection affinity. Sources are
+ * mapped to connections round robin if there are more of them. */
+static uint64_t quicdoq_perf_get_affinity(quicdoq_perf_ctx_t* perf_ctx, struct sockaddr_storage* addr)
+{
+    int source_id = quicdoq_perf_find_source(perf_ctx, addr);
+
+    return (source_id < 0) ? 0 : (uint64_t)(source_id % perf_ctx->nb_cnx) + 1;
+}
+
+/* Without an explicit number of connections, read the whole trace once to
+ * count its sources, so that each of them gets a connection of its own. */
+static int quicdoq_perf_count_sources(quicdoq_perf_ctx_t* perf_ctx)
+{
+    int ret = 0;
+    int is_end = 0;
+
+    while (ret == 0) {
+        ret = quicdoq_trace_next(perf_ctx->trace, &perf_ctx->trace_query, &is_end);
+        if (ret != 0) {
+            fprintf(stderr, "Error reading the trace\n");
+        }
+        else if (is_end) {
+            break;
+        }
+        else {
+            (void)quicdoq_perf_find_source(perf_ctx, &perf_ctx->trace_query.source_addr);
+        }
+    }
+
+    return ret;
+}
+
+
+int quicdoq_perf_open_trace(quicdoq_perf_ctx_t* perf_ctx, char const* trace_file)
+{
+    int ret = 0;
+
+    for (int i = 0; i < QUICDOQ_PERF_SOURCE_BINS; i++) {
+        perf_ctx->source_bins[i] = -1;
+    }
+
+    if (perf_ctx->nb_cnx == 0) {
+        if ((perf_ctx->trace = quicdoq_trace_open(trace_file)) == NULL) {
+            fprintf(stderr, "Cannot open the trace: %s\n", trace_file);
+            ret = -1;
+        }
+        else {
+            ret = quicdoq_perf_count_sources(perf_ctx);
+            perf_ctx->nb_cnx = (perf_ctx->nb_sources > 0) ? perf_ctx->nb_sources : 1;
+            quicdoq_trace_close(perf_ctx->trace);
+            perf_ctx->trace = NULL;
+        }
+    }
+
+    if (ret != 0) {
+        /* Error already reported */
+    }
+    else if ((perf_ctx->trace = quicdoq_trace_open(trace_file)) == NULL) {
+        fprintf(stderr, "Cannot open the trace: %s\n", trace_file);
+        ret = -1;
+    }
+    else if ((ret = quicdoq_perf_read_trace(perf_ctx, 0)) == 0) {
+        if (!perf_ctx->has_trace_query) {
+            fprintf(stderr, "No query in trace: %s\n", trace_file);
+            ret = -1;
+        }
+        else {
+            perf_ctx->trace_start = perf_ctx->trace_query.timestamp;
+        }
+    }
+
+    return ret;
+}
+
+/* Time at which the next query is due, in open loop and trace modes */
+static uint64_t quicdoq_perf_next_query_time(quicdoq_perf_ctx_t* perf_ctx)
+{
+    uint64_t next_time = UINT64_MAX;
+
+    if (perf_ctx->trace != NULL) {
+        if (perf_ctx->has_trace_query) {
+            uint64_t delta = (perf_ctx->trace_query.timestamp > perf_ctx->trace_start) ?
+                perf_ctx->trace_query.timestamp - perf_ctx->trace_start : 0;
+            next_time = perf_ctx->start_time + (uint64_t)(((double)delta) / perf_ctx->time_scale);
+        }
+    }
+    else if (perf_ctx->target_qps > 0) {
+        next_time = perf_ctx->start_time + (perf_ctx->nb_scheduled * 1000000ull) / perf_ctx->target_qps;
+    }
+
+    return next_time;
+}
+
+/* Send the queries that are due. In open loop, queries are scheduled at
+ * fixed intervals from the start time; in trace mode, they are scheduled
+ * at their time in the trace, divided by the time scale. Latency is then
+ * measured from the scheduled time, so that the delays of a late client
+ * loop are not hidden. If no query context is free when a query is due,
+ * or if the query cannot be posted, the query is counted as not sent.
+ * In closed loop, new queries are sent as soon as previous ones complete. */
+int quicdoq_perf_send_queries(quicdoq_ctx_t* qd_client, quicdoq_perf_ctx_t* perf_ctx, uint64_t current_time)
+{
+    int ret = 0;
+
+    while (ret == 0 && current_time < perf_ctx->end_time) {
+        int slot_id;
+        quicdoq_query_ctx_t* query_ctx;
+        uint64_t query_time = current_time;
+        int is_sent = 1;
+
+        if (perf_ctx->target_qps > 0 || perf_ctx->trace != NULL) {
+            if ((query_time = quicdoq_perf_next_query_time(perf_ctx)) > current_time) {
+                break;
+            }
+            perf_ctx->nb_scheduled++;
+            if (perf_ctx->first_free < 0 ||
+                (perf_ctx->trace != NULL && perf_ctx->trace_query.query_length > QUICDOQ_MAX_STREAM_DATA)) {
+                perf_ctx->nb_not_sent++;
+                if (perf_ctx->trace != NULL) {
+                    ret = quicdoq_perf_read_trace(perf_ctx, current_time);
+                }
+                continue;
+            }
+        }
+        else if (perf_ctx->nb_in_flight >= perf_ctx->concurrency || perf_ctx->first_free < 0) {
+            break;
+        }
+
+        slot_id = perf_ctx->first_free;
+        query_ctx = perf_ctx->slots[slot_id].query_ctx;
+        perf_ctx->first_free = perf_ctx->slots[slot_id].next_free;
+
+        query_ctx->response_length = 0;
+        query_ctx->server_name = perf_ctx->server_name;
+        query_ctx->server_addr = perf_ctx->server_addr;
+        query_ctx->client_addr = perf_ctx->client_addr;
+        query_ctx->client_cb = quicdoq_perf_client_cb;
+        query_ctx->client_cb_ctx = perf_ctx;
+
+        if (perf_ctx->trace != NULL) {
+            memcpy(query_ctx->query, perf_ctx->trace_query.query, perf_ctx->trace_query.query_length);
+            query_ctx->query_length = (uint16_t)perf_ctx->trace_query.query_length;
+            query_ctx->cnx_affinity = quicdoq_perf_get_affinity(perf_ctx, &perf_ctx->trace_query.source_addr);
+            ret = quicdoq_perf_read_trace(perf_ctx, current_time);
+        }
+        else {
+            char const* text = perf_ctx->query_text[perf_ctx->next_text];
+
+            perf_ctx->next_text = (perf_ctx->next_text + 1) % perf_ctx->nb_query_text;
+            if (quicdoq_format_query_from_text(query_ctx, text) != 0) {
+                fprintf(stderr, "Cannot format query: %s\n", text);
+                is_sent = 0;
+            }
+        }
+
+        /* The query is sent even if reading the next one in the trace failed */
+        if (is_sent) {
+            perf_ctx->slots[slot_id].send_time = query_time;
+            perf_ctx->nb_in_flight++;
+            perf_ctx->nb_sent++;
+            if (quicdoq_post_query(qd_client, query_ctx) != 0) {
+                perf_ctx->nb_in_flight--;
+                perf_ctx->nb_sent--;
+                is_sent = 0;
+            }
+        }
+
+        if (!is_sent) {
+            perf_ctx->nb_not_sent++;
+            perf_ctx->slots[slot_id].next_free = perf_ctx->first_free;
+            perf_ctx->first_free = slot_id;
+            if (perf_ctx->target_qps == 0 && perf_ctx->trace == NULL) {
+                /* In closed loop, retry on the next call */
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int quicdoq_perf_compare_latency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Nearest rank percentile, on the sorted latency array */
+static uint64_t quicdoq_perf_percentile(quicdoq_perf_ctx_t* perf_ctx, double p)
+{
+    uint64_t v = 0;
+
+    if (perf_ctx->nb_latency > 0) {
+        size_t rank = (size_t)(p * (double)perf_ctx->nb_latency + 0.999999);
+        if (rank > 0) {
+            rank--;
+        }
+        if (rank >= perf_ctx->nb_latency) {
+            rank = perf_ctx->nb_latency - 1;
+        }
+        v = perf_ctx->latency[rank];
+    }
+
+    return v;
+}
+
+void quicdoq_perf_report(quicdoq_ctx_t* qd_client, quicdoq_perf_ctx_t* perf_ctx, FILE* F_json)
+{
+    quicdoq_pool_stats_t pool_stats;
+    uint64_t elapsed = perf_ctx->last_completion_time - perf_ctx->start_time;
+    double qps = 0;
+    uint64_t lat_min = 0;
+    uint64_t lat_max = 0;
+    uint64_t lat_p50;
+    uint64_t lat_p90;
+    uint64_t lat_p99;
+    uint64_t lat_p999;
+
+    quicdoq_get_pool_stats(qd_client, &pool_stats);
+
+    if (perf_ctx->last_completion_time <= perf_ctx->start_time) {
+        elapsed = 0;
+    }
+    else {
+        qps = ((double)perf_ctx->nb_completed) * 1000000.0 / ((double)elapsed);
+    }
+
+    qsort(perf_ctx->latency, perf_ctx->nb_latency, sizeof(uint64_t), quicdoq_perf_compare_latency);
+    if (perf_ctx->nb_latency > 0) {
+        lat_min = perf_ctx->latency[0];
+        lat_max = perf_ctx->latency[perf_ctx->nb_latency - 1];
+    }
+    lat_p50 = quicdoq_perf_percentile(perf_ctx, 0.5);
+    lat_p90 = quicdoq_perf_percentile(perf_ctx, 0.9);
+    lat_p99 = quicdoq_perf_percentile(perf_ctx, 0.99);
+    lat_p999 = quicdoq_perf_percentile(perf_ctx, 0.999);
+
+    if (perf_ctx->trace != NULL) {
+        printf("Mode: trace replay, speed %.2f, %d sources, %" PRIu64 " records skipped\n", perf_ctx->time_scale, perf_ctx->nb_sources,
+            quicdoq_trace_nb_skipped(perf_ctx->trace));
+    }
+    else if (perf_ctx->target_qps > 0) {
+        printf("Mode: open loop, target %" PRIu64 " QPS\n", perf_ctx->target_qps);
+    }
+    else {
+        printf("Mode: closed loop, %d queries in flight\n", perf_ctx->concurrency);
+    }
+    printf("Connections: %d, handshakes: %" PRIu64 " (0-RTT: %" PRIu64 ")\n",
+        perf_ctx->nb_cnx, pool_stats.nb_cnx_started, pool_stats.nb_cnx_0rtt);
+    printf("Queries: sent %" PRIu64 ", completed %" PRIu64 ", cancelled %" PRIu64 ", failed %" PRIu64 ", not sent %" PRIu64 ", in flight %d\n",
+        perf_ctx->nb_sent, perf_ctx->nb_completed, perf_ctx->nb_cancelled, perf_ctx->nb_failed,
+        perf_ctx->nb_not_sent, perf_ctx->nb_in_flight);
+    printf("Elapsed: %.3f s, throughput: %.1f QPS\n", ((double)elapsed) / 1000000.0, qps);
+    printf("Latency (us): min %" PRIu64 ", p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+        lat_min, lat_p50, lat_p90, lat_p99, lat_p999, lat_max);
+
+    if (F_json != NULL) {
+        fprintf(F_json, "{\n");
+        fprintf(F_json, "  \"mode\": \"%s\",\n", (perf_ctx->trace != NULL) ? "trace" : ((perf_ctx->target_qps > 0) ? "open" : "closed"));
+        if (perf_ctx->trace != NULL) {
+            fprintf(F_json, "  \"time_scale\": %.2f,\n", perf_ctx->time_scale);
+            fprintf(F_json, "  \"sources\": %d,\n", perf_ctx->nb_sources);
+            fprintf(F_json, "  \"skipped_records\": %" PRIu64 ",\n", quicdoq_trace_nb_skipped(perf_ctx->trace));
+        }
+        fprintf(F_json, "  \"target_qps\": %" PRIu64 ",\n", perf_ctx->target_qps);
+        fprintf(F_json, "  \"concurrency\": %d,\n", perf_ctx->concurrency);
+        fprintf(F_json, "  \"connections\": %d,\n", perf_ctx->nb_cnx);
+        fprintf(F_json, "  \"handshakes\": %" PRIu64 ",\n", pool_stats.nb_cnx_started);
+        fprintf(F_json, "  \"handshakes_0rtt\": %" PRIu64 ",\n", pool_stats.nb_cnx_0rtt);
+        fprintf(F_json, "  \"sent\": %" PRIu64 ",\n", perf_ctx->nb_sent);
+        fprintf(F_json, "  \"completed\": %" PRIu64 ",\n", perf_ctx->nb_completed);
+        fprintf(F_json, "  \"cancelled\": %" PRIu64 ",\n", perf_ctx->nb_cancelled);
+        fprintf(F_json, "  \"failed\": %" PRIu64 ",\n", perf_ctx->nb_failed);
+        fprintf(F_json, "  \"not_sent\": %" PRIu64 ",\n", perf_ctx->nb_not_sent);
+        fprintf(F_json, "  \"elapsed_us\": %" PRIu64 ",\n", elapsed);
+        fprintf(F_json, "  \"qps\": %.1f,\n", qps);
+        fprintf(F_json, "  \"latency_us\": { \"min\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+            ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 " }\n",
+            lat_min, lat_p50, lat_p90, lat_p99, lat_p999, lat_max);
+        fprintf(F_json, "}\n");
+    }
+}
+
+/* Run the load test. The client, and the embedded server if there is one,
+ * share a single loop. Socket 0 is the client socket, the other sockets
+ * are the server sockets. */
+/* Size of the quicdoq contexts: room for the connections of the test, and
+ * for as many again being replaced or still closing. */
+static uint32_t quicdoq_perf_max_connections(quicdoq_perf_ctx_t* perf_ctx)
+{
+    uint64_t max_cnx = 2 * (uint64_t)perf_ctx->nb_cnx;
+
+    if (max_cnx < QUICDOQ_DEFAULT_MAX_CONNECTIONS) {
+        max_cnx = QUICDOQ_DEFAULT_MAX_CONNECTIONS;
+    }
+    else if (max_cnx > UINT32_MAX) {
+        max_cnx = UINT32_MAX;
+    }
+
+    return (uint32_t)max_cnx;
+}
+
+int quicdoq_perf_run(quicdoq_perf_ctx_t* perf_ctx, char const* server_text, int server_port, int is_embedded,
+    char const* sni, char const* root_crt, char const* server_cert_file, char const* server_key_file,
+    char const* solution_dir, char const* json_file)
+{
+    int ret = 0;
+    quicdoq_ctx_t* qd_client = NULL;
+    quicdoq_ctx_t* qd_server = NULL;
+    picoquic_server_sockets_t server_sockets;
+    SOCKET_TYPE s_socket[PICOQUIC_NB_SERVER_SOCKETS + 1];
+    int nb_sockets = 1;
+    struct sockaddr_storage server_address;
+    struct sockaddr_storage client_address;
+    struct sockaddr_storage addr_from;
+    struct sockaddr_storage addr_to;
+    int if_index_to;
+    int is_name = 0;
+    uint8_t recv_buffer[PICOQUIC_MAX_PACKET_SIZE];
+    uint8_t send_buffer[PICOQUIC_MAX_PACKET_SIZE];
+    char default_server_cert_file[512];
+    char default_server_key_file[512];
+    char default_root_crt[512];
+    uint64_t current_time = picoquic_current_time();
+    FILE* F_json = NULL;
+
+    memset(&server_sockets, 0, sizeof(server_sockets));
+    memset(&client_address, 0, sizeof(client_address));
+    s_socket[0] = INVALID_SOCKET;
+
+    if (solution_dir == NULL) {
+#ifdef _WINDOWS
+#ifdef _WINDOWS64
+        solution_dir = "..\\..\\..\\picoquic";
+#else
+        solution_dir = "..\\..\\picoquic";
+#endif
+#else
+        solution_dir = "../picoquic";
+#endif
+    }
+
+    if (is_embedded) {
+        server_text = "127.0.0.1";
+        if (sni == NULL) {
+            sni = PICOQUIC_TEST_SNI;
+        }
+        if (server_cert_file == NULL &&
+            (ret = picoquic_get_input_path(default_server_cert_file, sizeof(default_server_cert_file),
+                solution_dir, PICOQUIC_TEST_FILE_SERVER_CERT)) == 0) {
+            server_cert_file = default_server_cert_file;
+        }
+        if (ret == 0 && server_key_file == NULL &&
+            (ret = picoquic_get_input_path(default_server_key_file, sizeof(default_server_key_file),
+                solution_dir, PICOQUIC_TEST_FILE_SERVER_KEY)) == 0) {
+            server_key_file = default_server_key_file;
+        }
+        if (ret == 0 && root_crt == NULL &&
+            (ret = picoquic_get_input_path(default_root_crt, sizeof(default_root_crt),
+                solution_dir, PICOQUIC_TEST_FILE_CERT_STORE)) == 0) {
+            root_crt = default_root_crt;
+        }
+    }
+
+    if (ret == 0) {
+        ret = picoquic_get_server_address(server_text, server_port, &server_address, &is_name);
+        if (ret != 0) {
+            fprintf(stderr, "Cannot parse the server address: %s\n", server_text);
+        }
+        else if (sni == NULL && is_name) {
+            sni = server_text;
+        }
+    }
+
+    if (ret == 0 && is_embedded) {
+        qd_server = quicdoq_create_ex(NULL, server_cert_file, server_key_file, NULL, NULL, NULL,
+            quicdoq_perf_server_cb, NULL, NULL, quicdoq_perf_max_connections(perf_ctx));
+        if (qd_server == NULL) {
+            fprintf(stderr, "Cannot create the embedded server\n");
+            ret = -1;
+        }
+        else {
+            quicdoq_set_callback(qd_server, quicdoq_perf_server_cb, qd_server);
+            ret = picoquic_open_server_sockets(&server_sockets, server_port);
+            if (ret != 0) {
+                fprintf(stderr, "Cannot open the server sockets on port %d\n", server_port);
+            }
+            else {
+                for (int i = 0; i < PICOQUIC_NB_SERVER_SOCKETS; i++) {
+                    s_socket[nb_sockets++] = server_sockets.s_socket[i];
+                }
+            }
+        }
+    }
+
+    if (ret == 0) {
+        s_socket[0] = picoquic_open_client_socket(server_address.ss_family);
+        if (s_socket[0] == INVALID_SOCKET) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        qd_client = quicdoq_create_ex(NULL, NULL, NULL, root_crt, NULL, NULL, quicdoq_perf_client_cb, (void*)perf_ctx, NULL,
+            quicdoq_perf_max_connections(perf_ctx));
+        if (qd_client == NULL) {
+            fprintf(stderr, "Cannot create the client context\n");
+            ret = -1;
+        }
+        else {
+            int max_streams = (perf_ctx->nb_slots + perf_ctx->nb_cnx - 1) / perf_ctx->nb_cnx;
+
+            perf_ctx->server_name = sni;
+            perf_ctx->server_addr = (struct sockaddr*)&server_address;
+            perf_ctx->client_addr = (struct sockaddr*)&client_address;
+            if (perf_ctx->trace != NULL) {
+                /* Connections are opened when their source sends its first query,
+                 * and have no limit on queries in flight beyond that of the server. */
+                quicdoq_set_pool_params(qd_client, QUICDOQ_PERF_MAX_IN_FLIGHT, 1, 0, 0);
+            }
+            else {
+                quicdoq_set_pool_params(qd_client, (uint16_t)((max_streams > UINT16_MAX) ? UINT16_MAX : max_streams),
+                    (uint16_t)perf_ctx->nb_cnx, 0, 0);
+                ret = quicdoq_prewarm_connections(qd_client, sni, (struct sockaddr*)&server_address, perf_ctx->nb_cnx);
+            }
+        }
+    }
+
+    if (ret == 0 && json_file != NULL) {
+        if (strcmp(json_file, "-") == 0) {
+            F_json = stdout;
+        }
+        else if ((F_json = picoquic_file_open(json_file, "w")) == NULL) {
+            fprintf(stderr, "Cannot open the JSON file: %s\n", json_file);
+            ret = -1;
+        }
+    }
+
+    current_time = picoquic_current_time();
+    perf_ctx->start_time = current_time;
+    /* Without a duration, a trace is replayed until its end */
+    perf_ctx->end_time = (perf_ctx->duration > 0) ? current_time + perf_ctx->duration : UINT64_MAX;
+    perf_ctx->last_completion_time = current_time;
+
+    while (ret == 0 && (current_time < perf_ctx->end_time ||
+        (perf_ctx->nb_in_flight > 0 && current_time < perf_ctx->end_time + QUICDOQ_PERF_DRAIN_TIME))) {
+        unsigned char received_ecn;
+        int bytes_recv;
+        int socket_rank = -1;
+        uint64_t next_time;
+        uint64_t stop_time = (perf_ctx->end_time == UINT64_MAX) ? UINT64_MAX : perf_ctx->end_time + QUICDOQ_PERF_DRAIN_TIME;
+        int64_t delta_t = 0;
+
+        ret = quicdoq_perf_send_queries(qd_client, perf_ctx, current_time);
+        if (ret != 0) {
+            break;
+        }
+
+        /* Send all the packets that are ready */
+        for (int q = 0; ret == 0 && q < 2; q++) {
+            quicdoq_ctx_t* qd = (q == 0) ? qd_client : qd_server;
+            size_t send_length = 0;
+
+            if (qd == NULL) {
+                continue;
+            }
+            do {
+                struct sockaddr_storage peer_addr;
+                struct sockaddr_storage local_addr;
+                int if_index = 0;
+
+                send_length = 0;
+                ret = picoquic_prepare_next_packet(quicdoq_get_quic_ctx(qd), current_time,
+                    send_buffer, sizeof(send_buffer), &send_length,
+                    &peer_addr, &local_addr, &if_index, NULL, NULL);
+
+                if (ret == 0 && send_length > 0) {
+                    if (q == 0) {
+                        (void)sendto(s_socket[0], (const char*)send_buffer, (int)send_length, 0,
+                            (struct sockaddr*)&peer_addr, picoquic_addr_length((struct sockaddr*)&peer_addr));
+                    }
+                    else {
+                        int sock_err = 0;
+                        (void)picoquic_send_through_server_sockets(&server_sockets,
+                            (struct sockaddr*)&peer_addr, (struct sockaddr*)&local_addr, if_index,
+                            (const char*)send_buffer, (int)send_length, &sock_err);
+                    }
+                }
+            } while (ret == 0 && send_length > 0);
+        }
+
+        /* Compute the next wake time */
+        next_time = picoquic_get_next_wake_time(quicdoq_get_quic_ctx(qd_client), current_time);
+        if (qd_server != NULL) {
+            uint64_t server_time = picoquic_get_next_wake_time(quicdoq_get_quic_ctx(qd_server), current_time);
+            if (server_time < next_time) {
+                next_time = server_time;
+            }
+        }
+        if (current_time < perf_ctx->end_time) {
+            uint64_t query_time = quicdoq_perf_next_query_time(perf_ctx);
+            if (query_time < next_time) {
+                next_time = query_time;
+            }
+        }
+        if (next_time > stop_time) {
+            next_time = stop_time;
+        }
+        if (next_time > current_time) {
+            delta_t = (int64_t)(next_time - current_time);
+        }
+
+        if_index_to = 0;
+        bytes_recv = picoquic_select_ex(s_socket, nb_sockets, &addr_from, &addr_to, &if_index_to, &received_ecn,
+            recv_buffer, sizeof(recv_buffer), delta_t, &socket_rank, &current_time);
+
+        if (bytes_recv < 0) {
+            ret = -1;
+        }
+        else if (bytes_recv > 0) {
+            if (socket_rank == 0) {
+                if (client_address.ss_family == 0) {
+                    picoquic_store_addr(&client_address, (struct sockaddr*)&addr_to);
+                }
+                ret = picoquic_incoming_packet(quicdoq_get_quic_ctx(qd_client), recv_buffer, (size_t)bytes_recv,
+                    (struct sockaddr*)&addr_from, (struct sockaddr*)&addr_to, if_index_to, received_ecn, current_time);
+            }
+            else {
+                (void)picoquic_incoming_packet(quicdoq_get_quic_ctx(qd_server), recv_buffer, (size_t)bytes_recv,
+                    (struct sockaddr*)&addr_from, (struct sockaddr*)&addr_to, if_index_to, received_ecn, current_time);
+            }
+        }
+    }
+
+    if (ret == 0) {
+        quicdoq_perf_report(qd_client, perf_ctx, F_json);
+    }
+    else {
+        fprintf(stderr, "Load test failed, ret = %d\n", ret);
+    }
+
+    if (F_json != NULL && F_json != stdout) {
+        (void)picoquic_file_close(F_json);
+    }
+
+    if (qd_client != NULL) {
+        quicdoq_delete(qd_client);
+    }
+
+    if (qd_server != NULL) {
+        quicdoq_delete(qd_server);
+        picoquic_close_server_sockets(&server_sockets);
+    }
+
+    if (s_socket[0] != INVALID_SOCKET) {
+        SOCKET_CLOSE(s_socket[0]);
+    }
+
+    return ret;
+}
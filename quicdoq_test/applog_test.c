@@ -0,0 +1,131 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Application log tests.
+ * Log a few events and check the text written by the writer thread, then
+ * log many events in a small ring and check that all of them are either
+ * written or counted as dropped.
+ */
+
+#define APP_LOG_TEST_FILE "quicdoq_app_log_test.txt"
+#define APP_LOG_TEST_NB_BURST 20000
+
+static const char* app_log_test_expected[] = {
+    "1000001 0102030405060708: Response #0 received at cnx time: 1000us.\n",
+    "1000002 0102030405060708: Query #1 refused with EDE 0x12 at cnx time: 2000us.\n",
+    "1000003 0102030405060708: Quicdoq: Malformed query on stream #8.\n",
+    "1000004 : Quicdoq: Early query on stream #12 is a replay.\n"
+};
+
+static int app_log_test_count_lines(char const* file_name, uint64_t* nb_lines, int check_expected)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_name, "r");
+    char line[256];
+
+    *nb_lines = 0;
+    if (F == NULL) {
+        DBG_PRINTF("Cannot open %s", file_name);
+        ret = -1;
+    }
+    else {
+        while (ret == 0 && fgets(line, sizeof(line), F) != NULL) {
+            if (check_expected) {
+                if (*nb_lines >= sizeof(app_log_test_expected) / sizeof(char const*) ||
+                    strcmp(line, app_log_test_expected[*nb_lines]) != 0) {
+                    DBG_PRINTF("Unexpected line %" PRIu64 ": %s", *nb_lines, line);
+                    ret = -1;
+                }
+            }
+            *nb_lines += 1;
+        }
+        (void)picoquic_file_close(F);
+    }
+
+    return ret;
+}
+
+int quicdoq_app_log_test()
+{
+    int ret = 0;
+    picoquic_connection_id_t cid = { { 1, 2, 3, 4, 5, 6, 7, 8 }, 8 };
+    quicdoq_app_log_t* app_log = quicdoq_app_log_open(APP_LOG_TEST_FILE, 8);
+    quicdoq_app_log_stats_t stats;
+    uint64_t nb_lines = 0;
+
+    if (app_log == NULL) {
+        DBG_PRINTF("Cannot open %s", APP_LOG_TEST_FILE);
+        ret = -1;
+    }
+    else {
+        if (quicdoq_app_log_event(app_log, 1000001, &cid, quicdoq_log_event_response, 0, 0, 1000, 0) != 0 ||
+            quicdoq_app_log_event(app_log, 1000002, &cid, quicdoq_log_event_refused, 1, 4, 2000, 0x12) != 0 ||
+            quicdoq_app_log_event(app_log, 1000003, &cid, quicdoq_log_event_malformed, 2, 8, 3000, 0) != 0 ||
+            quicdoq_app_log_event(app_log, 1000004, NULL, quicdoq_log_event_replay, 3, 12, 4000, 0) != 0) {
+            DBG_PRINTF("%s", "Cannot log events");
+            ret = -1;
+        }
+        quicdoq_app_log_close(app_log);
+    }
+
+    if (ret == 0 && (ret = app_log_test_count_lines(APP_LOG_TEST_FILE, &nb_lines, 1)) == 0 && nb_lines != 4) {
+        DBG_PRINTF("Expected 4 lines, got %" PRIu64, nb_lines);
+        ret = -1;
+    }
+
+    /* Burst of events in a ring of 8 records */
+    if (ret == 0) {
+        if ((app_log = quicdoq_app_log_open(APP_LOG_TEST_FILE, 8)) == NULL) {
+            ret = -1;
+        }
+        else {
+            uint64_t nb_failed = 0;
+
+            for (uint64_t i = 0; i < APP_LOG_TEST_NB_BURST; i++) {
+                if (quicdoq_app_log_event(app_log, i, &cid, quicdoq_log_event_response, i, 4 * i, i, 0) != 0) {
+                    nb_failed++;
+                }
+            }
+            quicdoq_app_log_get_stats(app_log, &stats);
+            quicdoq_app_log_close(app_log);
+
+            if (stats.nb_dropped != nb_failed || stats.nb_events + stats.nb_dropped != APP_LOG_TEST_NB_BURST) {
+                DBG_PRINTF("Unexpected stats, %" PRIu64 " events, %" PRIu64 " dropped", stats.nb_events, stats.nb_dropped);
+                ret = -1;
+            }
+            else if ((ret = app_log_test_count_lines(APP_LOG_TEST_FILE, &nb_lines, 0)) == 0 && nb_lines != stats.nb_events) {
+                DBG_PRINTF("Expected %" PRIu64 " lines, got %" PRIu64, stats.nb_events, nb_lines);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,354 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* C-DNS logging test.
+ * Log queries and responses in blocks of 8 items, then decode the file
+ * and check its structure: file preamble, one map per block, tables
+ * without duplicates, and table indexes within bounds.
+ */
+
+#define CDNS_TEST_FILE "quicdoq_cdns_test.cdns"
+#define CDNS_TEST_BLOCK_ITEMS 8
+#define CDNS_TEST_NB_ITEMS 30
+#define CDNS_TEST_INDEFINITE UINT64_MAX
+
+static const uint8_t cdns_test_query[] = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01,
+    0, 0, 41, 0x04, 0xd0, 0, 0, 0x80, 0, 0, 0
+};
+
+static const uint8_t cdns_test_response[] = {
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01,
+    0xc0, 12, 0, 1, 0, 1, 0, 0, 0x0e, 0x10, 0, 4, 192, 0, 2, 1
+};
+
+typedef struct st_cdns_test_reader_t {
+    const uint8_t* data;
+    size_t length;
+    size_t pos;
+} cdns_test_reader_t;
+
+/* Read the head of a CBOR item. Indefinite lengths are returned as CDNS_TEST_INDEFINITE */
+static int cdns_test_head(cdns_test_reader_t* reader, int* major_type, uint64_t* value)
+{
+    uint8_t additional;
+    size_t nb_bytes = 0;
+
+    if (reader->pos >= reader->length) {
+        return -1;
+    }
+    *major_type = reader->data[reader->pos] >> 5;
+    additional = reader->data[reader->pos++] & 0x1F;
+    if (additional < 24) {
+        *value = additional;
+    }
+    else if (additional == 31) {
+        *value = CDNS_TEST_INDEFINITE;
+    }
+    else if (additional <= 27) {
+        nb_bytes = (size_t)1 << (additional - 24);
+        if (reader->pos + nb_bytes > reader->length) {
+            return -1;
+        }
+        *value = 0;
+        for (size_t i = 0; i < nb_bytes; i++) {
+            *value = (*value << 8) | reader->data[reader->pos++];
+        }
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int cdns_test_expect(cdns_test_reader_t* reader, int expected_major_type, uint64_t* value)
+{
+    int major_type;
+
+    if (cdns_test_head(reader, &major_type, value) != 0 || major_type != expected_major_type) {
+        return -1;
+    }
+    return 0;
+}
+
+static int cdns_test_skip(cdns_test_reader_t* reader)
+{
+    int major_type;
+    uint64_t value;
+    int ret = cdns_test_head(reader, &major_type, &value);
+
+    if (ret == 0) {
+        switch (major_type) {
+        case 2:
+        case 3:
+            if (value > reader->length - reader->pos) {
+                ret = -1;
+            }
+            else {
+                reader->pos += (size_t)value;
+            }
+            break;
+        case 4:
+        case 5:
+            if (value == CDNS_TEST_INDEFINITE) {
+                ret = -1;
+            }
+            else {
+                uint64_t nb_items = (major_type == 5) ? 2 * value : value;
+                for (uint64_t i = 0; ret == 0 && i < nb_items; i++) {
+                    ret = cdns_test_skip(reader);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/* Read the length of a table in the block tables */
+static int cdns_test_tables(cdns_test_reader_t* reader, uint64_t* table_length)
+{
+    uint64_t nb_tables;
+    int ret = cdns_test_expect(reader, 5, &nb_tables);
+
+    for (uint64_t t = 0; ret == 0 && t < nb_tables; t++) {
+        uint64_t key;
+        uint64_t nb_entries;
+
+        if ((ret = cdns_test_expect(reader, 0, &key)) == 0) {
+            size_t start = reader->pos;
+
+            if ((ret = cdns_test_expect(reader, 4, &nb_entries)) == 0 && key < 4) {
+                table_length[key] = nb_entries;
+            }
+            reader->pos = start;
+            ret = cdns_test_skip(reader);
+        }
+    }
+
+    return ret;
+}
+
+/* Check the query response items against the table lengths */
+static int cdns_test_items(cdns_test_reader_t* reader, const uint64_t* table_length, uint64_t* nb_items, uint64_t* nb_responses)
+{
+    uint64_t nb_qr;
+    int ret = cdns_test_expect(reader, 4, &nb_qr);
+
+    for (uint64_t i = 0; ret == 0 && i < nb_qr; i++) {
+        uint64_t nb_keys;
+
+        if ((ret = cdns_test_expect(reader, 5, &nb_keys)) == 0) {
+            for (uint64_t k = 0; ret == 0 && k < nb_keys; k++) {
+                uint64_t key;
+                uint64_t value;
+
+                if ((ret = cdns_test_expect(reader, 0, &key)) == 0 &&
+                    (ret = cdns_test_expect(reader, 0, &value)) == 0) {
+                    if ((key == 1 && value >= table_length[0]) ||
+                        (key == 4 && value >= table_length[3]) ||
+                        (key == 7 && value >= table_length[2])) {
+                        DBG_PRINTF("Index %" PRIu64 " out of bounds for key %" PRIu64, value, key);
+                        ret = -1;
+                    }
+                    else if (key == 9) {
+                        *nb_responses += 1;
+                    }
+                }
+            }
+            *nb_items += 1;
+        }
+    }
+
+    return ret;
+}
+
+static int cdns_test_read(const uint8_t* data, size_t length, uint64_t* nb_blocks, uint64_t* nb_items, uint64_t* nb_responses)
+{
+    cdns_test_reader_t reader = { data, length, 0 };
+    uint64_t value;
+    uint64_t nb_keys;
+    int ret = 0;
+
+    if (cdns_test_expect(&reader, 4, &value) != 0 || value != 3 ||
+        cdns_test_expect(&reader, 3, &value) != 0 || value != 5 || memcmp(data + reader.pos, "C-DNS", 5) != 0) {
+        DBG_PRINTF("%s", "Bad C-DNS file type");
+        return -1;
+    }
+    reader.pos += 5;
+    if (cdns_test_expect(&reader, 5, &nb_keys) != 0 || cdns_test_expect(&reader, 0, &value) != 0 || value != 0 ||
+        cdns_test_expect(&reader, 0, &value) != 0 || value != 1) {
+        DBG_PRINTF("%s", "Bad C-DNS preamble");
+        return -1;
+    }
+    for (uint64_t k = 1; ret == 0 && k < nb_keys; k++) {
+        if ((ret = cdns_test_skip(&reader)) == 0) {
+            ret = cdns_test_skip(&reader);
+        }
+    }
+    if (ret != 0 || cdns_test_expect(&reader, 4, &value) != 0 || value != CDNS_TEST_INDEFINITE) {
+        DBG_PRINTF("%s", "Bad C-DNS block array");
+        return -1;
+    }
+
+    while (ret == 0 && reader.pos < length && data[reader.pos] != 0xff) {
+        uint64_t table_length[4] = { 0, 0, 0, 0 };
+
+        if ((ret = cdns_test_expect(&reader, 5, &nb_keys)) != 0) {
+            break;
+        }
+        for (uint64_t k = 0; ret == 0 && k < nb_keys; k++) {
+            uint64_t key;
+
+            if ((ret = cdns_test_expect(&reader, 0, &key)) == 0) {
+                if (key == 2) {
+                    ret = cdns_test_tables(&reader, table_length);
+                    if (ret == 0 && (table_length[0] > 2 || table_length[2] > 3)) {
+                        DBG_PRINTF("Duplicates in block tables, %" PRIu64 " addresses, %" PRIu64 " names",
+                            table_length[0], table_length[2]);
+                        ret = -1;
+                    }
+                }
+                else if (key == 3) {
+                    ret = cdns_test_items(&reader, table_length, nb_items, nb_responses);
+                }
+                else {
+                    ret = cdns_test_skip(&reader);
+                }
+            }
+        }
+        *nb_blocks += 1;
+    }
+
+    if (ret == 0 && reader.pos + 1 != length) {
+        DBG_PRINTF("Unexpected end of C-DNS file at %zu, length %zu", reader.pos, length);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int quicdoq_cdns_test()
+{
+    int ret = 0;
+    quicdoq_cdns_t* cdns = quicdoq_cdns_open(CDNS_TEST_FILE, CDNS_TEST_BLOCK_ITEMS, 10000000, QUICDOQ_CDNS_QR_TYPE_CLIENT);
+    quicdoq_cdns_stats_t stats;
+    struct sockaddr_storage addr[2];
+    uint8_t query[sizeof(cdns_test_query)];
+    uint8_t response[sizeof(cdns_test_response)];
+    quicdoq_dns_view_t view;
+    uint64_t query_time = 1600000000000000ull;
+
+    if (cdns == NULL) {
+        DBG_PRINTF("Cannot open %s", CDNS_TEST_FILE);
+        return -1;
+    }
+
+    picoquic_store_text_addr(&addr[0], "10.0.0.1", 4433);
+    picoquic_store_text_addr(&addr[1], "2001:db8::1", 4434);
+
+    for (int i = 0; ret == 0 && i < CDNS_TEST_NB_ITEMS; i++) {
+        /* Use three different names, and two client addresses */
+        memcpy(query, cdns_test_query, sizeof(query));
+        memcpy(response, cdns_test_response, sizeof(response));
+        query[13] = (uint8_t)('a' + i % 3);
+        query[1] = (uint8_t)i;
+        response[1] = (uint8_t)i;
+        if (quicdoq_dns_view_parse(&view, query, sizeof(query)) != 0) {
+            DBG_PRINTF("Cannot parse query %d", i);
+            ret = -1;
+        }
+        else if (quicdoq_cdns_log(cdns, &view, query, sizeof(query), (i & 1) ? NULL : response, sizeof(response),
+            (struct sockaddr*)&addr[i % 2], query_time + 1000 * i, query_time + 1000 * i + 250) != 0) {
+            DBG_PRINTF("Cannot log item %d", i);
+            ret = -1;
+        }
+        else if (i % CDNS_TEST_BLOCK_ITEMS == 0 && i > 0) {
+            /* Wait until the writer releases the previous block, so no item is dropped */
+            uint64_t start_time = picoquic_current_time();
+
+            do {
+                quicdoq_cdns_get_stats(cdns, &stats);
+            } while (stats.nb_blocks < (uint64_t)(i / CDNS_TEST_BLOCK_ITEMS) &&
+                picoquic_current_time() < start_time + 5000000);
+        }
+    }
+
+    if (quicdoq_cdns_log(cdns, NULL, cdns_test_query, 11, NULL, 0, (struct sockaddr*)&addr[0], query_time, 0) == 0) {
+        DBG_PRINTF("%s", "Malformed query not detected");
+        ret = -1;
+    }
+
+    quicdoq_cdns_get_stats(cdns, &stats);
+    quicdoq_cdns_close(cdns);
+
+    if (ret == 0 && (stats.nb_items != CDNS_TEST_NB_ITEMS || stats.nb_dropped != 0 || stats.nb_malformed != 1)) {
+        DBG_PRINTF("Unexpected stats, %" PRIu64 " items, %" PRIu64 " dropped", stats.nb_items, stats.nb_dropped);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        FILE* F = picoquic_file_open(CDNS_TEST_FILE, "rb");
+        uint8_t* data = (uint8_t*)malloc(0x10000);
+        size_t length = 0;
+        uint64_t nb_blocks = 0;
+        uint64_t nb_items = 0;
+        uint64_t nb_responses = 0;
+
+        if (F == NULL || data == NULL) {
+            ret = -1;
+        }
+        else {
+            length = fread(data, 1, 0x10000, F);
+            ret = cdns_test_read(data, length, &nb_blocks, &nb_items, &nb_responses);
+            if (ret == 0 && (nb_blocks != 4 || nb_items != CDNS_TEST_NB_ITEMS || nb_responses != CDNS_TEST_NB_ITEMS / 2)) {
+                DBG_PRINTF("Found %" PRIu64 " blocks, %" PRIu64 " items, %" PRIu64 " responses",
+                    nb_blocks, nb_items, nb_responses);
+                ret = -1;
+            }
+        }
+        if (F != NULL) {
+            (void)picoquic_file_close(F);
+        }
+        if (data != NULL) {
+            free(data);
+        }
+    }
+
+    return ret;
+}
@@ -243,9 +243,6 @@ int dns_query_format_test()
 
 /* Test the RR Type entry */
 
-extern const quicdoq_rr_entry_t rr_table[];
-extern const size_t nb_rr_table;
-
 int rr_name_parse_test()
 {
     int ret = 0;
@@ -286,6 +283,128 @@ int rr_name_parse_test()
     return ret;
 }
 
+/* Test the perfect hash of the RR names and the reverse mapping.
+ * The hash tables are recomputed from rr_table, and printed if they
+ * do not match the tables in quicdoq_util.c.
+ */
+static int rr_hash_generate(uint8_t* displacement, uint8_t* hash_index)
+{
+    int ret = 0;
+    size_t bucket_size[QUICDOQ_RR_HASH_BUCKETS];
+    uint8_t is_used[256];
+
+    memset(bucket_size, 0, sizeof(bucket_size));
+    memset(is_used, 0, sizeof(is_used));
+    memset(displacement, 0, QUICDOQ_RR_HASH_BUCKETS);
+
+    for (size_t i = 0; i < nb_rr_table; i++) {
+        bucket_size[quicdoq_rr_hash(rr_table[i].rr_name, 0) % QUICDOQ_RR_HASH_BUCKETS]++;
+    }
+
+    /* Place the largest buckets first */
+    for (size_t b_size = nb_rr_table; ret == 0 && b_size > 0; b_size--) {
+        for (uint32_t b = 0; ret == 0 && b < QUICDOQ_RR_HASH_BUCKETS; b++) {
+            if (bucket_size[b] != b_size) {
+                continue;
+            }
+            ret = -1;
+            for (uint32_t d = 1; ret != 0 && d < 256; d++) {
+                uint8_t is_tried[256];
+                int is_ok = 1;
+
+                memset(is_tried, 0, sizeof(is_tried));
+                for (size_t i = 0; is_ok && i < nb_rr_table; i++) {
+                    if (quicdoq_rr_hash(rr_table[i].rr_name, 0) % QUICDOQ_RR_HASH_BUCKETS == b) {
+                        uint32_t slot = quicdoq_rr_hash(rr_table[i].rr_name, d) % (uint32_t)nb_rr_table;
+                        if (is_used[slot] || is_tried[slot]) {
+                            is_ok = 0;
+                        }
+                        else {
+                            is_tried[slot] = 1;
+                            hash_index[slot] = (uint8_t)i;
+                        }
+                    }
+                }
+                if (is_ok) {
+                    for (size_t slot = 0; slot < nb_rr_table; slot++) {
+                        is_used[slot] |= is_tried[slot];
+                    }
+                    displacement[b] = (uint8_t)d;
+                    ret = 0;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+int rr_hash_test()
+{
+    int ret = 0;
+    uint8_t displacement[QUICDOQ_RR_HASH_BUCKETS];
+    uint8_t hash_index[256];
+    const uint16_t no_name[] = { 0, 54, 64, 98, 110, 248, 261, 4096, 32767, 32770, 0xFFFF };
+    size_t nb_no_name = sizeof(no_name) / sizeof(uint16_t);
+
+    if (nb_rr_table > 255) {
+        DBG_PRINTF("Too many RR names for the hash table: %zu", nb_rr_table);
+        ret = -1;
+    }
+    else if (rr_hash_generate(displacement, hash_index) != 0) {
+        DBG_PRINTF("%s", "Cannot generate the RR hash table");
+        ret = -1;
+    }
+    else if (memcmp(displacement, rr_hash_displacement, QUICDOQ_RR_HASH_BUCKETS) != 0 ||
+        memcmp(hash_index, rr_hash_index, nb_rr_table) != 0) {
+        DBG_PRINTF("%s", "The RR hash tables do not match rr_table, expected:");
+        for (size_t i = 0; i < QUICDOQ_RR_HASH_BUCKETS; i++) {
+            DBG_PRINTF("rr_hash_displacement[%zu] = %d", i, displacement[i]);
+        }
+        for (size_t i = 0; i < nb_rr_table; i++) {
+            DBG_PRINTF("rr_hash_index[%zu] = %d", i, hash_index[i]);
+        }
+        ret = -1;
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_rr_table; i++) {
+        char lower_name[32];
+        size_t l = strlen(rr_table[i].rr_name);
+        char const* rr_name;
+
+        for (size_t j = 0; j <= l && j < sizeof(lower_name); j++) {
+            char c = rr_table[i].rr_name[j];
+            lower_name[j] = (c >= 'A' && c <= 'Z') ? (char)(c + 'a' - 'A') : c;
+        }
+
+        if (quicdoq_get_rr_type(lower_name) != rr_table[i].rr_type) {
+            DBG_PRINTF("For %s expected %d, got %d", lower_name, rr_table[i].rr_type, quicdoq_get_rr_type(lower_name));
+            ret = -1;
+        }
+        else if (rr_table[i].rr_type != 54 &&
+            ((rr_name = quicdoq_get_rr_name(rr_table[i].rr_type)) == NULL || strcmp(rr_name, rr_table[i].rr_name) != 0)) {
+            DBG_PRINTF("For type %d expected %s, got %s", rr_table[i].rr_type, rr_table[i].rr_name,
+                (rr_name == NULL) ? "NULL" : rr_name);
+            ret = -1;
+        }
+    }
+
+    for (size_t i = 0; ret == 0 && i < nb_no_name; i++) {
+        if (quicdoq_get_rr_name(no_name[i]) != NULL) {
+            DBG_PRINTF("For type %d expected no name, got %s", no_name[i], quicdoq_get_rr_name(no_name[i]));
+            ret = -1;
+        }
+    }
+
+    if (ret == 0 && (quicdoq_get_rr_type("Aaaa") != 28 || quicdoq_get_rr_type("AAAAA") != UINT16_MAX ||
+        quicdoq_get_rr_type("") != 0)) {
+        DBG_PRINTF("%s", "Unexpected value for a near miss");
+        ret = -1;
+    }
+
+    return ret;
+}
+
 /* Refuse format:
  * Check conditions based on input queries:
  * - bare
@@ -402,4 +521,471 @@ int dns_refuse_format_test()
     }
 
     return ret;
-}
\ No newline at end of file
+}
+/* Test the structured view of DNS messages: check the fields found in
+ * valid messages, and verify that malformed messages are rejected.
+ */
+static uint8_t dnscode_test_view_response[] = {
+    0x12, 0x34, 0x81, 0x80, 0, 1, 0, 2, 0, 1, 0, 1,
+    3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+    /* CNAME edge.example.com, at offset 33 */
+    0xc0, 12, 0, 5, 0, 1, 0, 0, 0x0e, 0x10, 0, 7, 4, 'e', 'd', 'g', 'e', 0xc0, 16,
+    /* A of the CNAME target, at offset 52 */
+    0xc0, 45, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 192, 0, 2, 1,
+    /* NS, at offset 68 */
+    0xc0, 16, 0, 2, 0, 1, 0, 1, 0x51, 0x80, 0, 6, 3, 'n', 's', '1', 0xc0, 16,
+    /* OPT, at offset 86 */
+    0, 0, 41, 4, 0xd0, 0, 0, 0, 0, 0, 0
+};
+
+static uint8_t dnscode_test_view_forward_pointer[] = { 1, 255, 1, 0,
+    0, 1, 0, 0, 0, 0, 0, 0,
+    0xc0, 14, 0, 1, 0, 1
+};
+
+static uint8_t dnscode_test_view_header_pointer[] = { 1, 255, 1, 0,
+    0, 1, 0, 0, 0, 0, 0, 0,
+    3, 'w', 'w', 'w', 0xc0, 4, 0, 1, 0, 1
+};
+
+static uint8_t dnscode_test_view_pointer_loop[] = { 1, 255, 1, 0,
+    0, 2, 0, 0, 0, 0, 0, 0,
+    1, 'a', 0xc0, 16, 0, 1, 0, 1,
+    1, 'b', 0xc0, 12, 0, 1, 0, 1
+};
+
+static uint8_t dnscode_test_view_long_label[] = { 1, 255, 1, 0,
+    0, 1, 0, 0, 0, 0, 0, 0,
+    64, 0, 1, 0, 1
+};
+
+static uint8_t dnscode_test_view_truncated_rr[] = { 1, 255, 0x81, 0x80,
+    0, 1, 0, 1, 0, 0, 0, 0,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+    0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 192, 0, 2
+};
+
+static uint8_t dnscode_test_view_two_opt[] = { 1, 255, 1, 0,
+    0, 1, 0, 0, 0, 0, 0, 2,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+    0, 0, 41, 8, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 41, 8, 0, 0, 0, 0, 0, 0, 0
+};
+
+static uint8_t dnscode_test_view_opt_in_answer[] = { 1, 255, 0x81, 0x80,
+    0, 1, 0, 1, 0, 0, 0, 0,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+    0, 0, 41, 8, 0, 0, 0, 0, 0, 0, 0
+};
+
+static uint8_t dnscode_test_view_bad_cname[] = { 1, 255, 0x81, 0x80,
+    0, 1, 0, 1, 0, 0, 0, 0,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+    0xc0, 12, 0, 5, 0, 1, 0, 0, 0, 60, 0, 3, 4, 'e', 'd'
+};
+
+typedef struct st_dnscode_view_bad_t {
+    uint8_t* message;
+    size_t length;
+    char const* name;
+} dnscode_view_bad_t;
+
+int dns_view_test()
+{
+    int ret = 0;
+    quicdoq_dns_view_t view;
+    uint8_t long_name[12 + 300 + 5];
+    uint8_t many_rr[12 + 17 + 40 * 16];
+    size_t pos;
+    dnscode_view_bad_t bad[] = {
+        { dnscode_test_query_bad_format, sizeof(dnscode_test_query_bad_format), "bad format" },
+        { dnscode_test_view_forward_pointer, sizeof(dnscode_test_view_forward_pointer), "forward pointer" },
+        { dnscode_test_view_header_pointer, sizeof(dnscode_test_view_header_pointer), "header pointer" },
+        { dnscode_test_view_pointer_loop, sizeof(dnscode_test_view_pointer_loop), "pointer loop" },
+        { dnscode_test_view_long_label, sizeof(dnscode_test_view_long_label), "long label" },
+        { dnscode_test_view_truncated_rr, sizeof(dnscode_test_view_truncated_rr), "truncated RR" },
+        { dnscode_test_view_two_opt, sizeof(dnscode_test_view_two_opt), "two OPT" },
+        { dnscode_test_view_opt_in_answer, sizeof(dnscode_test_view_opt_in_answer), "OPT in answer" },
+        { dnscode_test_view_bad_cname, sizeof(dnscode_test_view_bad_cname), "bad CNAME" },
+        { long_name, sizeof(long_name), "long name" },
+        { dnscode_test_query_bare, 11, "short header" }
+    };
+    size_t nb_bad = sizeof(bad) / sizeof(dnscode_view_bad_t);
+
+    /* Query with EDNS */
+    if (quicdoq_dns_view_parse(&view, dnscode_test_query_edns, sizeof(dnscode_test_query_edns)) != 0) {
+        DBG_PRINTF("%s", "Cannot parse the EDNS query");
+        ret = -1;
+    }
+    else if (view.id != 511 || QUICDOQ_VIEW_QR(&view) != 0 || view.qdcount != 1 || view.arcount != 1 ||
+        view.qname_offset != 12 || view.qname_length != 13 || view.qtype != 1 || view.qclass != 1 ||
+        !view.has_opt || view.opt.rr_class != 2048 || view.nb_rr != 1 ||
+        view.section_offset[0] != 29 || view.section_offset[1] != 29 || view.section_offset[2] != 29 ||
+        view.message_length != sizeof(dnscode_test_query_edns) ||
+        !quicdoq_dns_view_is_idempotent(&view)) {
+        DBG_PRINTF("%s", "Unexpected view of the EDNS query");
+        ret = -1;
+    }
+
+    /* Response with compression in names and RDATA */
+    if (ret == 0) {
+        if (quicdoq_dns_view_parse(&view, dnscode_test_view_response, sizeof(dnscode_test_view_response)) != 0) {
+            DBG_PRINTF("%s", "Cannot parse the response");
+            ret = -1;
+        }
+        else if (view.id != 0x1234 || QUICDOQ_VIEW_QR(&view) != 1 || QUICDOQ_VIEW_RCODE(&view) != 0 ||
+            view.nb_rr != 4 || view.section_offset[0] != 33 || view.section_offset[1] != 68 ||
+            view.section_offset[2] != 86 || view.rr[0].rr_type != 5 || view.rr[0].ttl != 3600 ||
+            view.rr[1].name_offset != 52 || view.rr[1].rdata_offset != 64 || view.rr[1].rdata_length != 4 ||
+            view.rr[2].rr_type != 2 || !view.has_opt || view.opt.rr_class != 1232 ||
+            view.message_length != sizeof(dnscode_test_view_response)) {
+            DBG_PRINTF("%s", "Unexpected view of the response");
+            ret = -1;
+        }
+        else {
+            /* The owner of the A record is compressed twice */
+            const uint8_t expected[] = { 4, 'e', 'd', 'g', 'e', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0 };
+            uint8_t name[256];
+
+            if (quicdoq_dns_view_copy_name(dnscode_test_view_response, sizeof(dnscode_test_view_response), view.rr[1].name_offset,
+                name, sizeof(name)) != sizeof(expected) || memcmp(name, expected, sizeof(expected)) != 0 ||
+                quicdoq_dns_view_copy_name(dnscode_test_view_response, sizeof(dnscode_test_view_response), view.rr[1].name_offset,
+                    name, sizeof(expected) - 1) != 0) {
+                DBG_PRINTF("%s", "Unexpected copy of a compressed name");
+                ret = -1;
+            }
+        }
+    }
+
+    /* Zone transfers are not idempotent */
+    if (ret == 0) {
+        uint8_t axfr[sizeof(dnscode_test_query_bare)];
+
+        memcpy(axfr, dnscode_test_query_bare, sizeof(axfr));
+        axfr[25] = 0;
+        axfr[26] = 252;
+        if (quicdoq_dns_view_parse(&view, axfr, sizeof(axfr)) != 0 || quicdoq_dns_view_is_idempotent(&view)) {
+            DBG_PRINTF("%s", "AXFR should not be idempotent");
+            ret = -1;
+        }
+    }
+
+    /* More records than the view can hold are checked but not recorded */
+    if (ret == 0) {
+        memset(many_rr, 0, sizeof(many_rr));
+        many_rr[5] = 1;
+        many_rr[7] = 40;
+        memcpy(many_rr + 12, dnscode_test_query_bare + 12, 17);
+        pos = 12 + 17;
+        for (int i = 0; i < 40; i++) {
+            uint8_t rr[16] = { 0xc0, 12, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 192, 0, 2, 0 };
+            rr[15] = (uint8_t)i;
+            memcpy(many_rr + pos, rr, sizeof(rr));
+            pos += sizeof(rr);
+        }
+        if (quicdoq_dns_view_parse(&view, many_rr, pos) != 0 || view.nb_rr != QUICDOQ_VIEW_MAX_RR ||
+            view.ancount != 40 || view.message_length != pos) {
+            DBG_PRINTF("%s", "Unexpected view of the message with many records");
+            ret = -1;
+        }
+        else {
+            /* A pointer to a later record must be rejected, even past the recorded ones */
+            many_rr[pos - 16] = (uint8_t)(0xc0 | ((pos - 4) >> 8));
+            many_rr[pos - 15] = (uint8_t)((pos - 4) & 0xff);
+            if (quicdoq_dns_view_parse(&view, many_rr, pos) == 0) {
+                DBG_PRINTF("%s", "Forward pointer in the last record not detected");
+                ret = -1;
+            }
+        }
+    }
+
+    /* Names longer than 255 bytes */
+    memset(long_name, 0, sizeof(long_name));
+    long_name[5] = 1;
+    pos = 12;
+    for (int i = 0; i < 5; i++) {
+        long_name[pos] = 59;
+        memset(long_name + pos + 1, 'a', 59);
+        pos += 60;
+    }
+    long_name[pos] = 0;
+    long_name[pos + 2] = 1;
+    long_name[pos + 4] = 1;
+
+    for (size_t i = 0; ret == 0 && i < nb_bad; i++) {
+        if (quicdoq_dns_view_parse(&view, bad[i].message, bad[i].length) == 0) {
+            DBG_PRINTF("Malformed message not detected: %s", bad[i].name);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Verify that the vector versions of the name functions give the same
+ * results as the byte per byte versions, for random labels including
+ * all byte values and output buffers of all sizes.
+ */
+static uint64_t dns_name_simd_random(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int dns_name_simd_test()
+{
+    int ret = 0;
+    uint64_t state = 0xDEADBEEFCAFEull;
+    uint8_t label[64];
+    uint8_t text_v[300];
+    uint8_t text_s[300];
+    const uint8_t charset[] = "AZaz09-_. .\\\x7f\x80\xff\x1f";
+
+    for (int trial = 0; ret == 0 && trial < 2000; trial++) {
+        size_t length = (size_t)(dns_name_simd_random(&state) % 64);
+        int mode = trial % 3;
+
+        for (size_t i = 0; i < length; i++) {
+            uint64_t r = dns_name_simd_random(&state);
+            if (mode == 0) {
+                label[i] = (uint8_t)r;
+            }
+            else if (mode == 1 && (r & 15) == 0) {
+                label[i] = charset[(r >> 8) % (sizeof(charset) - 1)];
+            }
+            else {
+                label[i] = (uint8_t)('a' + (r >> 8) % 26);
+            }
+        }
+
+        for (size_t text_max = 1; ret == 0 && text_max <= sizeof(text_v); text_max += (text_max < 80) ? 1 : 37) {
+            uint8_t* end_v;
+            uint8_t* end_s;
+
+            memset(text_v, 0xAA, sizeof(text_v));
+            memset(text_s, 0xAA, sizeof(text_s));
+            end_v = NormalizeNamePart(length, label, text_v, text_v + text_max);
+            end_s = quicdoq_normalize_name_part_scalar(length, label, text_s, text_s + text_max);
+
+            if ((end_v == NULL) != (end_s == NULL) ||
+                (end_v != NULL && (end_v - text_v != end_s - text_s || memcmp(text_v, text_s, end_v - text_v + 1) != 0))) {
+                DBG_PRINTF("Normalize mismatch, trial %d, length %zu, text max %zu", trial, length, text_max);
+                ret = -1;
+            }
+        }
+    }
+
+    /* Folding: compare with the scalar version, and check that names
+     * that only differ by case or compression fold to the same value. */
+    if (ret == 0) {
+        uint8_t msg[512];
+        uint8_t fold_v[256];
+        uint8_t fold_s[256];
+        size_t len_v = 0;
+        size_t len_s = 0;
+        uint64_t hash_v = 0;
+        uint64_t hash_s = 0;
+        uint64_t hash_lower = 0;
+        uint8_t* data;
+        size_t after_first;
+        size_t next_v;
+        size_t next_s;
+
+        memset(msg, 0, 12);
+        data = quicdog_format_dns_name(msg + 12, msg + sizeof(msg), "www.Example.COM");
+        after_first = data - msg;
+        data = quicdog_format_dns_name(data, msg + sizeof(msg), "www.example.com");
+        /* Compressed: "WWW" then a pointer to "Example.COM" */
+        *data++ = 3; *data++ = 'W'; *data++ = 'W'; *data++ = 'W'; *data++ = 0xC0; *data++ = 16;
+        /* Long labels, to exercise the vector paths */
+        data = quicdog_format_dns_name(data, msg + sizeof(msg),
+            "ThisIsAVeryLongLabelWithUpperCaseLettersOnBothSidesOfTheMiddle.AND-ANOTHER-ONE-THAT-IS-QUITE-LONG-TOO.example");
+
+        for (size_t start = 12; ret == 0 && start < (size_t)(data - msg); ) {
+            next_v = quicdoq_fold_dns_name(msg, data - msg, start, fold_v, sizeof(fold_v), &len_v, &hash_v);
+            next_s = quicdoq_fold_dns_name_scalar(msg, data - msg, start, fold_s, sizeof(fold_s), &len_s, &hash_s);
+            if (next_v == 0 || next_v != next_s || len_v != len_s || hash_v != hash_s || memcmp(fold_v, fold_s, len_v) != 0) {
+                DBG_PRINTF("Fold mismatch for name at %zu", start);
+                ret = -1;
+            }
+            else {
+                for (size_t i = 0; i < len_v; i++) {
+                    if (fold_v[i] >= 'A' && fold_v[i] <= 'Z') {
+                        DBG_PRINTF("Fold left upper case for name at %zu", start);
+                        ret = -1;
+                        break;
+                    }
+                }
+                if (start == 12) {
+                    hash_lower = hash_v;
+                }
+                else if (start < 12 + 2 * (after_first - 12) + 6 && hash_v != hash_lower) {
+                    DBG_PRINTF("Different hash for equivalent name at %zu", start);
+                    ret = -1;
+                }
+                else if (start >= 12 + 2 * (after_first - 12) + 6 && hash_v == hash_lower) {
+                    DBG_PRINTF("Same hash for different name at %zu", start);
+                    ret = -1;
+                }
+            }
+            start = next_v;
+        }
+
+        /* Malformed names and small buffers are rejected */
+        if (ret == 0) {
+            uint8_t forward[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xC0, 14, 1, 'a', 0 };
+            if (quicdoq_fold_dns_name(forward, sizeof(forward), 12, fold_v, sizeof(fold_v), &len_v, &hash_v) != 0 ||
+                quicdoq_fold_dns_name(msg, after_first, 12, fold_v, 8, &len_v, &hash_v) != 0 ||
+                quicdoq_fold_dns_name(msg, after_first - 1, 12, fold_v, sizeof(fold_v), &len_v, &hash_v) != 0) {
+                DBG_PRINTF("%s", "Malformed name not detected by fold");
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* Build a response with the DNS message builder. Verify that names
+ * are compressed, that the counts are set, that the result can be parsed,
+ * and that records that do not fit are removed and cause truncation.
+ */
+static const uint8_t dnscode_test_builder_ede[] = { 0, 15, 0, 7, 0, 3, 's', 't', 'a', 'l', 'e' };
+
+static int dns_builder_fill(quicdoq_query_ctx_t* query_ctx, quicdoq_builder_t* builder, int nb_answers, int nb_additional)
+{
+    int ret = 0;
+    uint8_t www[64];
+    uint8_t ns1[64];
+    uint8_t a_data[4] = { 192, 0, 2, 1 };
+    const uint8_t* qname = query_ctx->query + 12;
+
+    if (quicdoq_builder_name_from_text(www, sizeof(www), "www.example.com") == 0 ||
+        quicdoq_builder_name_from_text(ns1, sizeof(ns1), "ns1.Example.COM.") == 0) {
+        ret = -1;
+    }
+    else if (quicdoq_builder_init_response(builder, query_ctx, 0) != 0 ||
+        quicdoq_builder_start_rr(builder, quicdoq_section_answer, qname, 5, 1, 3600) != 0 ||
+        quicdoq_builder_add_rdata_name(builder, www, 1) != 0 ||
+        quicdoq_builder_end_rr(builder) != 0) {
+        ret = -1;
+    }
+
+    for (int i = 0; ret == 0 && i < nb_answers; i++) {
+        a_data[3] = (uint8_t)(i + 1);
+        ret = quicdoq_builder_add_rr(builder, quicdoq_section_answer, www, 1, 1, 600, a_data, sizeof(a_data));
+    }
+
+    if (ret == 0) {
+        ret = quicdoq_builder_start_rr(builder, quicdoq_section_authority, qname, 2, 1, 86400);
+        if (ret == 0) {
+            ret = quicdoq_builder_add_rdata_name(builder, ns1, 1);
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < nb_additional; i++) {
+        a_data[3] = (uint8_t)(i + 100);
+        ret = quicdoq_builder_add_rr(builder, quicdoq_section_additional, ns1, 1, 1, 600, a_data, sizeof(a_data));
+    }
+
+    if (ret == 0 && quicdoq_builder_start_opt(builder, 1232, 0, 0) == 0) {
+        ret = quicdoq_builder_add_ede(builder, 3, "stale");
+    }
+
+    if (quicdoq_builder_finish_response(builder, query_ctx) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int dns_builder_test()
+{
+    int ret = 0;
+    uint8_t response[512];
+    uint8_t bad_name[70];
+    quicdoq_query_ctx_t query_ctx;
+    quicdoq_builder_t builder;
+    quicdoq_dns_view_t view;
+
+    memset(&query_ctx, 0, sizeof(query_ctx));
+    query_ctx.query = dnscode_test_query_edns;
+    query_ctx.query_length = (uint16_t)sizeof(dnscode_test_query_edns);
+    query_ctx.response = response;
+    query_ctx.response_max_size = (uint16_t)sizeof(response);
+
+    /* Complete response */
+    if (dns_builder_fill(&query_ctx, &builder, 1, 0) != 0) {
+        DBG_PRINTF("%s", "Cannot build the response");
+        ret = -1;
+    }
+    else if (query_ctx.response_length != 103 || builder.is_truncated ||
+        response[29] != 0xc0 || response[30] != 12 || response[45] != 0xc0 || response[46] != 12 ||
+        response[47] != 0xc0 || response[48] != 41 || response[63] != 0xc0 || response[64] != 12 ||
+        response[79] != 0xc0 || response[80] != 12 ||
+        memcmp(response + 103 - sizeof(dnscode_test_builder_ede), dnscode_test_builder_ede, sizeof(dnscode_test_builder_ede)) != 0) {
+        DBG_PRINTF("Unexpected response, length %zu", query_ctx.response_length);
+        ret = -1;
+    }
+    else if (quicdoq_dns_view_parse(&view, response, query_ctx.response_length) != 0) {
+        DBG_PRINTF("%s", "Cannot parse the response");
+        ret = -1;
+    }
+    else if (view.id != 511 || QUICDOQ_VIEW_QR(&view) != 1 || (view.flags & 0x0100) == 0 || QUICDOQ_VIEW_TC(&view) ||
+        view.qdcount != 1 || view.ancount != 2 || view.nscount != 1 || view.arcount != 1 ||
+        view.qtype != 1 || view.rr[0].rr_type != 5 || view.rr[1].ttl != 600 || view.rr[2].rr_type != 2 ||
+        !view.has_opt || view.opt.rr_class != 1232 || view.opt.rdata_length != sizeof(dnscode_test_builder_ede)) {
+        DBG_PRINTF("%s", "Unexpected view of the response");
+        ret = -1;
+    }
+
+    /* Answers that do not fit are removed and the TC bit is set */
+    if (ret == 0) {
+        query_ctx.response_max_size = 200;
+        if (dns_builder_fill(&query_ctx, &builder, 16, 0) == 0 || !builder.is_truncated ||
+            builder.count[quicdoq_section_answer] != 10 || query_ctx.response_length != 47 + 9 * 16 ||
+            quicdoq_dns_view_parse(&view, response, query_ctx.response_length) != 0 ||
+            QUICDOQ_VIEW_TC(&view) != 1 || view.ancount != 10 || view.nscount != 0 || view.arcount != 0) {
+            DBG_PRINTF("Unexpected truncated response, length %zu", query_ctx.response_length);
+            ret = -1;
+        }
+    }
+
+    /* Additional records that do not fit do not cause truncation */
+    if (ret == 0) {
+        query_ctx.response_max_size = 120;
+        if (dns_builder_fill(&query_ctx, &builder, 1, 4) == 0 || builder.is_truncated ||
+            builder.count[quicdoq_section_additional] != 2 || builder.has_opt ||
+            quicdoq_dns_view_parse(&view, response, query_ctx.response_length) != 0 ||
+            QUICDOQ_VIEW_TC(&view) != 0 || view.arcount != 2 || view.has_opt) {
+            DBG_PRINTF("Unexpected response without additional records, length %zu", query_ctx.response_length);
+            ret = -1;
+        }
+    }
+
+    /* Records must be added in section order, names must be valid */
+    if (ret == 0) {
+        uint8_t root = 0;
+
+        memset(bad_name, 0, sizeof(bad_name));
+        bad_name[0] = 64;
+        query_ctx.response_max_size = (uint16_t)sizeof(response);
+        if (quicdoq_builder_init_response(&builder, &query_ctx, 3) != 0 ||
+            quicdoq_builder_start_opt(&builder, 1232, 0, 0) != 0 ||
+            quicdoq_builder_start_opt(&builder, 1232, 0, 0) == 0 ||
+            quicdoq_builder_start_rr(&builder, quicdoq_section_answer, &root, 1, 1, 0) == 0 ||
+            quicdoq_builder_add_question(&builder, &root, 1, 1) == 0 ||
+            quicdoq_builder_start_rr(&builder, quicdoq_section_additional, bad_name, 1, 1, 0) == 0 ||
+            builder.is_truncated || builder.length != 29 + 11 ||
+            quicdoq_builder_finish_response(&builder, &query_ctx) != 0 ||
+            quicdoq_dns_view_parse(&view, response, query_ctx.response_length) != 0 ||
+            QUICDOQ_VIEW_RCODE(&view) != 3 || view.arcount != 1 || !view.has_opt) {
+            DBG_PRINTF("%s", "Unexpected result of invalid builder calls");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
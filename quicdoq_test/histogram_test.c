@@ -0,0 +1,125 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Histogram tests.
+ * Check that percentiles are within the bucket precision for a uniform
+ * distribution, that merging two halves gives the same histogram as
+ * recording all the values, and that extreme values are handled.
+ */
+
+#define HISTOGRAM_TEST_NB_VALUES 100000
+
+static int histogram_test_check(const quicdoq_histogram_t* histogram, double percentile, uint64_t expected)
+{
+    int ret = 0;
+    uint64_t value = quicdoq_histogram_percentile(histogram, percentile);
+
+    /* Rounded up to the top of the bucket, at most 12.5% above the exact value */
+    if (value < expected || value > expected + expected / 8) {
+        DBG_PRINTF("Percentile %f is %" PRIu64 ", expected %" PRIu64, percentile, value, expected);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int quicdoq_histogram_test()
+{
+    int ret = 0;
+    quicdoq_histogram_t* histogram = (quicdoq_histogram_t*)malloc(3 * sizeof(quicdoq_histogram_t));
+
+    if (histogram == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(histogram, 0, 3 * sizeof(quicdoq_histogram_t));
+
+        if (quicdoq_histogram_percentile(&histogram[0], 50.0) != 0) {
+            DBG_PRINTF("%s", "Empty histogram should return 0");
+            ret = -1;
+        }
+
+        /* Values 1 to N, in two halves */
+        for (uint64_t v = 1; v <= HISTOGRAM_TEST_NB_VALUES; v++) {
+            quicdoq_histogram_record(&histogram[0], v);
+            quicdoq_histogram_record(&histogram[(v & 1) ? 1 : 2], v);
+        }
+        quicdoq_histogram_merge(&histogram[1], &histogram[2]);
+
+        if (ret == 0 && (histogram[0].count != HISTOGRAM_TEST_NB_VALUES || histogram[0].min != 1 ||
+            histogram[0].max != HISTOGRAM_TEST_NB_VALUES ||
+            histogram[0].sum != (uint64_t)HISTOGRAM_TEST_NB_VALUES * (HISTOGRAM_TEST_NB_VALUES + 1) / 2)) {
+            DBG_PRINTF("%s", "Unexpected count, min, max or sum");
+            ret = -1;
+        }
+        else if (ret == 0 && memcmp(&histogram[0], &histogram[1], sizeof(quicdoq_histogram_t)) != 0) {
+            DBG_PRINTF("%s", "Merged histogram differs");
+            ret = -1;
+        }
+
+        if (ret == 0 && (ret = histogram_test_check(&histogram[0], 50.0, HISTOGRAM_TEST_NB_VALUES / 2)) == 0 &&
+            (ret = histogram_test_check(&histogram[0], 99.0, HISTOGRAM_TEST_NB_VALUES * 99 / 100)) == 0 &&
+            (ret = histogram_test_check(&histogram[0], 0.001, 1)) == 0 &&
+            quicdoq_histogram_percentile(&histogram[0], 100.0) != HISTOGRAM_TEST_NB_VALUES) {
+            DBG_PRINTF("%s", "The 100th percentile should be the max");
+            ret = -1;
+        }
+
+        /* Small values have a bucket each */
+        if (ret == 0) {
+            memset(&histogram[2], 0, sizeof(quicdoq_histogram_t));
+            for (uint64_t v = 0; v < 16; v++) {
+                quicdoq_histogram_record(&histogram[2], v);
+            }
+            for (uint64_t v = 0; ret == 0 && v < 16; v++) {
+                if (histogram[2].bucket[v] != 1 || quicdoq_histogram_percentile(&histogram[2], (double)(v + 1) * 100.0 / 16.0) != v) {
+                    DBG_PRINTF("Unexpected bucket for %" PRIu64, v);
+                    ret = -1;
+                }
+            }
+        }
+
+        /* Huge values go to the last bucket */
+        if (ret == 0) {
+            memset(&histogram[2], 0, sizeof(quicdoq_histogram_t));
+            quicdoq_histogram_record(&histogram[2], UINT64_MAX);
+            quicdoq_histogram_record(&histogram[2], ((uint64_t)1) << 40);
+            if (histogram[2].bucket[QUICDOQ_HISTOGRAM_NB_BUCKETS - 1] != 2 || histogram[2].min != ((uint64_t)1) << 40 ||
+                quicdoq_histogram_percentile(&histogram[2], 50.0) != UINT64_MAX) {
+                DBG_PRINTF("%s", "Unexpected handling of large values");
+                ret = -1;
+            }
+        }
+
+        free(histogram);
+    }
+
+    return ret;
+}
@@ -0,0 +1,152 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Metrics tests.
+ * Count events in two shards, check the aggregated snapshot and its
+ * Prometheus text, then export to a file and check that the file holds
+ * the text of the final snapshot.
+ */
+
+#define METRICS_TEST_FILE "quicdoq_metrics_test.prom"
+#define METRICS_TEST_TEXT_MAX 8192
+
+static int metrics_test_check_text(char const* text, char const* expected)
+{
+    int ret = 0;
+
+    if (strstr(text, expected) == NULL) {
+        DBG_PRINTF("Cannot find: %s", expected);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int quicdoq_metrics_test()
+{
+    int ret = 0;
+    quicdoq_metrics_t* metrics = quicdoq_metrics_create();
+    quicdoq_metrics_shard_t* shard[2] = { NULL, NULL };
+    quicdoq_metrics_snapshot_t snapshot;
+    char* text = (char*)malloc(METRICS_TEST_TEXT_MAX);
+    char* exported = (char*)malloc(METRICS_TEST_TEXT_MAX);
+    size_t text_length = 0;
+
+    if (metrics == NULL || text == NULL || exported == NULL) {
+        ret = -1;
+    }
+    else if ((shard[0] = quicdoq_metrics_add_shard(metrics)) == NULL ||
+        (shard[1] = quicdoq_metrics_add_shard(metrics)) == NULL) {
+        DBG_PRINTF("%s", "Cannot add the shards");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        quicdoq_metrics_increment(shard[0], quicdoq_metric_queries_received, 1);
+        quicdoq_metrics_increment(shard[1], quicdoq_metric_queries_received, 2);
+        quicdoq_metrics_increment(shard[1], quicdoq_metric_relay_retransmits, 7);
+        quicdoq_metrics_increment(shard[0], quicdoq_metric_max, 1);
+        quicdoq_metrics_snapshot(metrics, &snapshot);
+
+        for (int i = 0; ret == 0 && i < quicdoq_metric_max; i++) {
+            uint64_t expected = (i == quicdoq_metric_queries_received) ? 3 : ((i == quicdoq_metric_relay_retransmits) ? 7 : 0);
+            if (snapshot.counter[i] != expected) {
+                DBG_PRINTF("Counter %s is %" PRIu64 " instead of %" PRIu64, quicdoq_metric_name((quicdoq_metric_enum)i),
+                    snapshot.counter[i], expected);
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0 && (quicdoq_metric_name(quicdoq_metric_max) != NULL ||
+        strcmp(quicdoq_metric_name(quicdoq_metric_relay_timeouts), "relay_timeouts") != 0)) {
+        DBG_PRINTF("%s", "Unexpected metric names");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        if (quicdoq_metrics_format(&snapshot, text, 64, &text_length) == 0) {
+            DBG_PRINTF("%s", "Formatting in a short buffer should fail");
+            ret = -1;
+        }
+        else if (quicdoq_metrics_format(&snapshot, text, METRICS_TEST_TEXT_MAX, &text_length) != 0 ||
+            text_length != strlen(text)) {
+            DBG_PRINTF("%s", "Cannot format the metrics");
+            ret = -1;
+        }
+        else if ((ret = metrics_test_check_text(text, "# TYPE quicdoq_queries_received_total counter\nquicdoq_queries_received_total 3\n")) == 0 &&
+            (ret = metrics_test_check_text(text, "\nquicdoq_relay_retransmits_total 7\n")) == 0) {
+            ret = metrics_test_check_text(text, "\nquicdoq_protocol_errors_total 0\n");
+        }
+    }
+
+    /* Export with a long interval: the file is written at start and when deleting */
+    if (ret == 0 && quicdoq_metrics_start_export(metrics, METRICS_TEST_FILE, 60000000) != 0) {
+        DBG_PRINTF("Cannot export to %s", METRICS_TEST_FILE);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        quicdoq_metrics_increment(shard[0], quicdoq_metric_responses_sent, 5);
+        quicdoq_metrics_snapshot(metrics, &snapshot);
+        ret = quicdoq_metrics_format(&snapshot, text, METRICS_TEST_TEXT_MAX, &text_length);
+    }
+
+    if (metrics != NULL) {
+        quicdoq_metrics_delete(metrics);
+    }
+
+    if (ret == 0) {
+        FILE* F = picoquic_file_open(METRICS_TEST_FILE, "r");
+        size_t exported_length = 0;
+
+        if (F == NULL) {
+            DBG_PRINTF("Cannot open %s", METRICS_TEST_FILE);
+            ret = -1;
+        }
+        else {
+            exported_length = fread(exported, 1, METRICS_TEST_TEXT_MAX, F);
+            (void)picoquic_file_close(F);
+            if (exported_length != text_length || memcmp(exported, text, text_length) != 0) {
+                DBG_PRINTF("%s", "The exported text does not match the last snapshot");
+                ret = -1;
+            }
+        }
+    }
+
+    if (text != NULL) {
+        free(text);
+    }
+    if (exported != NULL) {
+        free(exported);
+    }
+
+    return ret;
+}
@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
 #include <picoquic.h>
 #include <picoquic_utils.h>
 #include "quicdoq.h"
@@ -40,6 +42,9 @@
 
 char const* quicdoq_test_picoquic_solution_dir = QUICDOQ_PICOQUIC_DEFAULT_SOLUTION_DIR;
 
+/* Enough connections for the scalability scenarios */
+#define QUICDOQ_TEST_MAX_CONNECTIONS 4096
+
 
 /* End to end test of Quicdoq
 * Set a network with two DoQ nodes : client and server.
@@ -84,6 +89,10 @@ typedef struct st_quicdoq_test_scenario_entry_t {
     uint64_t schedule_time;
     uint64_t response_delay;
     int is_success;
+    int new_cnx; /* Close the client connections before sending this query */
+    uint64_t cnx_affinity; /* Connection affinity of the query, 0 for the pool */
+    size_t response_padding; /* Bytes added to the response, to simulate large answers */
+    uint64_t deadline; /* Client deadline, relative to the schedule time, 0 if none */
 } quicdoq_test_scenario_entry_t;
 
 typedef struct st_quicdoq_test_scenario_record_t {
@@ -100,7 +109,10 @@ typedef struct st_quicdoq_test_scenario_record_t {
     int server_error;
     int response_received;
     int cancel_received;
+    int is_abandoned; /* Query cancelled by the client */
+    int is_failed;
     int is_success;
+    int nb_copies_received; /* Copies of the query sent to a second server, as hedges */
 } quicdoq_test_scenario_record_t;
 
 /* Text context, holding all the state of the ongoing simulation */
@@ -126,25 +138,44 @@ typedef struct st_quicdog_test_ctx_t {
     uint64_t next_response_time;
     uint16_t next_query_id;
     uint16_t next_response_id;
+    uint16_t first_queued_id; /* No response is queued for queries below that ID */
+    uint16_t nb_responses_received;
     int all_query_served;
     int some_query_inconsistent;
     int some_query_failed;
 } quicdog_test_ctx_t;
 
-/* Server call back for tests */
-uint16_t quicdog_test_get_query_id_by_stream_id(quicdoq_query_ctx_t* query_ctx, quicdog_test_ctx_t * test_ctx)
+/* Obtain the query ID from the first label of the query name.
+ * Queries may wait in the client's pending queue before they are
+ * assigned a connection and a stream, so the name is the only stable key.
+ */
+uint16_t quicdog_test_get_query_id_from_name(uint8_t const* query, size_t query_length, quicdog_test_ctx_t* test_ctx)
 {
     uint16_t qid = 0;
-    for (; qid < test_ctx->nb_scenarios; qid++) {
-        if (picoquic_compare_connection_id(&test_ctx->record[qid].cid, &query_ctx->cid) == 0 &&
-            test_ctx->record[qid].stream_id == query_ctx->stream_id) {
-            break;
+
+    if (query_length <= 13 || 13 + (size_t)query[12] > query_length) {
+        qid = test_ctx->nb_scenarios;
+    }
+    else {
+        uint8_t l = query[12];
+
+        for (uint8_t x = 0; x < l; x++) {
+            int c = query[13 + x];
+            if (c < '0' || c > '9') {
+                qid = test_ctx->nb_scenarios;
+                break;
+            }
+            else {
+                qid = (uint16_t)(10 * qid + c - '0');
+            }
         }
     }
 
     return qid;
 }
 
+/* Server call back for tests */
+
 int quicdog_test_get_format_response(
     uint8_t * query, size_t query_length, 
     uint8_t * response, size_t response_max_size, size_t * response_length)
@@ -202,14 +233,27 @@ void quicdoq_set_test_response_queue(quicdog_test_ctx_t* test_ctx, uint16_t qid)
         test_ctx->next_response_time = r_time;
         test_ctx->next_response_id = qid;
     }
+
+    if (qid < test_ctx->first_queued_id) {
+        test_ctx->first_queued_id = qid;
+    }
 }
 
+/* Only the queries already sent can have a queued response. Skip the
+ * first queries that have none, so that large scenarios do not pay
+ * a full scan of the records for each response. */
 void quicdoq_reset_test_response_queue(quicdog_test_ctx_t* test_ctx)
 {
     test_ctx->next_response_id = test_ctx->nb_scenarios;
     test_ctx->next_response_time = UINT64_MAX;
 
-    for (uint16_t qid = 0; qid < test_ctx->nb_scenarios; qid++) {
+    while (test_ctx->first_queued_id < test_ctx->next_query_id &&
+        test_ctx->record[test_ctx->first_queued_id].queued_response == NULL &&
+        test_ctx->record[test_ctx->first_queued_id].queued_packet == NULL) {
+        test_ctx->first_queued_id++;
+    }
+
+    for (uint16_t qid = test_ctx->first_queued_id; qid < test_ctx->next_query_id; qid++) {
         if (test_ctx->record[qid].query_received && 
             (test_ctx->record[qid].queued_response != NULL || test_ctx->record[qid].queued_packet != NULL)){
             quicdoq_set_test_response_queue(test_ctx, qid);
@@ -225,13 +269,22 @@ int quicdoq_test_server_cb(
 {
     int ret = 0;
     quicdog_test_ctx_t* test_ctx = (quicdog_test_ctx_t*)callback_ctx;
-    uint16_t qid = quicdog_test_get_query_id_by_stream_id(query_ctx, test_ctx);
+    uint16_t qid = quicdog_test_get_query_id_from_name(query_ctx->query, query_ctx->query_length, test_ctx);
 
     switch (callback_code) {
     case quicdoq_incoming_query: /* Incoming callback query */
-        if (qid > test_ctx->nb_scenarios || test_ctx->record[qid].query_received) {
+        if (qid >= test_ctx->nb_scenarios) {
             ret = -1;
         }
+        else if (test_ctx->record[qid].query_received) {
+            /* A copy of the query, sent as a hedge, is answered at once */
+            test_ctx->record[qid].nb_copies_received++;
+            if (quicdog_test_get_format_response(query_ctx->query, query_ctx->query_length,
+                query_ctx->response, query_ctx->response_max_size, &query_ctx->response_length) != 0 ||
+                quicdoq_post_response(query_ctx) != 0) {
+                ret = -1;
+            }
+        }
         else {
             test_ctx->record[qid].query_arrival_time = current_time;
             test_ctx->record[qid].query_received = 1;
@@ -241,6 +294,15 @@ int quicdoq_test_server_cb(
                     query_ctx->response, query_ctx->response_max_size, &query_ctx->response_length) != 0) {
                 query_ctx->response_length = 0; /* This will trigger a cancellation */
             }
+            else if (test_ctx->scenario[qid].response_padding > 0) {
+                size_t padding = test_ctx->scenario[qid].response_padding;
+
+                if (query_ctx->response_length + padding > query_ctx->response_max_size) {
+                    padding = query_ctx->response_max_size - query_ctx->response_length;
+                }
+                memset(query_ctx->response + query_ctx->response_length, 0, padding);
+                query_ctx->response_length += padding;
+            }
             test_ctx->record[qid].queued_response = query_ctx;
             quicdoq_set_test_response_queue(test_ctx, qid);
         }
@@ -248,10 +310,10 @@ int quicdoq_test_server_cb(
     case quicdoq_query_cancelled: /* Query cancelled before response provided */
     case quicdoq_query_failed: /* Query failed for reasons other than cancelled. */
         /* remove response from queue, mark it cancelled */
-        if (qid > test_ctx->nb_scenarios || !test_ctx->record[qid].query_received || test_ctx->record[qid].queued_response) {
+        if (qid >= test_ctx->nb_scenarios || !test_ctx->record[qid].query_received) {
             ret = -1;
         }
-        else {
+        else if (test_ctx->record[qid].queued_response != NULL) {
             test_ctx->record[qid].queued_response = NULL;
             test_ctx->record[qid].response_sent_time = test_ctx->simulated_time;
             test_ctx->record[qid].server_error = 1;
@@ -332,21 +394,20 @@ int quicdoq_test_client_cb(
             break;
         case quicdoq_query_failed:  /* Query failed for reasons other than cancelled. */
             /* tabulate failed */
+            test_ctx->record[qid].is_failed = 1;
             test_ctx->some_query_failed = 1;
             break;
+        case quicdoq_query_cancelled: /* Query cancelled by the client */
+            test_ctx->record[qid].is_abandoned = 1;
+            break;
         default: /* callback code not expected on client */
             ret = -1;
             break;
         }
 
         /* Check whether there are still responses pending. */
-        test_ctx->all_query_served = 1;
-        for (uint16_t i = 0; i < test_ctx->nb_scenarios; i++) {
-            if (!test_ctx->record[i].response_received) {
-                test_ctx->all_query_served = 0;
-                break;
-            }
-        }
+        test_ctx->nb_responses_received++;
+        test_ctx->all_query_served = (test_ctx->nb_responses_received >= test_ctx->nb_scenarios);
     }
 
     if (ret == 0 && query_ctx != NULL) {
@@ -398,6 +459,19 @@ int quicdoq_test_client_submit_query(quicdog_test_ctx_t* test_ctx)
             query_ctx->server_addr = (struct sockaddr*) & test_ctx->server_addr;
             query_ctx->client_cb = quicdoq_test_client_cb;
             query_ctx->client_cb_ctx = test_ctx;
+            query_ctx->cnx_affinity = test_ctx->scenario[test_ctx->next_query_id].cnx_affinity;
+            if (test_ctx->scenario[test_ctx->next_query_id].deadline != 0) {
+                query_ctx->deadline = test_ctx->simulated_time + test_ctx->scenario[test_ctx->next_query_id].deadline;
+            }
+
+            if (test_ctx->scenario[test_ctx->next_query_id].new_cnx) {
+                quicdoq_cnx_ctx_t* cnx_ctx = test_ctx->qd_client->first_cnx;
+
+                while (cnx_ctx != NULL) {
+                    (void)picoquic_close(cnx_ctx->cnx, 0);
+                    cnx_ctx = cnx_ctx->next_cnx;
+                }
+            }
 
             ret = quicdoq_post_query(test_ctx->qd_client, query_ctx);
             test_ctx->record[test_ctx->next_query_id].cid = query_ctx->cid;
@@ -509,14 +583,14 @@ quicdog_test_ctx_t* quicdoq_test_ctx_create(quicdoq_test_scenario_entry_t const
         }
 
         /* create the client and server contexts */
-        test_ctx->qd_server = quicdoq_create(NULL,
+        test_ctx->qd_server = quicdoq_create_ex(NULL,
             test_ctx->test_server_cert_file, test_ctx->test_server_key_file, NULL, NULL, NULL,
             quicdoq_test_server_cb, (void*)test_ctx,
-            &test_ctx->simulated_time);
-        test_ctx->qd_client = quicdoq_create(NULL,
+            &test_ctx->simulated_time, QUICDOQ_TEST_MAX_CONNECTIONS);
+        test_ctx->qd_client = quicdoq_create_ex(NULL,
             NULL, NULL, test_ctx->test_server_cert_store_file, NULL, NULL,
             quicdoq_test_client_cb, (void*)test_ctx,
-            &test_ctx->simulated_time);
+            &test_ctx->simulated_time, QUICDOQ_TEST_MAX_CONNECTIONS);
 
         if (test_udp && test_ctx->qd_server != NULL) {
             test_ctx->udp_ctx = quicdoq_create_udp_ctx(test_ctx->qd_server, (struct sockaddr*) & test_ctx->udp_addr);
@@ -633,6 +707,12 @@ int quicdoq_test_udp_packet_prepare(quicdog_test_ctx_t* test_ctx, picoquictest_s
         quicdoq_udp_prepare_next_packet(test_ctx->udp_ctx, test_ctx->simulated_time,
             packet->bytes, PICOQUIC_MAX_PACKET_SIZE, &packet->length,
             &packet->addr_to, &packet->addr_from,&if_index);
+
+        if (packet->length > 0 && test_ctx->udp_ctx->is_connected && packet->addr_from.ss_family != 0) {
+            /* A connected relay should leave the choice of source address to the socket */
+            DBG_PRINTF("%s", "Connected relay set a source address");
+            ret = -1;
+        }
     }
 
     if (ret == 0 && packet->length > 0) {
@@ -685,24 +765,15 @@ int quicdoq_test_sim_udp_output(quicdog_test_ctx_t* test_ctx, picoquictest_sim_l
     }
     else {
         /* Obtain the query ID from the name. */
-        uint16_t qid = 0;
-        uint8_t l = packet->bytes[12];
+        uint16_t qid = quicdog_test_get_query_id_from_name(packet->bytes, packet->length, test_ctx);
 
-        for (uint8_t x = 0; x < l; x++) {
-            int c = packet->bytes[13 + x];
-            if (c < '0' || c > '9') {
-                ret = -1;
-                break;
-            }
-            else {
-                qid = (uint16_t)(10 * qid + c - '0');
-            }
+        if (qid >= test_ctx->nb_scenarios) {
+            ret = -1;
         }
-
-        if (ret == 0) {
+        else {
             picoquictest_sim_packet_t* queued = picoquictest_sim_link_create_packet();
 
-            if (qid > test_ctx->nb_scenarios || queued == NULL) {
+            if (queued == NULL) {
                 ret = -1;
             }
             else {
@@ -843,6 +914,16 @@ int quicdoq_test_sim_step(quicdog_test_ctx_t* test_ctx, int * is_active)
         }
     }
 
+    if ((try_time = quicdoq_next_deadline(test_ctx->qd_client)) < next_time) {
+        next_time = try_time;
+        next_step = 9;
+    }
+
+    if ((try_time = quicdoq_next_deadline(test_ctx->qd_server)) < next_time) {
+        next_time = try_time;
+        next_step = 9;
+    }
+
     /* Update the virtual time */
     if (next_time > test_ctx->simulated_time) {
         test_ctx->simulated_time = next_time;
@@ -886,6 +967,12 @@ int quicdoq_test_sim_step(quicdog_test_ctx_t* test_ctx, int * is_active)
         /* Prepare arrival on udp_link_out */
         ret = quicdoq_test_sim_udp_output(test_ctx, test_ctx->udp_link_out, is_active);
         break;
+    case 9:
+        /* Abandon the queries past their deadline */
+        quicdoq_check_deadlines(test_ctx->qd_client, test_ctx->simulated_time);
+        quicdoq_check_deadlines(test_ctx->qd_server, test_ctx->simulated_time);
+        *is_active = 1;
+        break;
     default:
         /* Nothing to do, which is unlikely since the server is always up. */
         ret = -1;
@@ -983,3 +1070,1324 @@ int quicdoq_one_loss_udp_test()
 {
     return quicdoq_test_scenario(one_loss_scenario, sizeof(one_loss_scenario), 1, 10000000);
 }
+
+/* Connected relay scenario: same as the multi queries scenario, but the relay
+ * is configured as if the backend was reached through a connected socket. */
+int quicdoq_connected_udp_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(multi_queries_scenario, sizeof(multi_queries_scenario), 1);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_udp_set_connected(test_ctx->udp_ctx, 1);
+
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else if (test_ctx->udp_ctx->local_addr.ss_family != 0) {
+            DBG_PRINTF("%s", "Connected relay learned a local address");
+            ret = -1;
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Latency scenario: two queries relayed over UDP. Each query goes through
+ * all the stages, and the stage delays add up to the end to end delay. */
+int quicdoq_latency_udp_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(multi_queries_scenario, sizeof(multi_queries_scenario), 1);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else {
+            quicdoq_latency_stats_t* stats = (quicdoq_latency_stats_t*)malloc(sizeof(quicdoq_latency_stats_t));
+            uint64_t stage_sum = 0;
+
+            if (stats == NULL) {
+                ret = -1;
+            }
+            else {
+                quicdoq_get_latency_stats(test_ctx->qd_server, stats);
+                for (int stage = 0; ret == 0 && stage < quicdoq_stage_max; stage++) {
+                    uint64_t expected = (stage == quicdoq_stage_first_byte) ? 0 : 2;
+
+                    if (stats->stage[stage].count != expected) {
+                        DBG_PRINTF("Stage %s counted %" PRIu64 " times instead of %" PRIu64,
+                            quicdoq_stage_name((quicdoq_stage_enum)stage), stats->stage[stage].count, expected);
+                        ret = -1;
+                    }
+                    stage_sum += stats->stage[stage].sum;
+                }
+                if (ret == 0 && (stats->end_to_end.count != 2 || stats->end_to_end.sum != stage_sum ||
+                    stats->end_to_end.min == 0 || stats->stage[quicdoq_stage_relay_reply].min == 0)) {
+                    DBG_PRINTF("End to end delay %" PRIu64 " does not match stage delays %" PRIu64,
+                        stats->end_to_end.sum, stage_sum);
+                    ret = -1;
+                }
+                free(stats);
+            }
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Connection statistics scenario: two queries on one connection. The
+ * client and server counters must mirror each other, and the dump must
+ * list the connection. */
+#define CNX_STATS_TEST_DUMP "quicdoq_cnx_stats_test.txt"
+
+int quicdoq_cnx_stats_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(multi_queries_scenario, sizeof(multi_queries_scenario), 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else {
+            quicdoq_cnx_ctx_t* client_cnx = quicdoq_first_cnx(test_ctx->qd_client);
+            quicdoq_cnx_ctx_t* server_cnx = quicdoq_first_cnx(test_ctx->qd_server);
+            quicdoq_cnx_stats_t client_stats;
+            quicdoq_cnx_stats_t server_stats;
+
+            if (client_cnx == NULL || server_cnx == NULL || quicdoq_next_cnx(client_cnx) != NULL || quicdoq_next_cnx(server_cnx) != NULL) {
+                DBG_PRINTF("%s", "Expected one connection on each side");
+                ret = -1;
+            }
+            else {
+                quicdoq_get_cnx_stats(client_cnx, &client_stats);
+                quicdoq_get_cnx_stats(server_cnx, &server_stats);
+
+                if (client_stats.is_server || !server_stats.is_server ||
+                    client_stats.nb_queries != 2 || client_stats.nb_responses != 2 ||
+                    server_stats.nb_queries != 2 || server_stats.nb_responses != 2 ||
+                    client_stats.open_streams != 0 || server_stats.open_streams != 0 ||
+                    client_stats.peak_streams == 0 || server_stats.peak_streams == 0 ||
+                    client_stats.bytes_sent == 0 || client_stats.bytes_sent != server_stats.bytes_received ||
+                    client_stats.bytes_received == 0 || client_stats.bytes_received != server_stats.bytes_sent ||
+                    client_stats.rtt == 0 || client_stats.cwin == 0 || server_stats.peer_addr.ss_family == 0) {
+                    DBG_PRINTF("Unexpected stats, client %" PRIu64 "/%" PRIu64 " queries/responses, server %" PRIu64 "/%" PRIu64,
+                        client_stats.nb_queries, client_stats.nb_responses, server_stats.nb_queries, server_stats.nb_responses);
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0) {
+            FILE* F = picoquic_file_open(CNX_STATS_TEST_DUMP, "w");
+
+            if (F == NULL) {
+                ret = -1;
+            }
+            else {
+                ret = quicdoq_dump_top_cnx(test_ctx->qd_server, F, quicdoq_cnx_column_from_name("bytes_in"), 10);
+                (void)picoquic_file_close(F);
+            }
+            if (ret == 0 && (quicdoq_cnx_column_from_name("nonsense") != quicdoq_cnx_column_max ||
+                quicdoq_dump_top_cnx(test_ctx->qd_server, stdout, quicdoq_cnx_column_max, 10) == 0)) {
+                DBG_PRINTF("%s", "Unknown columns should be rejected");
+                ret = -1;
+            }
+        }
+
+        if (ret == 0) {
+            FILE* F = picoquic_file_open(CNX_STATS_TEST_DUMP, "r");
+            char line[512];
+            int nb_lines = 0;
+
+            if (F == NULL) {
+                ret = -1;
+            }
+            else {
+                while (fgets(line, sizeof(line), F) != NULL) {
+                    nb_lines++;
+                }
+                (void)picoquic_file_close(F);
+                if (nb_lines != 3) {
+                    DBG_PRINTF("Expected 3 lines in the dump, got %d", nb_lines);
+                    ret = -1;
+                }
+            }
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Connection pool scenario: eight queries at once, with at most two queries
+ * in flight per connection and at most two connections. Queries wait in the
+ * client's pending queue, and a second connection is opened once two queries
+ * are waiting. */
+static quicdoq_test_scenario_entry_t const pool_scenario[] = {
+    { 0, 0, 1 },
+    { 0, 0, 1 },
+    { 0, 0, 1 },
+    { 0, 0, 1 },
+    { 0, 0, 1 },
+    { 0, 0, 1 },
+    { 0, 0, 1 },
+    { 0, 0, 1 }
+};
+
+int quicdoq_pool_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(pool_scenario, sizeof(pool_scenario), 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        int nb_cnx = 0;
+        quicdoq_cnx_ctx_t* cnx_ctx;
+
+        quicdoq_set_pool_params(test_ctx->qd_client, 2, 2, 2, 1000000);
+
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else if (test_ctx->qd_client->first_pending != NULL) {
+            DBG_PRINTF("%s", "Queries still waiting in the client pool");
+            ret = -1;
+        }
+
+        for (cnx_ctx = test_ctx->qd_client->first_cnx; cnx_ctx != NULL; cnx_ctx = cnx_ctx->next_cnx) {
+            nb_cnx++;
+            if (cnx_ctx->nb_open_streams != 0) {
+                DBG_PRINTF("Connection still has %d open streams", cnx_ctx->nb_open_streams);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && nb_cnx != 2) {
+            DBG_PRINTF("Expected 2 client connections, got %d", nb_cnx);
+            ret = -1;
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Connection affinity scenario: six queries from three simulated clients.
+ * The pool allows a single connection, but each affinity value gets its own
+ * connection, and all queries of a client go over that connection. */
+static quicdoq_test_scenario_entry_t const affinity_scenario[] = {
+    { 0, 0, 1, 0, 1 },
+    { 0, 0, 1, 0, 2 },
+    { 0, 0, 1, 0, 3 },
+    { 10000, 0, 1, 0, 1 },
+    { 10000, 0, 1, 0, 2 },
+    { 10000, 0, 1, 0, 3 }
+};
+
+int quicdoq_affinity_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(affinity_scenario, sizeof(affinity_scenario), 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        int nb_cnx = 0;
+        quicdoq_cnx_ctx_t* cnx_ctx;
+
+        quicdoq_set_pool_params(test_ctx->qd_client, 64, 1, 16, 0);
+
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+
+        for (cnx_ctx = test_ctx->qd_client->first_cnx; ret == 0 && cnx_ctx != NULL; cnx_ctx = cnx_ctx->next_cnx) {
+            nb_cnx++;
+            if (cnx_ctx->affinity < 1 || cnx_ctx->affinity > 3) {
+                DBG_PRINTF("Unexpected connection affinity %llu", (unsigned long long)cnx_ctx->affinity);
+                ret = -1;
+            }
+        }
+
+        for (uint16_t i = 0; ret == 0 && i < 3; i++) {
+            /* Queries i and i + 3 come from the same client */
+            if (picoquic_compare_connection_id(&test_ctx->record[i].cid, &test_ctx->record[i + 3].cid) != 0) {
+                DBG_PRINTF("Queries %d and %d used different connections", i, i + 3);
+                ret = -1;
+            }
+        }
+
+        if (ret == 0 && nb_cnx != 3) {
+            DBG_PRINTF("Expected 3 client connections, got %d", nb_cnx);
+            ret = -1;
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Zero RTT scenario: the second query is sent on a new connection, after the
+ * client received a session ticket on the first one. The query goes out in
+ * 0-RTT, and its response arrives faster than the first one. */
+static quicdoq_test_scenario_entry_t const zero_rtt_scenario[] = {
+    { 0, 0, 1, 0 },
+    { 1000000, 0, 1, 1 }
+};
+
+static int quicdoq_zero_rtt_test_one(quicdoq_0rtt_policy_enum policy)
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(zero_rtt_scenario, sizeof(zero_rtt_scenario), 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_0rtt_stats_t stats;
+
+        quicdoq_set_0rtt_policy(test_ctx->qd_server, policy, QUICDOQ_REPLAY_WINDOW_DEFAULT);
+
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+
+        quicdoq_get_0rtt_stats(test_ctx->qd_server, &stats);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else if (test_ctx->qd_client->last_cnx == NULL || !test_ctx->qd_client->last_cnx->is_0rtt_attempted) {
+            DBG_PRINTF("%s", "Second connection did not attempt 0-RTT");
+            ret = -1;
+        }
+        else if (policy == quicdoq_0rtt_accept_none) {
+            if (stats.nb_accepted != 0 || stats.nb_deferred != 1) {
+                DBG_PRINTF("Expected 0 accepted, 1 deferred, got %llu, %llu",
+                    (unsigned long long)stats.nb_accepted, (unsigned long long)stats.nb_deferred);
+                ret = -1;
+            }
+        }
+        else {
+            uint64_t first_delay = test_ctx->record[0].response_arrival_time - test_ctx->record[0].query_sent_time;
+            uint64_t second_delay = test_ctx->record[1].response_arrival_time - test_ctx->record[1].query_sent_time;
+
+            if (stats.nb_accepted != 1 || stats.nb_deferred != 0 || stats.nb_replays != 0) {
+                DBG_PRINTF("Expected 1 accepted, 0 deferred, got %llu, %llu",
+                    (unsigned long long)stats.nb_accepted, (unsigned long long)stats.nb_deferred);
+                ret = -1;
+            }
+            else if (second_delay >= first_delay) {
+                DBG_PRINTF("0-RTT query delay %llu, first query delay %llu",
+                    (unsigned long long)second_delay, (unsigned long long)first_delay);
+                ret = -1;
+            }
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+int quicdoq_zero_rtt_test()
+{
+    return quicdoq_zero_rtt_test_one(quicdoq_0rtt_accept_idempotent);
+}
+
+/* Same scenario, but the server defers all early queries until the handshake completes. */
+int quicdoq_zero_rtt_defer_test()
+{
+    return quicdoq_zero_rtt_test_one(quicdoq_0rtt_accept_none);
+}
+
+/* Replay cache: an early query is accepted once per initial CID and stream
+ * within the replay window, and accepted again once its generation of the
+ * filter is cleared. Filling a generation past its capacity is counted as
+ * saturation, without losing entries or raising false positives much. */
+static void quicdoq_replay_test_cid(picoquic_connection_id_t* cid, uint32_t n)
+{
+    memset(cid, 0, sizeof(picoquic_connection_id_t));
+    cid->id_len = 8;
+    cid->id[0] = 0xdd;
+    for (int i = 0; i < 4; i++) {
+        cid->id[4 + i] = (uint8_t)(n >> (8 * i));
+    }
+}
+
+int quicdoq_replay_cache_test()
+{
+    int ret = 0;
+    quicdoq_replay_cache_t* cache = (quicdoq_replay_cache_t*)malloc(sizeof(quicdoq_replay_cache_t));
+    picoquic_connection_id_t cid_a = { { 1, 2, 3, 4, 5, 6, 7, 8 }, 8 };
+    picoquic_connection_id_t cid_b = { { 1, 2, 3, 4, 5, 6, 7, 9 }, 8 };
+    uint64_t window = 1200000;
+
+    if (cache == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(cache, 0, sizeof(quicdoq_replay_cache_t));
+
+        if (quicdoq_replay_check(cache, &cid_a, 0, 0, window) != 0 ||
+            quicdoq_replay_check(cache, &cid_a, 4, 10, window) != 0 ||
+            quicdoq_replay_check(cache, &cid_b, 0, 20, window) != 0) {
+            DBG_PRINTF("%s", "New early query rejected");
+            ret = -1;
+        }
+        else if (quicdoq_replay_check(cache, &cid_a, 0, 500000, window) != 1 ||
+            quicdoq_replay_check(cache, &cid_b, 0, 1199999, window) != 1) {
+            DBG_PRINTF("%s", "Replay not detected");
+            ret = -1;
+        }
+        else if (quicdoq_replay_check(cache, &cid_a, 0, 1600000, window) != 0) {
+            /* Four slices of window/3 after the first entry, its generation is cleared */
+            DBG_PRINTF("%s", "Entry not expired after the replay window");
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            uint32_t nb_entries = QUICDOQ_REPLAY_GENERATION_MAX + 1000;
+            uint32_t nb_false = 0;
+            picoquic_connection_id_t cid;
+
+            quicdoq_replay_cache_clear(cache);
+            for (uint32_t i = 0; i < nb_entries; i++) {
+                quicdoq_replay_test_cid(&cid, i);
+                (void)quicdoq_replay_check(cache, &cid, 0, 0, window);
+            }
+            for (uint32_t i = 0; ret == 0 && i < nb_entries; i++) {
+                quicdoq_replay_test_cid(&cid, i);
+                if (quicdoq_replay_check(cache, &cid, 0, 1, window) != 1) {
+                    DBG_PRINTF("Entry %u lost", i);
+                    ret = -1;
+                }
+            }
+            if (ret == 0 && (cache->nb_saturated == 0 || cache->nb_saturated > 1000)) {
+                DBG_PRINTF("Saturated %" PRIu64 " instead of at most 1000", cache->nb_saturated);
+                ret = -1;
+            }
+            /* New queries are rarely taken for replays, about 2% at this load */
+            nb_false = 0;
+            for (uint32_t i = 0; ret == 0 && i < 1000; i++) {
+                quicdoq_replay_test_cid(&cid, nb_entries + i);
+                nb_false += quicdoq_replay_check(cache, &cid, 0, 2, window);
+            }
+            if (ret == 0 && nb_false > 60) {
+                DBG_PRINTF("%u false positives in 1000 new queries", nb_false);
+                ret = -1;
+            }
+        }
+        free(cache);
+    }
+
+    return ret;
+}
+
+/* Load shedding scenario: six queries sent at once, with responses delayed
+ * so that the first ones are still in flight when the others arrive. The
+ * server budget admits only some of them; the others are either reset with
+ * QUICDOQ_ERROR_EXCESSIVE_LOAD, and the client sees them cancelled, or
+ * refused, and the client receives a response. */
+static quicdoq_test_scenario_entry_t const load_shed_scenario[] = {
+    { 0, 20000, 1 },
+    { 0, 20000, 1 },
+    { 0, 20000, 1 },
+    { 0, 20000, 1 },
+    { 0, 20000, 1 },
+    { 0, 20000, 1 }
+};
+
+static int quicdoq_load_shed_test_one(quicdoq_load_budget_t const* budget, quicdoq_rate_limit_t const* rate_limit,
+    int test_udp, uint16_t nb_admitted)
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(load_shed_scenario, sizeof(load_shed_scenario), test_udp);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_load_stats_t load;
+        quicdoq_rate_limit_stats_t rate_stats;
+        uint64_t nb_shed_reset;
+        uint64_t nb_shed_refused;
+        int is_refused = (rate_limit == NULL) ? budget->refuse_on_overload : rate_limit->refuse_over_limit;
+        uint16_t nb_received = 0;
+        uint16_t nb_success = 0;
+        uint16_t nb_cancelled = 0;
+        uint16_t nb_shed = (uint16_t)(test_ctx->nb_scenarios - nb_admitted);
+
+        quicdoq_set_load_budget(test_ctx->qd_server, budget);
+        if (rate_limit != NULL && quicdoq_set_rate_limit(test_ctx->qd_server, rate_limit) != 0) {
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            ret = quicdoq_test_sim_run(test_ctx, 3000000);
+        }
+
+        for (uint16_t qid = 0; qid < test_ctx->nb_scenarios; qid++) {
+            nb_received += (test_ctx->record[qid].query_received) ? 1 : 0;
+            nb_success += (test_ctx->record[qid].is_success) ? 1 : 0;
+            nb_cancelled += (test_ctx->record[qid].cancel_received) ? 1 : 0;
+        }
+        quicdoq_get_load_stats(test_ctx->qd_server, &load);
+        quicdoq_get_rate_limit_stats(test_ctx->qd_server, &rate_stats);
+        if (rate_limit == NULL) {
+            nb_shed_reset = load.nb_shed_reset;
+            nb_shed_refused = load.nb_shed_refused;
+        }
+        else {
+            /* Queries over the rate are not counted as shed for load */
+            nb_shed_reset = (is_refused) ? 0 : rate_stats.nb_limited;
+            nb_shed_refused = (is_refused) ? rate_stats.nb_limited : 0;
+        }
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed) {
+            DBG_PRINTF("Fail after %llu, all_served=%d, failed=%d, ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else if (!test_udp && nb_received != nb_admitted) {
+            DBG_PRINTF("Expected %d queries passed to the server, got %d", nb_admitted, nb_received);
+            ret = -1;
+        }
+        else if (rate_limit != NULL && (load.nb_shed_reset != 0 || load.nb_shed_refused != 0)) {
+            DBG_PRINTF("%s", "Queries over the rate counted as shed for load");
+            ret = -1;
+        }
+        else if (is_refused) {
+            if (nb_success != test_ctx->nb_scenarios || nb_shed_refused != nb_shed || nb_shed_reset != 0) {
+                DBG_PRINTF("Expected %d refused, got %d responses, %llu refused, %llu reset", nb_shed, nb_success,
+                    (unsigned long long)nb_shed_refused, (unsigned long long)nb_shed_reset);
+                ret = -1;
+            }
+        }
+        else if (nb_success != nb_admitted || nb_cancelled != nb_shed || nb_shed_reset != nb_shed || nb_shed_refused != 0) {
+            DBG_PRINTF("Expected %d reset, got %d responses, %d cancelled, %llu reset", nb_shed, nb_success, nb_cancelled,
+                (unsigned long long)nb_shed_reset);
+            ret = -1;
+        }
+
+        if (ret == 0 && (load.nb_inflight_queries != 0 || load.buffer_bytes != 0 || load.relay_queue_depth != 0)) {
+            DBG_PRINTF("Load not released: %d queries, %llu bytes, %d relayed", load.nb_inflight_queries,
+                (unsigned long long)load.buffer_bytes, load.relay_queue_depth);
+            ret = -1;
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+int quicdoq_load_shed_test()
+{
+    quicdoq_load_budget_t budget;
+    int ret;
+
+    /* Limit the number of queries in flight */
+    memset(&budget, 0, sizeof(budget));
+    budget.max_inflight_queries = 2;
+    ret = quicdoq_load_shed_test_one(&budget, NULL, 0, 2);
+
+    if (ret == 0) {
+        /* Limit the buffers to what three queries need */
+        memset(&budget, 0, sizeof(budget));
+        budget.max_buffer_bytes = 6 * (uint64_t)QUICDOQ_MAX_STREAM_DATA;
+        ret = quicdoq_load_shed_test_one(&budget, NULL, 0, 3);
+    }
+
+    if (ret == 0) {
+        /* Limit the queries waiting for the UDP backend */
+        memset(&budget, 0, sizeof(budget));
+        budget.max_relay_queue = 2;
+        ret = quicdoq_load_shed_test_one(&budget, NULL, 1, 2);
+    }
+
+    return ret;
+}
+
+int quicdoq_load_shed_refuse_test()
+{
+    quicdoq_load_budget_t budget;
+
+    memset(&budget, 0, sizeof(budget));
+    budget.max_inflight_queries = 2;
+    budget.refuse_on_overload = 1;
+    budget.overload_ede = QUICDOQ_EDE_NOT_READY;
+
+    return quicdoq_load_shed_test_one(&budget, NULL, 0, 2);
+}
+
+/* Same scenario, with the server under its load budget but the client over
+ * its rate: a burst of 3 queries, then 1 query per second. */
+int quicdoq_rate_limit_cnx_test()
+{
+    quicdoq_load_budget_t budget;
+    quicdoq_rate_limit_t rate_limit;
+    int ret;
+
+    memset(&budget, 0, sizeof(budget));
+    memset(&rate_limit, 0, sizeof(rate_limit));
+    rate_limit.queries_per_second = 1;
+    rate_limit.burst = 3;
+    ret = quicdoq_load_shed_test_one(&budget, &rate_limit, 0, 3);
+
+    if (ret == 0) {
+        rate_limit.refuse_over_limit = 1;
+        rate_limit.over_limit_ede = QUICDOQ_EDE_NOT_READY;
+        ret = quicdoq_load_shed_test_one(&budget, &rate_limit, 0, 3);
+    }
+
+    return ret;
+}
+
+/* Transport parameter profiles.
+ * The client and the server use profiles other than the default, and each
+ * side checks the transport parameters received from the peer. The server
+ * allows fewer streams than the client pool, so the client must limit the
+ * queries in flight on its connection to that number. */
+int quicdoq_tp_profile_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(multi_queries_scenario, sizeof(multi_queries_scenario), 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_tp_profile_t client_profile;
+        quicdoq_tp_profile_t server_profile;
+        quicdoq_tp_profile_t bad_profile;
+
+        quicdoq_get_default_tp_profile(&client_profile);
+        client_profile.initial_max_data = 0x30000;
+        client_profile.max_idle_timeout = 15000;
+        memset(&server_profile, 0, sizeof(server_profile));
+        server_profile.initial_max_data = 0x40000;
+        server_profile.max_bidir_streams = 16;
+        memset(&bad_profile, 0, sizeof(bad_profile));
+        bad_profile.initial_max_data = 0x20000;
+        bad_profile.adaptive_max_data = 0x10000;
+
+        if (quicdoq_set_tp_profile(test_ctx->qd_client, &bad_profile) == 0) {
+            DBG_PRINTF("%s", "Adaptive maximum below the initial credit should be rejected");
+            ret = -1;
+        }
+        else if (quicdoq_set_tp_profile(test_ctx->qd_client, &client_profile) != 0 ||
+            quicdoq_set_tp_profile(test_ctx->qd_server, &server_profile) != 0) {
+            ret = -1;
+        }
+        else {
+            ret = quicdoq_test_sim_run(test_ctx, 3000000);
+        }
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d, failed=%d, ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else {
+            quicdoq_cnx_ctx_t* client_cnx = quicdoq_first_cnx(test_ctx->qd_client);
+            quicdoq_cnx_ctx_t* server_cnx = quicdoq_first_cnx(test_ctx->qd_server);
+
+            if (client_cnx == NULL || server_cnx == NULL) {
+                DBG_PRINTF("%s", "Expected one connection on each side");
+                ret = -1;
+            }
+            else {
+                picoquic_tp_t const* server_tp = picoquic_get_transport_parameters(client_cnx->cnx, 0);
+                picoquic_tp_t const* client_tp = picoquic_get_transport_parameters(server_cnx->cnx, 0);
+
+                if (server_tp->initial_max_data != 0x40000 ||
+                    quicdoq_tp_stream_count_from_limit(server_tp->initial_max_stream_id_bidir) != 16 ||
+                    server_tp->max_idle_timeout != QUICDOQ_TP_DEFAULT_IDLE_TIMEOUT ||
+                    client_tp->initial_max_data != 0x30000 || client_tp->max_idle_timeout != 15000 ||
+                    client_tp->initial_max_stream_data_bidi_local != QUICDOQ_MAX_STREAM_DATA) {
+                    DBG_PRINTF("Unexpected transport parameters, max data %" PRIu64 " from server, %" PRIu64 " from client",
+                        server_tp->initial_max_data, client_tp->initial_max_data);
+                    ret = -1;
+                }
+                else if (client_cnx->max_open_streams != 16) {
+                    DBG_PRINTF("Client allows %d streams, expected 16", (int)client_cnx->max_open_streams);
+                    ret = -1;
+                }
+            }
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Adaptive credit.
+ * A stream credit smaller than a DNS message is rejected. Large responses
+ * grow the connection credit up to the adaptive maximum, and memory
+ * pressure shrinks it back. */
+int quicdoq_tp_adaptive_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(multi_queries_scenario, sizeof(multi_queries_scenario), 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_tp_profile_t profile;
+        quicdoq_tp_credit_t credit;
+
+        memset(&profile, 0, sizeof(profile));
+        profile.initial_max_stream_data = 1024;
+        profile.is_adaptive = 1;
+        profile.adaptive_max_data = 0x18000;
+
+        if (quicdoq_set_tp_profile(test_ctx->qd_client, &profile) == 0) {
+            DBG_PRINTF("%s", "Stream credit below the message size was accepted");
+            ret = -1;
+        }
+        else {
+            profile.initial_max_stream_data = 0;
+            ret = quicdoq_set_tp_profile(test_ctx->qd_client, &profile);
+        }
+
+        if (ret == 0) {
+            ret = quicdoq_test_sim_run(test_ctx, 3000000);
+        }
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d, failed=%d, ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else {
+            quicdoq_cnx_ctx_t* client_cnx = quicdoq_first_cnx(test_ctx->qd_client);
+
+            quicdoq_get_tp_credit(test_ctx->qd_client, &credit);
+            if (client_cnx == NULL || credit.avg_message_size == 0 || credit.max_data != QUICDOQ_TP_DEFAULT_MAX_DATA) {
+                DBG_PRINTF("Unexpected credit after small responses, max data %" PRIu64, credit.max_data);
+                ret = -1;
+            }
+
+            for (int i = 0; ret == 0 && i < 32; i++) {
+                quicdoq_tp_message_received(client_cnx, QUICDOQ_MAX_STREAM_DATA);
+            }
+            quicdoq_get_tp_credit(test_ctx->qd_client, &credit);
+            if (ret == 0 && (credit.max_data != 0x18000 || credit.nb_increases == 0 ||
+                credit.stream_data != QUICDOQ_MAX_STREAM_DATA + 2)) {
+                DBG_PRINTF("Credit did not grow, max data %" PRIu64 ", stream data %" PRIu64, credit.max_data, credit.stream_data);
+                ret = -1;
+            }
+
+            if (ret == 0) {
+                test_ctx->qd_client->tp_profile.adaptive_memory_limit = QUICDOQ_TP_DEFAULT_MAX_DATA;
+                quicdoq_tp_message_received(client_cnx, QUICDOQ_MAX_STREAM_DATA);
+                quicdoq_get_tp_credit(test_ctx->qd_client, &credit);
+                if (!credit.is_memory_pressure || credit.max_data != QUICDOQ_TP_DEFAULT_MAX_DATA || credit.nb_decreases == 0) {
+                    DBG_PRINTF("Credit did not shrink, max data %" PRIu64, credit.max_data);
+                    ret = -1;
+                }
+            }
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Response scheduling scenario: a query with a large response, then eight
+ * queries with small responses, posted while the large one is being sent.
+ * With response priorities, the small responses overtake the large one. */
+static quicdoq_test_scenario_entry_t const priority_scenario[] = {
+    { 0, 10000, 1, 0, 0, 60000 },
+    { 5000, 10000, 1 },
+    { 5000, 10000, 1 },
+    { 5000, 10000, 1 },
+    { 5000, 10000, 1 },
+    { 5000, 10000, 1 },
+    { 5000, 10000, 1 },
+    { 5000, 10000, 1 },
+    { 5000, 10000, 1 }
+};
+
+int quicdoq_response_priority_test()
+{
+    quicdog_test_ctx_t* test_ctx = NULL;
+    int ret = 0;
+
+    /* Shorter remaining size goes first, and age promotes large answers */
+    if (quicdoq_response_priority(100, 0) >= quicdoq_response_priority(4000, 0) ||
+        quicdoq_response_priority(4000, 0) >= quicdoq_response_priority(60000, 0) ||
+        quicdoq_response_priority(60000, 0) != quicdoq_response_priority(1000000, 0) ||
+        quicdoq_response_priority(60000, QUICDOQ_PRIORITY_AGE_STEP) >= quicdoq_response_priority(60000, 0) ||
+        quicdoq_response_priority(60000, 100 * (uint64_t)QUICDOQ_PRIORITY_AGE_STEP) != quicdoq_response_priority(100, 0) ||
+        (quicdoq_response_priority(100, 0) & 1) == 0) {
+        DBG_PRINTF("%s", "Unexpected response priorities");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        test_ctx = quicdoq_test_ctx_create(priority_scenario, sizeof(priority_scenario), 0);
+        if (test_ctx == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d, failed=%d, ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else {
+            for (uint16_t qid = 1; ret == 0 && qid < test_ctx->nb_scenarios; qid++) {
+                if (test_ctx->record[qid].response_arrival_time >= test_ctx->record[0].response_arrival_time) {
+                    DBG_PRINTF("Small response %d arrived at %" PRIu64 ", after the large one at %" PRIu64,
+                        qid, test_ctx->record[qid].response_arrival_time, test_ctx->record[0].response_arrival_time);
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+    if (test_ctx != NULL) {
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Client cancellation scenario: the first query gets a slow response, and
+ * the client allows a single stream, so the second query waits in the pool.
+ * Cancelling the first query releases the stream for the second one. */
+static quicdoq_test_scenario_entry_t const cancel_scenario[] = {
+    { 0, 1000000, 1 },
+    { 0, 0, 1 }
+};
+
+int quicdoq_cancel_query_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(cancel_scenario, sizeof(cancel_scenario), 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_cnx_ctx_t* client_cnx = NULL;
+        int is_active = 0;
+
+        quicdoq_set_pool_params(test_ctx->qd_client, 1, 1, 16, 0);
+
+        /* Run until the server holds the first query */
+        while (ret == 0 && !test_ctx->record[0].query_received && test_ctx->simulated_time < 500000) {
+            ret = quicdoq_test_sim_step(test_ctx, &is_active);
+        }
+        client_cnx = test_ctx->qd_client->first_cnx;
+
+        if (ret != 0 || !test_ctx->record[0].query_received || test_ctx->record[1].query_received ||
+            client_cnx == NULL || client_cnx->first_stream == NULL || test_ctx->qd_client->first_pending == NULL) {
+            DBG_PRINTF("%s", "Expected the first query in flight and the second one waiting");
+            ret = -1;
+        }
+        else if (quicdoq_cancel_query(test_ctx->qd_client, client_cnx->first_stream->query_ctx) != 0 ||
+            !test_ctx->record[0].is_abandoned || test_ctx->nb_responses_received != 1) {
+            DBG_PRINTF("%s", "Cancellation did not deliver the final callback");
+            ret = -1;
+        }
+        else if (test_ctx->qd_client->first_pending != NULL || client_cnx->nb_open_streams != 1) {
+            DBG_PRINTF("%s", "The waiting query did not get the stream credit");
+            ret = -1;
+        }
+        else {
+            uint64_t time_limit = test_ctx->simulated_time + 1500000;
+
+            /* Let the second query complete, and the slow response expire at the server */
+            while (ret == 0 && test_ctx->simulated_time < time_limit) {
+                ret = quicdoq_test_sim_step(test_ctx, &is_active);
+            }
+
+            if (ret != 0 || !test_ctx->record[1].is_success || test_ctx->record[1].response_arrival_time >= 1000000 ||
+                test_ctx->some_query_failed || test_ctx->some_query_inconsistent || test_ctx->nb_responses_received != 2) {
+                DBG_PRINTF("Fail after %llu, second query success=%d, ret=%d",
+                    (unsigned long long)test_ctx->simulated_time, test_ctx->record[1].is_success, ret);
+                ret = -1;
+            }
+            else if (!test_ctx->record[0].server_error || test_ctx->qd_client->first_cnx != client_cnx ||
+                client_cnx->first_stream != NULL || client_cnx->nb_open_streams != 0) {
+                DBG_PRINTF("%s", "Server did not abandon the cancelled query, or client state was not released");
+                ret = -1;
+            }
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+/* Relay cancellation scenario: the client cancels a query while the relay
+ * waits for the UDP response. The relay drops the query at once, counts the
+ * packet already sent as wasted, and ignores the late response. */
+static quicdoq_test_scenario_entry_t const relay_cancel_scenario[] = {
+    { 0, 1000000, 1 }
+};
+
+int quicdoq_relay_cancel_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(relay_cancel_scenario, sizeof(relay_cancel_scenario), 1);
+    quicdoq_metrics_t* metrics = quicdoq_metrics_create();
+    int ret = 0;
+
+    if (test_ctx == NULL || metrics == NULL || quicdoq_set_metrics(test_ctx->qd_server, metrics) != 0) {
+        ret = -1;
+    }
+    else {
+        quicdoq_cnx_ctx_t* client_cnx = NULL;
+        int is_active = 0;
+
+        /* Run until the relay has sent the query upstream */
+        while (ret == 0 && (test_ctx->udp_ctx->first_query == NULL || test_ctx->udp_ctx->first_query->nb_sent == 0) &&
+            test_ctx->simulated_time < 500000) {
+            ret = quicdoq_test_sim_step(test_ctx, &is_active);
+        }
+        client_cnx = test_ctx->qd_client->first_cnx;
+
+        if (ret != 0 || test_ctx->udp_ctx->first_query == NULL || client_cnx == NULL || client_cnx->first_stream == NULL) {
+            DBG_PRINTF("%s", "Expected the query waiting for the UDP response");
+            ret = -1;
+        }
+        else if (quicdoq_cancel_query(test_ctx->qd_client, client_cnx->first_stream->query_ctx) != 0 ||
+            !test_ctx->record[0].is_abandoned) {
+            DBG_PRINTF("%s", "Cancellation did not deliver the final callback");
+            ret = -1;
+        }
+        else {
+            uint64_t time_limit = test_ctx->simulated_time + 1500000;
+            quicdoq_load_stats_t load;
+            quicdoq_metrics_snapshot_t snapshot;
+
+            /* Let the cancellation reach the server, and the late UDP response arrive */
+            while (ret == 0 && test_ctx->simulated_time < time_limit) {
+                ret = quicdoq_test_sim_step(test_ctx, &is_active);
+            }
+            quicdoq_get_load_stats(test_ctx->qd_server, &load);
+            quicdoq_metrics_snapshot(metrics, &snapshot);
+
+            if (ret != 0 || test_ctx->udp_ctx->first_query != NULL || load.relay_queue_depth != 0 ||
+                load.nb_inflight_queries != 0 || test_ctx->qd_server->first_cnx == NULL ||
+                test_ctx->qd_server->first_cnx->first_stream != NULL) {
+                DBG_PRINTF("Relay did not drop the query, ret=%d, queue depth %d", ret, load.relay_queue_depth);
+                ret = -1;
+            }
+            else if (snapshot.counter[quicdoq_metric_relay_cancelled] != 1 ||
+                snapshot.counter[quicdoq_metric_relay_packets_wasted] == 0 ||
+                snapshot.counter[quicdoq_metric_relay_packets_wasted] != snapshot.counter[quicdoq_metric_relay_packets_sent] ||
+                snapshot.counter[quicdoq_metric_relay_responses] != 0 ||
+                snapshot.counter[quicdoq_metric_relay_timeouts] != 0) {
+                DBG_PRINTF("Unexpected relay metrics, %" PRIu64 " cancelled, %" PRIu64 " packets wasted",
+                    snapshot.counter[quicdoq_metric_relay_cancelled], snapshot.counter[quicdoq_metric_relay_packets_wasted]);
+                ret = -1;
+            }
+        }
+    }
+
+    if (test_ctx != NULL) {
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+    if (metrics != NULL) {
+        quicdoq_metrics_delete(metrics);
+    }
+
+    return ret;
+}
+
+/* Relay timeout scenario: the UDP server never answers. After the last
+ * retransmission the relay cancels the response, and the query no longer
+ * counts against the load budget, although the connection stays open. */
+int quicdoq_relay_timeout_test()
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(one_loss_scenario, sizeof(one_loss_scenario), 1);
+    quicdoq_metrics_t* metrics = quicdoq_metrics_create();
+    int ret = 0;
+
+    if (test_ctx == NULL || metrics == NULL || quicdoq_set_metrics(test_ctx->qd_server, metrics) != 0) {
+        ret = -1;
+    }
+    else {
+        quicdoq_load_stats_t load;
+        quicdoq_metrics_snapshot_t snapshot;
+
+        ret = quicdoq_test_sim_run(test_ctx, 10000000);
+        quicdoq_get_load_stats(test_ctx->qd_server, &load);
+        quicdoq_metrics_snapshot(metrics, &snapshot);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_inconsistent ||
+            snapshot.counter[quicdoq_metric_relay_timeouts] != 1) {
+            DBG_PRINTF("Fail after %llu, all_served=%d, %" PRIu64 " timeouts, ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                snapshot.counter[quicdoq_metric_relay_timeouts], ret);
+            ret = -1;
+        }
+        else if (load.nb_inflight_queries != 0 || load.buffer_bytes != 0 || load.relay_queue_depth != 0 ||
+            test_ctx->qd_server->first_cnx == NULL || test_ctx->qd_server->first_cnx->first_stream != NULL) {
+            DBG_PRINTF("Load not released: %d queries, %llu bytes, %d relayed", load.nb_inflight_queries,
+                (unsigned long long)load.buffer_bytes, load.relay_queue_depth);
+            ret = -1;
+        }
+    }
+
+    if (test_ctx != NULL) {
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+    if (metrics != NULL) {
+        quicdoq_metrics_delete(metrics);
+    }
+
+    return ret;
+}
+
+/* Deadline scenarios: the first query gets a slow response, the second
+ * a fast one. The first query is abandoned at its deadline, set either by
+ * the client, or by the server from its deadline budget. */
+static quicdoq_test_scenario_entry_t const client_deadline_scenario[] = {
+    { 0, 1000000, 1, 0, 0, 0, 200000 },
+    { 0, 0, 1 }
+};
+
+static quicdoq_test_scenario_entry_t const server_deadline_scenario[] = {
+    { 0, 1000000, 1 },
+    { 0, 0, 1 }
+};
+
+static quicdoq_test_scenario_entry_t const server_deadline_drop_scenario[] = {
+    { 0, 1000000, 0 },
+    { 0, 0, 1 }
+};
+
+static int quicdoq_deadline_test_one(quicdoq_test_scenario_entry_t const* scenario, size_t size_of_scenario, int test_udp,
+    uint64_t budget, int answer_servfail, int expect_failed)
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(scenario, size_of_scenario, test_udp);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        quicdoq_load_stats_t load;
+
+        quicdoq_set_deadline_budget(test_ctx->qd_server, budget, answer_servfail);
+        ret = quicdoq_test_sim_run(test_ctx, 3000000);
+        quicdoq_get_load_stats(test_ctx->qd_server, &load);
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_inconsistent ||
+            test_ctx->record[0].is_failed != expect_failed || (!expect_failed && test_ctx->some_query_failed) ||
+            !test_ctx->record[1].is_success) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else if (test_ctx->record[0].response_arrival_time > 500000) {
+            DBG_PRINTF("Query abandoned at %" PRIu64 ", after its deadline", test_ctx->record[0].response_arrival_time);
+            ret = -1;
+        }
+        else if ((!test_udp && !test_ctx->record[0].server_error) || load.relay_queue_depth != 0 ||
+            (test_udp && test_ctx->udp_ctx->first_query != NULL)) {
+            DBG_PRINTF("%s", "The server application did not drop the query");
+            ret = -1;
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+int quicdoq_deadline_test()
+{
+    /* The client fails the query locally at its deadline */
+    int ret = quicdoq_deadline_test_one(client_deadline_scenario, sizeof(client_deadline_scenario), 0, 0, 0, 1);
+
+    if (ret == 0) {
+        /* The server answers SERVFAIL when its budget is exhausted */
+        ret = quicdoq_deadline_test_one(server_deadline_scenario, sizeof(server_deadline_scenario), 0, 100000, 1, 0);
+    }
+
+    if (ret == 0) {
+        /* The server resets the stream, and the relay stops retransmitting */
+        ret = quicdoq_deadline_test_one(server_deadline_drop_scenario, sizeof(server_deadline_drop_scenario), 1, 100000, 0, 0);
+    }
+
+    return ret;
+}
+
+/* Hedge scenarios. The test server answers the copies of the queries
+ * at once, so the hedges win if they are sent. The second server is
+ * the same test server, reached at a different address.
+ */
+static quicdoq_test_scenario_entry_t const hedge_scenario[] = {
+    { 0, 1000000, 1 },
+    { 0, 1000000, 1 },
+    { 0, 1000000, 1 },
+    { 0, 1000000, 1 }
+};
+
+static quicdoq_test_scenario_entry_t const hedge_adaptive_scenario[] = {
+    { 0, 0, 1 }, { 20000, 0, 1 }, { 40000, 0, 1 }, { 60000, 0, 1 },
+    { 80000, 0, 1 }, { 100000, 0, 1 }, { 120000, 0, 1 }, { 140000, 0, 1 },
+    { 160000, 0, 1 }, { 180000, 0, 1 }, { 200000, 0, 1 }, { 220000, 0, 1 },
+    { 240000, 0, 1 }, { 260000, 0, 1 }, { 280000, 0, 1 }, { 300000, 0, 1 },
+    { 320000, 0, 1 }, { 340000, 0, 1 }, { 360000, 0, 1 }, { 380000, 0, 1 },
+    { 400000, 0, 1 }, { 420000, 0, 1 }, { 440000, 0, 1 }, { 460000, 0, 1 }
+};
+
+static int quicdoq_hedge_test_one(quicdoq_test_scenario_entry_t const* scenario, size_t size_of_scenario,
+    uint32_t budget_percent, uint64_t initial_delay, quicdoq_hedge_stats_t * stats, uint64_t * hedge_delay, int * nb_fast)
+{
+    quicdog_test_ctx_t* test_ctx = quicdoq_test_ctx_create(scenario, size_of_scenario, 0);
+    int ret = 0;
+
+    if (test_ctx == NULL) {
+        ret = -1;
+    }
+    else {
+        struct sockaddr_storage second_addr;
+        quicdoq_hedge_policy_t policy;
+
+        quicdoq_get_default_hedge_policy(&policy);
+        policy.budget_percent = budget_percent;
+        policy.initial_delay = initial_delay;
+        /* Above the response time of the fast queries, so that they are not hedged */
+        policy.min_delay = 50000;
+        quicdoq_set_hedge_policy(test_ctx->qd_client, &policy);
+        if (picoquic_store_text_addr(&second_addr, "1::1", 853) != 0 ||
+            quicdoq_add_hedge_server(test_ctx->qd_client, PICOQUIC_TEST_SNI, (struct sockaddr*)&test_ctx->server_addr) != 0 ||
+            quicdoq_add_hedge_server(test_ctx->qd_client, PICOQUIC_TEST_SNI, (struct sockaddr*)&second_addr) != 0) {
+            ret = -1;
+        }
+        else {
+            ret = quicdoq_test_sim_run(test_ctx, 3000000);
+        }
+
+        if (ret == 0 && (!test_ctx->all_query_served || test_ctx->some_query_inconsistent || test_ctx->some_query_failed)) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d)",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed);
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            quicdoq_get_hedge_stats(test_ctx->qd_client, stats);
+            *hedge_delay = quicdoq_get_hedge_delay(test_ctx->qd_client, (struct sockaddr*)&test_ctx->server_addr);
+            *nb_fast = 0;
+            for (uint16_t i = 0; i < test_ctx->nb_scenarios; i++) {
+                if (test_ctx->record[i].response_arrival_time - test_ctx->record[i].query_sent_time < 500000) {
+                    *nb_fast += 1;
+                }
+            }
+        }
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    return ret;
+}
+
+int quicdoq_hedge_test()
+{
+    quicdoq_hedge_stats_t stats;
+    uint64_t hedge_delay = 0;
+    int nb_fast = 0;
+    /* Slow queries: the budget allows hedging half of them, and the hedges win */
+    int ret = quicdoq_hedge_test_one(hedge_scenario, sizeof(hedge_scenario), 50, 50000, &stats, &hedge_delay, &nb_fast);
+
+    if (ret == 0 && (stats.nb_queries != 4 || stats.nb_hedges_sent != 2 || stats.nb_hedges_won != 2 ||
+        stats.nb_hedges_over_budget != 2 || nb_fast != 2)) {
+        DBG_PRINTF("Hedges: %" PRIu64 " queries, %" PRIu64 " sent, %" PRIu64 " won, %" PRIu64 " over budget, %d fast",
+            stats.nb_queries, stats.nb_hedges_sent, stats.nb_hedges_won, stats.nb_hedges_over_budget, nb_fast);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        /* Fast queries: no hedge is sent, and the delay adapts to the response times */
+        ret = quicdoq_hedge_test_one(hedge_adaptive_scenario, sizeof(hedge_adaptive_scenario), 100, 300000,
+            &stats, &hedge_delay, &nb_fast);
+        if (ret == 0 && (stats.nb_hedges_sent != 0 || stats.nb_queries != 24 || hedge_delay >= 100000)) {
+            DBG_PRINTF("Hedges: %" PRIu64 " sent for %" PRIu64 " queries, delay %" PRIu64,
+                stats.nb_hedges_sent, stats.nb_queries, hedge_delay);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Scalability scenarios.
+ * Generate a scenario in which nb_clients clients send nb_queries queries,
+ * spread evenly over the duration, each client using a connection of its
+ * own. All queries are expected to succeed. The run reports the simulated
+ * latency distribution, which is deterministic, and the CPU time per query,
+ * which is not, but makes regressions in the cost of the core visible.
+ */
+static int quicdoq_scale_compare_latency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+int quicdoq_scale_test_one(int nb_clients, int nb_queries, uint64_t duration, int test_udp, uint64_t max_p99)
+{
+    int ret = 0;
+    quicdog_test_ctx_t* test_ctx = NULL;
+    quicdoq_test_scenario_entry_t* scenario = NULL;
+    uint64_t* latency = NULL;
+    clock_t cpu_start;
+    clock_t cpu_end;
+
+    if (nb_queries <= 0 || nb_queries >= UINT16_MAX || nb_clients <= 0 || nb_clients > QUICDOQ_TEST_MAX_CONNECTIONS) {
+        ret = -1;
+    }
+    else if ((scenario = (quicdoq_test_scenario_entry_t*)malloc(nb_queries * sizeof(quicdoq_test_scenario_entry_t))) == NULL ||
+        (latency = (uint64_t*)malloc(nb_queries * sizeof(uint64_t))) == NULL) {
+        ret = -1;
+    }
+    else {
+        memset(scenario, 0, nb_queries * sizeof(quicdoq_test_scenario_entry_t));
+        for (int i = 0; i < nb_queries; i++) {
+            scenario[i].schedule_time = (duration * i) / nb_queries;
+            scenario[i].is_success = 1;
+            scenario[i].cnx_affinity = (uint64_t)(i % nb_clients) + 1;
+        }
+        test_ctx = quicdoq_test_ctx_create(scenario, nb_queries * sizeof(quicdoq_test_scenario_entry_t), test_udp);
+        if (test_ctx == NULL) {
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* One gigabit links, so that the cost measured is that of the code, not of queuing */
+        test_ctx->client_link->picosec_per_byte = 8000;
+        test_ctx->server_link->picosec_per_byte = 8000;
+        if (test_udp) {
+            test_ctx->udp_link_in->picosec_per_byte = 8000;
+            test_ctx->udp_link_out->picosec_per_byte = 8000;
+        }
+
+        cpu_start = clock();
+        ret = quicdoq_test_sim_run(test_ctx, duration + 10000000);
+        cpu_end = clock();
+
+        if (ret != 0 || !test_ctx->all_query_served || test_ctx->some_query_failed || test_ctx->some_query_inconsistent) {
+            DBG_PRINTF("Fail after %llu, all_served=%d (inconsistent=%d, failed=%d), ret=%d",
+                (unsigned long long)test_ctx->simulated_time, test_ctx->all_query_served,
+                test_ctx->some_query_inconsistent, test_ctx->some_query_failed, ret);
+            ret = -1;
+        }
+        else {
+            int nb_cnx = 0;
+            double cpu_us = ((double)(cpu_end - cpu_start)) * 1000000.0 / CLOCKS_PER_SEC;
+            quicdoq_cnx_ctx_t* cnx_ctx;
+
+            for (cnx_ctx = test_ctx->qd_client->first_cnx; cnx_ctx != NULL; cnx_ctx = cnx_ctx->next_cnx) {
+                nb_cnx++;
+            }
+
+            for (int i = 0; i < nb_queries; i++) {
+                latency[i] = test_ctx->record[i].response_arrival_time - test_ctx->record[i].query_sent_time;
+            }
+            qsort(latency, nb_queries, sizeof(uint64_t), quicdoq_scale_compare_latency);
+
+            DBG_PRINTF("Scale%s: %d clients, %d queries, latency (us) p50 %llu, p90 %llu, p99 %llu, max %llu, CPU %.1f us/query",
+                (test_udp) ? " UDP" : "", nb_clients, nb_queries,
+                (unsigned long long)latency[nb_queries / 2], (unsigned long long)latency[(nb_queries * 9) / 10],
+                (unsigned long long)latency[(nb_queries * 99) / 100], (unsigned long long)latency[nb_queries - 1],
+                cpu_us / nb_queries);
+
+            if (nb_cnx != nb_clients) {
+                DBG_PRINTF("Expected %d client connections, got %d", nb_clients, nb_cnx);
+                ret = -1;
+            }
+            else if (latency[(nb_queries * 99) / 100] > max_p99) {
+                DBG_PRINTF("Latency p99 %llu above %llu", (unsigned long long)latency[(nb_queries * 99) / 100],
+                    (unsigned long long)max_p99);
+                ret = -1;
+            }
+        }
+    }
+
+    if (test_ctx != NULL) {
+        quicdoq_test_ctx_delete(test_ctx);
+    }
+
+    if (scenario != NULL) {
+        free(scenario);
+    }
+
+    if (latency != NULL) {
+        free(latency);
+    }
+
+    return ret;
+}
+
+/* A thousand clients sending ten thousand queries in ten seconds. The
+ * links have a 10 ms latency, so the first query of each client takes
+ * two round trips, and the following ones a single round trip. */
+int quicdoq_scale_test()
+{
+    return quicdoq_scale_test_one(1000, 10000, 10000000, 0, 100000);
+}
+
+int quicdoq_scale_udp_test()
+{
+    return quicdoq_scale_test_one(1000, 10000, 10000000, 1, 100000);
+}
@@ -40,6 +40,38 @@ int quicdoq_multi_udp_test();
 int quicdoq_one_loss_test();
 int quicdoq_one_loss_udp_test();
 int dns_refuse_format_test();
+int quicdoq_connected_udp_test();
+int quicdoq_pool_test();
+int quicdoq_zero_rtt_test();
+int quicdoq_zero_rtt_defer_test();
+int quicdoq_replay_cache_test();
+int quicdoq_affinity_test();
+int quicdoq_trace_pcap_test();
+int quicdoq_trace_dnstap_test();
+int quicdoq_scale_test();
+int quicdoq_scale_udp_test();
+int quicdoq_cdns_test();
+int quicdoq_app_log_test();
+int quicdoq_metrics_test();
+int quicdoq_latency_udp_test();
+int quicdoq_histogram_test();
+int quicdoq_cnx_stats_test();
+int quicdoq_load_shed_test();
+int quicdoq_load_shed_refuse_test();
+int quicdoq_rate_limit_test();
+int quicdoq_rate_limit_cnx_test();
+int quicdoq_tp_profile_test();
+int quicdoq_tp_adaptive_test();
+int quicdoq_response_priority_test();
+int quicdoq_cancel_query_test();
+int quicdoq_relay_cancel_test();
+int quicdoq_relay_timeout_test();
+int quicdoq_deadline_test();
+int quicdoq_hedge_test();
+int dns_builder_test();
+int dns_name_simd_test();
+int dns_view_test();
+int rr_hash_test();
 
 #ifdef __cplusplus
 }
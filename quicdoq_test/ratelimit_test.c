@@ -0,0 +1,278 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Rate limiter tests.
+ * Check that a bucket allows a burst then refills at the configured rate,
+ * that addresses in the same prefix share a bucket, that IPv4 mapped
+ * addresses share the IPv4 bucket, that the table does not grow
+ * beyond its size when many prefixes are seen, and that evictions never
+ * give a bucket more than the burst.
+ */
+
+static void ratelimit_test_set_v4(struct sockaddr_storage* addr, uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    struct sockaddr_in* addr4 = (struct sockaddr_in*)addr;
+    uint8_t* bytes = (uint8_t*)&addr4->sin_addr;
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    addr4->sin_family = AF_INET;
+    bytes[0] = a;
+    bytes[1] = b;
+    bytes[2] = c;
+    bytes[3] = d;
+}
+
+static void ratelimit_test_set_v6(struct sockaddr_storage* addr, uint8_t const* prefix, size_t prefix_length, uint8_t last)
+{
+    struct sockaddr_in6* addr6 = (struct sockaddr_in6*)addr;
+    uint8_t* bytes = (uint8_t*)&addr6->sin6_addr;
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    addr6->sin6_family = AF_INET6;
+    memcpy(bytes, prefix, prefix_length);
+    bytes[15] = last;
+}
+
+/* Count the queries allowed out of nb_queries sent at current_time */
+static int ratelimit_test_burst(quicdoq_rate_limiter_t* limiter, struct sockaddr_storage* addr, int nb_queries, uint64_t current_time)
+{
+    int nb_allowed = 0;
+
+    for (int i = 0; i < nb_queries; i++) {
+        if (quicdoq_rate_limiter_check(limiter, (struct sockaddr*)addr, current_time) == 0) {
+            nb_allowed++;
+        }
+    }
+
+    return nb_allowed;
+}
+
+int quicdoq_rate_limit_test()
+{
+    int ret = 0;
+    quicdoq_rate_limit_t config;
+    quicdoq_rate_limiter_t* limiter = NULL;
+    struct sockaddr_storage addr;
+    uint64_t current_time = 1000000;
+    int nb_allowed;
+
+    memset(&config, 0, sizeof(config));
+    config.queries_per_second = 10;
+    config.burst = 5;
+    limiter = quicdoq_rate_limiter_create(&config);
+
+    if (limiter == NULL) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        /* The burst is allowed, then the bucket is empty */
+        ratelimit_test_set_v4(&addr, 10, 0, 0, 1);
+        if ((nb_allowed = ratelimit_test_burst(limiter, &addr, 8, current_time)) != 5) {
+            DBG_PRINTF("Expected 5 queries in the burst, got %d", nb_allowed);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* Same /24, same bucket. Another /24 has its own. */
+        ratelimit_test_set_v4(&addr, 10, 0, 0, 200);
+        if (ratelimit_test_burst(limiter, &addr, 1, current_time) != 0) {
+            DBG_PRINTF("%s", "Address in the same /24 not limited");
+            ret = -1;
+        }
+        else {
+            ratelimit_test_set_v4(&addr, 10, 0, 1, 1);
+            if (ratelimit_test_burst(limiter, &addr, 1, current_time) != 1) {
+                DBG_PRINTF("%s", "Address in another /24 limited");
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        /* 10 queries per second: one more token after 100 ms, and the bucket
+         * never holds more than the burst */
+        ratelimit_test_set_v4(&addr, 10, 0, 0, 1);
+        if ((nb_allowed = ratelimit_test_burst(limiter, &addr, 3, current_time + 100000)) != 1) {
+            DBG_PRINTF("Expected 1 query after 100ms, got %d", nb_allowed);
+            ret = -1;
+        }
+        else if ((nb_allowed = ratelimit_test_burst(limiter, &addr, 8, current_time + 100000000)) != 5) {
+            DBG_PRINTF("Expected 5 queries after 100s, got %d", nb_allowed);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* The IPv4 mapped address uses the bucket of its /24, which is empty */
+        static const uint8_t v4_mapped[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 10, 0, 0 };
+
+        ratelimit_test_set_v6(&addr, v4_mapped, sizeof(v4_mapped), 7);
+        if (ratelimit_test_burst(limiter, &addr, 1, current_time + 100000000) != 0) {
+            DBG_PRINTF("%s", "IPv4 mapped address not limited");
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        /* IPv6 addresses in the same /56 share a bucket */
+        static const uint8_t prefix_a[] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0x12, 0x34 };
+        static const uint8_t prefix_b[] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0x12, 0x35 };
+        static const uint8_t prefix_c[] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0x13, 0x34 };
+
+        ratelimit_test_set_v6(&addr, prefix_a, sizeof(prefix_a), 1);
+        nb_allowed = ratelimit_test_burst(limiter, &addr, 3, current_time);
+        ratelimit_test_set_v6(&addr, prefix_b, sizeof(prefix_b), 2);
+        nb_allowed += ratelimit_test_burst(limiter, &addr, 3, current_time);
+        if (nb_allowed != 5) {
+            DBG_PRINTF("Expected 5 queries from the /56, got %d", nb_allowed);
+            ret = -1;
+        }
+        else {
+            ratelimit_test_set_v6(&addr, prefix_c, sizeof(prefix_c), 1);
+            if (ratelimit_test_burst(limiter, &addr, 1, current_time) != 1) {
+                DBG_PRINTF("%s", "Address in another /56 limited");
+                ret = -1;
+            }
+        }
+    }
+
+    if (limiter != NULL) {
+        quicdoq_rate_limiter_delete(limiter);
+        limiter = NULL;
+    }
+
+    if (ret == 0) {
+        /* A small table: many prefixes evict each other. Once the table is
+         * full, new prefixes start with an empty bucket and are limited,
+         * until the evicted entries have been idle long enough. */
+        quicdoq_rate_limit_stats_t stats;
+
+        config.max_prefixes = 16;
+        limiter = quicdoq_rate_limiter_create(&config);
+        if (limiter == NULL) {
+            ret = -1;
+        }
+        else {
+            for (int i = 0; i < 1000; i++) {
+                ratelimit_test_set_v4(&addr, 192, (uint8_t)(i % 251), (uint8_t)(i / 251), 1);
+                (void)ratelimit_test_burst(limiter, &addr, 1, current_time);
+            }
+            stats = limiter->stats;
+            if (stats.nb_prefixes > 16 || stats.nb_evicted == 0 || stats.nb_allowed != stats.nb_prefixes ||
+                stats.nb_limited != 1000 - stats.nb_allowed || stats.nb_saturated != stats.nb_limited) {
+                DBG_PRINTF("Unexpected table stats, %u prefixes, %" PRIu64 " evicted, %" PRIu64 " allowed, %" PRIu64 " saturated",
+                    stats.nb_prefixes, stats.nb_evicted, stats.nb_allowed, stats.nb_saturated);
+                ret = -1;
+            }
+            else {
+                ratelimit_test_set_v4(&addr, 192, 0, 200, 1);
+                if ((nb_allowed = ratelimit_test_burst(limiter, &addr, 8, current_time + 100000000)) != 5) {
+                    DBG_PRINTF("Expected 5 queries after reusing an idle entry, got %d", nb_allowed);
+                    ret = -1;
+                }
+            }
+            quicdoq_rate_limiter_delete(limiter);
+        }
+    }
+
+    if (ret == 0) {
+        /* Prefixes that keep evicting each other: no bucket ever holds more
+         * than the burst, and no prefix gets more than the burst plus what
+         * the rate allows since its first query. Each limiter has its own
+         * hash key. */
+        quicdoq_rate_limiter_t* other = NULL;
+        uint64_t first_time[40];
+        uint64_t nb_prefix_allowed[40];
+        uint64_t test_time = current_time;
+
+        memset(first_time, 0, sizeof(first_time));
+        memset(nb_prefix_allowed, 0, sizeof(nb_prefix_allowed));
+        config.queries_per_second = 10;
+        config.max_prefixes = 16;
+        limiter = quicdoq_rate_limiter_create(&config);
+        other = quicdoq_rate_limiter_create(&config);
+        if (limiter == NULL || other == NULL) {
+            ret = -1;
+        }
+        else if (memcmp(limiter->hash_key, other->hash_key, sizeof(limiter->hash_key)) == 0) {
+            DBG_PRINTF("%s", "Two limiters use the same hash key");
+            ret = -1;
+        }
+
+        for (int i = 0; ret == 0 && i < 4000; i++) {
+            int p = (i * 7) % 40;
+
+            test_time += (uint64_t)((i * 7919) % 4000);
+            ratelimit_test_set_v4(&addr, 198, 51, (uint8_t)p, 1);
+            if (first_time[p] == 0) {
+                first_time[p] = test_time;
+            }
+            nb_prefix_allowed[p] += ratelimit_test_burst(limiter, &addr, 3, test_time);
+            if (nb_prefix_allowed[p] > config.burst +
+                (test_time - first_time[p]) * config.queries_per_second / QUICDOQ_RATE_LIMIT_TOKEN) {
+                DBG_PRINTF("Prefix %d allowed %" PRIu64 " queries in %" PRIu64 " us", p,
+                    nb_prefix_allowed[p], test_time - first_time[p]);
+                ret = -1;
+            }
+            for (size_t j = 0; ret == 0 && j < limiter->nb_slots; j++) {
+                if (limiter->slots[j].is_used &&
+                    limiter->slots[j].tokens > config.burst * QUICDOQ_RATE_LIMIT_TOKEN) {
+                    DBG_PRINTF("Bucket %zu holds %" PRIu64 " tokens", j, limiter->slots[j].tokens);
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0 && limiter->stats.nb_evicted == 0) {
+            DBG_PRINTF("%s", "No eviction with 40 prefixes in 16 slots");
+            ret = -1;
+        }
+        if (limiter != NULL) {
+            quicdoq_rate_limiter_delete(limiter);
+            limiter = NULL;
+        }
+        if (other != NULL) {
+            quicdoq_rate_limiter_delete(other);
+        }
+    }
+
+    if (ret == 0) {
+        /* Rate limiting is off if the rate is 0 */
+        config.queries_per_second = 0;
+        if (quicdoq_rate_limiter_create(&config) != NULL) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
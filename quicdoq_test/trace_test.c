@@ -0,0 +1,518 @@
+/*
+* Author: Christian Huitema
+* Copyright (c) 2020, Private Octopus, Inc.
+* All rights reserved.
+*
+* Permission to use, copy, modify, and distribute this software for any
+* purpose with or without fee is hereby granted, provided that the above
+* copyright notice and this permission notice appear in all copies.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+* ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL Private Octopus, Inc. BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <picoquic.h>
+#include <picoquic_utils.h>
+#include "quicdoq.h"
+#include "quicdoq_internal.h"
+
+/* Trace reader tests.
+ * Each test writes a small trace file, then checks that reading it back
+ * produces the expected queries, skipping the packets that are not queries.
+ */
+
+#define TRACE_TEST_PCAP_FILE "quicdoq_trace_test.pcap"
+#define TRACE_TEST_DNSTAP_FILE "quicdoq_trace_test.dnstap"
+#define TRACE_TEST_DNSTAP_FRAME_FILE "quicdoq_trace_test_frame.dnstap"
+#define TRACE_TEST_OVERSIZE 0x50000
+
+/* Query for example.com, type A */
+static const uint8_t trace_test_query[] = {
+    0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+    0x00, 0x01, 0x00, 0x01
+};
+
+typedef struct st_trace_test_packet_t {
+    uint64_t timestamp;
+    int is_ipv6;
+    uint8_t source_byte; /* last byte of the source address */
+    uint16_t source_port;
+    uint16_t dest_port;
+    int is_response;
+} trace_test_packet_t;
+
+static const trace_test_packet_t trace_test_packets[] = {
+    { 1000000, 0, 1, 10001, 53, 0 },
+    { 1000500, 0, 2, 10002, 53, 1 }, /* response, skipped */
+    { 1001000, 1, 3, 10003, 53, 0 },
+    { 1002000, 0, 4, 10004, 80, 0 }, /* not DNS, skipped */
+    { 1003000, 0, 1, 10001, 53, 0 }
+};
+
+static const size_t trace_test_nb_packets = sizeof(trace_test_packets) / sizeof(trace_test_packet_t);
+
+static uint8_t* trace_test_put32le(uint8_t* bytes, uint32_t v)
+{
+    *bytes++ = (uint8_t)v;
+    *bytes++ = (uint8_t)(v >> 8);
+    *bytes++ = (uint8_t)(v >> 16);
+    *bytes++ = (uint8_t)(v >> 24);
+    return bytes;
+}
+
+static uint8_t* trace_test_put32(uint8_t* bytes, uint32_t v)
+{
+    *bytes++ = (uint8_t)(v >> 24);
+    *bytes++ = (uint8_t)(v >> 16);
+    *bytes++ = (uint8_t)(v >> 8);
+    *bytes++ = (uint8_t)v;
+    return bytes;
+}
+
+static uint8_t* trace_test_put16(uint8_t* bytes, uint16_t v)
+{
+    *bytes++ = (uint8_t)(v >> 8);
+    *bytes++ = (uint8_t)v;
+    return bytes;
+}
+
+/* Format an Ethernet frame carrying the test query */
+static size_t trace_test_format_frame(uint8_t* bytes, const trace_test_packet_t* packet)
+{
+    uint8_t* x = bytes;
+    size_t udp_length = 8 + sizeof(trace_test_query);
+
+    memset(x, 0, 12);
+    x += 12;
+    x = trace_test_put16(x, (packet->is_ipv6) ? 0x86DD : 0x0800);
+    if (packet->is_ipv6) {
+        *x++ = 0x60;
+        memset(x, 0, 3);
+        x += 3;
+        x = trace_test_put16(x, (uint16_t)udp_length);
+        *x++ = 17;
+        *x++ = 64;
+        memset(x, 0, 32);
+        x[0] = 0x20;
+        x[1] = 0x01;
+        x[15] = packet->source_byte;
+        x[16] = 0x20;
+        x[17] = 0x01;
+        x[31] = 0x35;
+        x += 32;
+    }
+    else {
+        *x++ = 0x45;
+        *x++ = 0;
+        x = trace_test_put16(x, (uint16_t)(20 + udp_length));
+        x = trace_test_put32(x, 0);
+        *x++ = 64;
+        *x++ = 17;
+        x = trace_test_put16(x, 0);
+        x = trace_test_put32(x, 0x0A000000 | packet->source_byte);
+        x = trace_test_put32(x, 0x0A000035);
+    }
+    x = trace_test_put16(x, packet->source_port);
+    x = trace_test_put16(x, packet->dest_port);
+    x = trace_test_put16(x, (uint16_t)udp_length);
+    x = trace_test_put16(x, 0);
+    memcpy(x, trace_test_query, sizeof(trace_test_query));
+    if (packet->is_response) {
+        x[2] |= 0x80;
+    }
+    x += sizeof(trace_test_query);
+
+    return x - bytes;
+}
+
+static int trace_test_write_pcap(char const* file_name)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_name, "wb");
+
+    if (F == NULL) {
+        ret = -1;
+    }
+    else {
+        uint8_t header[24];
+        uint8_t* x = header;
+
+        /* Little endian file, microsecond timestamps, Ethernet */
+        x = trace_test_put32le(x, 0xa1b2c3d4);
+        *x++ = 2;
+        *x++ = 0;
+        *x++ = 4;
+        *x++ = 0;
+        x = trace_test_put32le(x, 0);
+        x = trace_test_put32le(x, 0);
+        x = trace_test_put32le(x, 0xFFFF);
+        x = trace_test_put32le(x, 1);
+        if (fwrite(header, 1, sizeof(header), F) != sizeof(header)) {
+            ret = -1;
+        }
+
+        for (size_t i = 0; ret == 0 && i < trace_test_nb_packets; i++) {
+            uint8_t record[256];
+            size_t length = trace_test_format_frame(record + 16, &trace_test_packets[i]);
+
+            x = record;
+            x = trace_test_put32le(x, (uint32_t)(trace_test_packets[i].timestamp / 1000000));
+            x = trace_test_put32le(x, (uint32_t)(trace_test_packets[i].timestamp % 1000000));
+            x = trace_test_put32le(x, (uint32_t)length);
+            x = trace_test_put32le(x, (uint32_t)length);
+            if (fwrite(record, 1, 16 + length, F) != 16 + length) {
+                ret = -1;
+            }
+            else if (i == 0) {
+                /* A record larger than the trace buffer, which is skipped */
+                uint8_t* oversize = (uint8_t*)calloc(1, TRACE_TEST_OVERSIZE);
+
+                x = record;
+                x = trace_test_put32le(x, (uint32_t)(trace_test_packets[i].timestamp / 1000000));
+                x = trace_test_put32le(x, (uint32_t)(trace_test_packets[i].timestamp % 1000000));
+                x = trace_test_put32le(x, TRACE_TEST_OVERSIZE);
+                x = trace_test_put32le(x, TRACE_TEST_OVERSIZE);
+                if (oversize == NULL || fwrite(record, 1, 16, F) != 16 ||
+                    fwrite(oversize, 1, TRACE_TEST_OVERSIZE, F) != TRACE_TEST_OVERSIZE) {
+                    ret = -1;
+                }
+                if (oversize != NULL) {
+                    free(oversize);
+                }
+            }
+        }
+        (void)picoquic_file_close(F);
+    }
+
+    return ret;
+}
+
+static uint8_t* trace_test_pb_varint(uint8_t* bytes, uint64_t v)
+{
+    while (v >= 0x80) {
+        *bytes++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *bytes++ = (uint8_t)v;
+    return bytes;
+}
+
+static uint8_t* trace_test_pb_bytes(uint8_t* bytes, uint64_t field, const uint8_t* data, size_t length)
+{
+    bytes = trace_test_pb_varint(bytes, (field << 3) | 2);
+    bytes = trace_test_pb_varint(bytes, length);
+    memcpy(bytes, data, length);
+    return bytes + length;
+}
+
+/* Format a Dnstap message. Queries are sent as CLIENT_QUERY (5), responses
+ * as CLIENT_RESPONSE (6). Packets not sent to port 53 are not captured by
+ * dnstap, they are skipped. */
+static size_t trace_test_format_dnstap(uint8_t* bytes, const trace_test_packet_t* packet)
+{
+    uint8_t message[256];
+    uint8_t* x = message;
+    uint8_t address[16];
+    uint8_t query[sizeof(trace_test_query)];
+
+    memset(address, 0, sizeof(address));
+    memcpy(query, trace_test_query, sizeof(query));
+    x = trace_test_pb_varint(x, (1 << 3) | 0);
+    x = trace_test_pb_varint(x, (packet->is_response) ? 6 : 5);
+    x = trace_test_pb_varint(x, (2 << 3) | 0);
+    x = trace_test_pb_varint(x, (packet->is_ipv6) ? 2 : 1);
+    if (packet->is_ipv6) {
+        address[0] = 0x20;
+        address[1] = 0x01;
+        address[15] = packet->source_byte;
+        x = trace_test_pb_bytes(x, 4, address, 16);
+    }
+    else {
+        address[0] = 10;
+        address[3] = packet->source_byte;
+        x = trace_test_pb_bytes(x, 4, address, 4);
+    }
+    x = trace_test_pb_varint(x, (6 << 3) | 0);
+    x = trace_test_pb_varint(x, packet->source_port);
+    x = trace_test_pb_varint(x, (8 << 3) | 0);
+    x = trace_test_pb_varint(x, packet->timestamp / 1000000);
+    x = trace_test_pb_varint(x, (9 << 3) | 5);
+    x = trace_test_put32le(x, (uint32_t)((packet->timestamp % 1000000) * 1000));
+    if (packet->is_response) {
+        query[2] |= 0x80;
+        x = trace_test_pb_bytes(x, 14, query, sizeof(query));
+    }
+    else {
+        x = trace_test_pb_bytes(x, 10, query, sizeof(query));
+    }
+
+    /* Dnstap envelope: the message in field 14, then the type MESSAGE in field 15 */
+    x = trace_test_pb_bytes(bytes, 14, message, x - message);
+    x = trace_test_pb_varint(x, (15 << 3) | 0);
+    x = trace_test_pb_varint(x, 1);
+    return x - bytes;
+}
+
+/* A dnstap frame laid out as the dnstap encoders write it, with identity
+ * and version fields before the message. The message is a CLIENT_QUERY over
+ * UDP from 192.0.2.7 port 53000, at 1700000000.123456 s, carrying the test
+ * query. */
+static const uint8_t trace_test_dnstap_frame[] = {
+    /* identity (1): "ns1.example" */
+    0x0a, 0x0b, 0x6e, 0x73, 0x31, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+    /* version (2): "unbound 1.17.1" */
+    0x12, 0x0e, 0x75, 0x6e, 0x62, 0x6f, 0x75, 0x6e, 0x64, 0x20, 0x31, 0x2e, 0x31, 0x37, 0x2e, 0x31,
+    /* message (14), 58 bytes */
+    0x72, 0x3a,
+    /* type (1) CLIENT_QUERY, socket_family (2) INET, socket_protocol (3) UDP,
+     * query_address (4), query_port (6), query_time_sec (8), query_time_nsec (9) */
+    0x08, 0x05, 0x10, 0x01, 0x18, 0x01, 0x22, 0x04, 0xc0, 0x00, 0x02, 0x07, 0x30, 0x88, 0x9e, 0x03,
+    0x40, 0x80, 0xe2, 0xcf, 0xaa, 0x06, 0x4d, 0x00, 0xca, 0x5b, 0x07,
+    /* query_message (10) */
+    0x52, 0x1d, 0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07, 0x65,
+    0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01,
+    /* type (15): MESSAGE */
+    0x78, 0x01
+};
+
+/* Start control frame, with the content type field */
+static int trace_test_write_fstrm_start(FILE* F)
+{
+    static const char content_type[] = "protobuf:dnstap.Dnstap";
+    uint8_t frame[64];
+    uint8_t* x = frame;
+    size_t type_length = sizeof(content_type) - 1;
+
+    x = trace_test_put32(x, 0);
+    x = trace_test_put32(x, (uint32_t)(12 + type_length));
+    x = trace_test_put32(x, 2);
+    x = trace_test_put32(x, 1);
+    x = trace_test_put32(x, (uint32_t)type_length);
+    memcpy(x, content_type, type_length);
+    x += type_length;
+
+    return (fwrite(frame, 1, x - frame, F) != (size_t)(x - frame)) ? -1 : 0;
+}
+
+/* Stop control frame */
+static int trace_test_write_fstrm_stop(FILE* F)
+{
+    uint8_t frame[12];
+    uint8_t* x = frame;
+
+    x = trace_test_put32(x, 0);
+    x = trace_test_put32(x, 4);
+    x = trace_test_put32(x, 3);
+
+    return (fwrite(frame, 1, x - frame, F) != (size_t)(x - frame)) ? -1 : 0;
+}
+
+static int trace_test_write_dnstap(char const* file_name)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_name, "wb");
+
+    if (F == NULL) {
+        ret = -1;
+    }
+    else {
+        uint8_t frame[512];
+
+        ret = trace_test_write_fstrm_start(F);
+
+        for (size_t i = 0; ret == 0 && i < trace_test_nb_packets; i++) {
+            if (trace_test_packets[i].dest_port == 53) {
+                size_t length = trace_test_format_dnstap(frame + 4, &trace_test_packets[i]);
+
+                (void)trace_test_put32(frame, (uint32_t)length);
+                if (fwrite(frame, 1, 4 + length, F) != 4 + length) {
+                    ret = -1;
+                }
+            }
+        }
+
+        if (ret == 0) {
+            ret = trace_test_write_fstrm_stop(F);
+        }
+        (void)picoquic_file_close(F);
+    }
+
+    return ret;
+}
+
+/* Write the reference frame in a file, and check the query read from it */
+static int trace_test_read_dnstap_frame(char const* file_name)
+{
+    int ret = 0;
+    FILE* F = picoquic_file_open(file_name, "wb");
+
+    if (F == NULL) {
+        ret = -1;
+    }
+    else {
+        uint8_t length_bytes[4];
+
+        (void)trace_test_put32(length_bytes, (uint32_t)sizeof(trace_test_dnstap_frame));
+        if ((ret = trace_test_write_fstrm_start(F)) == 0 &&
+            (fwrite(length_bytes, 1, 4, F) != 4 ||
+            fwrite(trace_test_dnstap_frame, 1, sizeof(trace_test_dnstap_frame), F) != sizeof(trace_test_dnstap_frame))) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = trace_test_write_fstrm_stop(F);
+        }
+        (void)picoquic_file_close(F);
+    }
+
+    if (ret == 0) {
+        quicdoq_trace_t* trace = quicdoq_trace_open(file_name);
+        quicdoq_trace_query_t query;
+        int is_end = 0;
+
+        if (trace == NULL) {
+            DBG_PRINTF("Cannot open trace %s", file_name);
+            ret = -1;
+        }
+        else {
+            struct sockaddr_in* addr = (struct sockaddr_in*)&query.source_addr;
+
+            if (quicdoq_trace_next(trace, &query, &is_end) != 0 || is_end) {
+                DBG_PRINTF("%s", "No query in the reference dnstap frame");
+                ret = -1;
+            }
+            else if (query.timestamp != 1700000000123456ull || query.query_length != sizeof(trace_test_query) ||
+                memcmp(query.query, trace_test_query, sizeof(trace_test_query)) != 0 ||
+                addr->sin_family != AF_INET || ntohs(addr->sin_port) != 53000 ||
+                ((uint8_t*)&addr->sin_addr)[0] != 192 || ((uint8_t*)&addr->sin_addr)[3] != 7) {
+                DBG_PRINTF("%s", "Unexpected query in the reference dnstap frame");
+                ret = -1;
+            }
+            quicdoq_trace_close(trace);
+        }
+    }
+
+    return ret;
+}
+
+static int trace_test_check_query(quicdoq_trace_query_t* query, const trace_test_packet_t* packet)
+{
+    int ret = 0;
+
+    if (query->timestamp != packet->timestamp) {
+        DBG_PRINTF("Timestamp %llu instead of %llu", (unsigned long long)query->timestamp,
+            (unsigned long long)packet->timestamp);
+        ret = -1;
+    }
+    else if (query->query_length != sizeof(trace_test_query) ||
+        memcmp(query->query, trace_test_query, sizeof(trace_test_query)) != 0) {
+        DBG_PRINTF("Unexpected query, length %zu", query->query_length);
+        ret = -1;
+    }
+    else if (packet->is_ipv6) {
+        struct sockaddr_in6* addr = (struct sockaddr_in6*)&query->source_addr;
+        if (addr->sin6_family != AF_INET6 || ntohs(addr->sin6_port) != packet->source_port ||
+            ((uint8_t*)&addr->sin6_addr)[15] != packet->source_byte) {
+            DBG_PRINTF("%s", "Unexpected IPv6 source address");
+            ret = -1;
+        }
+    }
+    else {
+        struct sockaddr_in* addr = (struct sockaddr_in*)&query->source_addr;
+        if (addr->sin_family != AF_INET || ntohs(addr->sin_port) != packet->source_port ||
+            ((uint8_t*)&addr->sin_addr)[3] != packet->source_byte) {
+            DBG_PRINTF("%s", "Unexpected IPv4 source address");
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int trace_test_read(char const* file_name, uint64_t nb_skipped)
+{
+    int ret = 0;
+    quicdoq_trace_t* trace = quicdoq_trace_open(file_name);
+
+    if (trace == NULL) {
+        DBG_PRINTF("Cannot open trace %s", file_name);
+        ret = -1;
+    }
+    else {
+        size_t i = 0;
+        int is_end = 0;
+
+        while (ret == 0) {
+            quicdoq_trace_query_t query;
+
+            ret = quicdoq_trace_next(trace, &query, &is_end);
+            if (ret != 0 || is_end) {
+                break;
+            }
+            /* Skip the packets that are not queries */
+            while (i < trace_test_nb_packets &&
+                (trace_test_packets[i].is_response || trace_test_packets[i].dest_port != 53)) {
+                i++;
+            }
+            if (i >= trace_test_nb_packets) {
+                DBG_PRINTF("%s", "Too many queries in trace");
+                ret = -1;
+            }
+            else {
+                ret = trace_test_check_query(&query, &trace_test_packets[i]);
+                i++;
+            }
+        }
+
+        if (ret == 0 && i != trace_test_nb_packets) {
+            DBG_PRINTF("Only %zu packets read", i);
+            ret = -1;
+        }
+        else if (ret == 0 && quicdoq_trace_nb_skipped(trace) != nb_skipped) {
+            DBG_PRINTF("Skipped %" PRIu64 " records, expected %" PRIu64, quicdoq_trace_nb_skipped(trace), nb_skipped);
+            ret = -1;
+        }
+
+        quicdoq_trace_close(trace);
+    }
+
+    return ret;
+}
+
+int quicdoq_trace_pcap_test()
+{
+    int ret = trace_test_write_pcap(TRACE_TEST_PCAP_FILE);
+
+    if (ret == 0) {
+        ret = trace_test_read(TRACE_TEST_PCAP_FILE, 1);
+    }
+
+    return ret;
+}
+
+int quicdoq_trace_dnstap_test()
+{
+    int ret = trace_test_write_dnstap(TRACE_TEST_DNSTAP_FILE);
+
+    if (ret == 0) {
+        ret = trace_test_read(TRACE_TEST_DNSTAP_FILE, 0);
+    }
+
+    if (ret == 0) {
+        ret = trace_test_read_dnstap_frame(TRACE_TEST_DNSTAP_FRAME_FILE);
+    }
+
+    return ret;
+}
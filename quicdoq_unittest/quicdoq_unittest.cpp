@@ -93,5 +93,229 @@ namespace quicdoqunittest
 
 			Assert::AreEqual(ret, 0);
 		}
+
+		TEST_METHOD(connected_udp)
+		{
+			int ret = quicdoq_connected_udp_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(pool)
+		{
+			int ret = quicdoq_pool_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(zero_rtt)
+		{
+			int ret = quicdoq_zero_rtt_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(zero_rtt_defer)
+		{
+			int ret = quicdoq_zero_rtt_defer_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(replay_cache)
+		{
+			int ret = quicdoq_replay_cache_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(affinity)
+		{
+			int ret = quicdoq_affinity_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(trace_pcap)
+		{
+			int ret = quicdoq_trace_pcap_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(trace_dnstap)
+		{
+			int ret = quicdoq_trace_dnstap_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(scale)
+		{
+			int ret = quicdoq_scale_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(scale_udp)
+		{
+			int ret = quicdoq_scale_udp_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(rr_hash)
+		{
+			int ret = rr_hash_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(dns_view)
+		{
+			int ret = dns_view_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(dns_name_simd)
+		{
+			int ret = dns_name_simd_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(dns_builder)
+		{
+			int ret = dns_builder_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(cdns)
+		{
+			int ret = quicdoq_cdns_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(app_log)
+		{
+			int ret = quicdoq_app_log_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(metrics)
+		{
+			int ret = quicdoq_metrics_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(latency_udp)
+		{
+			int ret = quicdoq_latency_udp_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(histogram)
+		{
+			int ret = quicdoq_histogram_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(cnx_stats)
+		{
+			int ret = quicdoq_cnx_stats_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(load_shed)
+		{
+			int ret = quicdoq_load_shed_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(load_shed_refuse)
+		{
+			int ret = quicdoq_load_shed_refuse_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(rate_limit)
+		{
+			int ret = quicdoq_rate_limit_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(rate_limit_cnx)
+		{
+			int ret = quicdoq_rate_limit_cnx_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(tp_profile)
+		{
+			int ret = quicdoq_tp_profile_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(tp_adaptive)
+		{
+			int ret = quicdoq_tp_adaptive_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(response_priority)
+		{
+			int ret = quicdoq_response_priority_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(cancel_query)
+		{
+			int ret = quicdoq_cancel_query_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(relay_cancel)
+		{
+			int ret = quicdoq_relay_cancel_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(relay_timeout)
+		{
+			int ret = quicdoq_relay_timeout_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(deadline)
+		{
+			int ret = quicdoq_deadline_test();
+
+			Assert::AreEqual(ret, 0);
+		}
+
+		TEST_METHOD(hedge)
+		{
+			int ret = quicdoq_hedge_test();
+
+			Assert::AreEqual(ret, 0);
+		}
 	};
 }